@@ -26,33 +26,66 @@ File description:
 
 #define VISIBILITY_OFFSET 1.0e-4
 
+/// Min. absolute value of a ray direction's component used for ray-AABB intersection tests
+#define RDIR_MIN_ABS 1.0e-30
+
 
 // Offsets below correspond with data layout produced by gpuart::BoundingVolumesHierarchy::Compile()
-#define BVH_NODE_INFO_OFS  2
-#define BVH_PRIM_DATA_OFS  3
+#define BVH_NODE_INFO_OFS     0
+#define BVH_QUANT_PARAMS_OFS  1 ///< Inner nodes only
+#define BVH_CHILDREN_BB_OFS   2 ///< Inner nodes only; followed by further children addresses if there are more than 2 children
+#define BVH_PRIM_DATA_OFS     1 ///< Leaves only
 
 /// Values (number of RGBA quads occupied) correspond with gpuart::Primitive::StoreIntoBVH()
 #define SPHERE_DATA_LEN    1
 #define DISC_DATA_LEN      2
 #define TRIANGLE_DATA_LEN  3
 #define CONE_DATA_LEN      4
+#define MESH_TRIANGLE_DATA_LEN 1
+#define INSTANCE_DATA_LEN  4
 
 #define BVH_LEAF        (1U<<31)
-#define BVH_IS_LOWER    (1U<<30)
 #define BVH_IS_ROOT     (1U<<29)
 
-#define BVH_FLAGS_MASK  (BVH_LEAF | BVH_IS_LOWER | BVH_IS_ROOT)
+#define BVH_CHILD_INDEX_SHIFT 26U
+#define BVH_CHILD_INDEX_MASK  (7U<<BVH_CHILD_INDEX_SHIFT)
+
+#define BVH_ORDER_AXIS_SHIFT 24U
+#define BVH_ORDER_AXIS_MASK  (3U<<BVH_ORDER_AXIS_SHIFT)
+
+#define BVH_FLAGS_MASK  (BVH_LEAF | BVH_IS_ROOT | BVH_CHILD_INDEX_MASK | BVH_ORDER_AXIS_MASK)
 
 #define NDINFO_FLAGS       0
-#define NDINFO_LO_ADDR     1
-#define NDINFO_HI_ADDR     2
+#define NDINFO_CHILD0_ADDR 1
+#define NDINFO_CHILD1_ADDR 2
 #define NDINFO_PARENT_ADDR 3
 
+/// Number of children whose bounding boxes are stored in a single quad
+#define CHBB_PER_QUAD 2U
+/// Number of children addresses stored in node info; the remaining ones follow the children bounding boxes
+#define NDINFO_NUM_CHILDREN_ADDR 2U
+
 // Primitive types
 #define SPHERE   0
 #define DISC     1
 #define TRIANGLE 2
 #define CONE     3
+#define MESH_TRIANGLE 4
+#define INSTANCE 5 ///< Stored in leaves of a top-level tree (see gpuart::TwoLevelBVH)
+
+// Components of 'TraversalStats'; values correspond with gpuart::Renderer::TraversalStat
+#define STAT_NODES_VISITED   0
+#define STAT_AABB_TESTS      1
+#define STAT_PRIMITIVE_TESTS 2
+
+#ifdef TRAVERSAL_STATS
+/** Counters of the current pixel, shared with (and initialized and output by) the rendering stage shader;
+    compiled in only in the instrumented variant of the shaders. */
+uvec4 TraversalStats;
+#define COUNT_STAT(stat) TraversalStats[stat]++
+#else
+#define COUNT_STAT(stat)
+#endif
 
 
 // External functions -------------------------------------
@@ -127,6 +160,7 @@ int CheckBVHPrimitiveIntersection(
     in vec3 rdir,   ///< Ray's direction
     in int primitiveType,
     in samplerBuffer bvhTree,
+    in samplerBuffer meshVertices, ///< Vertices referred to by mesh triangles in 'bvhTree'
     in int addr,    ///< Start of primitive data in 'bvhTree' (not including the primitive type)
 
     /** Satisfies: rstart + pos*rdir = intersection.
@@ -138,6 +172,8 @@ int CheckBVHPrimitiveIntersection(
 {
     vec2 triangleUV;
 
+    COUNT_STAT(STAT_PRIMITIVE_TESTS);
+
     // For each primitive type its data is interpreted according to
     // gpuart::Primitive::StoreDataIntoBVH() implementations
 
@@ -220,238 +256,464 @@ int CheckBVHPrimitiveIntersection(
 
         return addr + TRIANGLE_DATA_LEN;
     }
+    else if (primitiveType == MESH_TRIANGLE)
+    {
+        uvec3 indices = floatBitsToUint(texelFetch(bvhTree, addr).xyz);
+
+        TriangleIntersection(
+            rstart, rdir,
+            texelFetch(meshVertices, int(indices.x)).xyz, // v0
+            texelFetch(meshVertices, int(indices.y)).xyz, // v1
+            texelFetch(meshVertices, int(indices.z)).xyz, // v2
+
+            pos, intersection, normal, triangleUV);
+
+        if (pos < VISIBILITY_OFFSET)
+            pos = -1;
+
+        return addr + MESH_TRIANGLE_DATA_LEN;
+    }
 }
 
 
 //---------------------------------------------------------
 
-/// Checks for a ray-AABB (axis-aligned bounding box) intersection
+/** Checks for a ray-AABB (axis-aligned bounding box) intersection (branchless slab test).
+    Returns false also if the AABB lies entirely behind 'rstart'. */
 bool IntersectsAABB(
     in vec3 rstart, ///< Ray's starting point
-    in vec3 rdir,   ///< Ray's direction
-    in vec3 rdiv,   ///< 1/rdir (component-wise)
-    in samplerBuffer bvhTree, ///< BVH tree
-    in int addr,    ///< Address in 'bvhTree' of the AABB's definition
-    
-    /** Receives position of the closest (entering) intersection,
-    such that rstart + pos*rdir gives its location.
-    Receives -1 if 'rstart' lies inside the AABB. */ 
-    out float pos
+    in vec3 rdiv,   ///< 1/rdir (component-wise); must be finite, see GetFiniteRayDirInverse()
+    in vec3 bbmin,  ///< AABB's minimum corner
+    in vec3 bbmax,  ///< AABB's maximum corner
+
+    /** Receive positions of the entering and exiting intersection,
+    such that rstart + pos*rdir gives their location.
+    'tnear' is negative if 'rstart' lies inside the AABB. */
+    out float tnear,
+    out float tfar
 )
 {
-    vec3 bbmin = texelFetch(bvhTree, addr).xyz;
-    vec3 bbmax = texelFetch(bvhTree, addr+1).xyz;
+    vec3 t0 = (bbmin - rstart) * rdiv,
+         t1 = (bbmax - rstart) * rdiv;
 
-    if (all(greaterThanEqual(rstart, bbmin))
-        && all(lessThanEqual(rstart, bbmax)))
+    vec3 tmin = min(t0, t1),
+         tmax = max(t0, t1);
+
+    tnear = max(max(tmin.x, tmin.y), tmin.z);
+    tfar  = min(min(tmax.x, tmax.y), tmax.z);
+
+    return tnear <= tfar && tfar >= 0;
+}
+
+/// Returns a child's bounding box corner, dequantized in the same way as in gpuart::BoundingVolumesHierarchy
+vec3 Dequantize(
+    in vec3 origin, ///< Parent's minimum corner
+    in vec3 scale,  ///< Quantization scale
+    in uint qvalue  ///< Quantized coordinates (8 bits each)
+)
+{
+    return origin + vec3((uvec3(qvalue) >> uvec3(0U, 8U, 16U)) & 0xFFU) * scale;
+}
+
+/// Checks for an intersection with a child's bounding box stored (quantized) in its parent
+bool IntersectsChildAABB(
+    in vec3 rstart, ///< Ray's starting point
+    in vec3 rdiv,   ///< 1/rdir (component-wise), finite
+    in vec4 quantParams, ///< Parent's minimum corner and quantization exponents
+    in uint qmin,   ///< Child's quantized minimum corner
+    in uint qmax,   ///< Child's quantized maximum corner
+
+    out float tnear, ///< Position of the entering intersection (negative if 'rstart' lies inside)
+    out float tfar   ///< Position of the exiting intersection
+)
+{
+    // Quantization scales are powers of 2, stored as (biased) floating-point exponents
+    uvec3 exponents = (uvec3(floatBitsToUint(quantParams.w)) >> uvec3(0U, 8U, 16U)) & 0xFFU;
+    vec3 scale = uintBitsToFloat(exponents << 23U);
+
+    return IntersectsAABB(rstart, rdiv,
+                          Dequantize(quantParams.xyz, scale, qmin),
+                          Dequantize(quantParams.xyz, scale, qmax),
+                          tnear, tfar);
+}
+
+/** Returns the address of the inner node's next child (in visiting order) whose bounding box
+    is intersected before 'maxPos', or -1 if there is none.
+
+    Children are sorted along the node's order axis (see gpuart::BoundingVolumesHierarchy::Compile())
+    and visited front-to-back along it, i.e. in reverse order if the ray's direction is negative along it;
+    the order depends only on the ray's direction, so it is known again after returning from a child. */
+int FindNextBVHChild(
+    in vec3 rstart,
+    in vec3 rdir,
+    in vec3 rdiv,  ///< 1/rdir (component-wise), finite
+    in samplerBuffer bvhTree,
+    in int bvhIdx,        ///< Inner node's address in 'bvhTree'
+    in vec4 nodeInfo,     ///< Inner node's info quad
+    in uint returningFrom, ///< Index+1 of the child the traversal has returned from; 0 if none
+    in float maxPos       ///< Children entered beyond this position along the ray are culled
+)
+{
+    uint flags = floatBitsToUint(nodeInfo[NDINFO_FLAGS]);
+    uint numChildren = (flags & ~BVH_FLAGS_MASK);
+    bool reversed = (rdir[(flags & BVH_ORDER_AXIS_MASK) >> BVH_ORDER_AXIS_SHIFT] < 0);
+
+    // Position (in visiting order) of the next child to test
+    uint step = 0U;
+    if (returningFrom > 0U)
+        step = (reversed ? numChildren - returningFrom : returningFrom - 1U) + 1U;
+
+    if (step >= numChildren)
+        return -1;
+
+    vec4 quantParams = texelFetch(bvhTree, bvhIdx + BVH_QUANT_PARAMS_OFS);
+    uvec4 childrenBB;
+    int childrenBBIdx = -1;
+
+    for (; step < numChildren; step++)
     {
-        pos = -1;
-        return true;
+        uint i = (reversed ? numChildren - 1U - step : step);
+
+        if (int(i / CHBB_PER_QUAD) != childrenBBIdx)
+        {
+            childrenBBIdx = int(i / CHBB_PER_QUAD);
+            childrenBB = floatBitsToUint(texelFetch(bvhTree, bvhIdx + BVH_CHILDREN_BB_OFS + childrenBBIdx));
+        }
+
+        uvec2 qbox = (i % CHBB_PER_QUAD == 0U) ? childrenBB.xy : childrenBB.zw;
+        float tnear, tfar;
+
+        COUNT_STAT(STAT_AABB_TESTS);
+
+        if (IntersectsChildAABB(rstart, rdiv, quantParams, qbox.x, qbox.y, tnear, tfar)
+            && tnear <= maxPos)
+        {
+            if (i < NDINFO_NUM_CHILDREN_ADDR)
+                return int(floatBitsToUint(nodeInfo[NDINFO_CHILD0_ADDR + int(i)]));
+            else
+            {
+                uint addrIdx = i - NDINFO_NUM_CHILDREN_ADDR;
+                int addrQuad = bvhIdx + BVH_CHILDREN_BB_OFS
+                               + int((numChildren + CHBB_PER_QUAD - 1U) / CHBB_PER_QUAD + addrIdx / 4U);
+                return int(floatBitsToUint(texelFetch(bvhTree, addrQuad)[addrIdx % 4U]));
+            }
+        }
     }
-    else
+
+    return -1;
+}
+
+/** Returns the address of the root of the instance's bottom-level tree, and the ray transformed
+    into the instance's space (its direction is not normalized, so positions along the ray stay the same). */
+int EnterInstance(
+    in samplerBuffer bvhTree,
+    in int addr,    ///< Start of the instance's data in 'bvhTree' (not including the primitive type)
+    in vec3 rstart, ///< Ray's origin (world space)
+    in vec3 rdir,   ///< Ray's direction (world space)
+    out vec3 instRStart,
+    out vec3 instRDir
+)
+{
+    // Rows of the world-to-object transformation, see gpuart::Instance::StoreDataIntoBVH()
+    vec4 row0 = texelFetch(bvhTree, addr),
+         row1 = texelFetch(bvhTree, addr+1),
+         row2 = texelFetch(bvhTree, addr+2);
+
+    instRStart = vec3(dot(row0.xyz, rstart) + row0.w, dot(row1.xyz, rstart) + row1.w, dot(row2.xyz, rstart) + row2.w);
+    instRDir   = vec3(dot(row0.xyz, rdir), dot(row1.xyz, rdir), dot(row2.xyz, rdir));
+
+    return int(floatBitsToUint(texelFetch(bvhTree, addr+3).r));
+}
+
+/// Returns the instance's (object space) unit normal transformed into world space
+vec3 GetInstanceWorldNormal(
+    in samplerBuffer bvhTree,
+    in int addr, ///< Start of the instance's data in 'bvhTree' (not including the primitive type)
+    in vec3 normal
+)
+{
+    // Normals are transformed by the inverse transpose of object-to-world, i.e. the transpose of world-to-object
+    return normalize(normal.x * texelFetch(bvhTree, addr).xyz
+                     + normal.y * texelFetch(bvhTree, addr+1).xyz
+                     + normal.z * texelFetch(bvhTree, addr+2).xyz);
+}
+
+/// Returns 1/rdir (component-wise) with all components finite, as required by the ray-AABB test
+vec3 GetFiniteRayDirInverse(in vec3 rdir)
+{
+    /* Zero direction components are replaced by a tiny value; otherwise the slab test
+       could evaluate 0*inf = NaN for a ray lying in a slab's plane. */
+    return 1/mix(rdir, vec3(RDIR_MIN_ABS), lessThan(abs(rdir), vec3(RDIR_MIN_ABS)));
+}
+
+void CheckBVHIntersection(
+    in vec3 rstart,
+    in vec3 rdir,
+
+    in samplerBuffer bvhTree,
+    in samplerBuffer meshVertices, ///< Vertices referred to by mesh triangles in 'bvhTree'
+
+    /** Satisfies: rstart + pos*rdir = intersection.
+        Receives a value <0 if there is no intersection. */
+    out float pos,
+    out vec3 intersection, ///< Intersection coordinates
+    out vec3 normal,       ///< Unit normal at intersection (facing 'rstart')
+    out int primitiveType, ///< Type of the intersected primitive (mesh triangles are reported as TRIANGLE)
+    out int material,      ///< Material ID of the intersected primitive (index in the material table)
+
+    /// Address of the intersected primitive's data in 'bvhTree'; -1 if it belongs to an instance (stored in object space)
+    out int primitiveAddr
+)
+{
+    /* Children's bounding boxes are stored in (and tested at) their parent, so a node
+       is entered only if its bounding box is intersected. The root is always entered.
+       Inner nodes have up to 8 children (see gpuart::BoundingVolumesHierarchy::Compile()).
+
+       An instance in a top-level tree's leaf is entered by continuing the traversal at the root
+       of its bottom-level tree, with the ray transformed into the instance's space. Leaving
+       that root resumes the leaf at the instance's next primitive. */
+
+    int bvhIdx = 0; // Current node's address (index) in 'bvhTree'
+    uint returningFrom = 0U; // Index+1 of the current node's child the traversal has returned from; 0 if none
+
+    // Ray in the space of the current tree ('rstart' and 'rdir' stay in world space)
+    vec3 currRStart = rstart, currRDir = rdir;
+    vec3 rdiv = GetFiniteRayDirInverse(rdir);
+
+    int instanceAddr = -1; // Data address of the entered instance; -1 if traversing the top level
+
+    // Top-level leaf's primitives remaining after the entered instance
+    int resumeLeafAddr, resumePrimAddr;
+    uint resumeNumPrimitives;
+    bool resuming = false;
+
+    int hitInstanceAddr = -1; // Data address of the instance containing the closest intersection; -1 if none
+
+    pos = -1;
+    primitiveType = -1;
+    material = 0;
+    primitiveAddr = -1;
+    float closestPos = 1e+19;
+
+    do
     {
-        float kx, ky, kz, x, y, z;
-        bool intersected = false;
+        vec4 nodeInfo = texelFetch(bvhTree, bvhIdx + BVH_NODE_INFO_OFS).rgba;
+        uint flags = floatBitsToUint(nodeInfo[NDINFO_FLAGS]);
 
-        pos = 1.0e+19;
+        COUNT_STAT(STAT_NODES_VISITED); // also counts returns to the parent
 
-        if (rdir.x != 0)
+        if ((flags & BVH_LEAF) == BVH_LEAF)
         {
-            kx = (bbmin.x - rstart.x) * rdiv.x;
-            if (kx >= 0)
-            {
-                y = rstart.y + kx*rdir.y;
-                z = rstart.z + kx*rdir.z;
+            uint numPrimitives = (flags & ~BVH_FLAGS_MASK);
+            int primAddr = bvhIdx + BVH_PRIM_DATA_OFS;
 
-                if (y >= bbmin.y && y <= bbmax.y &&
-                    z >= bbmin.z && z <= bbmax.z)
-                {
-                    intersected = true;
-                    if (kx < pos)
-                        pos = kx;
-                }
+            if (resuming)
+            {
+                numPrimitives = resumeNumPrimitives;
+                primAddr = resumePrimAddr;
+                resuming = false;
             }
 
-            kx = (bbmax.x - rstart.x) * rdiv.x;
-            if (kx >= 0)
+            bool enteringInstance = false;
+
+            for (uint i = 0U; i < numPrimitives; i++)
             {
-                y = rstart.y + kx*rdir.y;
-                z = rstart.z + kx*rdir.z;
-                if (y >= bbmin.y && y <= bbmax.y &&
-                    z >= bbmin.z && z <= bbmax.z)
+                float currPos;
+                vec3 currIntersection, currNormal;
+                uvec2 header = floatBitsToUint(texelFetch(bvhTree, primAddr).rg); // type and material ID
+                int ptype = int(header.x);
+
+                if (ptype == INSTANCE)
                 {
-                    intersected = true;
-                    if (kx < pos)
-                        pos = kx;
+                    resumeLeafAddr = bvhIdx;
+                    resumePrimAddr = primAddr + 1 + INSTANCE_DATA_LEN;
+                    resumeNumPrimitives = numPrimitives - i - 1U;
+
+                    instanceAddr = primAddr + 1;
+                    bvhIdx = EnterInstance(bvhTree, instanceAddr, rstart, rdir, currRStart, currRDir);
+                    rdiv = GetFiniteRayDirInverse(currRDir);
+                    enteringInstance = true;
+                    break;
                 }
-            }
-        }
 
-        if (rdir.y != 0)
-        {
-            ky = (bbmin.y - rstart.y) * rdiv.y;
-            if (ky >= 0)
-            {
-                x = rstart.x + ky*rdir.x;
-                z = rstart.z + ky*rdir.z;
-                if (x >= bbmin.x && x <= bbmax.x &&
-                    z >= bbmin.z && z <= bbmax.z)
+                int dataAddr = primAddr + 1; // skips the type header
+                primAddr = CheckBVHPrimitiveIntersection(
+                            currRStart, currRDir, ptype,
+                            bvhTree, meshVertices, dataAddr,
+                            currPos, currIntersection, currNormal);
+
+                if (currPos > 0 && currPos < closestPos)
                 {
-                    intersected = true;
-                    if (ky < pos)
-                        pos = ky;
+                    closestPos = pos = currPos;
+                    intersection = currIntersection;
+                    normal = currNormal;
+                    primitiveType = (ptype == MESH_TRIANGLE ? TRIANGLE : ptype);
+                    material = int(header.y);
+                    primitiveAddr = (instanceAddr < 0 ? dataAddr : -1);
+                    hitInstanceAddr = instanceAddr;
                 }
             }
 
-            ky = (bbmax.y - rstart.y) * rdiv.y;
-            if (ky >= 0)
+            if (enteringInstance)
             {
-                x = rstart.x + ky*rdir.x;
-                z = rstart.z + ky*rdir.z;
-                if (x >= bbmin.x && x <= bbmax.x &&
-                    z >= bbmin.z && z <= bbmax.z)
-                {
-                    intersected = true;
-                    if (ky < pos)
-                        pos = ky;
-                }
+                returningFrom = 0U;
+                continue;
             }
         }
-
-        if (rdir.z != 0)
+        else
         {
-            kz = (bbmin.z - rstart.z) * rdiv.z;
-            if (kz >= 0)
+            // Children entered beyond the closest intersection found so far are culled
+            int childAddr = FindNextBVHChild(currRStart, currRDir, rdiv, bvhTree, bvhIdx, nodeInfo, returningFrom, closestPos);
+            if (childAddr >= 0)
             {
-                x = rstart.x + kz*rdir.x;
-                y = rstart.y + kz*rdir.y;
-                if (x >= bbmin.x && x <= bbmax.x &&
-                    y >= bbmin.y && y <= bbmax.y)
-                {
-                    intersected = true;
-                    if (kz < pos)
-                        pos = kz;
-                }
+                returningFrom = 0U;
+                bvhIdx = childAddr;
+                continue;
             }
+        }
 
-            kz = (bbmax.z - rstart.z) * rdiv.z;
-            if (kz >= 0)
-            {
-                x = rstart.x + kz*rdir.x;
-                y = rstart.y + kz*rdir.y;
-                if (x >= bbmin.x && x <= bbmax.x &&
-                    y >= bbmin.y && y <= bbmax.y)
-                {
-                    intersected = true;
-                    if (kz < pos)
-                        pos = kz;
-                }
-            }
+        // Return to the parent
+
+        if ((flags & BVH_IS_ROOT) == BVH_IS_ROOT)
+        {
+            if (instanceAddr < 0)
+                break;
+
+            // Leave the instance and resume the top-level leaf
+            instanceAddr = -1;
+            currRStart = rstart;
+            currRDir = rdir;
+            rdiv = GetFiniteRayDirInverse(rdir);
+            bvhIdx = resumeLeafAddr;
+            resuming = true;
+            continue;
         }
 
-        return intersected;
+        returningFrom = ((flags & BVH_CHILD_INDEX_MASK) >> BVH_CHILD_INDEX_SHIFT) + 1U;
+        bvhIdx = int(floatBitsToUint(nodeInfo[NDINFO_PARENT_ADDR]));
+
+    } while (true);
+
+    if (hitInstanceAddr >= 0)
+    {
+        // Positions along the ray are the same in both spaces
+        intersection = rstart + pos * rdir;
+        normal = GetInstanceWorldNormal(bvhTree, hitInstanceAddr, normal);
     }
 }
 
-#define FROM_NONE 0
-#define FROM_LO   1
-#define FROM_HI   2
-
-void CheckBVHIntersection(
+/** Returns 'true' if the ray intersects any primitive before reaching 'maxPos'
+    (such that rstart + maxPos*rdir is the end of the checked segment). Traversal stops
+    at the first intersection found; meant for shadow rays. */
+bool CheckBVHOcclusion(
     in vec3 rstart,
     in vec3 rdir,
 
     in samplerBuffer bvhTree,
+    in samplerBuffer meshVertices, ///< Vertices referred to by mesh triangles in 'bvhTree'
 
-    /** Satisfies: rstart + pos*rdir = intersection.
-        Receives a value <0 if there is no intersection. */
-    out float pos,
-    out vec3 intersection, ///< Intersection coordinates
-    out vec3 normal,       ///< Unit normal at intersection (facing 'rstart')
-    out int primitiveType  ///< Type of the intersected primitive
+    in float maxPos
 )
 {
-    int bvhIdx = 0; // Current node's address (index) in 'bvhTree'
-    bool recursionReturn = false;
-    int returningFrom = FROM_NONE;
+    // Instances are entered and left as in CheckBVHIntersection()
 
-    vec3 rdiv = 1/rdir;
+    int bvhIdx = 0;
+    uint returningFrom = 0U;
 
-    pos = -1;
-    primitiveType = -1;
-    float closestPos = 1e+19;
+    vec3 currRStart = rstart, currRDir = rdir;
+    vec3 rdiv = GetFiniteRayDirInverse(rdir);
 
-    vec4 nodeInfo;
-    uint flags = 0U;
+    bool inInstance = false;
+    int resumeLeafAddr, resumePrimAddr;
+    uint resumeNumPrimitives;
+    bool resuming = false;
 
     do
     {
-        nodeInfo = texelFetch(bvhTree, bvhIdx + BVH_NODE_INFO_OFS).rgba;
-        flags = floatBitsToUint(nodeInfo[NDINFO_FLAGS]);
+        vec4 nodeInfo = texelFetch(bvhTree, bvhIdx + BVH_NODE_INFO_OFS).rgba;
+        uint flags = floatBitsToUint(nodeInfo[NDINFO_FLAGS]);
 
-        if (recursionReturn && returningFrom == FROM_HI && (flags & BVH_IS_ROOT) == BVH_IS_ROOT)
-            break;
+        COUNT_STAT(STAT_NODES_VISITED); // also counts returns to the parent
 
-        float bboxIntrPos;
-        if (IntersectsAABB(rstart, rdir, rdiv, bvhTree, bvhIdx, bboxIntrPos))
+        if ((flags & BVH_LEAF) == BVH_LEAF)
         {
-            if (bboxIntrPos > closestPos)
-                recursionReturn = true;
-            else if ((flags & BVH_LEAF) == BVH_LEAF)
+            uint numPrimitives = (flags & ~BVH_FLAGS_MASK);
+            int primAddr = bvhIdx + BVH_PRIM_DATA_OFS;
+
+            if (resuming)
             {
-                uint numPrimitives = (flags & ~BVH_FLAGS_MASK);
-                int primAddr = bvhIdx + BVH_PRIM_DATA_OFS;
+                numPrimitives = resumeNumPrimitives;
+                primAddr = resumePrimAddr;
+                resuming = false;
+            }
 
-                for (uint i = 0U; i < numPrimitives; i++)
-                {
-                    float currPos;
-                    vec3 currIntersection, currNormal;
-                    int ptype = int(floatBitsToUint(texelFetch(bvhTree, primAddr).r));
-
-                    primAddr = CheckBVHPrimitiveIntersection(
-                                rstart, rdir, ptype,
-                                bvhTree, primAddr + 1, // +1 skips the stored 'ptype'
-                                currPos, currIntersection, currNormal);
-
-                    if (currPos > 0 && currPos < closestPos)
-                    {
-                        closestPos = pos = currPos;
-                        intersection = currIntersection;
-                        normal = currNormal;
-                        primitiveType = ptype;
-                    }
-                }
+            bool enteringInstance = false;
 
-                recursionReturn = true;
-            }
-            else
+            for (uint i = 0U; i < numPrimitives; i++)
             {
-                recursionReturn = false;
+                float currPos;
+                vec3 dummy1, dummy2; // unused; the compiler can skip their calculation
+                int ptype = int(floatBitsToUint(texelFetch(bvhTree, primAddr).r));
 
-                if (returningFrom == FROM_NONE)
-                    bvhIdx = int(floatBitsToUint(nodeInfo[NDINFO_LO_ADDR]));
-                else if (returningFrom == FROM_LO)
+                if (ptype == INSTANCE)
                 {
-                    returningFrom = FROM_NONE;
-                    bvhIdx = int(floatBitsToUint(nodeInfo[NDINFO_HI_ADDR]));
+                    resumeLeafAddr = bvhIdx;
+                    resumePrimAddr = primAddr + 1 + INSTANCE_DATA_LEN;
+                    resumeNumPrimitives = numPrimitives - i - 1U;
+
+                    inInstance = true;
+                    bvhIdx = EnterInstance(bvhTree, primAddr + 1, rstart, rdir, currRStart, currRDir);
+                    rdiv = GetFiniteRayDirInverse(currRDir);
+                    enteringInstance = true;
+                    break;
                 }
-                else
-                    recursionReturn = true;
+
+                primAddr = CheckBVHPrimitiveIntersection(
+                            currRStart, currRDir, ptype,
+                            bvhTree, meshVertices, primAddr + 1, // +1 skips the type header
+                            currPos, dummy1, dummy2);
+
+                if (currPos > 0 && currPos < maxPos)
+                    return true;
+            }
+
+            if (enteringInstance)
+            {
+                returningFrom = 0U;
+                continue;
             }
         }
         else
-            recursionReturn = true;
+        {
+            int childAddr = FindNextBVHChild(currRStart, currRDir, rdiv, bvhTree, bvhIdx, nodeInfo, returningFrom, maxPos);
+            if (childAddr >= 0)
+            {
+                returningFrom = 0U;
+                bvhIdx = childAddr;
+                continue;
+            }
+        }
 
+        // Return to the parent
 
-        if (recursionReturn)
+        if ((flags & BVH_IS_ROOT) == BVH_IS_ROOT)
         {
-            if ((flags & BVH_IS_LOWER) == BVH_IS_LOWER)
-                returningFrom = FROM_LO;
-            else // this also executes for root, which does not have BVH_IS_LOWER set; in effect, we break at the next iteration's start
-                returningFrom = FROM_HI;
-
-            bvhIdx = int(floatBitsToUint(nodeInfo[NDINFO_PARENT_ADDR]));
+            if (!inInstance)
+                break;
+
+            inInstance = false;
+            currRStart = rstart;
+            currRDir = rdir;
+            rdiv = GetFiniteRayDirInverse(rdir);
+            bvhIdx = resumeLeafAddr;
+            resuming = true;
+            continue;
         }
 
+        returningFrom = ((flags & BVH_CHILD_INDEX_MASK) >> BVH_CHILD_INDEX_SHIFT) + 1U;
+        bvhIdx = int(floatBitsToUint(nodeInfo[NDINFO_PARENT_ADDR]));
+
     } while (true);
+
+    return false;
 }
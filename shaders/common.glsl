@@ -37,6 +37,25 @@ float random(in vec4  v);
 
 float sqrlen(in vec3 v) { return dot(v, v); }
 
+/** Unpacks a material packed by gpuart::Material::Pack(): the first 3 components of a quad
+    in the material table, or the last 3 of a dynamic object's type header. */
+void UnpackMaterial(
+    in vec3 packedMaterial,
+    out vec3 albedo,
+    out float specular, ///< Probability of specular reflection
+    out vec3 emission,
+    out float roughness ///< Spread of specular reflections (0: perfect mirror)
+)
+{
+    uvec3 bits = floatBitsToUint(packedMaterial);
+
+    albedo = vec3((uvec3(bits.x) >> uvec3(0U, 8U, 16U)) & 0xFFU) / 255.0;
+    emission = vec3((uvec3(bits.y) >> uvec3(0U, 8U, 16U)) & 0xFFU) / 255.0
+               * uintBitsToFloat(bits.z & 0xFFFF0000U); // the emission scale
+    specular = float(bits.z & 0xFFU) / 255.0;
+    roughness = float((bits.z >> 8U) & 0xFFU) / 255.0;
+}
+
 vec3 GetOrthogonal(vec3 v)
 {
     if (all(lessThan(abs(v.xy), vec2(1.0e-6, 1.0e-6))))
@@ -32,38 +32,58 @@ File description:
 
 #define MAX_REFLECTIONS 1
 
+// Layout of a light record, see gpuart::LIGHT_DATA_LEN
+#define LIGHT_DATA_LEN      3
+#define LIGHT_CENTER_RADIUS 0
+#define LIGHT_NORMAL_TYPE   1
+
+/// Relative margin of visibility checks of lights, which stop short of the light's surface
+#define LIGHT_DIST_TOLERANCE 1.0e-3
+
+/// Max. position along a ray which effectively imposes no limit
+#define NO_MAX_POS 1.0e+19
+
 // External functions -------------------------------------
 
-void CheckBVHIntersection(
-    in vec3 rstart,
-    in vec3 rdir,
-    
+/// Checks intersections with all primitives and the dynamic objects
+void CheckIntersectionInclDynamicObjects(
+    in vec3 rstart,  ///< Ray's origin
+    in vec3 rdir,    ///< Ray's direction
+
     in samplerBuffer bvhTree,
-    
+    in samplerBuffer meshVertices, ///< Vertices referred to by mesh triangles in 'bvhTree'
+
+    in samplerBuffer dynamicObjects, ///< Stored by gpuart::StoreDynamicObjects()
+    in int numDynamicObjectGroups,
+
     /** Satisfies: rstart + pos*rdir = intersection.
         Receives a value <0 if there is no intersection. */
     out float pos,
     out vec3 intersection, ///< Intersection coordinates
     out vec3 normal,       ///< Unit normal at intersection (facing 'rstart')
-    out int primitiveType  ///< Type of the intersected primitive
+    out int primitiveType,
+    out int material,      ///< Material ID of the intersected primitive (unless it is a dynamic object)
+
+    /// Address of the intersected primitive's data in 'bvhTree'; -1 if it belongs to an instance or is a dynamic object
+    out int primitiveAddr,
+
+    /// Address of the intersected dynamic object's type and packed material in 'dynamicObjects'; -1 if none was hit
+    out int dynamicObject
 );
 
-/// Checks intersections with all primitives and the user-controlled sphere
-void CheckIntersectionInclUserSphere(
+/** Returns 'true' if the ray intersects any primitive or dynamic object
+    before reaching 'maxPos' (such that rstart + maxPos*rdir is the end of the checked segment). */
+bool CheckOcclusionInclDynamicObjects(
     in vec3 rstart,  ///< Ray's origin
     in vec3 rdir,    ///< Ray's direction
 
     in samplerBuffer bvhTree,
+    in samplerBuffer meshVertices, ///< Vertices referred to by mesh triangles in 'bvhTree'
 
-    in vec4 userSphere, ///< User sphere's position and radius
+    in samplerBuffer dynamicObjects, ///< Stored by gpuart::StoreDynamicObjects()
+    in int numDynamicObjectGroups,
 
-    /** Satisfies: rstart + pos*rdir = intersection.
-        Receives a value <0 if there is no intersection. */
-    out float pos,
-    out vec3 intersection, ///< Intersection coordinates
-    out vec3 normal,       ///< Unit normal at intersection (facing 'rstart')
-    out int primitiveType,
-    out bool userSphereHit
+    in float maxPos
 );
 
 vec3 GetSkyColor(
@@ -74,18 +94,21 @@ vec3 GetSkyColor(
     in vec4 sunDirAlt
 );
 
+/// Unpacks a material packed by gpuart::Material::Pack()
+void UnpackMaterial(
+    in vec3 packedMaterial,
+    out vec3 albedo,
+    out float specular, ///< Probability of specular reflection
+    out vec3 emission,
+    out float roughness ///< Spread of specular reflections (0: perfect mirror)
+);
+
 
 // ---------------------------------------------------------
 
 const float lightIntensity[] = float[](1.0);
 const float AMBIENT_INTENSITY = 0.15;
 
-/// Indexed by primitive type
-const vec3 PRIMITIVE_COLOR[] = vec3[](vec3(0.65, 0.4, 0.35), // sphere
-                                      vec3(0.1, 0.2, 0.1),   // disc
-                                      vec3(0.3, 0.3, 0.3),  // triangle
-                                      vec3(0.3, 0.3, 0.3)); // cone
-
 vec3 GetLambertShadedDiffuseColor(
     in vec3 lightDir, ///< Unit vector
     in vec3 normal,   ///< Unit vector
@@ -110,24 +133,31 @@ uniform vec4 SunDirAlt;    ///< Direction towards the Sun (unit) and its altitud
 uniform int SunDirectLightingEnabled;
 
 uniform samplerBuffer BVH;
+uniform samplerBuffer MeshVertices; ///< Vertices of mesh triangles stored in 'BVH'
+uniform samplerBuffer Materials; ///< Material table indexed by material IDs stored in 'BVH'
 
 
+uniform samplerBuffer DynamicObjects; ///< User-controlled objects stored by gpuart::StoreDynamicObjects()
+uniform int NumDynamicObjectGroups;
 
-uniform vec4 UserSphere;   ///< Center and radius of the user-controlled sphere
-uniform vec3 UserSphereEm; ///< User sphere's emissivity (may be all zeros)
-
-// Values correspond with UserSphereFlags (gpuart::Renderer)
-#define USPH_EM_NONZERO   (1U<<0)
-#define USPH_SPECULAR     (1U<<1)
-#define USPH_FUZZY        (1U<<2)
-
-uniform uint UserSphereFlags;
+uniform samplerBuffer Lights; ///< Emissive primitives and dynamic objects stored by gpuart::StoreLights()
+uniform int NumLights;
+uniform int FirstDynamicLight; ///< Index of the first light of a dynamic object; the scene's lights precede it
 
 
 // Outputs -------------------------------------------------
 
 layout(location = 0) out vec3 out_Irradiance;
 
+#ifdef TRAVERSAL_STATS
+/// Per-pixel traversal counters (see bvh_intersection.glsl) and the path length (number of traced segments)
+layout(location = 1) out vec4 out_TraversalStats;
+
+#define STAT_PATH_LENGTH 3
+
+uvec4 TraversalStats;
+#endif
+
 
 // ---------------------------------------------------------
 
@@ -135,8 +165,8 @@ void main()
 {
     float pos;
     vec3 intersection, normal;
-    int primitiveType;
-    bool userSphereHit;
+    int primitiveType, materialID;
+    int primitiveAddr, dynamicObject;
 
     vec3 rdir = texture(RDir, UV).xyz,
          rstart = texture(RStart, UV).xyz;
@@ -144,64 +174,89 @@ void main()
     vec3 colorWeight = vec3(1, 1, 1);
     out_Irradiance = vec3(0, 0, 0);
 
+#ifdef TRAVERSAL_STATS
+    TraversalStats = uvec4(0U);
+#endif
+
     for (int i = 0; i <= MAX_REFLECTIONS; i++)
     {
-    
-        CheckIntersectionInclUserSphere(
+#ifdef TRAVERSAL_STATS
+        TraversalStats[STAT_PATH_LENGTH]++;
+#endif
+
+        CheckIntersectionInclDynamicObjects(
             rstart, rdir,
-            BVH,
-            UserSphere,
+            BVH, MeshVertices,
+            DynamicObjects, NumDynamicObjectGroups,
+
+            pos, intersection, normal, primitiveType, materialID, primitiveAddr, dynamicObject);
+
+        if (primitiveType == -1)
+        {
+            out_Irradiance = colorWeight * GetSkyColor(rdir, SunDirAlt);
+            break;
+        }
 
-            pos, intersection, normal, primitiveType, userSphereHit);
+        // The only fetch needed for shading; a dynamic object's material is stored in its type header
+        vec3 packedMaterial = (dynamicObject >= 0 ? texelFetch(DynamicObjects, dynamicObject).yzw
+                                                  : texelFetch(Materials, materialID).xyz);
+        vec3 albedo, emission;
+        float specular, roughness;
+        UnpackMaterial(packedMaterial, albedo, specular, emission, roughness);
 
-        if ((UserSphereFlags & USPH_SPECULAR) != 0U && userSphereHit)
+        // Without random sampling, mostly specular surfaces are shown as perfect mirrors
+        if (specular >= 0.5)
         {
             rstart = intersection;
             rdir = reflect(rdir, normal);
-            colorWeight *= PRIMITIVE_COLOR[SPHERE];
+            colorWeight *= albedo;
         }
-        else if ((UserSphereFlags & USPH_EM_NONZERO) != 0U && userSphereHit)
+        else if (any(greaterThan(emission, vec3(0, 0, 0))))
         {
-            out_Irradiance = vec3(1, 1, 1);
+            // Emitters are shown with their normalized color
+            out_Irradiance = colorWeight * emission / max(max(emission.r, emission.g), emission.b);
+            break;
         }
         else
         {
-            if (primitiveType != -1)
+            vec3 diffuseColor = albedo * colorWeight;
+
+            if (SunDirectLightingEnabled == 1)
             {
-                vec3 diffuseColor = PRIMITIVE_COLOR[primitiveType] * colorWeight;
-                vec3 dummy1, dummy2;
+                if (!CheckOcclusionInclDynamicObjects(intersection, SunDirAlt.xyz,
+                                                      BVH, MeshVertices, DynamicObjects, NumDynamicObjectGroups,
+                                                      NO_MAX_POS))
+                    out_Irradiance += GetLambertShadedDiffuseColor(SunDirAlt.xyz, normal, diffuseColor, lightIntensity[0]);
+            }
 
-                if (SunDirectLightingEnabled == 1)
-                {
-                    CheckIntersectionInclUserSphere(
-                        intersection, SunDirAlt.xyz,
-                        BVH,
-                        UserSphere,
+            /* Emissive dynamic objects act as point lights of unit intensity at their centers. The scene's emitters
+               are left to path tracing: they can be numerous, and this preview casts one shadow ray per light. */
+            for (int l = FirstDynamicLight; l < NumLights; l++)
+            {
+                vec4 centerRadius = texelFetch(Lights, l * LIGHT_DATA_LEN + LIGHT_CENTER_RADIUS);
+                int type = int(floatBitsToUint(texelFetch(Lights, l * LIGHT_DATA_LEN + LIGHT_NORMAL_TYPE).w));
 
-                        pos, dummy1, dummy2, primitiveType, userSphereHit);
+                vec3 dirToLight = centerRadius.xyz - intersection;
+                float dist = length(dirToLight);
 
-                    if (primitiveType == -1)
-                        out_Irradiance += GetLambertShadedDiffuseColor(SunDirAlt.xyz, normal, diffuseColor, lightIntensity[0]);
-                }
+                /* Visibility is checked up to the light's (or its bounding sphere's) surface, so that the light
+                   does not occlude itself; a disc's center lies on its surface. Points inside are always lit. */
+                float maxPos = (type == DISC ? dist : dist - centerRadius.w) * (1 - LIGHT_DIST_TOLERANCE);
 
-                if ((UserSphereFlags & USPH_EM_NONZERO) != 0U)
+                if (maxPos <= 0 || !CheckOcclusionInclDynamicObjects(intersection, dirToLight/dist,
+                                                                      BVH, MeshVertices, DynamicObjects, NumDynamicObjectGroups,
+                                                                      maxPos))
                 {
-                    vec3 dirToSphere = UserSphere.xyz - intersection;
-                    float dist = length(dirToSphere);
-                    
-                    CheckBVHIntersection(intersection, dirToSphere/dist, BVH,
-                                        pos, dummy1, dummy2, primitiveType);
-                                        
-                    if (primitiveType == -1 || pos > dist)
-                        out_Irradiance += GetLambertShadedDiffuseColor(dirToSphere/dist, normal, diffuseColor, 1) / (dist*dist);
+                    out_Irradiance += GetLambertShadedDiffuseColor(dirToLight/dist, normal, diffuseColor, 1) / (dist*dist);
                 }
-
-                out_Irradiance += AMBIENT_INTENSITY * diffuseColor;
             }
-            else
-                out_Irradiance = colorWeight * GetSkyColor(rdir, SunDirAlt);
 
+            out_Irradiance += AMBIENT_INTENSITY * diffuseColor;
             break;
         }
     }
+
+#ifdef TRAVERSAL_STATS
+    out_TraversalStats = vec4(TraversalStats);
+#endif
 }
@@ -18,63 +18,93 @@ You should have received a copy of the GNU General Public License
 along with gpuart.  If not, see <http://www.gnu.org/licenses/>.
 
 File description:
-    Function to check ray intersection with scene and the user sphere
+    Functions to check ray intersection with scene and the dynamic objects
 */
 
 #version 330 core
 
 
-// Primitive types
-#define SPHERE   0
-#define DISC     1
-#define TRIANGLE 2
-
-#define PRIMITIVE_TYPE 0
-#define PRIMITIVE_ADDR 1
-
 #define VISIBILITY_OFFSET 1.0e-4
 
+// Layout of a group of dynamic objects, see gpuart::StoreDynamicObjects()
+#define DYNOBJ_GROUP_BB_MIN   0 ///< Also contains the next group's address
+#define DYNOBJ_GROUP_BB_MAX   1
+#define DYNOBJ_GROUP_OBJECTS  2 ///< Objects' types, packed materials and data
+
 
 // External functions -------------------------------------
 
-void SphereIntersection(
-    in vec3 rstart,  ///< Ray's origin
-    in vec3 rdir,    ///< Ray's direction
-    in vec3 center,  ///< Sphere's center
-    in float radius, ///< Sphere's radius
+/// Returns address of the next primitive's data
+int CheckBVHPrimitiveIntersection(
+    in vec3 rstart, ///< Ray's origin
+    in vec3 rdir,   ///< Ray's direction
+    in int primitiveType,
+    in samplerBuffer bvhTree,
+    in samplerBuffer meshVertices, ///< Vertices referred to by mesh triangles in 'bvhTree'
+    in int addr,    ///< Start of primitive data in 'bvhTree' (not including the primitive type)
 
     /** Satisfies: rstart + pos*rdir = intersection.
         Receives a value <0 if there is no intersection. */
     out float pos,
     out vec3 intersection, ///< Intersection coordinates
-    out vec3 normal  ///< Sphere's unit normal at intersection
+    out vec3 normal        ///< Unit normal at intersection (facing 'rstart')
+);
+
+bool IntersectsAABB(
+    in vec3 rstart, ///< Ray's starting point
+    in vec3 rdiv,   ///< 1/rdir (component-wise); must be finite, see GetFiniteRayDirInverse()
+    in vec3 bbmin,  ///< AABB's minimum corner
+    in vec3 bbmax,  ///< AABB's maximum corner
+
+    out float tnear,
+    out float tfar
 );
 
+vec3 GetFiniteRayDirInverse(in vec3 rdir);
+
 void CheckBVHIntersection(
     in vec3 rstart,
     in vec3 rdir,
     
     in samplerBuffer bvhTree,
+    in samplerBuffer meshVertices, ///< Vertices referred to by mesh triangles in 'bvhTree'
     
     /** Satisfies: rstart + pos*rdir = intersection.
         Receives a value <0 if there is no intersection. */
     out float pos,
     out vec3 intersection, ///< Intersection coordinates
     out vec3 normal,       ///< Unit normal at intersection (facing 'rstart')
-    out int primitiveType  ///< Type of the intersected primitive
+    out int primitiveType, ///< Type of the intersected primitive
+    out int material,      ///< Material ID of the intersected primitive
+    out int primitiveAddr  ///< Address of the intersected primitive's data in 'bvhTree'; -1 if it belongs to an instance
+);
+
+/** Returns 'true' if the ray intersects any primitive before reaching 'maxPos'
+    (such that rstart + maxPos*rdir is the end of the checked segment). */
+bool CheckBVHOcclusion(
+    in vec3 rstart,
+    in vec3 rdir,
+
+    in samplerBuffer bvhTree,
+    in samplerBuffer meshVertices, ///< Vertices referred to by mesh triangles in 'bvhTree'
+
+    in float maxPos
 );
 
 
 // --------------------------------------------------------
 
-/// Checks intersections with all primitives and the user-controlled sphere
-void CheckIntersectionInclUserSphere(
+/** Checks intersections with all primitives and the dynamic objects. Groups of dynamic objects
+    whose bounding box the ray misses (or enters beyond the closest intersection so far) are skipped. */
+void CheckIntersectionInclDynamicObjects(
     in vec3 rstart,  ///< Ray's origin
     in vec3 rdir,    ///< Ray's direction
 
     in samplerBuffer bvhTree,
+    in samplerBuffer meshVertices, ///< Vertices referred to by mesh triangles in 'bvhTree'
 
-    in vec4 userSphere, ///< User sphere's position and radius
+    in samplerBuffer dynamicObjects, ///< Stored by gpuart::StoreDynamicObjects()
+    in int numDynamicObjectGroups,
 
     /** Satisfies: rstart + pos*rdir = intersection.
         Receives a value <0 if there is no intersection. */
@@ -82,30 +112,110 @@ void CheckIntersectionInclUserSphere(
     out vec3 intersection, ///< Intersection coordinates
     out vec3 normal,       ///< Unit normal at intersection (facing 'rstart')
     out int primitiveType,
-    out bool userSphereHit
+    out int material,      ///< Material ID of the intersected primitive (unless it is a dynamic object)
+
+    /// Address of the intersected primitive's data in 'bvhTree'; -1 if it belongs to an instance or is a dynamic object
+    out int primitiveAddr,
+
+    /// Address of the intersected dynamic object's type and packed material in 'dynamicObjects'; -1 if none was hit
+    out int dynamicObject
 )
 {
     CheckBVHIntersection(
-        rstart, rdir, bvhTree,
+        rstart, rdir, bvhTree, meshVertices,
+
+        pos, intersection, normal, primitiveType, material, primitiveAddr);
+
+    dynamicObject = -1;
+    if (numDynamicObjectGroups == 0)
+        return;
+
+    vec3 rdiv = GetFiniteRayDirInverse(rdir);
+    int groupAddr = 0;
+
+    for (int i = 0; i < numDynamicObjectGroups; i++)
+    {
+        vec4 bbminNext = texelFetch(dynamicObjects, groupAddr + DYNOBJ_GROUP_BB_MIN);
+        vec3 bbmax = texelFetch(dynamicObjects, groupAddr + DYNOBJ_GROUP_BB_MAX).xyz;
+        int nextGroupAddr = int(floatBitsToUint(bbminNext.w));
+
+        float tnear, tfar;
+        if (IntersectsAABB(rstart, rdiv, bbminNext.xyz, bbmax, tnear, tfar) && (pos < 0 || tnear < pos))
+        {
+            int addr = groupAddr + DYNOBJ_GROUP_OBJECTS;
+            while (addr < nextGroupAddr)
+            {
+                int objType = int(floatBitsToUint(texelFetch(dynamicObjects, addr).x));
+                float objPos;
+                vec3 objIntersection, objNormal;
+
+                int nextAddr = CheckBVHPrimitiveIntersection(
+                    rstart, rdir, objType, dynamicObjects, meshVertices, addr + 1,
+                    objPos, objIntersection, objNormal);
+
+                if (objPos > VISIBILITY_OFFSET && (pos < 0 || objPos < pos))
+                {
+                    dynamicObject = addr;
+                    primitiveAddr = -1;
+                    primitiveType = objType;
+                    pos = objPos;
+                    intersection = objIntersection;
+                    normal = objNormal;
+                }
+
+                addr = nextAddr;
+            }
+        }
+
+        groupAddr = nextGroupAddr;
+    }
+}
+
+/** Returns 'true' if the ray intersects any primitive or dynamic object
+    before reaching 'maxPos' (such that rstart + maxPos*rdir is the end of the checked segment). */
+bool CheckOcclusionInclDynamicObjects(
+    in vec3 rstart,  ///< Ray's origin
+    in vec3 rdir,    ///< Ray's direction
 
-        pos, intersection, normal, primitiveType);
+    in samplerBuffer bvhTree,
+    in samplerBuffer meshVertices, ///< Vertices referred to by mesh triangles in 'bvhTree'
 
-    float usPos;
-    vec3 usIntersection, usNormal;
+    in samplerBuffer dynamicObjects, ///< Stored by gpuart::StoreDynamicObjects()
+    in int numDynamicObjectGroups,
 
-    SphereIntersection(
-        rstart, rdir,
-        userSphere.xyz, userSphere.w,
-        usPos, usIntersection, usNormal);
+    in float maxPos
+)
+{
+    vec3 rdiv = GetFiniteRayDirInverse(rdir);
+    int groupAddr = 0;
 
-    if (usPos > VISIBILITY_OFFSET && (pos < 0 || usPos < pos))
+    for (int i = 0; i < numDynamicObjectGroups; i++)
     {
-        userSphereHit = true;
-        primitiveType = SPHERE;
-        pos = usPos;
-        intersection = usIntersection;
-        normal = usNormal;
+        vec4 bbminNext = texelFetch(dynamicObjects, groupAddr + DYNOBJ_GROUP_BB_MIN);
+        vec3 bbmax = texelFetch(dynamicObjects, groupAddr + DYNOBJ_GROUP_BB_MAX).xyz;
+        int nextGroupAddr = int(floatBitsToUint(bbminNext.w));
+
+        float tnear, tfar;
+        if (IntersectsAABB(rstart, rdiv, bbminNext.xyz, bbmax, tnear, tfar) && tnear < maxPos)
+        {
+            int addr = groupAddr + DYNOBJ_GROUP_OBJECTS;
+            while (addr < nextGroupAddr)
+            {
+                int objType = int(floatBitsToUint(texelFetch(dynamicObjects, addr).x));
+                float objPos;
+                vec3 objIntersection, objNormal;
+
+                addr = CheckBVHPrimitiveIntersection(
+                    rstart, rdir, objType, dynamicObjects, meshVertices, addr + 1,
+                    objPos, objIntersection, objNormal);
+
+                if (objPos > VISIBILITY_OFFSET && objPos < maxPos)
+                    return true;
+            }
+        }
+
+        groupAddr = nextGroupAddr;
     }
-    else
-        userSphereHit = false;
+
+    return CheckBVHOcclusion(rstart, rdir, bvhTree, meshVertices, maxPos);
 }
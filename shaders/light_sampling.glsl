@@ -0,0 +1,191 @@
+/*
+GPU-Assisted Ray Tracer
+Copyright (C) 2016 Filip Szczerek <ga.software@yahoo.com>
+
+This file is part of gpuart.
+
+Gpuart is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Gpuart is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with gpuart.  If not, see <http://www.gnu.org/licenses/>.
+
+File description:
+   Sampling of emissive spheres and discs (next-event estimation)
+*/
+
+#version 330 core
+
+
+// Primitive types
+#define SPHERE   0
+#define DISC     1
+
+// Layout of a light record, see gpuart::LIGHT_DATA_LEN
+#define LIGHT_DATA_LEN      3
+#define LIGHT_CENTER_RADIUS 0
+#define LIGHT_NORMAL_TYPE   1
+#define LIGHT_EMISSION_CDF  2 ///< Emission and cumulative selection probability
+
+#define PI 3.1415926
+
+/// Lights seen at a smaller cosine (of a disc) or solid angle (of a sphere) are not sampled
+#define MIN_LIGHT_COSINE 1.0e-6
+
+
+// External functions -------------------------------------
+
+float sqrlen(in vec3 v);
+
+vec3 GetOrthogonal(vec3 v);
+
+// Pseudo-random value in half-open range [0:1]
+float random(in vec3 v);
+
+
+// --------------------------------------------------------
+
+/// Returns the power in proportion to which a light is selected; corresponds with gpuart::GetLightPower()
+float GetLightPower(in int type, in float radius, in vec3 emission)
+{
+    float luminance = dot(emission, vec3(0.2126, 0.7152, 0.0722));
+
+    if (type == SPHERE)
+        return luminance * 4*PI * radius*radius;
+    else if (type == DISC)
+        return luminance * PI * radius*radius;
+    else
+        return 0.0; // cones are not sampled
+}
+
+/** Returns 1 - cosine of the half-angle of the cone of directions from 'p' towards a sphere,
+    which is 0 if 'p' lies inside it; avoids the cancellation in 1 - cos(angle) for distant spheres. */
+float GetSphereConeOneMinusCos(in vec4 centerRadius, in vec3 p)
+{
+    float sinSqr = centerRadius.w * centerRadius.w / sqrlen(centerRadius.xyz - p);
+    if (sinSqr >= 1)
+        return 0.0;
+    else
+        return sinSqr / (1 + sqrt(1 - sinSqr));
+}
+
+/** Returns the probability density (per solid angle) with which SampleLight() chooses 'dir' from 'p',
+    reaching the emissive sphere or disc at distance 'dist'; includes the light's selection probability. */
+float GetLightPdf(
+    in int type,
+    in vec4 centerRadius,
+    in vec3 discNormal, ///< Unit normal (discs only)
+    in vec3 emission,
+    in float totalPower, ///< Total power of all lights (see gpuart::SetLightSelectionProbabilities())
+    in vec3 p,
+    in vec3 dir,        ///< Unit vector
+    in float dist
+)
+{
+    float selectionPdf = GetLightPower(type, centerRadius.w, emission) / totalPower;
+
+    if (type == SPHERE)
+    {
+        // Directions are sampled uniformly within the cone subtended by the sphere
+        float oneMinusCos = GetSphereConeOneMinusCos(centerRadius, p);
+        if (oneMinusCos < MIN_LIGHT_COSINE)
+            return 0.0;
+
+        return selectionPdf / (2*PI * oneMinusCos);
+    }
+    else
+    {
+        // Points are sampled uniformly on the disc's area
+        float cosine = abs(dot(discNormal, dir));
+        if (cosine < MIN_LIGHT_COSINE)
+            return 0.0;
+
+        return selectionPdf * dist*dist / (cosine * PI * centerRadius.w*centerRadius.w);
+    }
+}
+
+/** Selects a light in proportion to its power and samples a point on it; returns 'false' if there is
+    no point to sample (e.g. 'p' lies inside the selected sphere). Visibility is not checked. */
+bool SampleLight(
+    in samplerBuffer lights, ///< Light list (see gpuart::StoreLights())
+    in int numLights,
+    in float totalPower,     ///< Total power of all lights (see gpuart::SetLightSelectionProbabilities())
+    in vec3 p,               ///< Point to be lit
+    in vec3 randInput,
+
+    out vec3 dir,      ///< Unit direction from 'p' towards the sampled point
+    out float dist,    ///< Distance to the sampled point
+    out vec3 emission,
+    out float pdf      ///< Probability density (per solid angle) of choosing 'dir' (see GetLightPdf())
+)
+{
+    // Binary search for the first light whose cumulative selection probability exceeds a random value
+    float u = random(randInput);
+    int first = 0, last = numLights - 1;
+    while (first < last)
+    {
+        int mid = (first + last) / 2;
+        if (texelFetch(lights, mid * LIGHT_DATA_LEN + LIGHT_EMISSION_CDF).w > u)
+            last = mid;
+        else
+            first = mid + 1;
+    }
+
+    int addr = first * LIGHT_DATA_LEN;
+    vec4 centerRadius = texelFetch(lights, addr + LIGHT_CENTER_RADIUS);
+    vec4 normalType = texelFetch(lights, addr + LIGHT_NORMAL_TYPE);
+    int type = int(floatBitsToUint(normalType.w));
+    emission = texelFetch(lights, addr + LIGHT_EMISSION_CDF).rgb;
+
+    float u1 = random(randInput.zxy);
+    float phi = 2*PI * random(randInput.yzx);
+
+    if (type == SPHERE)
+    {
+        vec3 toCenter = centerRadius.xyz - p;
+        float centerDist = length(toCenter);
+        float oneMinusCosMax = GetSphereConeOneMinusCos(centerRadius, p);
+        if (oneMinusCosMax < MIN_LIGHT_COSINE)
+            return false;
+
+        // Uniform direction within the cone subtended by the sphere
+        float oneMinusCos = u1 * oneMinusCosMax;
+        float cosine = 1 - oneMinusCos;
+        float sine = sqrt(max(oneMinusCos * (2 - oneMinusCos), 0));
+
+        vec3 axis = toCenter / centerDist;
+        vec3 tangent = GetOrthogonal(axis);
+        dir = axis * cosine + (tangent * cos(phi) + cross(axis, tangent) * sin(phi)) * sine;
+
+        // Distance to the nearer intersection with the sphere
+        dist = centerDist * cosine - sqrt(max(centerRadius.w*centerRadius.w - centerDist*centerDist * sine*sine, 0));
+    }
+    else
+    {
+        // Uniform point on the disc's area
+        vec3 tangent = GetOrthogonal(normalType.xyz);
+        vec3 pointOnDisc = centerRadius.xyz + (tangent * cos(phi) + cross(normalType.xyz, tangent) * sin(phi))
+                                              * (centerRadius.w * sqrt(u1));
+        vec3 toPoint = pointOnDisc - p;
+        dist = length(toPoint);
+        dir = toPoint / dist;
+    }
+
+    pdf = GetLightPdf(type, centerRadius, normalType.xyz, emission, totalPower, p, dir, dist);
+    return (pdf > 0 && dist > 0);
+}
+
+/** Returns the weight of a sample taken with probability density 'pdf', which could also have been taken
+    by another technique with density 'otherPdf' (multiple importance sampling, power heuristic); 'pdf' > 0. */
+float PowerHeuristic(in float pdf, in float otherPdf)
+{
+    float ratio = otherPdf / pdf;
+    return 1 / (1 + ratio*ratio);
+}
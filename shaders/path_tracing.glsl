@@ -30,17 +30,22 @@ File description:
 #define TRIANGLE 2
 #define CONE     3
 
+/// Max. position along a ray which effectively imposes no limit
+#define NO_MAX_POS 1.0e+19
+
 
 // External functions -------------------------------------
 
-/// Checks intersections with all primitives and the user-controlled sphere
-void CheckIntersectionInclUserSphere(
+/// Checks intersections with all primitives and the dynamic objects
+void CheckIntersectionInclDynamicObjects(
     in vec3 rstart,  ///< Ray's origin
     in vec3 rdir,    ///< Ray's direction
 
     in samplerBuffer bvhTree,
+    in samplerBuffer meshVertices, ///< Vertices referred to by mesh triangles in 'bvhTree'
 
-    in vec4 userSphere, ///< User sphere's position and radius
+    in samplerBuffer dynamicObjects, ///< Stored by gpuart::StoreDynamicObjects()
+    in int numDynamicObjectGroups,
 
     /** Satisfies: rstart + pos*rdir = intersection.
         Receives a value <0 if there is no intersection. */
@@ -48,7 +53,28 @@ void CheckIntersectionInclUserSphere(
     out vec3 intersection, ///< Intersection coordinates
     out vec3 normal,       ///< Unit normal at intersection (facing 'rstart')
     out int primitiveType,
-    out bool userSphereHit
+    out int material,      ///< Material ID of the intersected primitive (unless it is a dynamic object)
+
+    /// Address of the intersected primitive's data in 'bvhTree'; -1 if it belongs to an instance or is a dynamic object
+    out int primitiveAddr,
+
+    /// Address of the intersected dynamic object's type and packed material in 'dynamicObjects'; -1 if none was hit
+    out int dynamicObject
+);
+
+/** Returns 'true' if the ray intersects any primitive or dynamic object
+    before reaching 'maxPos' (such that rstart + maxPos*rdir is the end of the checked segment). */
+bool CheckOcclusionInclDynamicObjects(
+    in vec3 rstart,  ///< Ray's origin
+    in vec3 rdir,    ///< Ray's direction
+
+    in samplerBuffer bvhTree,
+    in samplerBuffer meshVertices, ///< Vertices referred to by mesh triangles in 'bvhTree'
+
+    in samplerBuffer dynamicObjects, ///< Stored by gpuart::StoreDynamicObjects()
+    in int numDynamicObjectGroups,
+
+    in float maxPos
 );
 
 /// Returns a random unit (TODO: are we sure?) direction within a hemisphere around the unit vector 'v'
@@ -72,8 +98,50 @@ vec3 GetSkyColor(
     in vec4 sunDirAlt
 );
 
+/// Unpacks a material packed by gpuart::Material::Pack()
+void UnpackMaterial(
+    in vec3 packedMaterial,
+    out vec3 albedo,
+    out float specular, ///< Probability of specular reflection
+    out vec3 emission,
+    out float roughness ///< Spread of specular reflections (0: perfect mirror)
+);
+
+/** Selects a light in proportion to its power and samples a point on it; returns 'false' if there is
+    no point to sample (e.g. 'p' lies inside the selected sphere). Visibility is not checked. */
+bool SampleLight(
+    in samplerBuffer lights, ///< Light list (see gpuart::StoreLights())
+    in int numLights,
+    in float totalPower,     ///< Total power of all lights (see gpuart::SetLightSelectionProbabilities())
+    in vec3 p,               ///< Point to be lit
+    in vec3 randInput,
+
+    out vec3 dir,      ///< Unit direction from 'p' towards the sampled point
+    out float dist,    ///< Distance to the sampled point
+    out vec3 emission,
+    out float pdf      ///< Probability density (per solid angle) of choosing 'dir' (see GetLightPdf())
+);
+
+/** Returns the probability density (per solid angle) with which SampleLight() chooses 'dir' from 'p',
+    reaching the emissive sphere or disc at distance 'dist'; includes the light's selection probability. */
+float GetLightPdf(
+    in int type,
+    in vec4 centerRadius,
+    in vec3 discNormal, ///< Unit normal (discs only)
+    in vec3 emission,
+    in float totalPower, ///< Total power of all lights (see gpuart::SetLightSelectionProbabilities())
+    in vec3 p,
+    in vec3 dir,        ///< Unit vector
+    in float dist
+);
+
+/** Returns the weight of a sample taken with probability density 'pdf', which could also have been taken
+    by another technique with density 'otherPdf' (multiple importance sampling, power heuristic); 'pdf' > 0. */
+float PowerHeuristic(in float pdf, in float otherPdf);
+
 // Pseudo-random value in half-open range [0:1]
 float random(in float x);
+float random(in vec3 v);
 
 
 // ---------------------------------------------------------
@@ -91,44 +159,51 @@ uniform sampler2D RDir;    ///< Ray's direction
 uniform vec4 SunDirAlt;    ///< Direction towards the Sun (unit) and its altitude (radians)
 uniform int SunDirectLightingEnabled;
 
-uniform vec4 UserSphere;   ///< Center and radius of the user-controlled sphere
-uniform vec3 UserSphereEm; ///< User sphere's emittance (may be all zeros)
-uniform int  UserSphereEmNonZero;
-
 uniform vec4 RandSeed; ///< Differs for every pass, used for random-seeding
 uniform int NumPathsPerPixel; ///< Paths/pixel to trace in this pass
 uniform float PixelSize; ///< Pixel size in logical (world) coordinate system
 uniform vec3 CameraPos;
 
 uniform samplerBuffer BVH; ///< Bounding Volumes Hierarchy tree with the scene's primitives
+uniform samplerBuffer MeshVertices; ///< Vertices of mesh triangles stored in 'BVH'
+uniform samplerBuffer Materials; ///< Material table indexed by material IDs stored in 'BVH'
 
 uniform sampler2D PrevRadiance; ///< Radiance calculated in previous passes
 
-// Values correspond with UserSphereFlags (gpuart::Renderer)
-#define USPH_EM_NONZERO   (1U<<0)
-#define USPH_SPECULAR     (1U<<1)
-#define USPH_FUZZY        (1U<<2)
+uniform samplerBuffer DynamicObjects; ///< User-controlled objects stored by gpuart::StoreDynamicObjects()
+uniform int NumDynamicObjectGroups;
 
-uniform uint UserSphereFlags;
+uniform samplerBuffer Lights; ///< Emissive primitives and dynamic objects stored by gpuart::StoreLights()
+uniform int NumLights;
+uniform float TotalLightPower; ///< 0 if there are no lights to sample
 
 
 // Outputs -------------------------------------------------
 
 layout(location = 0) out vec3 out_Radiance;
 
+#ifdef TRAVERSAL_STATS
+/** Per-pixel traversal counters (see bvh_intersection.glsl) and the path length (number of traced segments),
+    averaged over the paths of this pass */
+layout(location = 1) out vec4 out_TraversalStats;
 
-// ---------------------------------------------------------
+#define STAT_PATH_LENGTH 3
 
-/// Indexed by primitive type
-const vec3 PRIMITIVE_COLOR[] = vec3[](vec3(0.65, 0.4, 0.35), // sphere
-                                      vec3(0.1, 0.2, 0.1),   // disc
-                                      vec3(0.3, 0.3, 0.3),  // triangle
-                                      vec3(0.3, 0.3, 0.3)); // cone
+uvec4 TraversalStats;
+#endif
 
 
+// ---------------------------------------------------------
 
 const vec3 SKY_LIGHT_INTENSITY = 2*vec3(1, 1, 1);
-const float FUZZY_ANGLE = 10 * 3.14159/180;
+
+/// Half-angle of the cone of specular reflections of a material with roughness 1
+const float MAX_ROUGHNESS_ANGLE = 3.14159/2;
+
+const float PI = 3.1415926;
+
+/// Relative margin of visibility checks of sampled lights, which stop short of the light's surface
+const float LIGHT_DIST_TOLERANCE = 1.0e-3;
 
 void main()
 {
@@ -150,6 +225,11 @@ void main()
     vec3 rdirOrtho2 = cross(normalize(rdir0), rdirOrtho1);
 
     vec3 color = vec3(0, 0, 0);
+
+#ifdef TRAVERSAL_STATS
+    TraversalStats = uvec4(0U);
+#endif
+
     for (int j = 0; j < NumPathsPerPixel; j++)
     {
         /* Dither the camera ray's starting point and direction in order to:
@@ -171,86 +251,140 @@ void main()
 
         vec3 pathColor = vec3(0, 0, 0);
         vec3 colorWeight = vec3(1, 1, 1);
-        bool userSphereHit = false;
-        bool specularReflection;
+
+        // Probability density (per solid angle) of the last diffuse reflection's direction; 0 after a specular one
+        float bsdfPdf = 0;
+
         int i;
         for (i = 0; i < MAX_PATH_SEGMENTS && all(greaterThan(colorWeight, MIN_WEIGHT)); i++)
         {
-            int ptype;
+            int ptype, materialID, primitiveAddr, dynamicObject;
 
+#ifdef TRAVERSAL_STATS
+            TraversalStats[STAT_PATH_LENGTH]++;
+#endif
 
-            CheckIntersectionInclUserSphere(
+            CheckIntersectionInclDynamicObjects(
                 rstart, rdir,
-                BVH, UserSphere,
+                BVH, MeshVertices, DynamicObjects, NumDynamicObjectGroups,
 
-                pos, intersection, normal, ptype, userSphereHit);
+                pos, intersection, normal, ptype, materialID, primitiveAddr, dynamicObject);
 
-            if (userSphereHit)
+            if (ptype == -1) // ray hits the background
             {
-                if ((UserSphereFlags & USPH_EM_NONZERO) != 0U)
-                {
-                    pathColor += UserSphereEm * colorWeight;
-                    break;
-                }
+                if (i == 0)
+                    pathColor = GetSkyColor(rdir0, SunDirAlt);
                 else
-                    ptype = SPHERE;
+                    pathColor += SKY_LIGHT_INTENSITY * GetSkyColor(rdir, SunDirAlt) * colorWeight;
+                break;
             }
-            else if (ptype == -1) // ray hits the background
+
+            // The only fetch needed for shading; a dynamic object's material is stored in its type header
+            vec3 packedMaterial = (dynamicObject >= 0 ? texelFetch(DynamicObjects, dynamicObject).yzw
+                                                      : texelFetch(Materials, materialID).xyz);
+            vec3 albedo, emission;
+            float specular, roughness;
+            UnpackMaterial(packedMaterial, albedo, specular, emission, roughness);
+
+            if (any(greaterThan(emission, vec3(0, 0, 0))))
             {
-                pathColor += SKY_LIGHT_INTENSITY * GetSkyColor(rdir, SunDirAlt) * colorWeight;
+                // An emitter seen directly is shown with its normalized color, as in direct lighting
+                if (i == 0)
+                    pathColor = emission / max(max(emission.r, emission.g), emission.b);
+                else
+                {
+                    /* A sampled light (an emissive sphere or disc, unless instanced) reached by a diffuse reflection
+                       could also have been found by next-event estimation; weight both techniques. */
+                    float weight = 1;
+                    if (bsdfPdf > 0 && TotalLightPower > 0 && (ptype == SPHERE || ptype == DISC)
+                        && (primitiveAddr >= 0 || dynamicObject >= 0))
+                    {
+                        vec4 centerRadius, discNormal;
+                        if (dynamicObject >= 0)
+                        {
+                            centerRadius = texelFetch(DynamicObjects, dynamicObject + 1);
+                            discNormal = texelFetch(DynamicObjects, dynamicObject + 2);
+                        }
+                        else
+                        {
+                            centerRadius = texelFetch(BVH, primitiveAddr);
+                            discNormal = texelFetch(BVH, primitiveAddr + 1);
+                        }
+
+                        float lightPdf = GetLightPdf(ptype, centerRadius, normalize(discNormal.xyz), emission, TotalLightPower,
+                                                     rstart, normalize(rdir), pos * length(rdir));
+                        weight = PowerHeuristic(bsdfPdf, lightPdf);
+                    }
+
+                    pathColor += emission * colorWeight * weight;
+                }
                 break;
             }
 
-            colorWeight *= PRIMITIVE_COLOR[ptype];
+            colorWeight *= albedo;
 
             rstart = intersection;
 
-            if (userSphereHit && (UserSphereFlags & USPH_SPECULAR) != 0U)
+            bool specularReflection = (specular >= 1 || (specular > 0 && random(intersection.zxy + RandSeed.wzy) < specular));
+            if (specularReflection)
             {
-                if ((UserSphereFlags & USPH_FUZZY) == 0U)
+                if (roughness == 0)
                     rdir = reflect(rdir, normal);
-                else                    
-                    rdir = GetRandomDirectionInsideCone(reflect(rdir, normal), normal, FUZZY_ANGLE,
+                else
+                    rdir = GetRandomDirectionInsideCone(reflect(rdir, normal), normal, roughness * MAX_ROUGHNESS_ANGLE,
                                                         intersection + RandSeed.xyz);
-                
-                specularReflection = true;
+                bsdfPdf = 0;
             }
             else
             {
                 rdir = GetRandomHemisphereDirection(normal, intersection + RandSeed.xyz);
-                specularReflection = false;
+                bsdfPdf = max(dot(rdir, normal), 0) / PI; // cosine-weighted
             }
 
             // Sun's direct lighting contribution ----------------
             if (SunDirectLightingEnabled == 1 && !specularReflection)
             {
-                float sunPos;
-                vec3 sunIntersection, dummy;
-                int sunPType;
-
-                CheckIntersectionInclUserSphere(
-                    intersection,
-                    SunDirAlt.xyz,
-
-                    BVH, UserSphere,
-
-                    sunPos, sunIntersection, dummy, sunPType, userSphereHit);
-
-                if (sunPType == -1)
+                if (!CheckOcclusionInclDynamicObjects(intersection, SunDirAlt.xyz,
+                                                      BVH, MeshVertices, DynamicObjects, NumDynamicObjectGroups,
+                                                      NO_MAX_POS))
                 {
                     float dotp = dot(SunDirAlt.xyz, normal);
                     if (dotp > 0)
-                        pathColor += dotp * PRIMITIVE_COLOR[ptype];
+                        pathColor += dotp * albedo;
+                }
+            }
+
+            // Next-event estimation: direct lighting by a point sampled on a randomly selected light
+            if (TotalLightPower > 0 && !specularReflection)
+            {
+                vec3 lightDir, lightEmission;
+                float lightDist, lightPdf;
+
+                if (SampleLight(Lights, NumLights, TotalLightPower, intersection, intersection.yzx + RandSeed.wxz,
+                                lightDir, lightDist, lightEmission, lightPdf))
+                {
+                    float cosine = dot(lightDir, normal);
+                    if (cosine > 0 && !CheckOcclusionInclDynamicObjects(intersection, lightDir,
+                                                                         BVH, MeshVertices, DynamicObjects, NumDynamicObjectGroups,
+                                                                         lightDist * (1 - LIGHT_DIST_TOLERANCE)))
+                    {
+                        // If the path ends here, the light cannot be reached by the next segment instead
+                        bool pathContinues = (i + 1 < MAX_PATH_SEGMENTS && all(greaterThan(colorWeight, MIN_WEIGHT)));
+                        float weight = (pathContinues ? PowerHeuristic(lightPdf, cosine / PI) : 1);
+
+                        // 'colorWeight' already includes the albedo; the diffuse BRDF is albedo/pi
+                        pathColor += lightEmission * colorWeight * (cosine / PI / lightPdf * weight);
+                    }
                 }
             }
         }
-        if (i == 0 && !userSphereHit) // ray hits the background directly
-            pathColor = GetSkyColor(rdir0, SunDirAlt);
-        else if (i == 0 && userSphereHit && !specularReflection)
-            pathColor = vec3(1, 1, 1);
 
         color += pathColor;
     }
 
     out_Radiance = texture(PrevRadiance, UV).rgb + color;
+
+#ifdef TRAVERSAL_STATS
+    out_TraversalStats = vec4(TraversalStats) / NumPathsPerPixel;
+#endif
 }
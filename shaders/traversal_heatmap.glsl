@@ -0,0 +1,65 @@
+/*
+GPU-Assisted Ray Tracer
+Copyright (C) 2016 Filip Szczerek <ga.software@yahoo.com>
+
+This file is part of gpuart.
+
+Gpuart is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Gpuart is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with gpuart.  If not, see <http://www.gnu.org/licenses/>.
+
+
+File description:
+   Rendering stage: heatmap of traversal statistics
+*/
+
+#version 330 core
+
+
+// Inputs -------------------------------------------------
+
+in vec2 UV; ///< Texture coordinates (ray index)
+
+/// Per-pixel counters written by the instrumented rendering stage shaders (see bvh_intersection.glsl)
+uniform sampler2D TraversalStats;
+
+/// Index of the counter to show (0-3)
+uniform int StatIndex;
+
+/// Counter value mapped to the hottest color
+uniform float MaxValue;
+
+
+// Outputs ------------------------------------------------
+
+layout(location = 0) out vec3 out_Color;
+
+
+// ---------------------------------------------------------
+
+/// Maps 'x' (0 to 1) to black-blue-cyan-green-yellow-red
+vec3 HeatColor(float x)
+{
+    const vec3 colors[6] = vec3[6](vec3(0, 0, 0), vec3(0, 0, 1), vec3(0, 1, 1),
+                                   vec3(0, 1, 0), vec3(1, 1, 0), vec3(1, 0, 0));
+
+    float pos = clamp(x, 0.0, 1.0) * 5.0;
+    int idx = min(int(pos), 4);
+
+    return mix(colors[idx], colors[idx + 1], pos - float(idx));
+}
+
+void main()
+{
+    float value = texture(TraversalStats, UV)[StatIndex];
+    out_Color = HeatColor(value / MaxValue);
+}
@@ -0,0 +1,358 @@
+/*
+GPU-Assisted Ray Tracer
+Copyright (C) 2016 Filip Szczerek <ga.software@yahoo.com>
+
+This file is part of gpuart.
+
+Gpuart is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Gpuart is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with gpuart.  If not, see <http://www.gnu.org/licenses/>.
+
+File description:
+    Benchmark of the OpenGL renderer on the built-in scenes (results in JSON)
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "core.h"
+#include "gl_utils.h"
+#include "math_types.h"
+#include "offscreen_context.h"
+#include "renderer.h"
+#include "scenes.h"
+#include "utils.h"
+
+
+using gpuart::Vec3f;
+
+
+static void PrintUsage()
+{
+    std::cout <<
+        "Usage: gpuart-bench [scene ...] [options]\n\n"
+        "Scenes: box, boxlight, dragon11k, dragon48k, dragon871k, cluster100k, tree21k (default: all)\n\n"
+        "Options:\n"
+        "  --size WxH               image size; may be specified multiple times (default: 640x480 and 1280x720)\n"
+        "  --frames N               number of timed frames of each mode (default: 20)\n"
+        "  --warmup N               number of untimed frames preceding the timed ones (default: 2)\n"
+        "  --paths-per-pass N       paths per pixel rendered in a single path tracing frame (default: 1)\n"
+        "  --sah                    build the BVH with the surface area heuristic\n"
+        "  --bvh-width N            max. children of a compiled BVH node (2-8, default: 4)\n"
+        "  --output FILE            write the results to FILE instead of stdout\n\n"
+        "Progress messages are printed to stderr.\n";
+}
+
+struct ImageSize
+{
+    unsigned width, height;
+};
+
+/// Frame time statistics (in milliseconds) of one scene, image size and rendering mode
+struct FrameTimes
+{
+    double mean, min, p50, p90, p99, max;
+
+    /// Mean GPU time of the frame's rendering passes (from timer queries); negative if unavailable
+    double gpuMean;
+
+    /// Millions of primary rays (direct lighting: camera rays; path tracing: paths) per second
+    double mraysPerSec;
+};
+
+struct Result
+{
+    std::string scene;
+    size_t numPrimitives;
+    double bvhBuildMs;  ///< Duration of Renderer::CompileScene() (BVH construction and compilation)
+    double uploadMs;    ///< Duration of Renderer::SetCompiledScene() (upload to the GPU)
+    ImageSize size;
+    FrameTimes direct, path;
+};
+
+/// Returns the 'p'-th percentile (0-100) of sorted 'values' (nearest-rank method)
+static double Percentile(const std::vector<double> &sortedValues, double p)
+{
+    size_t rank = (size_t)std::ceil(p / 100 * sortedValues.size());
+    return sortedValues[std::min(std::max<size_t>(rank, 1), sortedValues.size()) - 1];
+}
+
+/** Renders 'numWarmup' + 'numFrames' frames with 'renderFrame' and returns statistics of the timed ones;
+    'getGPUTime' returns the GPU time of the last frame's passes. */
+template<typename F, typename G>
+static FrameTimes MeasureFrames(unsigned numWarmup, unsigned numFrames, double raysPerFrame, F renderFrame, G getGPUTime)
+{
+    for (unsigned i = 0; i < numWarmup; i++)
+        renderFrame();
+    glFinish();
+
+    std::vector<double> times;
+    double gpuSum = 0;
+    for (unsigned i = 0; i < numFrames; i++)
+    {
+        auto tstart = std::chrono::high_resolution_clock::now();
+        renderFrame();
+        glFinish();
+        times.push_back(std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - tstart).count());
+
+        // After glFinish() the timer queries' results are available
+        double gpuTime = getGPUTime();
+        gpuSum = (gpuTime < 0 || gpuSum < 0) ? -1 : gpuSum + gpuTime;
+    }
+    std::sort(times.begin(), times.end());
+
+    FrameTimes ft;
+    ft.mean = std::accumulate(times.begin(), times.end(), 0.0) / times.size();
+    ft.min = times.front();
+    ft.p50 = Percentile(times, 50);
+    ft.p90 = Percentile(times, 90);
+    ft.p99 = Percentile(times, 99);
+    ft.max = times.back();
+    ft.gpuMean = (gpuSum < 0 ? -1 : gpuSum / numFrames);
+    ft.mraysPerSec = raysPerFrame / ft.mean * 1.0e-3;
+
+    return ft;
+}
+
+static std::string JsonString(const char *s)
+{
+    std::ostringstream result;
+    result << '"';
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            result << '\\' << *s;
+        else if ((unsigned char)*s < 0x20)
+            result << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)*s << std::dec;
+        else
+            result << *s;
+    }
+    result << '"';
+    return result.str();
+}
+
+static void WriteFrameTimes(std::ostream &os, const FrameTimes &ft)
+{
+    os << "{ \"frame_ms\": { \"mean\": " << ft.mean << ", \"min\": " << ft.min << ", \"p50\": " << ft.p50
+       << ", \"p90\": " << ft.p90 << ", \"p99\": " << ft.p99 << ", \"max\": " << ft.max << " }, ";
+    if (ft.gpuMean >= 0)
+        os << "\"gpu_ms\": " << ft.gpuMean << ", ";
+    os << "\"mrays_per_sec\": " << ft.mraysPerSec << " }";
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<std::string> sceneNames;
+    std::vector<ImageSize> sizes;
+    unsigned numFrames = 20, numWarmup = 2;
+    unsigned pathsPerPass = 1;
+    unsigned bvhWidth = 4;
+    auto strategy = gpuart::BVHBuildStrategy::Midpoint;
+    const char *outFileName = nullptr;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string opt = argv[i];
+        const int numArgsLeft = argc - 1 - i;
+
+        if (opt == "--size" && numArgsLeft >= 1)
+        {
+            ImageSize size;
+            if (2 != std::sscanf(argv[++i], "%ux%u", &size.width, &size.height) || size.width == 0 || size.height == 0)
+            {
+                std::cerr << "Invalid image size: " << argv[i] << std::endl;
+                return 1;
+            }
+            sizes.push_back(size);
+        }
+        else if (opt == "--frames" && numArgsLeft >= 1)
+            numFrames = std::max(1, std::atoi(argv[++i]));
+        else if (opt == "--warmup" && numArgsLeft >= 1)
+            numWarmup = std::max(0, std::atoi(argv[++i]));
+        else if (opt == "--paths-per-pass" && numArgsLeft >= 1)
+            pathsPerPass = std::max(1, std::atoi(argv[++i]));
+        else if (opt == "--sah")
+            strategy = gpuart::BVHBuildStrategy::SAH;
+        else if (opt == "--bvh-width" && numArgsLeft >= 1)
+        {
+            if (!gpuart::Utils::ParseBVHWidth(argv[++i], bvhWidth))
+            {
+                std::cerr << "Invalid BVH width: " << argv[i] << std::endl;
+                return 1;
+            }
+        }
+        else if (opt == "--output" && numArgsLeft >= 1)
+            outFileName = argv[++i];
+        else if (opt == "--help")
+        {
+            PrintUsage();
+            return 0;
+        }
+        else if (opt.compare(0, 2, "--") != 0)
+            sceneNames.push_back(opt);
+        else
+        {
+            std::cerr << "Invalid option: " << opt << "\n\n";
+            PrintUsage();
+            return 1;
+        }
+    }
+
+    if (sceneNames.empty())
+        sceneNames = { "box", "boxlight", "dragon11k", "dragon48k", "dragon871k", "cluster100k", "tree21k" };
+    if (sizes.empty())
+        sizes = { { 640, 480 }, { 1280, 720 } };
+
+    // Keep stdout for the results only; scene loading and BVH construction print progress messages
+    std::streambuf *stdoutBuf = std::cout.rdbuf(std::cerr.rdbuf());
+
+    gpuart::GL::OffscreenContext context;
+    if (!context.GetIsOK())
+        return 1;
+
+    const std::string glRenderer = reinterpret_cast<const char*>(glGetString(GL_RENDERER)),
+                      glVersion = reinterpret_cast<const char*>(glGetString(GL_VERSION));
+
+    if (!gpuart::GL::Init())
+    {
+        std::cerr << "Failed to initialize OpenGL objects." << std::endl;
+        return 1;
+    }
+
+    // Fixed camera (the initial one of the GUI)
+    gpuart::Camera cam;
+    cam.Pos = Vec3f(0.1f, -3.05f, 1);
+    cam.Up = Vec3f(0, 0, 1);
+    cam.Dir = Vec3f(0, 0, 0.95f) - cam.Pos;
+    cam.FovY = 60;
+    cam.ScreenDist = 0.2f;
+
+    gpuart::Renderer renderer(sizes[0].width, sizes[0].height, cam, true);
+    if (!renderer.GetIsOK())
+        return 1;
+    renderer.SetUserSphere(Vec3f(-0.4f, 0, 0.2f), 0, 0);
+
+    std::vector<Result> results;
+
+    for (const std::string &sceneName: sceneNames)
+    {
+        gpuart::PrimitiveSet primitives;
+        if (!CreateScene(sceneName.c_str(), primitives))
+            return 1;
+
+        gpuart::BVHBuildParams params;
+        params.strategy = strategy;
+        params.width = bvhWidth;
+
+        // Building does not use OpenGL; the upload is timed separately
+        auto tstart = std::chrono::high_resolution_clock::now();
+        gpuart::Renderer::CompiledScene scene = gpuart::Renderer::CompileScene(primitives, params, false);
+        const double bvhBuildMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - tstart).count();
+
+        glFinish();
+        tstart = std::chrono::high_resolution_clock::now();
+        renderer.SetCompiledScene(std::move(scene));
+        glFinish();
+        const double uploadMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - tstart).count();
+
+        for (const ImageSize &size: sizes)
+        {
+            std::cerr << "Benchmarking " << sceneName << " at " << size.width << "x" << size.height << "..." << std::endl;
+
+            if (!renderer.UpdateViewportSize(size.width, size.height))
+                return 1;
+
+            Result result;
+            result.scene = sceneName;
+            result.numPrimitives = primitives.GetCount();
+            result.bvhBuildMs = bvhBuildMs;
+            result.uploadMs = uploadMs;
+            result.size = size;
+
+            const double numPixels = (double)size.width * size.height;
+
+            result.direct = MeasureFrames(numWarmup, numFrames, numPixels,
+                                          [&renderer]() { renderer.RenderDirectLighting(); },
+                                          [&renderer]() { return renderer.GetStageTimes().directLighting; });
+
+            // Enough paths per pixel for the accumulation to never complete
+            renderer.RestartPathTracing(pathsPerPass, pathsPerPass * (numWarmup + numFrames));
+            result.path = MeasureFrames(numWarmup, numFrames, numPixels * pathsPerPass,
+                                        [&renderer]() { renderer.RenderPathTracingPass(); },
+                                        [&renderer]()
+                                        {
+                                            gpuart::Renderer::StageTimes times = renderer.GetStageTimes();
+                                            return times.pathTracing + times.ptracingNormalize;
+                                        });
+
+            results.push_back(result);
+        }
+    }
+
+    GLenum error = glGetError();
+    if (error != GL_NO_ERROR)
+    {
+        std::cerr << "OpenGL error 0x" << std::hex << error << std::dec << "." << std::endl;
+        return 1;
+    }
+
+    std::cout.rdbuf(stdoutBuf);
+
+    std::ofstream outFile;
+    if (outFileName)
+    {
+        outFile.open(outFileName);
+        if (!outFile)
+        {
+            std::cerr << "Cannot create \"" << outFileName << "\"." << std::endl;
+            return 1;
+        }
+    }
+    std::ostream &out = (outFileName ? outFile : std::cout);
+
+    out << std::fixed << std::setprecision(3);
+    out << "{\n"
+        << "  \"gl_renderer\": " << JsonString(glRenderer.c_str()) << ",\n"
+        << "  \"gl_version\": " << JsonString(glVersion.c_str()) << ",\n"
+        << "  \"gl_context\": " << JsonString(gpuart::GL::OffscreenContext::GetBackendName()) << ",\n"
+        << "  \"frames\": " << numFrames << ",\n"
+        << "  \"warmup_frames\": " << numWarmup << ",\n"
+        << "  \"paths_per_pass\": " << pathsPerPass << ",\n"
+        << "  \"bvh_width\": " << bvhWidth << ",\n"
+        << "  \"bvh_strategy\": \"" << (strategy == gpuart::BVHBuildStrategy::SAH ? "sah" : "midpoint") << "\",\n"
+        << "  \"results\": [\n";
+
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const Result &r = results[i];
+        out << "    { \"scene\": " << JsonString(r.scene.c_str()) << ", \"primitives\": " << r.numPrimitives
+            << ", \"bvh_build_ms\": " << r.bvhBuildMs << ", \"upload_ms\": " << r.uploadMs
+            << ", \"width\": " << r.size.width << ", \"height\": " << r.size.height << ",\n"
+            << "      \"direct\": "; WriteFrameTimes(out, r.direct); out << ",\n"
+            << "      \"path\": ";   WriteFrameTimes(out, r.path);   out << " }"
+            << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}" << std::endl;
+
+    return out ? 0 : 1;
+}
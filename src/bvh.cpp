@@ -22,7 +22,14 @@ File description:
 */
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cfloat>
+#include <cmath>
+#include <exception>
+#include <functional>
+#include <set>
+#include <thread>
 #include "bvh.h"
 
 
@@ -30,125 +37,560 @@ using gpuart::Primitive;
 
 static_assert(sizeof(GLfloat) == sizeof(uint32_t), "BVH code requires the sizes of GLfloat and uint32_t to be the same.");
 
-/**  Divides the 'primitives' with indices between 'from' (incl.) and 'two' (excl.)
-     along the longest spanned axis. */
-void gpuart::BoundingVolumesHierarchy::Subdivide(gpuart::BoundingBox *node, std::vector<Primitive*> &primitives, size_t from, size_t to,
-                                                 unsigned currentLevel, unsigned maxNumLevels, unsigned minPrimitivesPerNode)
+/// Surface area of an axis-aligned box; returns 0 for an empty box
+static float GetBoxArea(float xmin, float xmax, float ymin, float ymax, float zmin, float zmax)
 {
-    if (!node)
-        return;
+    if (xmin > xmax || ymin > ymax || zmin > zmax)
+        return 0;
 
-    // Bounding box of all primitives from the range [from, to)
-    float xminall = 99.0e+29f, xmaxall = -99.0e+29f,
-          yminall = 99.0e+29f, ymaxall = -99.0e+29f,
-          zminall = 99.0e+29f, zmaxall = -99.0e+29f;
+    float dx = xmax - xmin, dy = ymax - ymin, dz = zmax - zmin;
+    return 2 * (dx*dy + dy*dz + dz*dx);
+}
 
-    // Find the largest-extent axis of the primitives
-    for (size_t i = from; i < to; i++)
+namespace
+{
+    /// Bounds and centers of primitives, stored as a structure of arrays indexed by primitive
+    struct PrimitiveBounds
     {
-        float xmin = primitives[i]->GetXmin(), xmax = primitives[i]->GetXmax(),
-            ymin = primitives[i]->GetYmin(), ymax = primitives[i]->GetYmax(),
-            zmin = primitives[i]->GetZmin(), zmax = primitives[i]->GetZmax();
+        std::vector<float> min[3], max[3], center[3];
+    };
 
-        if (xmin < xminall) xminall = xmin;
-        if (xmax > xmaxall) xmaxall = xmax;
+    /// Bounding box and count of a group of primitives (e.g. a single SAH bin)
+    struct Bounds
+    {
+        float xmin, xmax, ymin, ymax, zmin, zmax;
+        size_t count;
 
-        if (ymin < yminall) yminall = ymin;
-        if (ymax > ymaxall) ymaxall = ymax;
+        Bounds(): xmin(99.0e+29f), xmax(-99.0e+29f),
+                  ymin(99.0e+29f), ymax(-99.0e+29f),
+                  zmin(99.0e+29f), zmax(-99.0e+29f),
+                  count(0)
+        { }
 
-        if (zmin < zminall) zminall = zmin;
-        if (zmax > zmaxall) zmaxall = zmax;
-    }
+        void Add(const PrimitiveBounds &pb, uint32_t idx)
+        {
+            xmin = std::min(xmin, pb.min[0][idx]); xmax = std::max(xmax, pb.max[0][idx]);
+            ymin = std::min(ymin, pb.min[1][idx]); ymax = std::max(ymax, pb.max[1][idx]);
+            zmin = std::min(zmin, pb.min[2][idx]); zmax = std::max(zmax, pb.max[2][idx]);
+            count++;
+        }
 
-    float xrange = xmaxall - xminall;
-    float yrange = ymaxall - yminall;
-    float zrange = zmaxall - zminall;
+        void Add(const Bounds &b)
+        {
+            xmin = std::min(xmin, b.xmin); xmax = std::max(xmax, b.xmax);
+            ymin = std::min(ymin, b.ymin); ymax = std::max(ymax, b.ymax);
+            zmin = std::min(zmin, b.zmin); zmax = std::max(zmax, b.zmax);
+            count += b.count;
+        }
 
-    node->xmin = xminall;
-    node->xmax = xmaxall;
-    node->ymin = yminall;
-    node->ymax = ymaxall;
-    node->zmin = zminall;
-    node->zmax = zmaxall;
+        float GetArea() const { return GetBoxArea(xmin, xmax, ymin, ymax, zmin, zmax); }
+    };
+}
 
-    if (to - from <= minPrimitivesPerNode || currentLevel == maxNumLevels-1)
+/// Reserves up to 'wanted' of the 'freeThreads'; returns the number of threads reserved
+static int AcquireThreads(std::atomic<int> &freeThreads, int wanted)
+{
+    int avail = freeThreads.load();
+    while (avail > 0)
     {
-        for (auto i = primitives.begin() + from; i != primitives.begin() + to; ++i)
-            node->primitives.push_back(*i);
-
-        return;
+        int numAcquired = std::min(avail, wanted);
+        if (freeThreads.compare_exchange_weak(avail, avail - numAcquired))
+            return numAcquired;
     }
+    return 0;
+}
 
-    // Subdivide along the longest spanned axis --------
+/** Calls 'func(args...)' and stores an exception it throws in 'error', so that the exception can be rethrown
+    after joining the thread which made the call (an exception escaping a thread terminates the program). */
+template<typename Func, typename... Args>
+static void CallStoringException(std::exception_ptr &error, Func &func, Args... args)
+{
+    try
+    {
+        func(args...);
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+}
 
-    auto iterTo = primitives.begin() + to;
+/// Rethrows the first exception stored in 'errors' (if any)
+static void RethrowFirst(const std::vector<std::exception_ptr> &errors)
+{
+    for (const auto &error: errors)
+        if (error)
+            std::rethrow_exception(error);
+}
 
-    /* All primitives in range [from, subdivisionIndex) will be fed to the lower (left) child node,
-       and those from [subdivisionIndex, iterTo) to the higher (right) node. */
-    size_t subdivisionIndex = from;
+/** Calls 'func(chunkFrom, chunkTo, chunkIdx)' for consecutive chunks of the range [from, to),
+    in parallel if the range is large enough and there are free threads. Results of 'func'
+    have to be independent of the chunk layout. Returns the number of chunks. An exception thrown
+    by 'func' is rethrown after all chunks' threads have been joined. */
+template<typename Func>
+static unsigned ForEachChunk(size_t from, size_t to, unsigned maxChunks, std::atomic<int> &freeThreads, Func func)
+{
+    int numExtraThreads = 0;
+    if (to - from >= 2 * gpuart::BoundingVolumesHierarchy::PARALLEL_MIN_PRIMITIVES)
+        numExtraThreads = AcquireThreads(freeThreads,
+                                         (int)std::min<size_t>(maxChunks - 1,
+                                                               (to - from) / gpuart::BoundingVolumesHierarchy::PARALLEL_MIN_PRIMITIVES - 1));
+
+    unsigned numChunks = numExtraThreads + 1;
+    size_t chunkLen = (to - from) / numChunks;
+
+    std::vector<std::exception_ptr> errors(numChunks);
+    std::vector<std::thread> threads;
+    try
+    {
+        for (unsigned i = 1; i < numChunks; i++)
+        {
+            const size_t chunkFrom = from + i*chunkLen, chunkTo = (i == numChunks - 1 ? to : from + (i+1)*chunkLen);
+            threads.emplace_back([func, chunkFrom, chunkTo, i, &errors]() mutable
+                                 { CallStoringException(errors[i], func, chunkFrom, chunkTo, i); });
+        }
 
-    if (xrange >= yrange && xrange >= zrange)
+        func(from, from + chunkLen, 0);
+    }
+    catch (...)
     {
-        // Sort by the position of primitive's center
-        std::sort(primitives.begin() + from, iterTo,
+        // Also covers failing to start a thread; the threads already started are joined below
+        errors[0] = std::current_exception();
+    }
+
+    for (auto &t: threads)
+        t.join();
 
-                  [](const Primitive *p1, const Primitive *p2)
-                  { return (p1->GetXmin() + p1->GetXmax())*0.5 < (p2->GetXmin() + p2->GetXmax())*0.5; }
-        );
+    freeThreads += numExtraThreads;
+    RethrowFirst(errors);
+    return numChunks;
+}
 
-        // Find the first primitive whose middle point is higher than the total BV's middle point
-        while (subdivisionIndex < to &&
-            0.5 * (primitives[subdivisionIndex]->GetXmin() + primitives[subdivisionIndex]->GetXmax()) <= xminall + 0.5*xrange)
+/** Calls 'buildLower' and 'buildHigher', in parallel if there are 'count' primitives to divide and a free thread.
+    An exception thrown by either is rethrown after the other thread has been joined. */
+template<typename FuncLower, typename FuncHigher>
+static void ForkJoin(size_t count, std::atomic<int> &freeThreads, FuncLower buildLower, FuncHigher buildHigher)
+{
+    if (count >= gpuart::BoundingVolumesHierarchy::PARALLEL_MIN_PRIMITIVES && AcquireThreads(freeThreads, 1))
+    {
+        std::vector<std::exception_ptr> errors(2);
+        std::thread lowerThread;
+        try
         {
-            subdivisionIndex++;
+            lowerThread = std::thread([&buildLower, &errors]() { CallStoringException(errors[0], buildLower); });
         }
+        catch (...)
+        {
+            freeThreads++;
+            throw;
+        }
+
+        CallStoringException(errors[1], buildHigher);
+        lowerThread.join();
+        freeThreads++;
+        RethrowFirst(errors);
     }
-    else if (yrange >= xrange && yrange >= zrange)
+    else
     {
-        std::sort(primitives.begin() + from, iterTo,
+        buildLower();
+        buildHigher();
+    }
+}
+
+struct gpuart::BoundingVolumesHierarchy::BuildContext
+{
+    unsigned maxNumLevels;
+    unsigned minPrimitivesPerNode;
+
+    /// Number of threads which can still be started
+    std::atomic<int> freeThreads;
+
+    const PrimitiveSet &primitives;
+
+    /// Calculated once for all 'primitives', so that subdivision reads them from contiguous arrays
+    PrimitiveBounds bounds;
+
+    /** Indices of 'primitives'; subdivision reorders them so that each node
+        refers to a contiguous range [from, to). */
+    std::vector<uint32_t> indices;
 
-                  [](const Primitive *p1, const Primitive *p2)
-                  { return (p1->GetYmin() + p1->GetYmax())*0.5 < (p2->GetYmin() + p2->GetYmax())*0.5; }
-        );
+    BuildContext(const PrimitiveSet &primitives): primitives(primitives) { }
 
-        // Find first primitive which is higher than the middle point
-        while (subdivisionIndex < to &&
-            0.5 * (primitives[subdivisionIndex]->GetYmin() + primitives[subdivisionIndex]->GetYmax()) <= yminall + 0.5*yrange)
+    /// Returns bounds of primitives in range [from, to) of 'indices', calculated in parallel if possible
+    Bounds GetBounds(size_t from, size_t to);
+
+    /// Assigns primitives in range [from, to) of 'indices' to a leaf 'node'
+    static void MakeLeaf(BoundingBox *node, size_t from, size_t to);
+};
+
+Bounds gpuart::BoundingVolumesHierarchy::BuildContext::GetBounds(size_t from, size_t to)
+{
+    Bounds chunkBounds[MAX_CHUNKS];
+
+    unsigned numChunks = ForEachChunk(from, to, MAX_CHUNKS, freeThreads,
+
+        [&](size_t chunkFrom, size_t chunkTo, unsigned chunkIdx)
         {
-            subdivisionIndex++;
+            for (size_t i = chunkFrom; i < chunkTo; i++)
+                chunkBounds[chunkIdx].Add(bounds, indices[i]);
         }
-    }
-    else if (zrange >= xrange && zrange >= yrange)
+    );
+
+    Bounds all;
+    for (unsigned i = 0; i < numChunks; i++)
+        all.Add(chunkBounds[i]);
+
+    return all;
+}
+
+void gpuart::BoundingVolumesHierarchy::BuildContext::MakeLeaf(BoundingBox *node, size_t from, size_t to)
+{
+    node->firstPrimitive = (uint32_t)from;
+    node->numPrimitives = (uint32_t)(to - from);
+}
+
+/** Subtrees are built in parallel using up to 'numThreads' threads (0: all hardware threads);
+    the resulting tree does not depend on the number of threads. */
+gpuart::BoundingVolumesHierarchy::BoundingVolumesHierarchy(const PrimitiveSet &primitives,
+                                                           unsigned maxNumLevels, unsigned minPrimitivesPerNode,
+                                                           BVHBuildStrategy strategy, unsigned numThreads)
+{
+    assert(primitives.GetCount() <= UINT32_MAX);
+
+    if (numThreads == 0)
+        numThreads = std::max(1U, std::thread::hardware_concurrency());
+
+    BuildContext ctx(primitives);
+    ctx.maxNumLevels = maxNumLevels;
+    ctx.minPrimitivesPerNode = minPrimitivesPerNode;
+    ctx.freeThreads = (int)numThreads - 1; // the calling thread does the work too
+
+    size_t numPrimitives = primitives.GetCount();
+    for (int axis = 0; axis < 3; axis++)
     {
-        std::sort(primitives.begin() + from, iterTo,
+        ctx.bounds.min[axis].resize(numPrimitives);
+        ctx.bounds.max[axis].resize(numPrimitives);
+        ctx.bounds.center[axis].resize(numPrimitives);
+    }
+    ctx.indices.resize(numPrimitives);
 
-                  [](const Primitive *p1, const Primitive *p2)
-                  { return (p1->GetZmin() + p1->GetZmax())*0.5 < (p2->GetZmin() + p2->GetZmax())*0.5; }
-        );
+    ForEachChunk(0, numPrimitives, MAX_CHUNKS, ctx.freeThreads,
 
-        // Find the first primitive which is higher than the middle point
-        while (subdivisionIndex < to &&
-            0.5 * (primitives[subdivisionIndex]->GetZmin() + primitives[subdivisionIndex]->GetZmax()) <= zminall + 0.5*zrange)
+        [&](size_t chunkFrom, size_t chunkTo, unsigned)
         {
-            subdivisionIndex++;
+            PrimitiveBounds &pb = ctx.bounds;
+            for (size_t i = chunkFrom; i < chunkTo; i++)
+            {
+                const Primitive &p = primitives[i];
+                pb.min[0][i] = p.GetXmin(); pb.max[0][i] = p.GetXmax();
+                pb.min[1][i] = p.GetYmin(); pb.max[1][i] = p.GetYmax();
+                pb.min[2][i] = p.GetZmin(); pb.max[2][i] = p.GetZmax();
+                for (int axis = 0; axis < 3; axis++)
+                    pb.center[axis][i] = (pb.min[axis][i] + pb.max[axis][i]) * 0.5f;
+
+                ctx.indices[i] = (uint32_t)i;
+            }
         }
+    );
+
+    Root.reset(new BoundingBox());
+    if (strategy == BVHBuildStrategy::SAH)
+        SubdivideSAH(Root.get(), 0, numPrimitives, 0, ctx);
+    else
+        Subdivide(Root.get(), 0, numPrimitives, 0, ctx);
+
+    PrimitiveIndices = std::move(ctx.indices);
+}
+
+/**  Divides the primitives with indices between 'from' (incl.) and 'two' (excl.)
+     along the longest spanned axis. */
+void gpuart::BoundingVolumesHierarchy::Subdivide(gpuart::BoundingBox *node, size_t from, size_t to,
+                                                 unsigned currentLevel, BuildContext &ctx)
+{
+    if (!node)
+        return;
+
+    // Bounding box of all primitives from the range [from, to)
+    Bounds all = ctx.GetBounds(from, to);
+
+    node->xmin = all.xmin;
+    node->xmax = all.xmax;
+    node->ymin = all.ymin;
+    node->ymax = all.ymax;
+    node->zmin = all.zmin;
+    node->zmax = all.zmax;
+
+    if (to - from <= ctx.minPrimitivesPerNode || currentLevel == ctx.maxNumLevels-1)
+    {
+        ctx.MakeLeaf(node, from, to);
+        return;
     }
 
+    // Subdivide along the longest spanned axis --------
+
+    float xrange = all.xmax - all.xmin;
+    float yrange = all.ymax - all.ymin;
+    float zrange = all.zmax - all.zmin;
+
+    int axis;
+    double midpoint;
+    if (xrange >= yrange && xrange >= zrange)
+    {
+        axis = 0;
+        midpoint = all.xmin + 0.5*xrange;
+    }
+    else if (yrange >= xrange && yrange >= zrange)
+    {
+        axis = 1;
+        midpoint = all.ymin + 0.5*yrange;
+    }
+    else
+    {
+        axis = 2;
+        midpoint = all.zmin + 0.5*zrange;
+    }
+
+    const std::vector<float> &center = ctx.bounds.center[axis];
+    auto iterFrom = ctx.indices.begin() + from;
+    auto iterTo = ctx.indices.begin() + to;
+
+    /* All primitives in range [from, subdivisionIndex) will be fed to the lower (left) child node,
+       i.e. those whose middle point is not higher than the total BV's middle point,
+       and those from [subdivisionIndex, to) to the higher (right) node. */
+    size_t subdivisionIndex = std::partition(iterFrom, iterTo, [&](uint32_t idx) { return center[idx] <= midpoint; })
+                              - ctx.indices.begin();
+
     /* Avoid an infinite recursion in case when there is a dominating bounding box
-       which always gets sorted as last and 'subdivisionIndex' points to it in every subsequent call. */
+       which always ends up on one side: move the primitive with the lowest (or highest) center
+       to the other side. */
     if (to - from > 2)
     {
+        auto compareCenters = [&](uint32_t idx1, uint32_t idx2) { return center[idx1] < center[idx2]; };
+
         if (subdivisionIndex == from)
+        {
+            std::iter_swap(iterFrom, std::min_element(iterFrom, iterTo, compareCenters));
             subdivisionIndex++;
+        }
         else if (subdivisionIndex == to)
+        {
+            std::iter_swap(iterTo - 1, std::max_element(iterFrom, iterTo, compareCenters));
             subdivisionIndex--;
+        }
     }
 
     node->higher.reset(new BoundingBox());
     node->lower.reset(new BoundingBox());
 
-    Subdivide(node->lower.get(), primitives, from, subdivisionIndex, currentLevel + 1, maxNumLevels, minPrimitivesPerNode);
-    Subdivide(node->higher.get(), primitives, subdivisionIndex, to, currentLevel + 1, maxNumLevels, minPrimitivesPerNode);
+    BoundingBox *lower = node->lower.get(), *higher = node->higher.get();
+
+    ForkJoin(to - from, ctx.freeThreads,
+             [&] { Subdivide(lower, from, subdivisionIndex, currentLevel + 1, ctx); },
+             [&] { Subdivide(higher, subdivisionIndex, to, currentLevel + 1, ctx); });
+}
+
+/**  Divides the primitives with indices between 'from' (incl.) and 'to' (excl.)
+     at the split position of the lowest SAH cost. */
+void gpuart::BoundingVolumesHierarchy::SubdivideSAH(gpuart::BoundingBox *node, size_t from, size_t to,
+                                                    unsigned currentLevel, BuildContext &ctx)
+{
+    if (!node)
+        return;
+
+    const PrimitiveBounds &pb = ctx.bounds;
+
+    // Bounds of primitives and of their centers, per chunk
+    struct
+    {
+        Bounds all;
+        float cmin[3] = { 99.0e+29f, 99.0e+29f, 99.0e+29f },
+              cmax[3] = { -99.0e+29f, -99.0e+29f, -99.0e+29f };
+    } chunkBounds[MAX_CHUNKS];
+
+    unsigned numChunks = ForEachChunk(from, to, MAX_CHUNKS, ctx.freeThreads,
+
+        [&](size_t chunkFrom, size_t chunkTo, unsigned chunkIdx)
+        {
+            auto &cb = chunkBounds[chunkIdx];
+            for (size_t i = chunkFrom; i < chunkTo; i++)
+            {
+                uint32_t idx = ctx.indices[i];
+                cb.all.Add(pb, idx);
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    cb.cmin[axis] = std::min(cb.cmin[axis], pb.center[axis][idx]);
+                    cb.cmax[axis] = std::max(cb.cmax[axis], pb.center[axis][idx]);
+                }
+            }
+        }
+    );
+
+    Bounds all;
+    float cmin[3] = { 99.0e+29f, 99.0e+29f, 99.0e+29f },
+          cmax[3] = { -99.0e+29f, -99.0e+29f, -99.0e+29f };
+
+    for (unsigned i = 0; i < numChunks; i++)
+    {
+        all.Add(chunkBounds[i].all);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            cmin[axis] = std::min(cmin[axis], chunkBounds[i].cmin[axis]);
+            cmax[axis] = std::max(cmax[axis], chunkBounds[i].cmax[axis]);
+        }
+    }
+
+    node->xmin = all.xmin;
+    node->xmax = all.xmax;
+    node->ymin = all.ymin;
+    node->ymax = all.ymax;
+    node->zmin = all.zmin;
+    node->zmax = all.zmax;
+
+    size_t count = to - from;
+
+    if (count <= ctx.minPrimitivesPerNode || currentLevel == ctx.maxNumLevels-1)
+    {
+        ctx.MakeLeaf(node, from, to);
+        return;
+    }
+
+    // Distribute the primitives into bins along each axis ----
+
+    float binScale[3];
+    for (int axis = 0; axis < 3; axis++)
+        binScale[axis] = (cmax[axis] > cmin[axis] ? SAH_NUM_BINS / (cmax[axis] - cmin[axis]) : 0);
+
+    auto getBin = [&](uint32_t idx, int axis)
+    {
+        unsigned b = (unsigned)((pb.center[axis][idx] - cmin[axis]) * binScale[axis]);
+        return std::min(b, SAH_NUM_BINS - 1);
+    };
+
+    // Small nodes are never processed in parallel; do not allocate bins for chunks they will not use
+    unsigned maxChunks = (count >= 2 * PARALLEL_MIN_PRIMITIVES ? MAX_CHUNKS : 1);
+
+    typedef Bounds AxisBins[3][SAH_NUM_BINS];
+    std::unique_ptr<AxisBins[]> chunkBins(new AxisBins[maxChunks]);
+
+    numChunks = ForEachChunk(from, to, maxChunks, ctx.freeThreads,
+
+        [&](size_t chunkFrom, size_t chunkTo, unsigned chunkIdx)
+        {
+            for (size_t i = chunkFrom; i < chunkTo; i++)
+            {
+                uint32_t idx = ctx.indices[i];
+                for (int axis = 0; axis < 3; axis++)
+                    chunkBins[chunkIdx][axis][getBin(idx, axis)].Add(pb, idx);
+            }
+        }
+    );
+
+    // Find the lowest-cost split plane among bin boundaries of all axes ----
+
+    float nodeArea = all.GetArea();
+    if (nodeArea <= 0)
+        nodeArea = 1; // only relative costs matter
+
+    float bestCost = 99.0e+29f;
+    int bestAxis = -1;
+    unsigned bestSplit = 0; // bins [0, bestSplit) go to the lower child
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (cmax[axis] <= cmin[axis])
+            continue;
+
+        Bounds bins[SAH_NUM_BINS];
+        for (unsigned i = 0; i < numChunks; i++)
+            for (unsigned b = 0; b < SAH_NUM_BINS; b++)
+                bins[b].Add(chunkBins[i][axis][b]);
+
+        // Areas and counts of all bins above each split plane, accumulated from the top
+        float higherArea[SAH_NUM_BINS];
+        size_t higherCount[SAH_NUM_BINS];
+        Bounds acc;
+        for (unsigned b = SAH_NUM_BINS - 1; b > 0; b--)
+        {
+            acc.Add(bins[b]);
+            higherArea[b] = acc.GetArea();
+            higherCount[b] = acc.count;
+        }
+
+        acc = Bounds();
+        for (unsigned split = 1; split < SAH_NUM_BINS; split++)
+        {
+            acc.Add(bins[split - 1]);
+            if (acc.count == 0 || higherCount[split] == 0)
+                continue;
+
+            float cost = SAH_TRAVERSAL_COST
+                         + SAH_INTERSECTION_COST * (acc.GetArea() * acc.count + higherArea[split] * higherCount[split]) / nodeArea;
+
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = split;
+            }
+        }
+    }
+
+    size_t subdivisionIndex;
+
+    if (bestAxis < 0)
+    {
+        // All primitives have the same center; the only option is to split them by count
+        if (count <= SAH_MAX_LEAF_SIZE)
+        {
+            ctx.MakeLeaf(node, from, to);
+            return;
+        }
+        subdivisionIndex = from + count/2;
+    }
+    else
+    {
+        if (count <= SAH_MAX_LEAF_SIZE && bestCost >= SAH_INTERSECTION_COST * count)
+        {
+            ctx.MakeLeaf(node, from, to);
+            return;
+        }
+
+        subdivisionIndex = std::partition(ctx.indices.begin() + from, ctx.indices.begin() + to,
+                                          [&](uint32_t idx) { return getBin(idx, bestAxis) < bestSplit; })
+                           - ctx.indices.begin();
+    }
+
+    node->higher.reset(new BoundingBox());
+    node->lower.reset(new BoundingBox());
+
+    BoundingBox *lower = node->lower.get(), *higher = node->higher.get();
+
+    ForkJoin(count, ctx.freeThreads,
+             [&] { SubdivideSAH(lower, from, subdivisionIndex, currentLevel + 1, ctx); },
+             [&] { SubdivideSAH(higher, subdivisionIndex, to, currentLevel + 1, ctx); });
+}
+
+/// Returns the sum of SAH costs of 'node' and its descendants, not normalized by the root's area
+float gpuart::BoundingVolumesHierarchy::GetSubtreeSAHCost(const BoundingBox &node)
+{
+    float area = GetBoxArea(node.xmin, node.xmax, node.ymin, node.ymax, node.zmin, node.zmax);
+
+    if (node.lower)
+        return area * SAH_TRAVERSAL_COST + GetSubtreeSAHCost(*node.lower) + GetSubtreeSAHCost(*node.higher);
+    else
+        return area * SAH_INTERSECTION_COST * node.numPrimitives;
+}
+
+/** Returns the expected cost of tracing a ray through the tree, according to
+    the surface area heuristic (lower is better). Suitable for comparing trees
+    of the same primitives built with different strategies. */
+float gpuart::BoundingVolumesHierarchy::GetSAHCost() const
+{
+    float rootArea = GetBoxArea(Root->xmin, Root->xmax, Root->ymin, Root->ymax, Root->zmin, Root->zmax);
+    if (rootArea <= 0)
+        return 0;
+
+    return GetSubtreeSAHCost(*Root) / rootArea;
 }
 
 static void PushElements(gpuart::Primitive::Data &vec, const std::initializer_list<GLfloat> &list)
@@ -157,68 +599,589 @@ static void PushElements(gpuart::Primitive::Data &vec, const std::initializer_li
         vec.push_back(elem);
 }
 
-/// Compiles BVH tree starting at 'node' and appends results at the back of 'compiledTree'
-void gpuart::BoundingVolumesHierarchy::CompileFrom(const BoundingBox &node, Primitive::Data &compiledTree,
-                                                   uint32_t parentAddr, bool isLower) const
+static GLfloat AsFloat(uint32_t value)
+{
+    return *reinterpret_cast<GLfloat*>(&value);
+}
+
+/// Returns the value at quantization level 'q'; the shader dequantizes in the same way
+static float Dequantize(float origin, float scale, uint32_t q)
+{
+    return origin + (float)q * scale;
+}
+
+/** Returns the biased exponent (as in IEEE 754 single precision) of the power of 2 scale
+    which lets [min, max] be covered by quantization levels 0..maxLevel. */
+static uint32_t GetQuantizationExponent(float min, float max, uint32_t maxLevel)
+{
+    int exponent;
+    std::frexp(((double)max - min) / maxLevel, &exponent); // 2^exponent > (max-min)/maxLevel
+
+    exponent = std::max(exponent, -126);
+    while (exponent < 127 && Dequantize(min, std::ldexp(1.0f, exponent), maxLevel) < max)
+        exponent++;
+
+    return (uint32_t)(exponent + 127);
+}
+
+/// Returns the highest quantization level not above 'value'
+static uint32_t QuantizeMin(float value, float origin, float scale, uint32_t maxLevel)
+{
+    double q = std::floor(((double)value - origin) / scale);
+    uint32_t result = (uint32_t)std::max(0.0, std::min<double>(q, maxLevel));
+
+    while (result > 0 && Dequantize(origin, scale, result) > value)
+        result--;
+
+    return result;
+}
+
+/// Returns the lowest quantization level not below 'value'
+static uint32_t QuantizeMax(float value, float origin, float scale, uint32_t maxLevel)
+{
+    double q = std::ceil(((double)value - origin) / scale);
+    uint32_t result = (uint32_t)std::max(0.0, std::min<double>(q, maxLevel));
+
+    while (result < maxLevel && Dequantize(origin, scale, result) < value)
+        result++;
+
+    return result;
+}
+
+/** Returns the descendants of inner node 'node' which become its children after collapsing
+    it into a node with up to 'maxChildren' children, sorted by their centers along 'orderAxis'
+    (the axis of the centers' largest spread). */
+std::vector<const gpuart::BoundingBox*> gpuart::BoundingVolumesHierarchy::GetCollapsedChildren(const BoundingBox &node, unsigned maxChildren,
+                                                                                               unsigned &orderAxis)
+{
+    std::vector<const BoundingBox*> children = { node.lower.get(), node.higher.get() };
+
+    // Repeatedly replace the inner child of the largest surface area by its own children
+    while (children.size() < maxChildren)
+    {
+        int largest = -1;
+        float largestArea = -1;
+        for (size_t i = 0; i < children.size(); i++)
+        {
+            const BoundingBox *child = children[i];
+            if (!child->lower)
+                continue;
+
+            float area = GetBoxArea(child->xmin, child->xmax, child->ymin, child->ymax, child->zmin, child->zmax);
+            if (area > largestArea)
+            {
+                largest = (int)i;
+                largestArea = area;
+            }
+        }
+
+        if (largest < 0)
+            break; // all children are leaves
+
+        const BoundingBox *expanded = children[largest];
+        children[largest] = expanded->higher.get();
+        children.insert(children.begin() + largest, expanded->lower.get());
+    }
+
+    // Centers are doubled, which does not change their order
+    auto getCenter = [](const BoundingBox *box, unsigned axis)
+        {
+            return (axis == 0 ? box->xmin + box->xmax : (axis == 1 ? box->ymin + box->ymax : box->zmin + box->zmax));
+        };
+
+    float largestSpread = -1;
+    for (unsigned axis = 0; axis < 3; axis++)
+    {
+        float cmin = FLT_MAX, cmax = -FLT_MAX;
+        for (const BoundingBox *child: children)
+        {
+            cmin = std::min(cmin, getCenter(child, axis));
+            cmax = std::max(cmax, getCenter(child, axis));
+        }
+
+        if (cmax - cmin > largestSpread)
+        {
+            orderAxis = axis;
+            largestSpread = cmax - cmin;
+        }
+    }
+
+    std::stable_sort(children.begin(), children.end(),
+                     [&](const BoundingBox *a, const BoundingBox *b) { return getCenter(a, orderAxis) < getCenter(b, orderAxis); });
+
+    return children;
+}
+
+/** Appends to 'compiledTree' the bounding boxes of 'children', quantized relative
+    to the bounds of 'node' (see CompileFrom()). */
+void gpuart::BoundingVolumesHierarchy::StoreChildBoxes(const BoundingBox &node, const std::vector<const BoundingBox*> &children,
+                                                       Primitive::Data &compiledTree)
+{
+    const float nodeMin[3] = { node.xmin, node.ymin, node.zmin },
+                nodeMax[3] = { node.xmax, node.ymax, node.zmax };
+
+    float scale[3];
+    uint32_t exponents = 0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        uint32_t biasedExp = GetQuantizationExponent(nodeMin[axis], nodeMax[axis], QUANT_MAX_LEVEL);
+        scale[axis] = std::ldexp(1.0f, (int)biasedExp - 127);
+        exponents |= biasedExp << (8*axis);
+    }
+
+    PushElements(compiledTree, { nodeMin[0], nodeMin[1], nodeMin[2], AsFloat(exponents) });
+
+    for (const BoundingBox *child: children)
+    {
+        const float childMin[3] = { child->xmin, child->ymin, child->zmin },
+                    childMax[3] = { child->xmax, child->ymax, child->zmax };
+
+        uint32_t qmin = 0, qmax = 0;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            qmin |= QuantizeMin(childMin[axis], nodeMin[axis], scale[axis], QUANT_MAX_LEVEL) << (8*axis);
+            qmax |= QuantizeMax(childMax[axis], nodeMin[axis], scale[axis], QUANT_MAX_LEVEL) << (8*axis);
+        }
+
+        PushElements(compiledTree, { AsFloat(qmin), AsFloat(qmax) });
+    }
+
+    if (children.size() % 2)
+        PushElements(compiledTree, { RGBA_PAD, RGBA_PAD });
+}
+
+/** Compiles BVH tree starting at 'node' and appends results at the back of 'compiledTree';
+    if 'locations' is not null, stores there the locations of the node's primitives. */
+void gpuart::BoundingVolumesHierarchy::CompileFrom(const BoundingBox &node, const PrimitiveSet &primitives, Primitive::Data &compiledTree,
+                                                   uint32_t parentAddr, uint32_t childIndex, unsigned maxChildren,
+                                                   std::vector<CompiledPrimitiveLocation> *locations) const
 {
     /*
     Layout of a node in a compiled tree:
 
-                      node_BB (2 x RGBA32F)                                node_info (1 x RGBA32F)
-        { xmin, ymin, zmin, PAD }, { xmax, ymax, zmax, PAD },  { flags|num_primitives, lo_addr, hi_addr, parent_addr },
+                               node_info (1 x RGBA32F)
+        { flags|num_primitives_or_children, child0_addr, child1_addr, parent_addr },
+
+    where flags contain the node's index among its parent's children (see CHILD_INDEX_SHIFT)
+    and, for inner nodes, the axis along which the children are sorted (see ORDER_AXIS_SHIFT).
 
     If (flags | LEAF): followed by compiled primitive data produced by gpuart::Primitive::StoreIntoBVH().
 
-    The ###_addr fields indicate element index (in terms of RGBA quads) of the "lower"/"higher" child and the parent node.
+    Otherwise followed by the children's bounding boxes, quantized relative to the node's bounds:
+
+                     quant_params (1 x RGBA32F)                              children_BB (ceil(num_children/2) x RGBA32F)
+        { xmin, ymin, zmin, x_exp | y_exp<<8 | z_exp<<16 },  { ch0_qmin, ch0_qmax, ch1_qmin, ch1_qmax }, { ch2_qmin, ch2_qmax, ... }, ...
+
+    where ###_qmin/qmax = qx | qy<<8 | qz<<16, and the corresponding coordinate equals ###min + q * 2^(###_exp - 127)
+    (i.e. ###_exp is a biased floating-point exponent). Quantized boxes enclose the original ones.
+    The root node's own bounding box is not stored.
+
+    If num_children > 2, followed by addresses of the remaining children:
+
+             children_addr (ceil((num_children-2)/4) x RGBA32F)
+        { child2_addr, child3_addr, child4_addr, child5_addr }, ...
 
-    NOTE: 'flags|num_primitives' and node addresses are uint32_t (shader reinterprets them via floatBitsToUint()).
+    The ###_addr fields indicate element index (in terms of RGBA quads) of a child and the parent node.
+    Unused slots (in leaves and in nodes with fewer children) are padding.
+
+    NOTE: 'flags|num_primitives_or_children', node addresses and quantized values are uint32_t
+    (shader reinterprets them via floatBitsToUint()).
     */
 
     uint32_t nodeAddr = (uint32_t)(compiledTree.size() / RGBA_ELEMS);
 
-    PushElements(compiledTree, { node.xmin, node.ymin, node.zmin, RGBA_PAD,
-                                 node.xmax, node.ymax, node.zmax, RGBA_PAD });
-
-    uint32_t flags = (isLower ? IS_LOWER : 0);
+    uint32_t flags = childIndex << CHILD_INDEX_SHIFT;
     if (&node == Root.get())
         flags |= IS_ROOT;
 
-    if (node.primitives.empty())
+    if (node.lower)
     {
         assert(compiledTree.size() <= (uint32_t)1<<31);
 
-        compiledTree.push_back(*reinterpret_cast<GLfloat*>(&flags));
+        unsigned orderAxis;
+        std::vector<const BoundingBox*> children = GetCollapsedChildren(node, maxChildren, orderAxis);
 
-        uint32_t lowerAddrLoc = (uint32_t)compiledTree.size();
-        compiledTree.push_back(0); // placeholder for 'lowerAddr'
+        flags |= orderAxis << ORDER_AXIS_SHIFT;
+        compiledTree.push_back(AsFloat(flags | (uint32_t)children.size()));
 
-        uint32_t higherAddrLoc = (uint32_t)compiledTree.size();
-        compiledTree.push_back(0); // placeholder for 'higherAddr'
+        std::vector<size_t> childAddrLoc;
+        childAddrLoc.push_back(compiledTree.size());
+        compiledTree.push_back(0); // placeholder for 'child0_addr'
+        childAddrLoc.push_back(compiledTree.size());
+        compiledTree.push_back(0); // placeholder for 'child1_addr'
 
-        compiledTree.push_back(*reinterpret_cast<GLfloat*>(&parentAddr));
+        compiledTree.push_back(AsFloat(parentAddr));
 
-        uint32_t lowerAddr = (uint32_t)(compiledTree.size() / RGBA_ELEMS);
-        compiledTree[lowerAddrLoc] = *reinterpret_cast<GLfloat*>(&lowerAddr);
+        StoreChildBoxes(node, children, compiledTree);
 
-        CompileFrom(*node.lower, compiledTree, nodeAddr, true);
+        for (size_t i = 2; i < children.size(); i++)
+        {
+            childAddrLoc.push_back(compiledTree.size());
+            compiledTree.push_back(0); // placeholder for 'child#_addr'
+        }
+        while (compiledTree.size() % RGBA_ELEMS)
+            compiledTree.push_back(RGBA_PAD);
 
-        uint32_t higherAddr = (uint32_t)(compiledTree.size() / RGBA_ELEMS);
-        compiledTree[higherAddrLoc] = *reinterpret_cast<GLfloat*>(&higherAddr);
+        for (size_t i = 0; i < children.size(); i++)
+        {
+            uint32_t childAddr = (uint32_t)(compiledTree.size() / RGBA_ELEMS);
+            compiledTree[childAddrLoc[i]] = AsFloat(childAddr);
 
-        CompileFrom(*node.higher, compiledTree, nodeAddr, false);
+            CompileFrom(*children[i], primitives, compiledTree, nodeAddr, (uint32_t)i, maxChildren, locations);
+        }
     }
     else
     {
         flags |= LEAF;
-        flags |= ((uint32_t)node.primitives.size() & ~FLAGS_MASK);
-        compiledTree.push_back(*reinterpret_cast<GLfloat*>(&flags));
+        flags |= (node.numPrimitives & ~FLAGS_MASK);
+        compiledTree.push_back(AsFloat(flags));
 
         PushElements(compiledTree, { RGBA_PAD, RGBA_PAD }); // no children addresses
-        compiledTree.push_back(*reinterpret_cast<GLfloat*>(&parentAddr));
+        compiledTree.push_back(AsFloat(parentAddr));
+
+        for (uint32_t i = node.firstPrimitive; i < node.firstPrimitive + node.numPrimitives; i++)
+        {
+            if (locations)
+                (*locations)[PrimitiveIndices[i]] = { nodeAddr, (uint32_t)compiledTree.size() };
+
+            primitives[PrimitiveIndices[i]].StoreIntoBVH(compiledTree);
+        }
+    }
+}
+
+/// Stores xmin, xmax, ymin, ymax, zmin, zmax of 'p' in 'bounds'
+static void GetPrimitiveBounds(const gpuart::Primitive &p, float *bounds)
+{
+    bounds[0] = p.GetXmin(); bounds[1] = p.GetXmax();
+    bounds[2] = p.GetYmin(); bounds[3] = p.GetYmax();
+    bounds[4] = p.GetZmin(); bounds[5] = p.GetZmax();
+}
+
+/** 'compiledTree' and 'locations' have to be produced by BoundingVolumesHierarchy::Compile()
+    from 'primitives'. */
+gpuart::BVHRefitter::BVHRefitter(const PrimitiveSet &primitives, const Primitive::Data &compiledTree,
+                                 std::vector<CompiledPrimitiveLocation> &&locations)
+    : Locations(std::move(locations))
+{
+    assert(Locations.size() == primitives.GetCount());
+
+    PrimitiveBounds.resize(6 * primitives.GetCount());
+    for (size_t i = 0; i < primitives.GetCount(); i++)
+        GetPrimitiveBounds(primitives[i], &PrimitiveBounds[6*i]);
+
+    auto getUint = [&compiledTree](size_t idx) { return *reinterpret_cast<const uint32_t*>(&compiledTree[idx]); };
+
+    // Walk the compiled tree from the root (see BoundingVolumesHierarchy::CompileFrom())
+    std::vector<uint32_t> addresses = { 0 };
+    for (size_t i = 0; i < addresses.size(); i++)
+    {
+        const uint32_t addr = addresses[i];
+        const size_t base = (size_t)addr * RGBA_ELEMS;
+        const uint32_t flags = getUint(base);
+
+        Node &node = Nodes[addr];
+        node.parentAddr = getUint(base + 3);
+        node.isLeaf = (flags & BoundingVolumesHierarchy::LEAF) != 0;
+        node.isRoot = (flags & BoundingVolumesHierarchy::IS_ROOT) != 0;
+
+        if (!node.isLeaf)
+        {
+            const uint32_t numChildren = flags & ~BoundingVolumesHierarchy::FLAGS_MASK;
+            node.items = { getUint(base + 1), getUint(base + 2) };
+
+            const size_t extraAddrPos = base + 2*RGBA_ELEMS + (numChildren + 1)/2 * RGBA_ELEMS;
+            for (uint32_t c = 2; c < numChildren; c++)
+                node.items.push_back(getUint(extraAddrPos + c - 2));
+
+            addresses.insert(addresses.end(), node.items.begin(), node.items.end());
+        }
+    }
+
+    for (uint32_t i = 0; i < Locations.size(); i++)
+        Nodes[Locations[i].leafAddr].items.push_back(i);
+
+    // Children are stored after their parents, so process nodes from the highest address
+    std::sort(addresses.begin(), addresses.end(), std::greater<uint32_t>());
+    for (uint32_t addr: addresses)
+        UpdateBounds(Nodes[addr]);
+}
+
+/// Recalculates the bounds of 'node' from its primitives or children; returns 'true' if they have changed
+bool gpuart::BVHRefitter::UpdateBounds(Node &node) const
+{
+    float bounds[6] = { FLT_MAX, -FLT_MAX, FLT_MAX, -FLT_MAX, FLT_MAX, -FLT_MAX };
+
+    for (uint32_t item: node.items)
+    {
+        const float *itemBounds = node.isLeaf ? &PrimitiveBounds[6*item] : Nodes.at(item).bounds;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            bounds[2*axis]     = std::min(bounds[2*axis],     itemBounds[2*axis]);
+            bounds[2*axis + 1] = std::max(bounds[2*axis + 1], itemBounds[2*axis + 1]);
+        }
+    }
+
+    if (std::equal(bounds, bounds + 6, node.bounds))
+        return false;
+
+    std::copy_n(bounds, 6, node.bounds);
+    return true;
+}
+
+/** Overwrites the data of the primitive with index 'primitiveIdx' (see PrimitiveSet) in 'compiledTree';
+    the new 'primitive' has to be of the same type and material. Bounding boxes are updated by Refit().
+    Returns 'false' if 'primitive' cannot replace the old one. */
+bool gpuart::BVHRefitter::UpdatePrimitive(size_t primitiveIdx, const Primitive &primitive, Primitive::Data &compiledTree)
+{
+    if (primitiveIdx >= Locations.size())
+    {
+        std::cerr << "Invalid primitive index: " << primitiveIdx << "." << std::endl;
+        return false;
+    }
+
+    const CompiledPrimitiveLocation &location = Locations[primitiveIdx];
+
+    Primitive::Data data;
+    primitive.StoreIntoBVH(data);
+
+    // Primitives of the same type have the same compiled size. The material may not change either,
+    // as the light list built along with the tree depends on it
+    const uint32_t *header = reinterpret_cast<const uint32_t*>(&data[0]);
+    const uint32_t *compiledHeader = reinterpret_cast<const uint32_t*>(&compiledTree[location.dataOffset]);
+    if (header[0] != compiledHeader[0] || header[1] != compiledHeader[1]
+        || location.dataOffset + data.size() > compiledTree.size())
+    {
+        std::cerr << "Primitive #" << primitiveIdx << " can only be replaced by one of the same type and material." << std::endl;
+        return false;
+    }
+
+    std::copy(data.begin(), data.end(), compiledTree.begin() + location.dataOffset);
+    ModifiedRanges.push_back({ location.dataOffset, data.size() });
 
-        for (gpuart::Primitive *p: node.primitives)
-            p->StoreIntoBVH(compiledTree);
+    GetPrimitiveBounds(primitive, &PrimitiveBounds[6*primitiveIdx]);
+    ChangedLeaves.push_back(location.leafAddr);
+
+    return true;
+}
+
+/** Refits the bounding boxes in 'compiledTree' affected by calls to UpdatePrimitive() since the last call.
+    Appends to 'modifiedRanges' the (sorted, disjoint) ranges of 'compiledTree' modified by both,
+    as pairs of { offset, number of elements }. */
+void gpuart::BVHRefitter::Refit(Primitive::Data &compiledTree, std::vector<std::pair<size_t, size_t>> &modifiedRanges)
+{
+    std::vector<std::pair<size_t, size_t>> ranges;
+    ranges.swap(ModifiedRanges);
+
+    // Children are stored after their parents, so a node is processed after all its modified descendants
+    std::set<uint32_t, std::greater<uint32_t>> pending(ChangedLeaves.begin(), ChangedLeaves.end());
+    ChangedLeaves.clear();
+
+    Primitive::Data childBoxes;
+    while (!pending.empty())
+    {
+        const uint32_t addr = *pending.begin();
+        pending.erase(pending.begin());
+
+        Node &node = Nodes.at(addr);
+        const bool boundsChanged = UpdateBounds(node);
+
+        if (!node.isLeaf)
+        {
+            // Re-quantize all children's boxes, as their bounds or the node's own may have changed
+            auto toBoundingBox = [](const float *bounds, BoundingBox &box)
+                {
+                    box.xmin = bounds[0]; box.xmax = bounds[1];
+                    box.ymin = bounds[2]; box.ymax = bounds[3];
+                    box.zmin = bounds[4]; box.zmax = bounds[5];
+                };
+
+            BoundingBox nodeBox;
+            toBoundingBox(node.bounds, nodeBox);
+
+            std::vector<BoundingBox> children(node.items.size());
+            std::vector<const BoundingBox*> childPtrs;
+            for (size_t i = 0; i < node.items.size(); i++)
+            {
+                toBoundingBox(Nodes.at(node.items[i]).bounds, children[i]);
+                childPtrs.push_back(&children[i]);
+            }
+
+            childBoxes.clear();
+            BoundingVolumesHierarchy::StoreChildBoxes(nodeBox, childPtrs, childBoxes);
+
+            const size_t offset = ((size_t)addr + 1) * RGBA_ELEMS;
+            std::copy(childBoxes.begin(), childBoxes.end(), compiledTree.begin() + offset);
+            ranges.push_back({ offset, childBoxes.size() });
+        }
+
+        if (boundsChanged && !node.isRoot)
+            pending.insert(node.parentAddr);
     }
+
+    // Merge overlapping and adjacent ranges
+    std::sort(ranges.begin(), ranges.end());
+    std::vector<std::pair<size_t, size_t>> merged;
+    for (const auto &range: ranges)
+    {
+        if (!merged.empty() && merged.back().first + merged.back().second >= range.first)
+        {
+            auto &last = merged.back();
+            last.second = std::max(last.first + last.second, range.first + range.second) - last.first;
+        }
+        else
+            merged.push_back(range);
+    }
+    modifiedRanges.insert(modifiedRanges.end(), merged.begin(), merged.end());
+}
+
+/// Returns the max. number of elements of a compiled top-level tree of 'numInstances' instances
+size_t gpuart::TwoLevelBVH::GetTopLevelCapacity(size_t numInstances)
+{
+    /* Each leaf holds at least one instance, and each compiled inner node has at least 2 children,
+       so there are at most 'numInstances' leaves and 'numInstances'-1 inner nodes. */
+    const size_t MAX_LEAF_QUADS_PER_INSTANCE = 1 + 1 + Instance::DATA_LEN; // node info, type, data
+    const size_t MAX_INNER_NODE_QUADS = 2 + (BoundingVolumesHierarchy::MAX_CHILDREN + 1) / 2   // node info, quant. params, boxes
+                                          + (BoundingVolumesHierarchy::MAX_CHILDREN - 2 + 3) / 4; // further children addresses
+
+    return RGBA_ELEMS * (numInstances * MAX_LEAF_QUADS_PER_INSTANCE
+                         + (numInstances > 0 ? numInstances - 1 : 0) * MAX_INNER_NODE_QUADS);
+}
+
+/** Builds the bottom-level trees of 'meshes' and the top-level tree of 'instances', and compiles them
+    into 'compiledTree' (cleared first) with up to 'maxChildren' children per node. Space is reserved
+    for the top-level tree of up to max('maxInstances', number of 'instances') instances. Vertices of all
+    meshes are concatenated into 'meshVertices' (mesh triangles' indices are offset accordingly), and so are
+    their material tables into 'materials' (primitives' material IDs are offset likewise; a table with only
+    the default materials is not repeated). Returns 'false' on failure. */
+bool gpuart::TwoLevelBVH::Build(const std::vector<PrimitiveSet> &meshes, const std::vector<MeshInstance> &instances, size_t maxInstances,
+                                unsigned maxNumLevels, unsigned minPrimitivesPerNode, BVHBuildStrategy strategy, unsigned maxChildren,
+                                Primitive::Data &compiledTree, std::vector<Vec3f> &meshVertices,
+                                std::vector<Material> &materials)
+{
+    if (instances.empty())
+    {
+        std::cerr << "A two-level scene requires at least one instance." << std::endl;
+        return false;
+    }
+
+    compiledTree.clear();
+    meshVertices.clear();
+    materials = GetDefaultMaterials();
+    BottomLevels.clear();
+
+    MaxInstances = std::max(maxInstances, instances.size());
+    TopLevelCapacity = GetTopLevelCapacity(MaxInstances);
+    Strategy = strategy;
+    MaxChildren = maxChildren;
+
+    // Reserved space is filled with empty leaves, so that the whole tree can be printed
+    for (size_t i = 0; i < TopLevelCapacity; i += RGBA_ELEMS)
+        PushElements(compiledTree, { AsFloat(BoundingVolumesHierarchy::LEAF), RGBA_PAD, RGBA_PAD, AsFloat(0) });
+
+    for (const PrimitiveSet &mesh: meshes)
+    {
+        if (mesh.IsEmpty() || !mesh.Instances.empty())
+        {
+            std::cerr << "Meshes of a two-level scene must be non-empty and must not contain instances." << std::endl;
+            return false;
+        }
+
+        BottomLevel bottomLevel;
+        bottomLevel.rootAddr = (uint32_t)(compiledTree.size() / RGBA_ELEMS);
+
+        float *bounds = bottomLevel.bounds;
+        bounds[0] = bounds[2] = bounds[4] = FLT_MAX;
+        bounds[1] = bounds[3] = bounds[5] = -FLT_MAX;
+        for (size_t i = 0; i < mesh.GetCount(); i++)
+        {
+            const Primitive &p = mesh[i];
+            bounds[0] = std::min(bounds[0], p.GetXmin()); bounds[1] = std::max(bounds[1], p.GetXmax());
+            bounds[2] = std::min(bounds[2], p.GetYmin()); bounds[3] = std::max(bounds[3], p.GetYmax());
+            bounds[4] = std::min(bounds[4], p.GetZmin()); bounds[5] = std::max(bounds[5], p.GetZmax());
+        }
+
+        BoundingVolumesHierarchy tree(mesh, maxNumLevels, minPrimitivesPerNode, strategy);
+
+        const uint32_t vertexOffset = (uint32_t)meshVertices.size();
+
+        // Every material table starts with the default materials; only a mesh with further ones gets its own copy
+        uint32_t materialOffset = 0;
+        if (mesh.Materials.size() > NUM_DEFAULT_MATERIALS)
+        {
+            materialOffset = (uint32_t)materials.size();
+            materials.insert(materials.end(), mesh.Materials.begin(), mesh.Materials.end());
+        }
+
+        if ((vertexOffset > 0 && !mesh.MeshTriangles.empty()) || materialOffset > 0)
+        {
+            // Primitives refer to vertices and materials of their own mesh; offset the indices stored in the compiled tree
+            std::vector<CompiledPrimitiveLocation> locations;
+            tree.Compile(mesh, compiledTree, maxChildren, &locations);
+
+            for (const CompiledPrimitiveLocation &location: locations)
+            {
+                GLfloat &material = compiledTree[location.dataOffset + 1]; // follows the type
+                material = AsFloat(*reinterpret_cast<const uint32_t*>(&material) + materialOffset);
+            }
+
+            const size_t firstMeshTriangle = mesh.Spheres.size() + mesh.Discs.size() + mesh.Triangles.size() + mesh.Cones.size();
+            for (size_t i = firstMeshTriangle; i < firstMeshTriangle + mesh.MeshTriangles.size(); i++)
+                for (size_t j = 0; j < 3; j++)
+                {
+                    GLfloat &index = compiledTree[locations[i].dataOffset + RGBA_ELEMS + j]; // skip the type
+                    index = AsFloat(*reinterpret_cast<const uint32_t*>(&index) + vertexOffset);
+                }
+        }
+        else
+            tree.Compile(mesh, compiledTree, maxChildren);
+
+        meshVertices.insert(meshVertices.end(), mesh.MeshVertices.begin(), mesh.MeshVertices.end());
+
+        BottomLevels.push_back(bottomLevel);
+    }
+
+    Primitive::Data topLevel;
+    if (!CompileTopLevel(instances, topLevel))
+        return false;
+
+    std::copy(topLevel.begin(), topLevel.end(), compiledTree.begin());
+
+    return true;
+}
+
+/** Builds and compiles the top-level tree of 'instances' into 'topLevel' (cleared first); it replaces
+    the beginning of the tree compiled by Build() (the rest of the reserved space is not used).
+    Returns 'false' if there are too many instances or an instance refers to a nonexistent mesh. */
+bool gpuart::TwoLevelBVH::CompileTopLevel(const std::vector<MeshInstance> &instances, Primitive::Data &topLevel) const
+{
+    if (instances.empty() || instances.size() > MaxInstances)
+    {
+        std::cerr << "Invalid number of instances: " << instances.size() << " (max. " << MaxInstances << ")." << std::endl;
+        return false;
+    }
+
+    PrimitiveSet instancePrimitives;
+    for (const MeshInstance &instance: instances)
+    {
+        if (instance.mesh >= BottomLevels.size())
+        {
+            std::cerr << "Instance refers to nonexistent mesh #" << instance.mesh << "." << std::endl;
+            return false;
+        }
+
+        const BottomLevel &bottomLevel = BottomLevels[instance.mesh];
+        instancePrimitives.Add(Instance(instance.objectToWorld, bottomLevel.bounds, bottomLevel.rootAddr));
+    }
+
+    // Instances are few, so use the default leaf size and build in the calling thread
+    const unsigned MAX_NUM_LEVELS = 1024, MIN_PRIMITIVES_PER_NODE = 2;
+    BoundingVolumesHierarchy tree(instancePrimitives, MAX_NUM_LEVELS, MIN_PRIMITIVES_PER_NODE, Strategy, 1);
+
+    topLevel.clear();
+    tree.Compile(instancePrimitives, topLevel, MaxChildren);
+    assert(topLevel.size() <= TopLevelCapacity);
+
+    return true;
 }
 
 /** Prints contents of a compiled BVH tree, interpreting it
@@ -229,35 +1192,20 @@ void gpuart::BoundingVolumesHierarchy::Print(const gpuart::Primitive::Data &comp
 
     while (pos != compiledTree.end())
     {
-        s << "Node at " << (pos - compiledTree.begin()) / RGBA_ELEMS;
-
-        s << ": [" << *pos++ << "; "; // xmin
-        s << *pos++ << "; ";          // ymin
-        s << *pos++ << "]<->[";       // zmin
-        pos++; // skip RGBA padding
-
-        s << *pos++ << "; ";   // xmax
-        s << *pos++ << "; ";          // ymax
-        s << *pos++ << "], ";         // zmax
-        pos++; // skip RGBA padding
+        s << "Node at " << (pos - compiledTree.begin()) / RGBA_ELEMS << ": ";
 
         uint32_t flags = *reinterpret_cast<const uint32_t*>(&*pos++);
 
-        if (flags & IS_LOWER)
-            s << "IS_LOWER ";
+        s << "child #" << ((flags & CHILD_INDEX_MASK) >> CHILD_INDEX_SHIFT) << " ";
 
         if (flags & IS_ROOT)
-        {
-            if (flags & IS_LOWER) s << "| ";
-            s << "ROOT ";
-        }
+            s << "| ROOT ";
 
         if (flags & LEAF)
         {
-            if (flags & (IS_LOWER | IS_ROOT)) s << "| ";
-            s << "LEAF, ";
+            s << "| LEAF, ";
 
-            pos += 2; // skip unused lo/hi children addresses
+            pos += 2; // skip unused children addresses
 
             uint32_t parentAddr = *reinterpret_cast<const uint32_t*>(&*pos++);
             s << "parent at " << parentAddr << ", ";
@@ -269,7 +1217,11 @@ void gpuart::BoundingVolumesHierarchy::Print(const gpuart::Primitive::Data &comp
             {
 
                 Primitive_t ptype = (Primitive_t)*reinterpret_cast<const uint32_t*>(&*pos++);
-                pos +=3; // skip RGBA padding
+                uint32_t material = *reinterpret_cast<const uint32_t*>(&*pos++);
+                pos += 2; // skip RGBA padding
+
+                if (ptype != INSTANCE)
+                    s << "(material " << material << ") ";
 
                 switch (ptype)
                 {
@@ -291,6 +1243,16 @@ void gpuart::BoundingVolumesHierarchy::Print(const gpuart::Primitive::Data &comp
                 case CONE:
                     s << "cone ";
                     gpuart::Cone::PrintBVH(pos, s);
+                    break;
+
+                case MESH_TRIANGLE:
+                    s << "mesh triangle ";
+                    gpuart::MeshTriangle::PrintBVH(pos, s);
+                    break;
+
+                case INSTANCE:
+                    s << "instance ";
+                    gpuart::Instance::PrintBVH(pos, s);
                 }
 
                 s << ", ";
@@ -300,14 +1262,52 @@ void gpuart::BoundingVolumesHierarchy::Print(const gpuart::Primitive::Data &comp
         }
         else
         {
-            uint32_t lowerAddr = *reinterpret_cast<const uint32_t*>(&*pos++);
-            s << "lo_child at " << lowerAddr << ", ";
+            size_t numChildren = flags & ~FLAGS_MASK;
+            s << "| " << numChildren << " children sorted along " << "XYZ"[(flags & ORDER_AXIS_MASK) >> ORDER_AXIS_SHIFT] << ", ";
 
-            uint32_t higherAddr = *reinterpret_cast<const uint32_t*>(&*pos++);
-            s << "hi_child at " << higherAddr << ", ";
+            std::vector<uint32_t> childAddr;
+            for (int i = 0; i < 2; i++)
+                childAddr.push_back(*reinterpret_cast<const uint32_t*>(&*pos++));
 
             uint32_t parentAddr = *reinterpret_cast<const uint32_t*>(&*pos++);
-            s << "parent at " << parentAddr << std::endl;
+            s << "parent at " << parentAddr << ", ";
+
+            float origin[3];
+            for (int axis = 0; axis < 3; axis++)
+                origin[axis] = *pos++;
+
+            uint32_t exponents = *reinterpret_cast<const uint32_t*>(&*pos++);
+
+            std::vector<uint32_t> qmin, qmax;
+            for (size_t i = 0; i < numChildren; i++)
+            {
+                qmin.push_back(*reinterpret_cast<const uint32_t*>(&*pos++));
+                qmax.push_back(*reinterpret_cast<const uint32_t*>(&*pos++));
+            }
+            if (numChildren % 2)
+                pos += 2; // skip padding
+
+            for (size_t i = 2; i < numChildren; i++)
+                childAddr.push_back(*reinterpret_cast<const uint32_t*>(&*pos++));
+            while ((pos - compiledTree.begin()) % RGBA_ELEMS)
+                pos++; // skip padding
+
+            for (size_t i = 0; i < numChildren; i++)
+            {
+                s << "child #" << i << " at " << childAddr[i] << ", box: [";
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    float scale = std::ldexp(1.0f, (int)((exponents >> (8*axis)) & 0xFF) - 127);
+                    s << Dequantize(origin[axis], scale, (qmin[i] >> (8*axis)) & QUANT_MAX_LEVEL) << (axis < 2 ? "; " : "]<->[");
+                }
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    float scale = std::ldexp(1.0f, (int)((exponents >> (8*axis)) & 0xFF) - 127);
+                    s << Dequantize(origin[axis], scale, (qmax[i] >> (8*axis)) & QUANT_MAX_LEVEL) << (axis < 2 ? "; " : "]");
+                }
+                s << (i + 1 < numChildren ? ", " : "");
+            }
+            s << std::endl;
         }
 
     }
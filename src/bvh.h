@@ -24,10 +24,13 @@ File description:
 #ifndef GPUART_BOUNDING_VOLUMES_HIERARCHY_HEADER
 #define GPUART_BOUNDING_VOLUMES_HIERARCHY_HEADER
 
+#include <algorithm>
 #include <cstdint>
 #include <nanogui/nanogui.h>
 #include <iostream>
 #include <memory>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "core.h"
@@ -35,37 +38,112 @@ File description:
 
 namespace gpuart
 {
+    enum class BVHBuildStrategy
+    {
+        Midpoint, ///< Split at the spatial midpoint of the longest spanned axis
+        SAH       ///< Split chosen with a binned surface area heuristic
+    };
 
     struct BoundingBox
     {
         float xmin, xmax, ymin, ymax, zmin, zmax;
         std::unique_ptr<BoundingBox> lower, higher;
-        std::vector<Primitive*> primitives;
+
+        /// Leaf's range of the hierarchy's primitive indices; a node without children is a leaf
+        uint32_t firstPrimitive = 0, numPrimitives = 0;
+    };
+
+    /// Location of a primitive in a compiled tree
+    struct CompiledPrimitiveLocation
+    {
+        uint32_t leafAddr;   ///< Element index (in terms of RGBA quads) of the leaf node
+        uint32_t dataOffset; ///< Index (in terms of floats) of the primitive's type header
     };
 
     class BoundingVolumesHierarchy
     {
-        static const uint32_t LEAF     = 1UL << 31;
-        static const uint32_t IS_LOWER = 1UL << 30;
-        static const uint32_t IS_ROOT  = 1UL << 29;
+        friend class BVHRefitter;
 
-        static const uint32_t FLAGS_MASK = LEAF | IS_LOWER | IS_ROOT;
+        /// Number of bins per axis evaluated by the SAH builder
+        static const unsigned SAH_NUM_BINS = 16;
+
+        /// Max. number of primitives in a leaf created by the SAH builder when splitting is not worth it
+        static const unsigned SAH_MAX_LEAF_SIZE = 8;
+
+        /// Relative costs of traversing a node and of intersecting a primitive, used by the SAH
+        static constexpr float SAH_TRAVERSAL_COST = 1.0f;
+        static constexpr float SAH_INTERSECTION_COST = 1.0f;
 
         std::unique_ptr<BoundingBox> Root;
 
-        /**  Divides the 'primitives' with indices between 'from' (incl.) and 'two' (excl.)
+        /// Indices of primitives (in the set the hierarchy was built of), grouped by leaves
+        std::vector<uint32_t> PrimitiveIndices;
+
+        /// State shared by all nodes' subdivisions during construction
+        struct BuildContext;
+
+        /**  Divides the primitives with indices between 'from' (incl.) and 'two' (excl.)
              along the longest spanned axis. */
-        void Subdivide(BoundingBox *node, std::vector<Primitive*> &primitives, size_t from, size_t to,
+        void Subdivide(BoundingBox *node, size_t from, size_t to,
                        unsigned currentLevel,
-                       unsigned maxNumLevels,
-                       unsigned minPrimitivesPerNode);
+                       BuildContext &ctx);
+
+        /**  Divides the primitives with indices between 'from' (incl.) and 'to' (excl.)
+             at the split position of the lowest SAH cost. */
+        void SubdivideSAH(BoundingBox *node, size_t from, size_t to,
+                          unsigned currentLevel,
+                          BuildContext &ctx);
+
+        /// Returns the sum of SAH costs of 'node' and its descendants, not normalized by the root's area
+        static float GetSubtreeSAHCost(const BoundingBox &node);
+
+        /** Returns the descendants of inner node 'node' which become its children after collapsing
+            it into a node with up to 'maxChildren' children, sorted by their centers along 'orderAxis'
+            (the axis of the centers' largest spread). */
+        static std::vector<const BoundingBox*> GetCollapsedChildren(const BoundingBox &node, unsigned maxChildren,
+                                                                    unsigned &orderAxis);
+
+        /** Appends to 'compiledTree' the bounding boxes of 'children', quantized relative
+            to the bounds of 'node'. */
+        static void StoreChildBoxes(const BoundingBox &node, const std::vector<const BoundingBox*> &children,
+                                    Primitive::Data &compiledTree);
 
-        /// Compiles BVH tree starting at 'node' and appends results at the back of 'compiledTree'
-        void CompileFrom(const BoundingBox &node, Primitive::Data &compiledTree,
-                         uint32_t parentAddr, bool isLower) const;
+        /** Compiles BVH tree starting at 'node' and appends results at the back of 'compiledTree';
+            if 'locations' is not null, stores there the locations of the node's primitives. */
+        void CompileFrom(const BoundingBox &node, const PrimitiveSet &primitives, Primitive::Data &compiledTree,
+                         uint32_t parentAddr, uint32_t childIndex, unsigned maxChildren,
+                         std::vector<CompiledPrimitiveLocation> *locations) const;
 
     public:
 
+        // Node flags and quantization of the compiled tree (see CompileFrom())
+
+        static const uint32_t LEAF     = 1UL << 31;
+        static const uint32_t IS_ROOT  = 1UL << 29;
+
+        /// Node's position among its parent's children is stored in flags at bits 26-28
+        static const uint32_t CHILD_INDEX_SHIFT = 26;
+        static const uint32_t CHILD_INDEX_MASK  = 7UL << CHILD_INDEX_SHIFT;
+
+        /** Inner node's axis (0-2) along which its children are sorted, stored in flags at bits 24-25;
+            rays with a negative direction along this axis visit the children in reverse order. */
+        static const uint32_t ORDER_AXIS_SHIFT = 24;
+        static const uint32_t ORDER_AXIS_MASK  = 3UL << ORDER_AXIS_SHIFT;
+
+        static const uint32_t FLAGS_MASK = LEAF | IS_ROOT | CHILD_INDEX_MASK | ORDER_AXIS_MASK;
+
+        /// Highest level of children's bounding box coordinates quantized relative to the parent (8 bits per coordinate)
+        static const uint32_t QUANT_MAX_LEVEL = 0xFF;
+
+        /// Min. number of primitives in a node for its subtrees or bounds to be processed in parallel
+        static const size_t PARALLEL_MIN_PRIMITIVES = 4096;
+
+        /// Max. number of chunks a node's primitives are divided into for parallel processing
+        static const unsigned MAX_CHUNKS = 16;
+
+        /// Max. number of children of a node in a compiled tree
+        static const unsigned MAX_CHILDREN = 8;
+
         BoundingVolumesHierarchy() = default;
 
         BoundingVolumesHierarchy(const BoundingVolumesHierarchy &)             = delete;
@@ -74,17 +152,29 @@ namespace gpuart
         BoundingVolumesHierarchy & operator=(BoundingVolumesHierarchy &&)      = default;
 
 
-        /// Order of elements in 'primitives' may change
-        BoundingVolumesHierarchy(std::vector<Primitive*> &primitives, unsigned maxNumLevels, unsigned minPrimitivesPerNode)
-        {
-            Root.reset(new BoundingBox());
-            Subdivide(Root.get(), primitives, 0, primitives.size(), 0, maxNumLevels, minPrimitivesPerNode);
-        }
+        /** Subtrees are built in parallel using up to 'numThreads' threads (0: all hardware threads);
+            the resulting tree does not depend on the number of threads. */
+        BoundingVolumesHierarchy(const PrimitiveSet &primitives, unsigned maxNumLevels, unsigned minPrimitivesPerNode,
+                                 BVHBuildStrategy strategy = BVHBuildStrategy::Midpoint, unsigned numThreads = 0);
+
+        /** Returns the expected cost of tracing a ray through the tree, according to
+            the surface area heuristic (lower is better). Suitable for comparing trees
+            of the same primitives built with different strategies. */
+        float GetSAHCost() const;
 
-        /// Compiles the BVH tree and appends results at the back of 'compiledTree'
-        void Compile(Primitive::Data &compiledTree) const
+        /** Compiles the BVH tree and appends results at the back of 'compiledTree';
+            'primitives' have to be the same as those the hierarchy was built of.
+            The binary tree is collapsed so that each compiled node has up to 'maxChildren'
+            (2 to MAX_CHILDREN) children, e.g. 4 produces a BVH4. If 'locations' is not null,
+            it receives the location of each primitive (indexed as in 'primitives'), e.g. for BVHRefitter. */
+        void Compile(const PrimitiveSet &primitives, Primitive::Data &compiledTree, unsigned maxChildren = 2,
+                     std::vector<CompiledPrimitiveLocation> *locations = nullptr) const
         {
-            CompileFrom(*Root.get(), compiledTree, 0, false);
+            if (locations)
+                locations->resize(primitives.GetCount());
+
+            CompileFrom(*Root.get(), primitives, compiledTree, 0, 0,
+                        std::max(2U, std::min(maxChildren, (unsigned)MAX_CHILDREN)), locations);
         }
 
         /** Prints contents of a compiled BVH tree, interpreting it
@@ -92,6 +182,109 @@ namespace gpuart
         static void Print(const Primitive::Data &compiledTree, std::ostream &s);
     };
 
+    /** Updates a compiled tree in place after some of its primitives have changed (e.g. moved), without
+        rebuilding it: the primitives' data are overwritten, and the bounding boxes of their leaves and
+        of all ancestors are refitted bottom-up, following the nodes' parent addresses. The topology
+        of the tree does not change, so its quality degrades when primitives move far from their
+        original positions (rebuild the tree then). */
+    class BVHRefitter
+    {
+        struct Node
+        {
+            float bounds[6]; ///< xmin, xmax, ymin, ymax, zmin, zmax
+            uint32_t parentAddr;
+            bool isLeaf, isRoot;
+
+            /// Addresses of children (in the compiled order) or indices of primitives (if 'isLeaf')
+            std::vector<uint32_t> items;
+        };
+
+        /// Nodes of the compiled tree by address
+        std::unordered_map<uint32_t, Node> Nodes;
+
+        std::vector<CompiledPrimitiveLocation> Locations;
+
+        /// Bounds of primitives (xmin, xmax, ymin, ymax, zmin, zmax), indexed as 'Locations'
+        std::vector<float> PrimitiveBounds;
+
+        /// Leaves whose primitives have changed since the last call to Refit()
+        std::vector<uint32_t> ChangedLeaves;
+
+        /// Ranges (offset, number of elements) modified by UpdatePrimitive() since the last call to Refit()
+        std::vector<std::pair<size_t, size_t>> ModifiedRanges;
+
+        /// Recalculates the bounds of 'node' from its primitives or children; returns 'true' if they have changed
+        bool UpdateBounds(Node &node) const;
+
+    public:
+
+        BVHRefitter() = default;
+
+        /** 'compiledTree' and 'locations' have to be produced by BoundingVolumesHierarchy::Compile()
+            from 'primitives'. */
+        BVHRefitter(const PrimitiveSet &primitives, const Primitive::Data &compiledTree,
+                    std::vector<CompiledPrimitiveLocation> &&locations);
+
+        /** Overwrites the data of the primitive with index 'primitiveIdx' (see PrimitiveSet) in 'compiledTree';
+            the new 'primitive' has to be of the same type and material. Bounding boxes are updated by Refit().
+            Returns 'false' if 'primitive' cannot replace the old one. */
+        bool UpdatePrimitive(size_t primitiveIdx, const Primitive &primitive, Primitive::Data &compiledTree);
+
+        /** Refits the bounding boxes in 'compiledTree' affected by calls to UpdatePrimitive() since the last call.
+            Appends to 'modifiedRanges' the (sorted, disjoint) ranges of 'compiledTree' modified by both,
+            as pairs of { offset, number of elements }. */
+        void Refit(Primitive::Data &compiledTree, std::vector<std::pair<size_t, size_t>> &modifiedRanges);
+    };
+
+    /** Two-level hierarchy: a bottom-level tree of each mesh, built and compiled once, and a top-level tree
+        over instances of the meshes placed with affine transformations (see Instance). When instances move,
+        only the top-level tree is rebuilt (see CompileTopLevel()).
+
+        The compiled top-level tree starts at address 0, where traversal starts, in space reserved for
+        up to 'maxInstances' instances (see Build()); the bottom-level trees follow. Meshes must not contain
+        instances (there is one level of instancing). */
+    class TwoLevelBVH
+    {
+        struct BottomLevel
+        {
+            uint32_t rootAddr; ///< Address (in RGBA quads) of the compiled tree's root
+            float bounds[6];   ///< xmin, xmax, ymin, ymax, zmin, zmax of the mesh's primitives
+        };
+
+        std::vector<BottomLevel> BottomLevels;
+
+        size_t MaxInstances = 0;
+
+        /// Number of elements reserved for the compiled top-level tree
+        size_t TopLevelCapacity = 0;
+
+        BVHBuildStrategy Strategy = BVHBuildStrategy::Midpoint;
+        unsigned MaxChildren = 2;
+
+    public:
+
+        /// Returns the max. number of elements of a compiled top-level tree of 'numInstances' instances
+        static size_t GetTopLevelCapacity(size_t numInstances);
+
+        /** Builds the bottom-level trees of 'meshes' and the top-level tree of 'instances', and compiles them
+            into 'compiledTree' (cleared first) with up to 'maxChildren' children per node. Space is reserved
+            for the top-level tree of up to max('maxInstances', number of 'instances') instances. Vertices of all
+            meshes are concatenated into 'meshVertices' (mesh triangles' indices are offset accordingly), and so are
+            their material tables into 'materials' (primitives' material IDs are offset likewise; a table with only
+            the default materials is not repeated). Returns 'false' on failure. */
+        bool Build(const std::vector<PrimitiveSet> &meshes, const std::vector<MeshInstance> &instances, size_t maxInstances,
+                   unsigned maxNumLevels, unsigned minPrimitivesPerNode, BVHBuildStrategy strategy, unsigned maxChildren,
+                   Primitive::Data &compiledTree, std::vector<Vec3f> &meshVertices,
+                   std::vector<Material> &materials);
+
+        /** Builds and compiles the top-level tree of 'instances' into 'topLevel' (cleared first); it replaces
+            the beginning of the tree compiled by Build() (the rest of the reserved space is not used).
+            Returns 'false' if there are too many instances or an instance refers to a nonexistent mesh. */
+        bool CompileTopLevel(const std::vector<MeshInstance> &instances, Primitive::Data &topLevel) const;
+
+        size_t GetMaxInstances() const { return MaxInstances; }
+    };
+
 }
 
 #endif
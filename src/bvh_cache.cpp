@@ -0,0 +1,178 @@
+/*
+GPU-Assisted Ray Tracer
+Copyright (C) 2016 Filip Szczerek <ga.software@yahoo.com>
+
+This file is part of gpuart.
+
+Gpuart is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Gpuart is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with gpuart.  If not, see <http://www.gnu.org/licenses/>.
+
+File description:
+    Persistent cache of compiled BVH trees implementation
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include "bvh_cache.h"
+
+
+namespace
+{
+    const char MAGIC[8] = "GPUABVH";
+    const uint32_t BYTE_ORDER_MARK = 0x01020304U;
+
+    // 64-bit FNV-1a
+    const uint64_t FNV_OFFSET_BASIS = 0xCBF29CE484222325ULL;
+    const uint64_t FNV_PRIME = 0x100000001B3ULL;
+
+    uint64_t HashFNV1a(const void *data, size_t size, uint64_t hash)
+    {
+        const unsigned char *bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; i++)
+        {
+            hash ^= bytes[i];
+            hash *= FNV_PRIME;
+        }
+        return hash;
+    }
+
+    uint64_t HashUInt(uint32_t value, uint64_t hash)
+    {
+        return HashFNV1a(&value, sizeof(value), hash);
+    }
+}
+
+/** Returns the key of a scene built from 'inputFiles' (whose contents are hashed) with 'params';
+    returns 'false' if any of the files cannot be read. */
+bool gpuart::BVHCache::GetKey(const char *sceneName, const std::vector<std::string> &inputFiles,
+                              const BVHBuildParams &params, uint64_t &key)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    hash = HashFNV1a(sceneName, std::strlen(sceneName) + 1, hash);
+    for (const std::string &fileName: inputFiles)
+    {
+        Utils::MappedFile file(fileName.c_str());
+        if (!file.IsOpen())
+            return false;
+
+        hash = HashUInt((uint32_t)file.GetSize(), hash);
+        hash = HashFNV1a(file.GetData(), file.GetSize(), hash);
+    }
+
+    hash = HashUInt(FORMAT_VERSION, hash);
+    hash = HashUInt(params.maxNumLevels, hash);
+    hash = HashUInt(params.minPrimitivesPerNode, hash);
+    hash = HashUInt((uint32_t)params.strategy, hash);
+    hash = HashUInt(params.width, hash);
+
+    key = hash;
+    return true;
+}
+
+/// Returns the name of the cache file of 'sceneName' with 'key'
+std::string gpuart::BVHCache::GetFileName(const char *sceneName, uint64_t key)
+{
+    std::stringstream ss;
+    ss << "data/" << sceneName << "-" << std::hex << std::setw(16) << std::setfill('0') << key << ".bvhcache";
+    return ss.str();
+}
+
+/// Returns 'false' on failure; the file is replaced atomically (written under a temporary name first)
+bool gpuart::BVHCache::Save(const char *fileName, uint64_t key, const BVHBuildParams &params,
+                            const Primitive::Data &tree, const Primitive::Data &meshVertices,
+                            const Primitive::Data &materials, const Primitive::Data &lights)
+{
+    Header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, MAGIC, sizeof(header.magic));
+    header.version = FORMAT_VERSION;
+    header.byteOrderMark = BYTE_ORDER_MARK;
+    header.key = key;
+    header.maxNumLevels = params.maxNumLevels;
+    header.minPrimitivesPerNode = params.minPrimitivesPerNode;
+    header.width = params.width;
+    header.strategy = (uint32_t)params.strategy;
+    header.treeSize = tree.size();
+    header.meshVerticesSize = meshVertices.size();
+    header.materialsSize = materials.size();
+    header.lightsSize = lights.size();
+
+    const std::string tempFileName = std::string(fileName) + ".tmp";
+    {
+        std::ofstream file(tempFileName, std::ios_base::binary);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(tree.data()), tree.size() * sizeof(GLfloat));
+        file.write(reinterpret_cast<const char*>(meshVertices.data()), meshVertices.size() * sizeof(GLfloat));
+        file.write(reinterpret_cast<const char*>(materials.data()), materials.size() * sizeof(GLfloat));
+        file.write(reinterpret_cast<const char*>(lights.data()), lights.size() * sizeof(GLfloat));
+
+        if (!file)
+        {
+            std::cerr << "Failed to write BVH cache file \"" << tempFileName << "\"." << std::endl;
+            file.close();
+            std::remove(tempFileName.c_str());
+            return false;
+        }
+    }
+
+    std::remove(fileName); // needed under Windows, where rename() does not replace files
+    if (0 != std::rename(tempFileName.c_str(), fileName))
+    {
+        std::cerr << "Failed to create BVH cache file \"" << fileName << "\"." << std::endl;
+        std::remove(tempFileName.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/// Maps 'fileName' and validates its header against 'key'; check success with IsValid()
+gpuart::BVHCache::File::File(const char *fileName, uint64_t key)
+: Mapped(fileName), Tree(nullptr), MeshVertices(nullptr), Materials(nullptr), Lights(nullptr),
+  TreeSize(0), MeshVerticesSize(0), MaterialsSize(0), LightsSize(0)
+{
+    if (!Mapped.IsOpen() || Mapped.GetSize() < sizeof(Header))
+        return;
+
+    Header header;
+    std::memcpy(&header, Mapped.GetData(), sizeof(header));
+
+    if (0 != std::memcmp(header.magic, MAGIC, sizeof(header.magic))
+        || header.version != FORMAT_VERSION
+        || header.byteOrderMark != BYTE_ORDER_MARK
+        || header.key != key
+        || header.treeSize == 0
+        || header.materialsSize == 0
+        || Mapped.GetSize() != sizeof(Header) + (header.treeSize + header.meshVerticesSize + header.materialsSize
+                                                 + header.lightsSize) * sizeof(GLfloat))
+    {
+        std::cerr << "Ignoring invalid or outdated BVH cache file \"" << fileName << "\"." << std::endl;
+        return;
+    }
+
+    // The header's size is a multiple of 8, so the arrays are suitably aligned
+    Tree = reinterpret_cast<const GLfloat*>(Mapped.GetData() + sizeof(Header));
+    TreeSize = (size_t)header.treeSize;
+    MeshVertices = Tree + TreeSize;
+    MeshVerticesSize = (size_t)header.meshVerticesSize;
+    Materials = MeshVertices + MeshVerticesSize;
+    MaterialsSize = (size_t)header.materialsSize;
+    Lights = Materials + MaterialsSize;
+    LightsSize = (size_t)header.lightsSize;
+}
@@ -0,0 +1,124 @@
+/*
+GPU-Assisted Ray Tracer
+Copyright (C) 2016 Filip Szczerek <ga.software@yahoo.com>
+
+This file is part of gpuart.
+
+Gpuart is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Gpuart is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with gpuart.  If not, see <http://www.gnu.org/licenses/>.
+
+File description:
+    Persistent cache of compiled BVH trees header
+*/
+
+#ifndef GPUART_BVH_CACHE_HEADER
+#define GPUART_BVH_CACHE_HEADER
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bvh.h"
+#include "core.h"
+#include "utils.h"
+
+
+namespace gpuart
+{
+    /// Parameters of BVH construction and compilation
+    struct BVHBuildParams
+    {
+        unsigned maxNumLevels = 1024;
+        unsigned minPrimitivesPerNode = 2;
+        BVHBuildStrategy strategy = BVHBuildStrategy::Midpoint;
+        unsigned width = 4; ///< Max. number of children of a compiled node
+    };
+
+    /** Cache files store the output of BoundingVolumesHierarchy::Compile(), the mesh vertices (as RGBA quads),
+        the material table (see StoreMaterials()) and the light list (see StoreLights()) of a scene.
+        A file is identified by a key: the hash of the scene's input files' contents, the scene's name
+        (which determines the primitives added procedurally) and the build parameters.
+
+        File layout (native byte order, checked on loading):
+            Header
+            float tree[treeSize]
+            float meshVertices[meshVerticesSize]
+            float materials[materialsSize]
+            float lights[lightsSize]
+
+        FORMAT_VERSION has to be increased whenever the compiled tree's layout changes. */
+    namespace BVHCache
+    {
+        const uint32_t FORMAT_VERSION = 4;
+
+        struct Header
+        {
+            char     magic[8]; ///< "GPUABVH"
+            uint32_t version;
+            uint32_t byteOrderMark; ///< 0x01020304
+            uint64_t key;
+            uint32_t maxNumLevels, minPrimitivesPerNode, width, strategy;
+            uint64_t treeSize;         ///< Number of floats
+            uint64_t meshVerticesSize; ///< Number of floats
+            uint64_t materialsSize;    ///< Number of floats
+            uint64_t lightsSize;       ///< Number of floats; 0 if the scene has no emissive primitives
+        };
+
+        /** Returns the key of a scene built from 'inputFiles' (whose contents are hashed) with 'params';
+            returns 'false' if any of the files cannot be read. */
+        bool GetKey(const char *sceneName, const std::vector<std::string> &inputFiles,
+                    const BVHBuildParams &params, uint64_t &key);
+
+        /// Returns the name of the cache file of 'sceneName' with 'key'
+        std::string GetFileName(const char *sceneName, uint64_t key);
+
+        /// Returns 'false' on failure; the file is replaced atomically (written under a temporary name first)
+        bool Save(const char *fileName, uint64_t key, const BVHBuildParams &params,
+                  const Primitive::Data &tree, const Primitive::Data &meshVertices, const Primitive::Data &materials,
+                  const Primitive::Data &lights);
+
+        /// Memory-mapped cache file; non-copyable
+        class File
+        {
+            Utils::MappedFile Mapped;
+
+            const GLfloat *Tree, *MeshVertices, *Materials, *Lights;
+            size_t TreeSize, MeshVerticesSize, MaterialsSize, LightsSize;
+
+        public:
+
+            /// Maps 'fileName' and validates its header against 'key'; check success with IsValid()
+            File(const char *fileName, uint64_t key);
+
+            File(const File &)             = delete;
+            File & operator=(const File &) = delete;
+
+            bool IsValid() const { return Tree != nullptr; }
+
+            const GLfloat *GetTree() const { return Tree; }
+            size_t GetTreeSize() const { return TreeSize; }
+
+            const GLfloat *GetMeshVertices() const { return MeshVertices; }
+            size_t GetMeshVerticesSize() const { return MeshVerticesSize; }
+
+            const GLfloat *GetMaterials() const { return Materials; }
+            size_t GetMaterialsSize() const { return MaterialsSize; }
+
+            const GLfloat *GetLights() const { return Lights; }
+            size_t GetLightsSize() const { return LightsSize; }
+        };
+    }
+}
+
+#endif // GPUART_BVH_CACHE_HEADER
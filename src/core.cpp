@@ -22,6 +22,8 @@ File description:
 */
 
 #include <algorithm>
+#include <cfloat>
+#include <cmath>
 #include "core.h"
 
 
@@ -33,6 +35,174 @@ void PushVector(gpuart::Primitive::Data &data, const gpuart::Vec3f &v)
     data.push_back(v.z);
 }
 
+/// Bits of the emission scale kept in the 3rd word of a packed material; the low 16 hold specular and roughness
+const uint32_t EMISSION_SCALE_MASK = 0xFFFF0000U;
+
+/// Emission scales are clamped to this value, so that rounding up their bits cannot produce an infinity (or a NaN)
+const float MAX_EMISSION_SCALE = 1.0e+30f;
+
+/// Converts a value from [0, 1] to 8 bits
+static
+uint32_t Unorm8(float v)
+{
+    return (uint32_t)std::lround(std::min(std::max(v, 0.0f), 1.0f) * 255);
+}
+
+/** Packs values from [0, 1] into 8 bits each, 'x' being the lowest. The top byte stays 0, so that
+    the result is never a NaN (whose bits could be changed when passing through a float texture). */
+static
+GLfloat PackUnorm8(float x, float y, float z)
+{
+    uint32_t packed = Unorm8(x) | (Unorm8(y) << 8) | (Unorm8(z) << 16);
+    return *reinterpret_cast<GLfloat*>(&packed);
+}
+
+static
+void UnpackUnorm8(GLfloat packed, float unpacked[3])
+{
+    uint32_t bits = *reinterpret_cast<const uint32_t*>(&packed);
+    for (int i = 0; i < 3; i++)
+        unpacked[i] = ((bits >> (8*i)) & 0xFFU) / 255.0f;
+}
+
+/// Appends a light record (see LIGHT_DATA_LEN); its selection probability is set by SetLightSelectionProbabilities()
+static
+void StoreLightRecord(gpuart::Primitive_t type, const gpuart::Vec3f &center, float radius, const gpuart::Vec3f &normal,
+                      const gpuart::Vec3f &emission, gpuart::Primitive::Data &lights)
+{
+    uint32_t ltype = (uint32_t)type;
+
+    PushVector(lights, center);
+    lights.push_back(radius);
+    PushVector(lights, normal);
+    lights.push_back(*reinterpret_cast<GLfloat*>(&ltype));
+    PushVector(lights, emission);
+    lights.push_back(RGBA_PAD);
+}
+
+/** Packs the material into 3 floats (the first 3 components of a quad in the material table):
+    { unorm8(albedo.rgb), unorm8(emission.rgb / scale), scale_hi16 | unorm8(specular, roughness) },
+    where 'scale' is the largest component of 'emission', rounded up to its upper 16 bits.
+    None of the words is a NaN. Correspond with UnpackMaterial() (GLSL). */
+void gpuart::Material::Pack(GLfloat packed[3]) const
+{
+    float scale = std::max(emission.x, std::max(emission.y, emission.z));
+    scale = (scale > 0 ? std::min(scale, MAX_EMISSION_SCALE) : 0.0f);
+
+    // Rounding up keeps the components of 'color' within [0, 1]
+    uint32_t scaleBits = *reinterpret_cast<const uint32_t*>(&scale);
+    if ((scaleBits & ~EMISSION_SCALE_MASK) != 0)
+        scaleBits = (scaleBits & EMISSION_SCALE_MASK) + (~EMISSION_SCALE_MASK + 1);
+    scale = *reinterpret_cast<const float*>(&scaleBits);
+
+    Vec3f color = (scale > 0 ? emission / scale : Vec3f(0, 0, 0));
+
+    uint32_t scaleSpecRough = scaleBits | Unorm8(specular) | (Unorm8(roughness) << 8);
+
+    packed[0] = PackUnorm8(albedo.x, albedo.y, albedo.z);
+    packed[1] = PackUnorm8(color.x, color.y, color.z);
+    packed[2] = *reinterpret_cast<const GLfloat*>(&scaleSpecRough);
+}
+
+/// Inverse of Pack() (up to the 8-bit quantization)
+gpuart::Material gpuart::Material::Unpack(const GLfloat packed[3])
+{
+    float a[3], e[3];
+    UnpackUnorm8(packed[0], a);
+    UnpackUnorm8(packed[1], e);
+
+    uint32_t bits = *reinterpret_cast<const uint32_t*>(&packed[2]);
+    uint32_t scaleBits = bits & EMISSION_SCALE_MASK;
+    float scale = *reinterpret_cast<const float*>(&scaleBits);
+
+    return Material(Vec3f(a[0], a[1], a[2]), (bits & 0xFFU) / 255.0f,
+                    Vec3f(e[0], e[1], e[2]) * scale, ((bits >> 8) & 0xFFU) / 255.0f);
+}
+
+/// Returns the materials with IDs listed in DefaultMaterial
+const std::vector<gpuart::Material> &gpuart::GetDefaultMaterials()
+{
+    static const std::vector<Material> defaultMaterials =
+    {
+        Material(Vec3f(0.65f, 0.4f, 0.35f)), // SPHERE_MATERIAL
+        Material(Vec3f(0.1f, 0.2f, 0.1f)),   // DISC_MATERIAL
+        Material(Vec3f(0.3f, 0.3f, 0.3f)),   // TRIANGLE_MATERIAL
+        Material(Vec3f(0.3f, 0.3f, 0.3f))    // CONE_MATERIAL
+    };
+
+    return defaultMaterials;
+}
+
+/// Returns the ID of the default material of primitives of 'ptype'
+uint32_t gpuart::GetDefaultMaterialID(Primitive_t ptype)
+{
+    switch (ptype)
+    {
+    case SPHERE: return SPHERE_MATERIAL;
+    case DISC:   return DISC_MATERIAL;
+    case CONE:   return CONE_MATERIAL;
+    default:     return TRIANGLE_MATERIAL; // also mesh triangles; instances have no material of their own
+    }
+}
+
+/// Replaces 'data' with the material table (RGBA quads, one per material) read by shaders
+void gpuart::StoreMaterials(const std::vector<Material> &materials, std::vector<GLfloat> &data)
+{
+    data.assign(RGBA_ELEMS * materials.size(), RGBA_PAD);
+    for (size_t i = 0; i < materials.size(); i++)
+        materials[i].Pack(&data[RGBA_ELEMS * i]);
+}
+
+/** Returns the power in proportion to which a light is selected for sampling: luminance of 'emission'
+    times the emitting area; 0 for cones. Corresponds with GetLightPower() (GLSL). */
+float gpuart::GetLightPower(Primitive_t type, float radius, const Vec3f &emission)
+{
+    const float PI = 3.1415926f;
+    float luminance = 0.2126f*emission.x + 0.7152f*emission.y + 0.0722f*emission.z;
+
+    switch (type)
+    {
+    case SPHERE: return luminance * 4*PI * radius*radius;
+    case DISC:   return luminance * PI * radius*radius;
+    default:     return 0; // cones are not sampled
+    }
+}
+
+/** Sets the cumulative selection probabilities of 'lights' (see LIGHT_DATA_LEN), making the path tracer
+    select lights in proportion to their power; returns the total power (see GetLightPower()). */
+float gpuart::SetLightSelectionProbabilities(Primitive::Data &lights)
+{
+    const size_t numLights = lights.size() / (RGBA_ELEMS * LIGHT_DATA_LEN);
+
+    std::vector<float> powers(numLights);
+    double totalPower = 0;
+    size_t lastSampled = 0; // the last light with non-zero power
+    for (size_t i = 0; i < numLights; i++)
+    {
+        const GLfloat *light = &lights[i * RGBA_ELEMS * LIGHT_DATA_LEN];
+        Primitive_t type = (Primitive_t)*reinterpret_cast<const uint32_t*>(&light[RGBA_ELEMS + 3]);
+
+        powers[i] = GetLightPower(type, light[3], Vec3f(light[2*RGBA_ELEMS], light[2*RGBA_ELEMS + 1], light[2*RGBA_ELEMS + 2]));
+        totalPower += powers[i];
+        if (powers[i] > 0)
+            lastSampled = i;
+    }
+
+    double cumulative = 0;
+    for (size_t i = 0; i < numLights; i++)
+    {
+        cumulative += powers[i];
+
+        // Exactly 1 from the last sampled light on, so that any random value in [0, 1) selects a light
+        lights[(i * LIGHT_DATA_LEN + 2) * RGBA_ELEMS + 3] = (i >= lastSampled || totalPower == 0 ? 1.0f : (float)(cumulative / totalPower));
+    }
+
+    return (float)totalPower;
+}
+
+
+//---------------------------------------------------------
+
 void gpuart::Sphere::CalcBoundingBox()
 {
     Xmin = Center.x - Radius;
@@ -64,6 +234,13 @@ void gpuart::Sphere::StoreDataIntoBVH(Data &data) const
     data.push_back(Radius);
 }
 
+/// See the base class declaration for details
+bool gpuart::Sphere::StoreLight(const Vec3f &emission, Data &lights) const
+{
+    StoreLightRecord(SPHERE, Center, Radius, Vec3f(0, 0, 0), emission, lights);
+    return true;
+}
+
 /// Prints to 'os' the data at 'it' stored previously by StoreDataIntoBVH()
 void gpuart::Sphere::PrintBVH(Data::const_iterator &it, std::ostream &os)
 {
@@ -114,6 +291,13 @@ void gpuart::Disc::StoreDataIntoBVH(Data &data) const
     data.push_back(RGBA_PAD);
 }
 
+/// See the base class declaration for details
+bool gpuart::Disc::StoreLight(const Vec3f &emission, Data &lights) const
+{
+    StoreLightRecord(DISC, Center, Radius, Normal.normalized(), emission, lights);
+    return true;
+}
+
 /// Prints to 'os' the data at 'it' stored previously by StoreDataIntoBVH()
 void gpuart::Disc::PrintBVH(Data::const_iterator &it, std::ostream &os)
 {
@@ -186,6 +370,42 @@ void gpuart::Triangle::PrintBVH(Data::const_iterator &it, std::ostream &os)
 }
 
 
+//---------------------------------------------------------
+
+/// 'i0', 'i1', 'i2' are indices in 'vertices'
+gpuart::MeshTriangle::MeshTriangle(const std::vector<Vec3f> &vertices, uint32_t i0, uint32_t i1, uint32_t i2)
+{
+    Indices[0] = i0; Indices[1] = i1; Indices[2] = i2;
+
+    const Vec3f &v0 = vertices[i0], &v1 = vertices[i1], &v2 = vertices[i2];
+
+    Xmin = std::min(v0.x, std::min(v1.x, v2.x));
+    Xmax = std::max(v0.x, std::max(v1.x, v2.x));
+    Ymin = std::min(v0.y, std::min(v1.y, v2.y));
+    Ymax = std::max(v0.y, std::max(v1.y, v2.y));
+    Zmin = std::min(v0.z, std::min(v1.z, v2.z));
+    Zmax = std::max(v0.z, std::max(v1.z, v2.z));
+}
+
+/// See the base class declaration for details
+void gpuart::MeshTriangle::StoreDataIntoBVH(Data &data) const
+{
+    for (int i = 0; i < 3; i++)
+        data.push_back(*reinterpret_cast<const GLfloat*>(&Indices[i]));
+    data.push_back(RGBA_PAD);
+}
+
+/// Prints to 'os' the data at 'it' stored previously by StoreDataIntoBVH()
+void gpuart::MeshTriangle::PrintBVH(Data::const_iterator &it, std::ostream &os)
+{
+    os << "{ " << *reinterpret_cast<const uint32_t*>(&*it++); // i0
+    os << ", " << *reinterpret_cast<const uint32_t*>(&*it++); // i1
+    os << ", " << *reinterpret_cast<const uint32_t*>(&*it++) << " }"; // i2
+
+    it++; // skip RGBA padding
+}
+
+
 //---------------------------------------------------------
 
 gpuart::Cone::Cone(const Vec3f &center1, const Vec3f &center2, float radius1, float radius2)
@@ -244,6 +464,15 @@ void gpuart::Cone::StoreDataIntoBVH(Data &data) const
     data.push_back(RGBA_PAD);
 }
 
+/// See the base class declaration for details
+bool gpuart::Cone::StoreLight(const Vec3f &emission, Data &lights) const
+{
+    // Direct lighting tests visibility only up to the bounding sphere of the cone, to avoid self-occlusion
+    float boundingRadius = std::sqrt(AxisLen*AxisLen/4 + std::max(Radius1, Radius2)*std::max(Radius1, Radius2));
+    StoreLightRecord(CONE, (Center1 + Center2) * 0.5f, boundingRadius, UnitAxis, emission, lights);
+    return true;
+}
+
 /// Prints to 'os' the data at 'it' stored previously by StoreDataIntoBVH()
 void gpuart::Cone::PrintBVH(Data::const_iterator &it, std::ostream &os)
 {
@@ -279,3 +508,357 @@ void gpuart::Cone::PrintBVH(Data::const_iterator &it, std::ostream &os)
 
     os << " }";
 }
+
+
+//---------------------------------------------------------
+
+/// Returns the identity transformation
+gpuart::Transform3x4 gpuart::Transform3x4::Identity()
+{
+    return Transform3x4{ { { 1, 0, 0, 0 },
+                           { 0, 1, 0, 0 },
+                           { 0, 0, 1, 0 } } };
+}
+
+gpuart::Transform3x4 gpuart::Transform3x4::Translation(const Vec3f &offset)
+{
+    Transform3x4 t = Identity();
+    t.m[0][3] = offset.x;
+    t.m[1][3] = offset.y;
+    t.m[2][3] = offset.z;
+    return t;
+}
+
+/// Returns the rotation by 'angle' (radians) about the Z axis
+gpuart::Transform3x4 gpuart::Transform3x4::RotationZ(float angle)
+{
+    const float c = std::cos(angle), s = std::sin(angle);
+    return Transform3x4{ { { c, -s, 0, 0 },
+                           { s,  c, 0, 0 },
+                           { 0,  0, 1, 0 } } };
+}
+
+gpuart::Transform3x4 gpuart::Transform3x4::Scaling(float factor)
+{
+    return Transform3x4{ { { factor, 0, 0, 0 },
+                           { 0, factor, 0, 0 },
+                           { 0, 0, factor, 0 } } };
+}
+
+/// Returns the transformation which applies 'b' first, then 'a'
+gpuart::Transform3x4 gpuart::operator *(const Transform3x4 &a, const Transform3x4 &b)
+{
+    Transform3x4 result;
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 4; j++)
+        {
+            result.m[i][j] = a.m[i][0]*b.m[0][j] + a.m[i][1]*b.m[1][j] + a.m[i][2]*b.m[2][j];
+            if (j == 3)
+                result.m[i][j] += a.m[i][3];
+        }
+
+    return result;
+}
+
+/// Returns the inverse transformation; the matrix must not be singular
+gpuart::Transform3x4 gpuart::Transform3x4::Inverse() const
+{
+    // Inverse of the linear part from its cofactors
+    double cof[3][3];
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+        {
+            int i1 = (i + 1) % 3, i2 = (i + 2) % 3,
+                j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+            cof[i][j] = (double)m[i1][j1]*m[i2][j2] - (double)m[i1][j2]*m[i2][j1];
+        }
+
+    double det = m[0][0]*cof[0][0] + m[0][1]*cof[0][1] + m[0][2]*cof[0][2];
+
+    Transform3x4 inv;
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            inv.m[i][j] = (float)(cof[j][i] / det);
+
+    // Inverse translation: -inv(A) * t
+    for (int i = 0; i < 3; i++)
+        inv.m[i][3] = -(inv.m[i][0]*m[0][3] + inv.m[i][1]*m[1][3] + inv.m[i][2]*m[2][3]);
+
+    return inv;
+}
+
+
+//---------------------------------------------------------
+
+/** 'objectBounds' (xmin, xmax, ymin, ymax, zmin, zmax) enclose the bottom-level tree's primitives;
+    the instance's bounding box encloses them after transforming with 'objectToWorld'. */
+gpuart::Instance::Instance(const Transform3x4 &objectToWorld, const float objectBounds[6], uint32_t bottomLevelRoot)
+:  WorldToObject(objectToWorld.Inverse()), BottomLevelRoot(bottomLevelRoot)
+{
+    Xmin = Ymin = Zmin = FLT_MAX;
+    Xmax = Ymax = Zmax = -FLT_MAX;
+
+    // Enclose all corners of the transformed box
+    for (int corner = 0; corner < 8; corner++)
+    {
+        Vec3f p = objectToWorld.TransformPoint(Vec3f(objectBounds[0 + (corner & 1)],
+                                                     objectBounds[2 + ((corner >> 1) & 1)],
+                                                     objectBounds[4 + ((corner >> 2) & 1)]));
+        Xmin = std::min(Xmin, p.x); Xmax = std::max(Xmax, p.x);
+        Ymin = std::min(Ymin, p.y); Ymax = std::max(Ymax, p.y);
+        Zmin = std::min(Zmin, p.z); Zmax = std::max(Zmax, p.z);
+    }
+}
+
+/// See the base class declaration for details
+void gpuart::Instance::StoreDataIntoBVH(Data &data) const
+{
+    for (int row = 0; row < 3; row++)
+        for (int col = 0; col < 4; col++)
+            data.push_back(WorldToObject.m[row][col]);
+
+    data.push_back(*reinterpret_cast<const GLfloat*>(&BottomLevelRoot));
+    data.push_back(RGBA_PAD);
+    data.push_back(RGBA_PAD);
+    data.push_back(RGBA_PAD);
+}
+
+/// Prints to 'os' the data at 'it' stored previously by StoreDataIntoBVH()
+void gpuart::Instance::PrintBVH(Data::const_iterator &it, std::ostream &os)
+{
+    os << "{ world-to-object: ";
+    for (int row = 0; row < 3; row++)
+    {
+        os << "[" << *it++;
+        for (int col = 1; col < 4; col++)
+            os << ", " << *it++;
+        os << "] ";
+    }
+
+    os << "bottom-level root: " << *reinterpret_cast<const uint32_t*>(&*it++) << " }";
+    it+=3; // skip RGBA padding
+}
+
+
+//---------------------------------------------------------
+
+/** Calculates the screen's bottom-left corner and vectors spanning its width and height,
+    for a viewport of the specified aspect ratio (width/height). */
+void gpuart::Camera::GetScreen(float aspect, Vec3f &bottomLeft, Vec3f &deltaHorz, Vec3f &deltaVert) const
+{
+    const float PI = 3.1415926f;
+
+    // 'Up' projected onto the plane orthogonal to 'Dir'
+    Vec3f up = ((Dir ^ Up) ^ Dir).normalized();
+    Vec3f target = Pos + Dir.normalized() * ScreenDist;
+    // Screen center to right edge
+    Vec3f a = (Dir.normalized() ^ up) * ScreenDist * aspect * std::tan(FovY/2 * PI/180);
+    // Screen center to top edge
+    Vec3f b = up * a.length() / aspect;
+
+    bottomLeft = target - a - b;
+    deltaHorz = 2*a;
+    deltaVert = 2*b;
+}
+
+
+//---------------------------------------------------------
+
+gpuart::DynamicObject gpuart::DynamicObject::MakeSphere(const Vec3f &center, float radius)
+{
+    DynamicObject obj;
+    obj.type = SPHERE;
+    obj.pos = center;
+    obj.axis = Vec3f(0, 0, 1);
+    obj.radius = obj.radius2 = radius;
+    obj.material = GetDefaultMaterials()[SPHERE_MATERIAL];
+    return obj;
+}
+
+gpuart::DynamicObject gpuart::DynamicObject::MakeDisc(const Vec3f &center, const Vec3f &normal, float radius)
+{
+    DynamicObject obj = MakeSphere(center, radius);
+    obj.type = DISC;
+    obj.axis = normal.normalized();
+    obj.material = GetDefaultMaterials()[DISC_MATERIAL];
+    return obj;
+}
+
+gpuart::DynamicObject gpuart::DynamicObject::MakeCone(const Vec3f &center1, const Vec3f &center2, float radius1, float radius2)
+{
+    DynamicObject obj = MakeSphere(center1, radius1);
+    obj.type = CONE;
+    obj.axis = center2 - center1;
+    obj.radius2 = radius2;
+    obj.material = GetDefaultMaterials()[CONE_MATERIAL];
+    return obj;
+}
+
+static
+bool IsDynamicObjectEnabled(const gpuart::DynamicObject &obj)
+{
+    return (obj.radius > 0 || (obj.type == gpuart::CONE && obj.radius2 > 0));
+}
+
+/// Calls 'f' with the primitive (sphere, disc or cone) corresponding to 'obj'
+template<typename F>
+static
+void WithDynamicObjectPrimitive(const gpuart::DynamicObject &obj, F f)
+{
+    if (obj.type == gpuart::DISC)
+        f(gpuart::Disc(obj.pos, obj.axis, obj.radius));
+    else if (obj.type == gpuart::CONE)
+        f(gpuart::Cone(obj.pos, obj.pos + obj.axis, obj.radius, obj.radius2));
+    else
+        f(gpuart::Sphere(obj.pos, obj.radius));
+}
+
+/// Returns the point used as the object's position for grouping
+static
+gpuart::Vec3f GetDynamicObjectCenter(const gpuart::DynamicObject &obj)
+{
+    if (obj.type == gpuart::CONE)
+        return obj.pos + obj.axis * 0.5f;
+    else
+        return obj.pos;
+}
+
+/** Stores 'obj' as in a BVH leaf, with its packed material in place of the material ID and padding of the type header;
+    'bounds' (xmin, xmax, ymin, ymax, zmin, zmax) are extended to enclose it. */
+static
+void StoreDynamicObject(const gpuart::DynamicObject &obj, gpuart::Primitive::Data &data, float bounds[6])
+{
+    const size_t header = data.size();
+
+    WithDynamicObjectPrimitive(obj, [&](const gpuart::Primitive &primitive)
+    {
+        primitive.StoreIntoBVH(data);
+
+        bounds[0] = std::min(bounds[0], primitive.GetXmin()); bounds[1] = std::max(bounds[1], primitive.GetXmax());
+        bounds[2] = std::min(bounds[2], primitive.GetYmin()); bounds[3] = std::max(bounds[3], primitive.GetYmax());
+        bounds[4] = std::min(bounds[4], primitive.GetZmin()); bounds[5] = std::max(bounds[5], primitive.GetZmax());
+    });
+
+    obj.material.Pack(&data[header + 1]);
+}
+
+/// Splits objects with indices in ['begin', 'end') into groups and stores them; returns the number of groups
+static
+unsigned StoreDynamicObjectGroups(const std::vector<gpuart::DynamicObject> &objects,
+                                  std::vector<size_t>::iterator begin, std::vector<size_t>::iterator end,
+                                  gpuart::Primitive::Data &data)
+{
+    if (end - begin > (ptrdiff_t)gpuart::DYNAMIC_OBJECTS_PER_GROUP)
+    {
+        // Split at the median along the axis of the largest extent of the objects' centers
+        gpuart::Vec3f cmin = GetDynamicObjectCenter(objects[*begin]), cmax = cmin;
+        for (auto it = begin; it != end; it++)
+        {
+            gpuart::Vec3f c = GetDynamicObjectCenter(objects[*it]);
+            cmin = gpuart::Vec3f(std::min(cmin.x, c.x), std::min(cmin.y, c.y), std::min(cmin.z, c.z));
+            cmax = gpuart::Vec3f(std::max(cmax.x, c.x), std::max(cmax.y, c.y), std::max(cmax.z, c.z));
+        }
+
+        gpuart::Vec3f extent = cmax - cmin;
+        int axis = (extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2));
+
+        auto mid = begin + (end - begin)/2;
+        std::nth_element(begin, mid, end,
+                         [&](size_t a, size_t b)
+                         {
+                             gpuart::Vec3f ca = GetDynamicObjectCenter(objects[a]),
+                                           cb = GetDynamicObjectCenter(objects[b]);
+                             return (axis == 0 ? ca.x < cb.x : (axis == 1 ? ca.y < cb.y : ca.z < cb.z));
+                         });
+
+        return StoreDynamicObjectGroups(objects, begin, mid, data)
+               + StoreDynamicObjectGroups(objects, mid, end, data);
+    }
+
+    const size_t groupStart = data.size();
+    data.insert(data.end(), 2*RGBA_ELEMS, RGBA_PAD); // bounding box and next group's address, filled in below
+
+    float bounds[6] = { FLT_MAX, -FLT_MAX, FLT_MAX, -FLT_MAX, FLT_MAX, -FLT_MAX };
+    for (auto it = begin; it != end; it++)
+        StoreDynamicObject(objects[*it], data, bounds);
+
+    uint32_t next = (uint32_t)(data.size() / RGBA_ELEMS);
+
+    data[groupStart + 0] = bounds[0];
+    data[groupStart + 1] = bounds[2];
+    data[groupStart + 2] = bounds[4];
+    data[groupStart + 3] = *reinterpret_cast<const GLfloat*>(&next);
+
+    data[groupStart + RGBA_ELEMS + 0] = bounds[1];
+    data[groupStart + RGBA_ELEMS + 1] = bounds[3];
+    data[groupStart + RGBA_ELEMS + 2] = bounds[5];
+
+    return 1;
+}
+
+/** Stores 'objects' (except disabled ones) into 'data' (RGBA quads) for intersection tests in shaders.
+    Objects are split into groups of up to DYNAMIC_OBJECTS_PER_GROUP objects close to each other;
+    a group starts with its bounding box and the address of the next group: { xmin, ymin, zmin, next },
+    { xmax, ymax, zmax, PAD }. Each object in a group is stored as its type and packed material
+    { type, packed[0], packed[1], packed[2] } (see Material::Pack()), followed by data as in a BVH leaf
+    (see Primitive::StoreIntoBVH()). Returns the number of groups. */
+unsigned gpuart::StoreDynamicObjects(const std::vector<DynamicObject> &objects, Primitive::Data &data)
+{
+    std::vector<size_t> enabled;
+    for (size_t i = 0; i < objects.size(); i++)
+        if (IsDynamicObjectEnabled(objects[i]))
+            enabled.push_back(i);
+
+    data.clear();
+    if (enabled.empty())
+        return 0;
+    else
+        return StoreDynamicObjectGroups(objects, enabled.begin(), enabled.end(), data);
+}
+
+/// Returns the emission of 'material' as read by shaders (see Material::Pack())
+static
+gpuart::Vec3f GetPackedEmission(const gpuart::Material &material)
+{
+    GLfloat packed[3];
+    material.Pack(packed);
+    return gpuart::Material::Unpack(packed).emission;
+}
+
+/** Appends the light records (see LIGHT_DATA_LEN) of the emissive spheres, discs and cones of 'primitives'
+    to 'lights', with their emission as read by shaders (see Material::Pack()). If not null, 'indices'
+    receive the primitives' indices (see PrimitiveSet). */
+void gpuart::StoreLights(const PrimitiveSet &primitives, Primitive::Data &lights, std::vector<size_t> *indices)
+{
+    auto store = [&](const Primitive &primitive, size_t index)
+    {
+        const uint32_t material = primitive.GetMaterial();
+        if (material < primitives.Materials.size() && primitives.Materials[material].IsEmissive()
+            && primitive.StoreLight(GetPackedEmission(primitives.Materials[material]), lights)
+            && indices)
+        {
+            indices->push_back(index);
+        }
+    };
+
+    size_t index = 0;
+    for (const Sphere &sphere: primitives.Spheres)
+        store(sphere, index++);
+    for (const Disc &disc: primitives.Discs)
+        store(disc, index++);
+
+    index += primitives.Triangles.size();
+    for (const Cone &cone: primitives.Cones)
+        store(cone, index++);
+}
+
+/// Appends the light records of the enabled emissive 'objects' to 'lights'
+void gpuart::StoreLights(const std::vector<DynamicObject> &objects, Primitive::Data &lights)
+{
+    for (const DynamicObject &obj: objects)
+        if (IsDynamicObjectEnabled(obj) && obj.material.IsEmissive())
+            WithDynamicObjectPrimitive(obj, [&](const Primitive &primitive)
+            {
+                primitive.StoreLight(GetPackedEmission(obj.material), lights);
+            });
+}
@@ -42,19 +42,120 @@ namespace gpuart
         SPHERE   = 0,
         DISC     = 1,
         TRIANGLE = 2,
-        CONE     = 3
+        CONE     = 3,
+        MESH_TRIANGLE = 4,
+        INSTANCE = 5 ///< Stored only in a top-level tree (see TwoLevelBVH); never reported as intersected
     };
 
+    /// Affine transformation stored as a row-major 3x4 matrix: p' = M * (p, 1)
+    struct Transform3x4
+    {
+        float m[3][4];
+
+        /// Returns the identity transformation
+        static Transform3x4 Identity();
+
+        static Transform3x4 Translation(const Vec3f &offset);
+
+        /// Returns the rotation by 'angle' (radians) about the Z axis
+        static Transform3x4 RotationZ(float angle);
+
+        static Transform3x4 Scaling(float factor);
+
+        /// Returns the inverse transformation; the matrix must not be singular
+        Transform3x4 Inverse() const;
+
+        Vec3f TransformPoint(const Vec3f &p) const
+        {
+            return Vec3f(m[0][0]*p.x + m[0][1]*p.y + m[0][2]*p.z + m[0][3],
+                         m[1][0]*p.x + m[1][1]*p.y + m[1][2]*p.z + m[1][3],
+                         m[2][0]*p.x + m[2][1]*p.y + m[2][2]*p.z + m[2][3]);
+        }
+
+        /// Transforms a direction (ignores the translation)
+        Vec3f TransformDir(const Vec3f &v) const
+        {
+            return Vec3f(m[0][0]*v.x + m[0][1]*v.y + m[0][2]*v.z,
+                         m[1][0]*v.x + m[1][1]*v.y + m[1][2]*v.z,
+                         m[2][0]*v.x + m[2][1]*v.y + m[2][2]*v.z);
+        }
+    };
+
+    /// Returns the transformation which applies 'b' first, then 'a'
+    Transform3x4 operator *(const Transform3x4 &a, const Transform3x4 &b);
+
+    /** Surface properties, referred to by primitives with material IDs (indices in PrimitiveSet::Materials).
+        Packed into a single RGBA quad (see Pack()), so that shading a hit takes one texture fetch. */
+    struct Material
+    {
+        Vec3f albedo;    ///< Diffuse reflectance; components in [0, 1]
+        float specular;  ///< Probability of specular (instead of diffuse) reflection, in [0, 1]
+        Vec3f emission;  ///< Emitted radiance; a surface with non-zero emission does not reflect light
+        float roughness; ///< Spread of specular reflections, in [0, 1]: 0 is a perfect mirror, 1 the whole hemisphere
+
+        Material(const Vec3f &albedo = Vec3f(0.5f, 0.5f, 0.5f), float specular = 0,
+                 const Vec3f &emission = Vec3f(0, 0, 0), float roughness = 0)
+        : albedo(albedo), specular(specular), emission(emission), roughness(roughness)
+        { }
+
+        bool IsEmissive() const { return emission.x > 0 || emission.y > 0 || emission.z > 0; }
+
+        /** Packs the material into 3 floats (the first 3 components of a quad in the material table):
+            { unorm8(albedo.rgb), unorm8(emission.rgb / scale), scale_hi16 | unorm8(specular, roughness) },
+            where 'scale' is the largest component of 'emission', rounded up to its upper 16 bits.
+            None of the words is a NaN. Correspond with UnpackMaterial() (GLSL). */
+        void Pack(GLfloat packed[3]) const;
+
+        /// Inverse of Pack() (up to the 8-bit quantization)
+        static Material Unpack(const GLfloat packed[3]);
+    };
+
+    /** IDs of the materials which every material table starts with (see GetDefaultMaterials());
+        one per primitive type (mesh triangles share the triangles' one) */
+    enum DefaultMaterial: uint32_t
+    {
+        SPHERE_MATERIAL   = 0,
+        DISC_MATERIAL     = 1,
+        TRIANGLE_MATERIAL = 2,
+        CONE_MATERIAL     = 3,
+
+        NUM_DEFAULT_MATERIALS
+    };
+
+    /// Returns the materials with IDs listed in DefaultMaterial
+    const std::vector<Material> &GetDefaultMaterials();
+
+    /// Returns the ID of the default material of primitives of 'ptype'
+    uint32_t GetDefaultMaterialID(Primitive_t ptype);
+
+    /// Replaces 'data' with the material table (RGBA quads, one per material) read by shaders
+    void StoreMaterials(const std::vector<Material> &materials, std::vector<GLfloat> &data);
+
+    /** Number of RGBA quads of a light record in the light list (see StoreLights()):
+            { center, radius }, { normal, type }, { emission, cumulative selection probability }
+        Spheres and discs are sampled by the path tracer; cones only act as point lights in direct lighting
+        (their 'center' is the middle of the axis, 'radius' the radius of the bounding sphere). */
+    const unsigned LIGHT_DATA_LEN = 3;
+
+    /** Returns the power in proportion to which a light is selected for sampling: luminance of 'emission'
+        times the emitting area; 0 for cones. Corresponds with GetLightPower() (GLSL). */
+    float GetLightPower(Primitive_t type, float radius, const Vec3f &emission);
+
     class Primitive
     {
     public:
 
         typedef std::vector<GLfloat> Data;
 
+        /// Value of 'MaterialID' selecting the default material of the primitive's type
+        static const uint32_t DEFAULT_MATERIAL = 0xFFFFFFFFU;
+
     protected:
         // Bounding box (in world space); derived classes have to calculate it on construction
         float Xmin, Xmax, Ymin, Ymax, Zmin, Zmax;
 
+        uint32_t MaterialID = DEFAULT_MATERIAL; ///< Index in the scene's material table (see PrimitiveSet::Materials)
+
     private:
 
         virtual Primitive_t GetType() const = 0;
@@ -67,18 +168,31 @@ namespace gpuart
 
         virtual ~Primitive() { }
 
-        /** Adds primitive's type and contents at the end of 'data'
-            in format suitable for later BVH traversal in a shader. */
+        /** Adds primitive's type and material ID { type, material, PAD, PAD }, followed by its contents,
+            at the end of 'data' in format suitable for later BVH traversal in a shader. */
         void StoreIntoBVH(Data &data) const
         {
             uint32_t ptype = (uint32_t)GetType();
+            uint32_t material = GetMaterial();
             data.push_back(*reinterpret_cast<GLfloat*>(&ptype));
-            data.push_back(RGBA_PAD);
+            data.push_back(*reinterpret_cast<GLfloat*>(&material));
             data.push_back(RGBA_PAD);
             data.push_back(RGBA_PAD);
             StoreDataIntoBVH(data);
         }
 
+        /// Returns the material ID (the default one of the primitive's type unless set with SetMaterial())
+        uint32_t GetMaterial() const
+        {
+            return (MaterialID == DEFAULT_MATERIAL ? GetDefaultMaterialID(GetType()) : MaterialID);
+        }
+
+        void SetMaterial(uint32_t materialID) { MaterialID = materialID; }
+
+        /** Adds the light record (see LIGHT_DATA_LEN) of the primitive emitting 'emission' at the end of 'lights';
+            returns 'false' (adding nothing) if the primitive cannot be a light (triangles, instances). */
+        virtual bool StoreLight(const Vec3f &, Data &) const { return false; }
+
         float GetXmin() const { return Xmin; }
         float GetXmax() const { return Xmax; }
         float GetYmin() const { return Ymin; }
@@ -105,6 +219,9 @@ namespace gpuart
 
         Sphere(const Vec3f &center, float radius);
 
+        /// See the base class declaration for details
+        bool StoreLight(const Vec3f &emission, Data &lights) const override;
+
         /// Prints to 'os' the data at 'it' stored previously by StoreDataIntoBVH()
         static void PrintBVH(Data::const_iterator &it, std::ostream &os);
     };
@@ -126,6 +243,9 @@ namespace gpuart
 
         Disc(const Vec3f &center, const Vec3f &normal, float radius);
 
+        /// See the base class declaration for details
+        bool StoreLight(const Vec3f &emission, Data &lights) const override;
+
         /// Prints to 'os' the data at 'it' stored previously by StoreDataIntoBVH()
         static void PrintBVH(Data::const_iterator &it, std::ostream &os);
     };
@@ -179,6 +299,24 @@ namespace gpuart
         static void PrintBVH(Data::const_iterator &it, std::ostream &os);
     };
 
+    /// Triangle of an indexed mesh; its vertices are stored separately (see PrimitiveSet::MeshVertices)
+    class MeshTriangle: public Primitive
+    {
+        uint32_t Indices[3];
+
+        /// See the base class declaration for details
+        void StoreDataIntoBVH(Data &data) const override;
+
+        Primitive_t GetType() const override { return Primitive_t::MESH_TRIANGLE; }
+
+    public:
+        /// 'i0', 'i1', 'i2' are indices in 'vertices'
+        MeshTriangle(const std::vector<Vec3f> &vertices, uint32_t i0, uint32_t i1, uint32_t i2);
+
+        /// Prints to 'os' the data at 'it' stored previously by StoreDataIntoBVH()
+        static void PrintBVH(Data::const_iterator &it, std::ostream &os);
+    };
+
     class Cone: public Primitive
     {
         Vec3f Center1, Center2;
@@ -199,9 +337,198 @@ namespace gpuart
     public:
         Cone(const Vec3f &center1, const Vec3f &center2, float radius1, float radius2);
 
+        /// See the base class declaration for details
+        bool StoreLight(const Vec3f &emission, Data &lights) const override;
+
         /// Prints to 'os' the data at 'it' stored previously by StoreDataIntoBVH()
         static void PrintBVH(Data::const_iterator &it, std::ostream &os);
     };
+
+    /** Instance of a bottom-level tree (see TwoLevelBVH) placed in the scene with an affine transformation;
+        stored in the leaves of the top-level tree, whose traversal continues in the bottom-level tree
+        with rays transformed into the instance's (object) space. */
+    class Instance: public Primitive
+    {
+        Transform3x4 WorldToObject;
+        uint32_t BottomLevelRoot; ///< Address (in RGBA quads) of the bottom-level tree's root
+
+        /// See the base class declaration for details
+        void StoreDataIntoBVH(Data &data) const override;
+
+        Primitive_t GetType() const override { return Primitive_t::INSTANCE; }
+
+    public:
+        /// Number of RGBA quads occupied by the data stored by StoreDataIntoBVH()
+        static const unsigned DATA_LEN = 4;
+
+        /** 'objectBounds' (xmin, xmax, ymin, ymax, zmin, zmax) enclose the bottom-level tree's primitives;
+            the instance's bounding box encloses them after transforming with 'objectToWorld'. */
+        Instance(const Transform3x4 &objectToWorld, const float objectBounds[6], uint32_t bottomLevelRoot);
+
+        /// Prints to 'os' the data at 'it' stored previously by StoreDataIntoBVH()
+        static void PrintBVH(Data::const_iterator &it, std::ostream &os);
+    };
+
+    /** Scene primitives stored contiguously, in a separate array per type.
+        Primitives are identified by a single index: spheres come first,
+        followed by discs, triangles, cones, mesh triangles and instances. */
+    class PrimitiveSet
+    {
+    public:
+
+        std::vector<Sphere>   Spheres;
+        std::vector<Disc>     Discs;
+        std::vector<Triangle> Triangles;
+        std::vector<Cone>     Cones;
+        std::vector<MeshTriangle> MeshTriangles;
+        std::vector<Instance> Instances;
+
+        /// Vertices of all 'MeshTriangles'
+        std::vector<Vec3f> MeshVertices;
+
+        /// Indexed by primitives' material IDs; starts with the default materials (see DefaultMaterial)
+        std::vector<Material> Materials = GetDefaultMaterials();
+
+        /// Returns the new material's ID
+        uint32_t AddMaterial(const Material &material)
+        {
+            Materials.push_back(material);
+            return (uint32_t)(Materials.size() - 1);
+        }
+
+        void Add(const Sphere &sphere)     { Spheres.push_back(sphere); }
+        void Add(const Disc &disc)         { Discs.push_back(disc); }
+        void Add(const Triangle &triangle) { Triangles.push_back(triangle); }
+        void Add(const Cone &cone)         { Cones.push_back(cone); }
+        void Add(const MeshTriangle &meshTriangle) { MeshTriangles.push_back(meshTriangle); }
+        void Add(const Instance &instance) { Instances.push_back(instance); }
+
+        size_t GetCount() const
+        {
+            return Spheres.size() + Discs.size() + Triangles.size() + Cones.size() + MeshTriangles.size()
+                   + Instances.size();
+        }
+
+        bool IsEmpty() const { return GetCount() == 0; }
+
+        void Clear()
+        {
+            Spheres.clear();
+            Discs.clear();
+            Triangles.clear();
+            Cones.clear();
+            MeshTriangles.clear();
+            Instances.clear();
+            MeshVertices.clear();
+            Materials = GetDefaultMaterials();
+        }
+
+        /// Returns the primitive with index 'idx' (see the class description)
+        const Primitive &operator[](size_t idx) const
+        {
+            if (idx < Spheres.size())
+                return Spheres[idx];
+            idx -= Spheres.size();
+
+            if (idx < Discs.size())
+                return Discs[idx];
+            idx -= Discs.size();
+
+            if (idx < Triangles.size())
+                return Triangles[idx];
+            idx -= Triangles.size();
+
+            if (idx < Cones.size())
+                return Cones[idx];
+            idx -= Cones.size();
+
+            if (idx < MeshTriangles.size())
+                return MeshTriangles[idx];
+            idx -= MeshTriangles.size();
+
+            return Instances[idx];
+        }
+    };
+
+    class Camera
+    {
+    public:
+        Vec3f Pos; ///< Camera position
+        Vec3f Dir; ///< Viewing direction
+        Vec3f Up;  ///< Camera's "up" direction
+        float FovY; ///< Vertical field of view in degrees
+
+        /// Pos-screen distance; camera rays originate at the screen
+        float ScreenDist;
+
+        /** Calculates the screen's bottom-left corner and vectors spanning its width and height,
+            for a viewport of the specified aspect ratio (width/height). */
+        void GetScreen(float aspect, Vec3f &bottomLeft, Vec3f &deltaHorz, Vec3f &deltaVert) const;
+    };
+
+    /// Placement of a mesh in a two-level scene (see TwoLevelBVH)
+    struct MeshInstance
+    {
+        uint32_t mesh; ///< Index of the instanced mesh
+        Transform3x4 objectToWorld;
+    };
+
+    /** User-controlled sphere, disc or cone, which can be moved in every frame without rebuilding
+        the scene's BVH; stored separately with StoreDynamicObjects(). */
+    struct DynamicObject
+    {
+        /// Roughness set by SetFuzzy()
+        static constexpr float FUZZY_ROUGHNESS = 1.0f/9; // spread of 10 degrees
+
+        Primitive_t type; ///< SPHERE, DISC or CONE
+        Vec3f pos;        ///< Center (of a cone: center of the first base)
+        Vec3f axis;       ///< Disc: unit normal; cone: vector from the first base's center to the second's
+        float radius;     ///< Radius (of a cone: of the first base); 0 disables the object
+        float radius2;    ///< Radius of a cone's second base
+        Material material; ///< Initially the default material of 'type'
+
+        static DynamicObject MakeSphere(const Vec3f &center, float radius);
+        static DynamicObject MakeDisc(const Vec3f &center, const Vec3f &normal, float radius);
+        static DynamicObject MakeCone(const Vec3f &center1, const Vec3f &center2, float radius1, float radius2);
+
+        /// Makes the object emit white light of radiance 'em' (if positive)
+        void SetEmittance(float em) { material.emission = Vec3f(em, em, em); }
+
+        float GetEmittance() const { return material.emission.x; }
+
+        void SetSpecular(bool specular) { material.specular = (specular ? 1.0f : 0.0f); }
+
+        void SetFuzzy(bool fuzzy)
+        {
+            if (fuzzy)
+                material.roughness = FUZZY_ROUGHNESS;
+            else
+                material.roughness = 0;
+        }
+    };
+
+    /// Max. number of dynamic objects sharing a bounding box (see StoreDynamicObjects())
+    const unsigned DYNAMIC_OBJECTS_PER_GROUP = 4;
+
+    /** Stores 'objects' (except disabled ones) into 'data' (RGBA quads) for intersection tests in shaders.
+        Objects are split into groups of up to DYNAMIC_OBJECTS_PER_GROUP objects close to each other;
+        a group starts with its bounding box and the address of the next group: { xmin, ymin, zmin, next },
+        { xmax, ymax, zmax, PAD }. Each object in a group is stored as its type and packed material
+        { type, packed[0], packed[1], packed[2] } (see Material::Pack()), followed by data as in a BVH leaf
+        (see Primitive::StoreIntoBVH()). Returns the number of groups. */
+    unsigned StoreDynamicObjects(const std::vector<DynamicObject> &objects, Primitive::Data &data);
+
+    /** Appends the light records (see LIGHT_DATA_LEN) of the emissive spheres, discs and cones of 'primitives'
+        to 'lights', with their emission as read by shaders (see Material::Pack()). If not null, 'indices'
+        receive the primitives' indices (see PrimitiveSet). */
+    void StoreLights(const PrimitiveSet &primitives, Primitive::Data &lights, std::vector<size_t> *indices = nullptr);
+
+    /// Appends the light records of the enabled emissive 'objects' to 'lights'
+    void StoreLights(const std::vector<DynamicObject> &objects, Primitive::Data &lights);
+
+    /** Sets the cumulative selection probabilities of 'lights' (see LIGHT_DATA_LEN), making the path tracer
+        select lights in proportion to their power; returns the total power (see GetLightPower()). */
+    float SetLightSelectionProbabilities(Primitive::Data &lights);
 }
 
 
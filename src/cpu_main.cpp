@@ -0,0 +1,242 @@
+/*
+GPU-Assisted Ray Tracer
+Copyright (C) 2016 Filip Szczerek <ga.software@yahoo.com>
+
+This file is part of gpuart.
+
+Gpuart is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Gpuart is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with gpuart.  If not, see <http://www.gnu.org/licenses/>.
+
+File description:
+    Headless rendering with the CPU reference renderer
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include "core.h"
+#include "cpu_renderer.h"
+#include "math_types.h"
+#include "scenes.h"
+#include "utils.h"
+
+
+using gpuart::Vec3f;
+using gpuart::Utils::TimeElapsed;
+
+
+static void PrintUsage()
+{
+    std::cout <<
+        "Usage: gpuart-cpu <scene> <direct|path> <output.pfm|output.ppm> [options]\n\n"
+        "Scenes: box, boxlight, dragon11k, dragon48k, dragon871k, cluster100k, tree21k\n\n"
+        "Options:\n"
+        "  --size WxH               image size (default: 640x480)\n"
+        "  --paths N                paths per pixel of path tracing (default: 16)\n"
+        "  --threads N              number of rendering threads (default: all hardware threads)\n"
+        "  --sah                    build the BVH with the surface area heuristic\n"
+        "  --bvh-width N            max. children of a compiled BVH node (2-8, default: 4)\n"
+        "  --sphere RADIUS EM       user sphere's radius and emittance (default: 0 0)\n"
+        "  --compare REF.pfm        compare the result with a reference image (e.g. rendered on the GPU);\n"
+        "                           exit code is 1 if they differ\n"
+        "  --tolerance T            max. per-channel difference of matching pixels (default: 0.01)\n"
+        "  --max-outliers F         max. fraction of pixels exceeding the tolerance (default: 0.02)\n";
+}
+
+static bool EndsWith(const std::string &s, const char *suffix)
+{
+    size_t len = std::strlen(suffix);
+    return s.size() >= len && s.compare(s.size() - len, len, suffix) == 0;
+}
+
+/// Returns 'true' if 'image' matches 'reference' within the specified limits; prints the statistics
+static bool CompareImages(unsigned width, unsigned height, const std::vector<Vec3f> &image,
+                          const char *refFileName, float tolerance, float maxOutliers)
+{
+    unsigned refWidth, refHeight;
+    std::vector<Vec3f> reference;
+    if (!gpuart::Utils::LoadImagePFM(refFileName, refWidth, refHeight, reference))
+        return false;
+
+    if (refWidth != width || refHeight != height)
+    {
+        std::cerr << "Reference image size " << refWidth << "x" << refHeight << " differs from "
+                  << width << "x" << height << "." << std::endl;
+        return false;
+    }
+
+    double sumDiff = 0;
+    float maxDiff = 0;
+    size_t numOutliers = 0;
+
+    for (size_t i = 0; i < image.size(); i++)
+    {
+        float diff = 0;
+        for (float Vec3f::*channel: { &Vec3f::x, &Vec3f::y, &Vec3f::z })
+        {
+            float a = image[i].*channel, b = reference[i].*channel;
+
+            // NaNs (e.g. the sky color straight up) match only other NaNs
+            if (std::isnan(a) || std::isnan(b))
+                diff = std::max(diff, std::isnan(a) == std::isnan(b) ? 0 : tolerance + 1);
+            else
+                diff = std::max(diff, std::abs(a - b));
+        }
+
+        sumDiff += diff;
+        maxDiff = std::max(maxDiff, diff);
+        if (diff > tolerance)
+            numOutliers++;
+    }
+
+    float outliersFraction = (float)numOutliers / image.size();
+
+    std::cout << std::defaultfloat << std::setprecision(4)
+              << "Difference from reference: mean " << sumDiff / image.size() << ", max " << maxDiff
+              << ", pixels above tolerance: " << numOutliers << " (" << 100 * outliersFraction << "%)." << std::endl;
+
+    return outliersFraction <= maxOutliers;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    const char *sceneName = argv[1];
+    const std::string mode = argv[2];
+    const std::string outFileName = argv[3];
+
+    unsigned width = 640, height = 480;
+    unsigned pathsPerPixel = 16;
+    unsigned numThreads = 0;
+    unsigned bvhWidth = 4;
+    auto strategy = gpuart::BVHBuildStrategy::Midpoint;
+    float sphereRadius = 0, sphereEmittance = 0;
+    const char *refFileName = nullptr;
+    float tolerance = 0.01f, maxOutliers = 0.02f;
+
+    for (int i = 4; i < argc; i++)
+    {
+        const std::string opt = argv[i];
+        const int numArgsLeft = argc - 1 - i;
+
+        if (opt == "--size" && numArgsLeft >= 1)
+        {
+            if (2 != std::sscanf(argv[++i], "%ux%u", &width, &height) || width == 0 || height == 0)
+            {
+                std::cerr << "Invalid image size: " << argv[i] << std::endl;
+                return 1;
+            }
+        }
+        else if (opt == "--paths" && numArgsLeft >= 1)
+            pathsPerPixel = std::max(1, std::atoi(argv[++i]));
+        else if (opt == "--threads" && numArgsLeft >= 1)
+            numThreads = std::max(0, std::atoi(argv[++i]));
+        else if (opt == "--sah")
+            strategy = gpuart::BVHBuildStrategy::SAH;
+        else if (opt == "--bvh-width" && numArgsLeft >= 1)
+        {
+            if (!gpuart::Utils::ParseBVHWidth(argv[++i], bvhWidth))
+            {
+                std::cerr << "Invalid BVH width: " << argv[i] << std::endl;
+                return 1;
+            }
+        }
+        else if (opt == "--sphere" && numArgsLeft >= 2)
+        {
+            sphereRadius = (float)std::atof(argv[++i]);
+            sphereEmittance = (float)std::atof(argv[++i]);
+        }
+        else if (opt == "--compare" && numArgsLeft >= 1)
+            refFileName = argv[++i];
+        else if (opt == "--tolerance" && numArgsLeft >= 1)
+            tolerance = (float)std::atof(argv[++i]);
+        else if (opt == "--max-outliers" && numArgsLeft >= 1)
+            maxOutliers = (float)std::atof(argv[++i]);
+        else
+        {
+            std::cerr << "Invalid option: " << opt << "\n\n";
+            PrintUsage();
+            return 1;
+        }
+    }
+
+    if (mode != "direct" && mode != "path")
+    {
+        std::cerr << "Unknown rendering mode: " << mode << std::endl;
+        return 1;
+    }
+
+    if (!EndsWith(outFileName, ".pfm") && !EndsWith(outFileName, ".ppm"))
+    {
+        std::cerr << "Output file must have extension .pfm or .ppm." << std::endl;
+        return 1;
+    }
+
+    // Same initial camera as in the GUI
+    gpuart::Camera cam;
+    cam.Pos = Vec3f(0.1f, -3.05f, 1);
+    cam.Up = Vec3f(0, 0, 1);
+    cam.Dir = Vec3f(0, 0, 0.95f) - cam.Pos;
+    cam.FovY = 60;
+    cam.ScreenDist = 0.2f;
+
+    gpuart::CPURenderer renderer(width, height, cam, numThreads);
+    renderer.SetUserSphere(Vec3f(-0.4f, 0, 0.2f), sphereRadius, sphereEmittance);
+    renderer.SetBVHWidth(bvhWidth);
+
+    {
+        gpuart::PrimitiveSet primitives;
+        if (!CreateScene(sceneName, primitives))
+            return 1;
+
+        renderer.SetPrimitives(primitives, true, strategy);
+    }
+
+    std::cout << "Rendering " << width << "x" << height << "... "; std::cout.flush();
+    auto tstart = std::chrono::high_resolution_clock::now();
+
+    if (mode == "direct")
+        renderer.RenderDirectLighting();
+    else
+    {
+        renderer.RestartPathTracing(1, pathsPerPixel);
+        while (renderer.RenderPathTracingPass() < pathsPerPixel)
+            ;
+    }
+
+    std::cout << "done (" << TimeElapsed(tstart) << ")." << std::endl;
+
+    bool saved = (EndsWith(outFileName, ".pfm")
+                  ? gpuart::Utils::SaveImagePFM(outFileName.c_str(), width, height, renderer.GetImage())
+                  : gpuart::Utils::SaveImagePPM(outFileName.c_str(), width, height, renderer.GetImage()));
+    if (!saved)
+        return 1;
+
+    if (refFileName && !CompareImages(width, height, renderer.GetImage(), refFileName, tolerance, maxOutliers))
+        return 1;
+
+    return 0;
+}
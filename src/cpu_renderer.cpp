@@ -0,0 +1,1489 @@
+/*
+GPU-Assisted Ray Tracer
+Copyright (C) 2016 Filip Szczerek <ga.software@yahoo.com>
+
+This file is part of gpuart.
+
+Gpuart is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Gpuart is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with gpuart.  If not, see <http://www.gnu.org/licenses/>.
+
+File description:
+    CPU reference renderer implementation
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+#include "cpu_renderer.h"
+#include "utils.h"
+
+
+using gpuart::Vec3f;
+using gpuart::Primitive;
+using gpuart::BoundingVolumesHierarchy;
+using gpuart::Utils::TimeElapsed;
+
+#define PI 3.1415926f
+
+
+/* Functions below mirror (as closely as possible) their GLSL counterparts
+   of the same names in 'shaders'; see there for details. */
+
+namespace
+{
+
+// Values correspond with #defines in shaders -------------
+
+const float VISIBILITY_OFFSET = 1.0e-4f;
+const float TRIANGLE_SURFACE_TOLERANCE = 1.0e-10f;
+const float CONE_TOLERANCE = 1.0e-7f;
+const float RDIR_MIN_ABS = 1.0e-30f;
+const float NO_MAX_POS = 1.0e+19f;
+
+// Offsets of RGBA quads, see gpuart::BoundingVolumesHierarchy::Compile()
+const int BVH_NODE_INFO_OFS    = 0;
+const int BVH_QUANT_PARAMS_OFS = 1;
+const int BVH_CHILDREN_BB_OFS  = 2;
+const int BVH_PRIM_DATA_OFS    = 1;
+
+const int NDINFO_FLAGS       = 0;
+const int NDINFO_CHILD0_ADDR = 1;
+const int NDINFO_PARENT_ADDR = 3;
+
+const uint32_t CHBB_PER_QUAD = 2;
+const uint32_t NDINFO_NUM_CHILDREN_ADDR = 2;
+
+// Layout of a group of dynamic objects, see gpuart::StoreDynamicObjects()
+const int DYNOBJ_GROUP_BB_MIN  = 0;
+const int DYNOBJ_GROUP_BB_MAX  = 1;
+const int DYNOBJ_GROUP_OBJECTS = 2;
+
+/// Number of RGBA quads occupied by primitives' data, indexed by gpuart::Primitive_t
+const int PRIMITIVE_DATA_LEN[] = { 1, 2, 3, 4, 1, (int)gpuart::Instance::DATA_LEN };
+
+// Direct lighting
+const int MAX_REFLECTIONS = 1;
+const float LIGHT_INTENSITY = 1.0f;
+const float AMBIENT_INTENSITY = 0.15f;
+
+// Layout of a light record, see gpuart::LIGHT_DATA_LEN
+const int LIGHT_CENTER_RADIUS = 0;
+const int LIGHT_NORMAL_TYPE   = 1;
+const int LIGHT_EMISSION_CDF  = 2;
+
+const float MIN_LIGHT_COSINE = 1.0e-6f;
+const float LIGHT_DIST_TOLERANCE = 1.0e-3f;
+
+// Path tracing
+const int MAX_PATH_SEGMENTS = 5;
+const float MIN_WEIGHT = 0.01f;
+const float SKY_LIGHT_INTENSITY = 2.0f;
+const float MAX_ROUGHNESS_ANGLE = 3.14159f/2;
+
+// Sky colors
+const Vec3f SKY_ZENITH_COLOR_SUN_HI(0.2f, 0.6f, 1);
+const Vec3f SKY_ZENITH_COLOR_SUN_LO(0, 0.2f, 0.5f);
+const Vec3f SKY_HORIZON_COLOR_SUN_HI(1, 1, 1);
+const Vec3f SKY_HORIZON_COLOR_SUN_LO(1, 0.647f, 0.367f);
+
+
+// GLSL built-ins -----------------------------------------
+
+uint32_t FloatBitsToUint(float f)
+{
+    uint32_t result;
+    std::memcpy(&result, &f, sizeof(result));
+    return result;
+}
+
+float UintBitsToFloat(uint32_t u)
+{
+    float result;
+    std::memcpy(&result, &u, sizeof(result));
+    return result;
+}
+
+/// Component-wise multiplication
+Vec3f Mul(const Vec3f &v, const Vec3f &w)
+{
+    return Vec3f(v.x*w.x, v.y*w.y, v.z*w.z);
+}
+
+Vec3f Mix(const Vec3f &v, const Vec3f &w, float a)
+{
+    return v*(1-a) + w*a;
+}
+
+Vec3f Reflect(const Vec3f &v, const Vec3f &normal)
+{
+    return v - normal * (2 * (normal*v));
+}
+
+Vec3f Neg(const Vec3f &v)
+{
+    return Vec3f(-v.x, -v.y, -v.z);
+}
+
+/// Returns the i-th component
+float At(const Vec3f &v, unsigned i)
+{
+    return (i == 0 ? v.x : (i == 1 ? v.y : v.z));
+}
+
+/// Returns the RGBA quad at 'addr' (equivalent of texelFetch() from a buffer texture)
+const float *Fetch(const Primitive::Data &data, int addr)
+{
+    return &data[RGBA_ELEMS * addr];
+}
+
+// noise.glsl ---------------------------------------------
+
+uint32_t Hash(uint32_t x)
+{
+    x += (x << 10);
+    x ^= (x >>  6);
+    x += (x <<  3);
+    x ^= (x >> 11);
+    x += (x << 15);
+    return x;
+}
+
+uint32_t Hash(uint32_t x, uint32_t y)             { return Hash(x ^ Hash(y)); }
+uint32_t Hash(uint32_t x, uint32_t y, uint32_t z) { return Hash(x ^ Hash(y) ^ Hash(z)); }
+
+float FloatConstruct(uint32_t m)
+{
+    const uint32_t ieeeMantissa = 0x007FFFFFU;
+    const uint32_t ieeeOne      = 0x3F800000U;
+
+    m &= ieeeMantissa;
+    m |= ieeeOne;
+
+    return UintBitsToFloat(m) - 1.0f;
+}
+
+float Random(float x)          { return FloatConstruct(Hash(FloatBitsToUint(x))); }
+float Random(float x, float y) { return FloatConstruct(Hash(FloatBitsToUint(x), FloatBitsToUint(y))); }
+float Random(const Vec3f &v)   { return FloatConstruct(Hash(FloatBitsToUint(v.x), FloatBitsToUint(v.y), FloatBitsToUint(v.z))); }
+
+// common.glsl --------------------------------------------
+
+Vec3f GetOrthogonal(const Vec3f &v)
+{
+    if (std::abs(v.x) < 1.0e-6f && std::abs(v.y) < 1.0e-6f)
+        return Vec3f(1, 0, 0);
+    else
+        return Vec3f(v.y, -v.x, 0).normalized();
+}
+
+Vec3f GetRandomHemisphereDirection(const Vec3f &v, const Vec3f &randInput)
+{
+    const float PIDBL = 3.1415926f*2;
+
+    float _2pr1 = PIDBL * Random(randInput);
+    float r2 = Random(Vec3f(randInput.z, randInput.x, randInput.y));
+    float sr2 = std::sqrt(1.0f - r2);
+
+    float x = std::cos(_2pr1)*sr2,
+          y = std::sin(_2pr1)*sr2,
+          z = std::sqrt(r2);
+
+    Vec3f tangent = GetOrthogonal(v);
+
+    return tangent * x + (v ^ tangent) * y + v*z;
+}
+
+/// Note: the GLSL version multiplies by the transpose of the matrix used in Vec3f::rotate()
+Vec3f Rotate(const Vec3f &v, const Vec3f &axis, float sine, float cosine)
+{
+    const Vec3f col0((axis.x*axis.x+(1-axis.x*axis.x)*cosine), (axis.x*axis.y*(1-cosine)-axis.z*sine),   (axis.x*axis.z*(1-cosine)+axis.y*sine)),
+                col1((axis.x*axis.y*(1-cosine)+axis.z*sine),   (axis.y*axis.y+(1-axis.y*axis.y)*cosine), (axis.y*axis.z*(1-cosine)-axis.x*sine)),
+                col2((axis.x*axis.z*(1-cosine)-axis.y*sine),   (axis.y*axis.z*(1-cosine)+axis.x*sine),   (axis.z*axis.z+(1-axis.z*axis.z)*cosine));
+
+    return col0*v.x + col1*v.y + col2*v.z;
+}
+
+Vec3f GetRandomDirectionInsideCone(const Vec3f &v, const Vec3f &normal, float halfAngle, const Vec3f &randInput)
+{
+    float a = Random(randInput.x, randInput.y) * halfAngle;
+    float b = Random(randInput.y, randInput.z) * 2 * 3.14159f;
+
+    float sina = std::sin(a), cosa = std::cos(a),
+          sinb = std::sin(b), cosb = std::cos(b);
+
+    float sinc = (Neg(v) ^ normal).length() / v.length();
+    if (cosa < sinc)
+    {
+        cosa = sinc;
+        sina = 1-cosa*cosa;
+    }
+
+    Vec3f vOrtho = GetOrthogonal(v);
+
+    Vec3f w = Rotate(v, vOrtho, sina, cosa).normalized();
+    return Rotate(w, v, sinb, cosb);
+}
+
+// sky.glsl -----------------------------------------------
+
+Vec3f GetSkyColor(const Vec3f &dir, const Vec3f &sunDir, float sunAltitude)
+{
+    (void)sunDir; // unused, as in the shader
+
+    const Vec3f zenith(0, 0, 1);
+    Vec3f dirHorzProj = (zenith ^ dir.normalized()) ^ zenith;
+    float weight;
+
+    if (dir.z >= 0)
+        weight = dir.normalized() * dirHorzProj.normalized();
+    else
+        weight = 1;
+
+    float sunWeight = 1.0f - sunAltitude / (3.1415926f/2);
+
+    Vec3f colZenith = Mix(SKY_ZENITH_COLOR_SUN_HI, SKY_ZENITH_COLOR_SUN_LO, sunWeight);
+    Vec3f colHorizon = Mix(SKY_HORIZON_COLOR_SUN_HI, SKY_HORIZON_COLOR_SUN_LO, sunWeight);
+
+    return Mix(colZenith, colHorizon, std::pow(weight, 16.0f));
+}
+
+// Primitives ---------------------------------------------
+
+void SphereIntersection(const Vec3f &rstart, const Vec3f &rdir, const Vec3f &center, float radius,
+                        float &pos, Vec3f &intersection, Vec3f &normal)
+{
+    float a = rdir * rdir;
+    float b = 2 * (rdir * (rstart - center));
+    float c = (rstart - center).sqrlength() - radius*radius;
+
+    float delta = b*b - 4*a*c;
+
+    if (delta >= 0)
+    {
+        float sd = std::sqrt(delta);
+        float k1 = (-b + sd) / (a + a);
+        float k2 = (-b - sd) / (a + a);
+
+        if (k1 < VISIBILITY_OFFSET)
+            pos = k2;
+        else if (k2 < VISIBILITY_OFFSET)
+            pos = k1;
+        else
+            pos = (k1 < k2 ? k1 : k2);
+
+        intersection = rstart + rdir * pos;
+        normal = (intersection - center).normalized();
+        if ((rstart - intersection) * normal < 0)
+            normal = Neg(normal);
+    }
+    else
+        pos = -1;
+}
+
+void DiscIntersection(const Vec3f &rstart, const Vec3f &rdir, const Vec3f &center, float radius, const Vec3f &dnormal,
+                      float &pos, Vec3f &intersection, Vec3f &normal)
+{
+    float tmp = rdir * dnormal;
+    if (std::abs(tmp) < 1.0e-8f)
+    {
+        pos = -1;
+        return;
+    }
+
+    float k = (dnormal * (center - rstart)) / tmp;
+
+    if (k <= 0)
+    {
+        pos = -1;
+        return;
+    }
+
+    Vec3f q = rdir * k + rstart;
+
+    if ((q - center).sqrlength() <= radius*radius)
+    {
+        pos = k;
+        intersection = rstart + rdir * k;
+        if ((rstart - center) * dnormal > 0)
+            normal = dnormal;
+        else
+            normal = Neg(dnormal);
+    }
+    else
+        pos = -1;
+}
+
+void TriangleIntersection(const Vec3f &rstart, const Vec3f &rdir, const Vec3f &v0, const Vec3f &v1, const Vec3f &v2,
+                          float &pos, Vec3f &intersection, Vec3f &normal)
+{
+    Vec3f edge1 = v1 - v0,
+          edge2 = v2 - v0;
+    Vec3f pvec = rdir ^ edge2;
+    float det = edge1 * pvec;
+    if (std::abs(det) < TRIANGLE_SURFACE_TOLERANCE)
+    {
+        pos = -1;
+        return;
+    }
+
+    float invDet = 1/det;
+    Vec3f tvec = rstart - v0;
+
+    float u = (tvec * pvec) * invDet;
+    if (u < 0 || u > 1)
+    {
+        pos = -1;
+        return;
+    }
+    Vec3f qvec = tvec ^ edge1;
+    float v = (rdir * qvec) * invDet;
+    if (v < 0 || u + v > 1)
+        pos = -1;
+    else
+    {
+        pos = (edge2 * qvec) * invDet;
+        intersection = rstart + rdir * pos;
+        normal = (edge1 ^ edge2).normalized();
+        if ((rstart - intersection) * normal < 0)
+            normal = Neg(normal);
+    }
+}
+
+void ConeIntersection(const Vec3f &rstart, const Vec3f &rdir,
+                      const Vec3f &center1, float radius1, const Vec3f &unitAxis, float axisLen,
+                      float widthCoeff, float cosB, float dotAxC1,
+                      float &pos, Vec3f &intersection, Vec3f &normal)
+{
+    Vec3f D = unitAxis * (unitAxis * rdir);
+    Vec3f E = Neg(rdir);
+    Vec3f F = center1 + unitAxis * (unitAxis * rstart) - unitAxis * dotAxC1 - rstart;
+    float G = widthCoeff * (unitAxis * rdir);
+    float H = widthCoeff * (unitAxis * rstart) - widthCoeff * dotAxC1 + radius1;
+
+    float A = D*D + E*E + 2*(D*E) - G*G;
+    float B = 2 * (F * (D+E)) - 2*G*H;
+    float C = F*F - H*H;
+
+    if (std::abs(A) < CONE_TOLERANCE)
+    {
+        pos = -1;
+        return;
+    }
+
+    float delta = B*B - 4*A*C;
+
+    if (delta < CONE_TOLERANCE)
+    {
+        pos = -1;
+        return;
+    }
+
+    float sqrtdelta = std::sqrt(delta);
+
+    float k1 = (-B + sqrtdelta)/(A+A);
+    float k2 = (-B - sqrtdelta)/(A+A);
+
+    Vec3f p1 = rstart + rdir * k1;
+    Vec3f p2 = rstart + rdir * k2;
+
+    float t1 = unitAxis * (p1 - center1);
+    float t2 = unitAxis * (p2 - center1);
+
+    bool onaxis1 = t1 >= 0 && t1 <= axisLen;
+    bool onaxis2 = t2 >= 0 && t2 <= axisLen;
+
+    if (k1 < VISIBILITY_OFFSET && onaxis2)
+    {
+        pos = k2;
+        intersection = p2;
+    }
+    else if (k2 < VISIBILITY_OFFSET && onaxis1)
+    {
+        pos = k1;
+        intersection = p1;
+    }
+    else
+    {
+        if ((k1 < k2 && onaxis1 && onaxis2) || (onaxis1 && !onaxis2))
+        {
+            pos = k1;
+            intersection = p1;
+        }
+        else if ((k2 < k1 && onaxis1 && onaxis2) || (!onaxis1 && onaxis2))
+        {
+            pos = k2;
+            intersection = p2;
+        }
+        else
+        {
+            pos = -1;
+            return;
+        }
+    }
+
+    if (pos > 0)
+    {
+        Vec3f proj = center1 + unitAxis * (unitAxis * (intersection - center1));
+
+        Vec3f n1 = (intersection - proj).normalized();
+        float u = cosB - n1 * unitAxis;
+        normal = (unitAxis * u + n1).normalized();
+        if (normal * rdir > 0)
+            normal = Neg(normal);
+    }
+}
+
+// bvh_intersection.glsl ----------------------------------
+
+/// Returns address of the next primitive's data
+int CheckBVHPrimitiveIntersection(const Vec3f &rstart, const Vec3f &rdir, int primitiveType,
+                                  const Primitive::Data &bvhTree, const std::vector<Vec3f> &meshVertices, int addr,
+                                  float &pos, Vec3f &intersection, Vec3f &normal)
+{
+    const float *d = Fetch(bvhTree, addr);
+
+    switch (primitiveType)
+    {
+    case gpuart::SPHERE:
+        SphereIntersection(rstart, rdir, Vec3f(d), d[3], pos, intersection, normal);
+        break;
+
+    case gpuart::DISC:
+        DiscIntersection(rstart, rdir, Vec3f(d), d[3], Vec3f(d + RGBA_ELEMS), pos, intersection, normal);
+        break;
+
+    case gpuart::TRIANGLE:
+        TriangleIntersection(rstart, rdir, Vec3f(d), Vec3f(d + RGBA_ELEMS), Vec3f(d + 2*RGBA_ELEMS),
+                             pos, intersection, normal);
+        break;
+
+    case gpuart::CONE:
+        ConeIntersection(rstart, rdir,
+                         Vec3f(d), d[3],                           // first center and radius
+                         Vec3f(d + 2*RGBA_ELEMS), d[2*RGBA_ELEMS + 3], // unit axis and axis length
+                         d[3*RGBA_ELEMS], d[3*RGBA_ELEMS + 1], d[3*RGBA_ELEMS + 2],
+                         pos, intersection, normal);
+        break;
+
+    case gpuart::MESH_TRIANGLE:
+        TriangleIntersection(rstart, rdir,
+                             meshVertices[FloatBitsToUint(d[0])],
+                             meshVertices[FloatBitsToUint(d[1])],
+                             meshVertices[FloatBitsToUint(d[2])],
+                             pos, intersection, normal);
+        break;
+
+    default: assert(0);
+    }
+
+    if (pos < VISIBILITY_OFFSET)
+        pos = -1;
+
+    return addr + PRIMITIVE_DATA_LEN[primitiveType];
+}
+
+bool IntersectsAABB(const Vec3f &rstart, const Vec3f &rdiv, const Vec3f &bbmin, const Vec3f &bbmax,
+                    float &tnear, float &tfar)
+{
+    Vec3f t0 = Mul(bbmin - rstart, rdiv),
+          t1 = Mul(bbmax - rstart, rdiv);
+
+    tnear = std::max(std::max(std::min(t0.x, t1.x), std::min(t0.y, t1.y)), std::min(t0.z, t1.z));
+    tfar  = std::min(std::min(std::max(t0.x, t1.x), std::max(t0.y, t1.y)), std::max(t0.z, t1.z));
+
+    return tnear <= tfar && tfar >= 0;
+}
+
+Vec3f Dequantize(const Vec3f &origin, const Vec3f &scale, uint32_t qvalue)
+{
+    return origin + Mul(Vec3f((float)(qvalue & 0xFF), (float)((qvalue >> 8) & 0xFF), (float)((qvalue >> 16) & 0xFF)),
+                        scale);
+}
+
+bool IntersectsChildAABB(const Vec3f &rstart, const Vec3f &rdiv, const float *quantParams,
+                         uint32_t qmin, uint32_t qmax, float &tnear, float &tfar)
+{
+    uint32_t exponents = FloatBitsToUint(quantParams[3]);
+    Vec3f scale(UintBitsToFloat((exponents & 0xFF) << 23),
+                UintBitsToFloat(((exponents >> 8) & 0xFF) << 23),
+                UintBitsToFloat(((exponents >> 16) & 0xFF) << 23));
+
+    return IntersectsAABB(rstart, rdiv,
+                          Dequantize(Vec3f(quantParams), scale, qmin),
+                          Dequantize(Vec3f(quantParams), scale, qmax),
+                          tnear, tfar);
+}
+
+int FindNextBVHChild(const Vec3f &rstart, const Vec3f &rdir, const Vec3f &rdiv,
+                     const Primitive::Data &bvhTree, int bvhIdx, const float *nodeInfo,
+                     uint32_t returningFrom, float maxPos)
+{
+    uint32_t flags = FloatBitsToUint(nodeInfo[NDINFO_FLAGS]);
+    uint32_t numChildren = (flags & ~BoundingVolumesHierarchy::FLAGS_MASK);
+    unsigned orderAxis = (flags & BoundingVolumesHierarchy::ORDER_AXIS_MASK) >> BoundingVolumesHierarchy::ORDER_AXIS_SHIFT;
+    bool reversed = (At(rdir, orderAxis) < 0);
+
+    uint32_t step = 0;
+    if (returningFrom > 0)
+        step = (reversed ? numChildren - returningFrom : returningFrom - 1) + 1;
+
+    if (step >= numChildren)
+        return -1;
+
+    const float *quantParams = Fetch(bvhTree, bvhIdx + BVH_QUANT_PARAMS_OFS);
+
+    for (; step < numChildren; step++)
+    {
+        uint32_t i = (reversed ? numChildren - 1 - step : step);
+
+        const float *childrenBB = Fetch(bvhTree, bvhIdx + BVH_CHILDREN_BB_OFS + i / CHBB_PER_QUAD);
+        const float *qbox = childrenBB + (i % CHBB_PER_QUAD) * 2;
+        float tnear, tfar;
+
+        if (IntersectsChildAABB(rstart, rdiv, quantParams, FloatBitsToUint(qbox[0]), FloatBitsToUint(qbox[1]), tnear, tfar)
+            && tnear <= maxPos)
+        {
+            if (i < NDINFO_NUM_CHILDREN_ADDR)
+                return (int)FloatBitsToUint(nodeInfo[NDINFO_CHILD0_ADDR + i]);
+            else
+            {
+                uint32_t addrIdx = i - NDINFO_NUM_CHILDREN_ADDR;
+                int addrQuad = bvhIdx + BVH_CHILDREN_BB_OFS
+                               + (int)((numChildren + CHBB_PER_QUAD - 1) / CHBB_PER_QUAD + addrIdx / 4);
+                return (int)FloatBitsToUint(Fetch(bvhTree, addrQuad)[addrIdx % 4]);
+            }
+        }
+    }
+
+    return -1;
+}
+
+int EnterInstance(const Primitive::Data &bvhTree, int addr, const Vec3f &rstart, const Vec3f &rdir,
+                  Vec3f &instRStart, Vec3f &instRDir)
+{
+    const float *row0 = Fetch(bvhTree, addr),
+                *row1 = Fetch(bvhTree, addr + 1),
+                *row2 = Fetch(bvhTree, addr + 2);
+
+    instRStart = Vec3f(Vec3f(row0) * rstart + row0[3], Vec3f(row1) * rstart + row1[3], Vec3f(row2) * rstart + row2[3]);
+    instRDir   = Vec3f(Vec3f(row0) * rdir, Vec3f(row1) * rdir, Vec3f(row2) * rdir);
+
+    return (int)FloatBitsToUint(Fetch(bvhTree, addr + 3)[0]);
+}
+
+Vec3f GetInstanceWorldNormal(const Primitive::Data &bvhTree, int addr, const Vec3f &normal)
+{
+    return (Vec3f(Fetch(bvhTree, addr)) * normal.x
+            + Vec3f(Fetch(bvhTree, addr + 1)) * normal.y
+            + Vec3f(Fetch(bvhTree, addr + 2)) * normal.z).normalized();
+}
+
+Vec3f GetFiniteRayDirInverse(const Vec3f &rdir)
+{
+    return Vec3f(1 / (std::abs(rdir.x) < RDIR_MIN_ABS ? RDIR_MIN_ABS : rdir.x),
+                 1 / (std::abs(rdir.y) < RDIR_MIN_ABS ? RDIR_MIN_ABS : rdir.y),
+                 1 / (std::abs(rdir.z) < RDIR_MIN_ABS ? RDIR_MIN_ABS : rdir.z));
+}
+
+/** Traverses the tree in the same order as the shaders. For each primitive of the visited leaves
+    calls 'onPrimitive(type, material, dataAddr, pos, intersection, normal)' (in world space, also for primitives
+    of instances, whose 'dataAddr' is -1), which returns 'false' to stop the traversal and updates 'maxPos' (children entered beyond it are culled). */
+template<typename F>
+void TraverseBVH(const Vec3f &rstart, const Vec3f &rdir,
+                 const Primitive::Data &bvhTree, const std::vector<Vec3f> &meshVertices,
+                 float &maxPos, F onPrimitive)
+{
+    int bvhIdx = 0;
+    uint32_t returningFrom = 0;
+
+    Vec3f currRStart = rstart, currRDir = rdir;
+    Vec3f rdiv = GetFiniteRayDirInverse(rdir);
+
+    int instanceAddr = -1;
+    int resumeLeafAddr = 0, resumePrimAddr = 0;
+    uint32_t resumeNumPrimitives = 0;
+    bool resuming = false;
+
+    while (true)
+    {
+        const float *nodeInfo = Fetch(bvhTree, bvhIdx + BVH_NODE_INFO_OFS);
+        uint32_t flags = FloatBitsToUint(nodeInfo[NDINFO_FLAGS]);
+
+        if ((flags & BoundingVolumesHierarchy::LEAF) == BoundingVolumesHierarchy::LEAF)
+        {
+            uint32_t numPrimitives = (flags & ~BoundingVolumesHierarchy::FLAGS_MASK);
+            int primAddr = bvhIdx + BVH_PRIM_DATA_OFS;
+
+            if (resuming)
+            {
+                numPrimitives = resumeNumPrimitives;
+                primAddr = resumePrimAddr;
+                resuming = false;
+            }
+
+            bool enteringInstance = false;
+
+            for (uint32_t i = 0; i < numPrimitives; i++)
+            {
+                float currPos;
+                Vec3f currIntersection, currNormal;
+                const float *header = Fetch(bvhTree, primAddr); // type and material ID
+                int ptype = (int)FloatBitsToUint(header[0]);
+
+                if (ptype == gpuart::INSTANCE)
+                {
+                    resumeLeafAddr = bvhIdx;
+                    resumePrimAddr = primAddr + 1 + PRIMITIVE_DATA_LEN[gpuart::INSTANCE];
+                    resumeNumPrimitives = numPrimitives - i - 1;
+
+                    instanceAddr = primAddr + 1;
+                    bvhIdx = EnterInstance(bvhTree, instanceAddr, rstart, rdir, currRStart, currRDir);
+                    rdiv = GetFiniteRayDirInverse(currRDir);
+                    enteringInstance = true;
+                    break;
+                }
+
+                int dataAddr = primAddr + 1; // skips the type header
+                primAddr = CheckBVHPrimitiveIntersection(
+                            currRStart, currRDir, ptype,
+                            bvhTree, meshVertices, dataAddr,
+                            currPos, currIntersection, currNormal);
+
+                if (instanceAddr >= 0 && currPos > 0)
+                {
+                    currIntersection = rstart + currPos * rdir;
+                    currNormal = GetInstanceWorldNormal(bvhTree, instanceAddr, currNormal);
+                }
+
+                if (!onPrimitive(ptype, (int)FloatBitsToUint(header[1]), (instanceAddr < 0 ? dataAddr : -1),
+                                 currPos, currIntersection, currNormal))
+                    return;
+            }
+
+            if (enteringInstance)
+            {
+                returningFrom = 0;
+                continue;
+            }
+        }
+        else
+        {
+            int childAddr = FindNextBVHChild(currRStart, currRDir, rdiv, bvhTree, bvhIdx, nodeInfo, returningFrom, maxPos);
+            if (childAddr >= 0)
+            {
+                returningFrom = 0;
+                bvhIdx = childAddr;
+                continue;
+            }
+        }
+
+        // Return to the parent
+
+        if ((flags & BoundingVolumesHierarchy::IS_ROOT) == BoundingVolumesHierarchy::IS_ROOT)
+        {
+            if (instanceAddr < 0)
+                break;
+
+            // Leave the instance and resume the top-level leaf
+            instanceAddr = -1;
+            currRStart = rstart;
+            currRDir = rdir;
+            rdiv = GetFiniteRayDirInverse(rdir);
+            bvhIdx = resumeLeafAddr;
+            resuming = true;
+            continue;
+        }
+
+        returningFrom = ((flags & BoundingVolumesHierarchy::CHILD_INDEX_MASK) >> BoundingVolumesHierarchy::CHILD_INDEX_SHIFT) + 1;
+        bvhIdx = (int)FloatBitsToUint(nodeInfo[NDINFO_PARENT_ADDR]);
+    }
+}
+
+void CheckBVHIntersection(const Vec3f &rstart, const Vec3f &rdir,
+                          const Primitive::Data &bvhTree, const std::vector<Vec3f> &meshVertices,
+                          float &pos, Vec3f &intersection, Vec3f &normal, int &primitiveType, int &material,
+                          int &primitiveAddr)
+{
+    pos = -1;
+    primitiveType = -1;
+    material = 0;
+    primitiveAddr = -1;
+    float closestPos = NO_MAX_POS;
+
+    TraverseBVH(rstart, rdir, bvhTree, meshVertices, closestPos,
+        [&](int ptype, int currMaterial, int dataAddr, float currPos, const Vec3f &currIntersection, const Vec3f &currNormal)
+        {
+            if (currPos > 0 && currPos < closestPos)
+            {
+                closestPos = pos = currPos;
+                intersection = currIntersection;
+                normal = currNormal;
+                primitiveType = (ptype == gpuart::MESH_TRIANGLE ? (int)gpuart::TRIANGLE : ptype);
+                material = currMaterial;
+                primitiveAddr = dataAddr;
+            }
+            return true;
+        });
+}
+
+bool CheckBVHOcclusion(const Vec3f &rstart, const Vec3f &rdir,
+                       const Primitive::Data &bvhTree, const std::vector<Vec3f> &meshVertices,
+                       float maxPos)
+{
+    bool occluded = false;
+
+    TraverseBVH(rstart, rdir, bvhTree, meshVertices, maxPos,
+        [&](int, int, int, float currPos, const Vec3f &, const Vec3f &)
+        {
+            occluded = (currPos > 0 && currPos < maxPos);
+            return !occluded;
+        });
+
+    return occluded;
+}
+
+// intersection.glsl --------------------------------------
+
+void CheckIntersectionInclDynamicObjects(const Vec3f &rstart, const Vec3f &rdir,
+                                         const Primitive::Data &bvhTree, const std::vector<Vec3f> &meshVertices,
+                                         const Primitive::Data &dynamicObjects, unsigned numDynamicObjectGroups,
+                                         float &pos, Vec3f &intersection, Vec3f &normal, int &primitiveType,
+                                         int &material, int &primitiveAddr, int &dynamicObject)
+{
+    CheckBVHIntersection(rstart, rdir, bvhTree, meshVertices, pos, intersection, normal, primitiveType, material, primitiveAddr);
+
+    dynamicObject = -1;
+    if (numDynamicObjectGroups == 0)
+        return;
+
+    Vec3f rdiv = GetFiniteRayDirInverse(rdir);
+    int groupAddr = 0;
+
+    for (unsigned i = 0; i < numDynamicObjectGroups; i++)
+    {
+        const float *bbminNext = Fetch(dynamicObjects, groupAddr + DYNOBJ_GROUP_BB_MIN);
+        const float *bbmax = Fetch(dynamicObjects, groupAddr + DYNOBJ_GROUP_BB_MAX);
+        int nextGroupAddr = (int)FloatBitsToUint(bbminNext[3]);
+
+        float tnear, tfar;
+        if (IntersectsAABB(rstart, rdiv, Vec3f(bbminNext), Vec3f(bbmax), tnear, tfar) && (pos < 0 || tnear < pos))
+        {
+            int addr = groupAddr + DYNOBJ_GROUP_OBJECTS;
+            while (addr < nextGroupAddr)
+            {
+                int objType = (int)FloatBitsToUint(Fetch(dynamicObjects, addr)[0]);
+                float objPos;
+                Vec3f objIntersection, objNormal;
+
+                int nextAddr = CheckBVHPrimitiveIntersection(rstart, rdir, objType, dynamicObjects, meshVertices, addr + 1,
+                                                             objPos, objIntersection, objNormal);
+
+                if (objPos > VISIBILITY_OFFSET && (pos < 0 || objPos < pos))
+                {
+                    dynamicObject = addr;
+                    primitiveAddr = -1;
+                    primitiveType = objType;
+                    pos = objPos;
+                    intersection = objIntersection;
+                    normal = objNormal;
+                }
+
+                addr = nextAddr;
+            }
+        }
+
+        groupAddr = nextGroupAddr;
+    }
+}
+
+bool CheckOcclusionInclDynamicObjects(const Vec3f &rstart, const Vec3f &rdir,
+                                      const Primitive::Data &bvhTree, const std::vector<Vec3f> &meshVertices,
+                                      const Primitive::Data &dynamicObjects, unsigned numDynamicObjectGroups,
+                                      float maxPos)
+{
+    Vec3f rdiv = GetFiniteRayDirInverse(rdir);
+    int groupAddr = 0;
+
+    for (unsigned i = 0; i < numDynamicObjectGroups; i++)
+    {
+        const float *bbminNext = Fetch(dynamicObjects, groupAddr + DYNOBJ_GROUP_BB_MIN);
+        const float *bbmax = Fetch(dynamicObjects, groupAddr + DYNOBJ_GROUP_BB_MAX);
+        int nextGroupAddr = (int)FloatBitsToUint(bbminNext[3]);
+
+        float tnear, tfar;
+        if (IntersectsAABB(rstart, rdiv, Vec3f(bbminNext), Vec3f(bbmax), tnear, tfar) && tnear < maxPos)
+        {
+            int addr = groupAddr + DYNOBJ_GROUP_OBJECTS;
+            while (addr < nextGroupAddr)
+            {
+                int objType = (int)FloatBitsToUint(Fetch(dynamicObjects, addr)[0]);
+                float objPos;
+                Vec3f objIntersection, objNormal;
+
+                addr = CheckBVHPrimitiveIntersection(rstart, rdir, objType, dynamicObjects, meshVertices, addr + 1,
+                                                     objPos, objIntersection, objNormal);
+
+                if (objPos > VISIBILITY_OFFSET && objPos < maxPos)
+                    return true;
+            }
+        }
+
+        groupAddr = nextGroupAddr;
+    }
+
+    return CheckBVHOcclusion(rstart, rdir, bvhTree, meshVertices, maxPos);
+}
+
+// light_sampling.glsl ------------------------------------
+
+float GetLightPower(int type, float radius, const Vec3f &emission)
+{
+    float luminance = emission * Vec3f(0.2126f, 0.7152f, 0.0722f);
+
+    if (type == gpuart::SPHERE)
+        return luminance * 4*PI * radius*radius;
+    else if (type == gpuart::DISC)
+        return luminance * PI * radius*radius;
+    else
+        return 0;
+}
+
+float GetSphereConeOneMinusCos(const float *centerRadius, const Vec3f &p)
+{
+    float sinSqr = centerRadius[3] * centerRadius[3] / (Vec3f(centerRadius) - p).sqrlength();
+    if (sinSqr >= 1)
+        return 0;
+    else
+        return sinSqr / (1 + std::sqrt(1 - sinSqr));
+}
+
+float GetLightPdf(int type, const float *centerRadius, const Vec3f &discNormal, const Vec3f &emission, float totalPower,
+                  const Vec3f &p, const Vec3f &dir, float dist)
+{
+    float selectionPdf = GetLightPower(type, centerRadius[3], emission) / totalPower;
+
+    if (type == gpuart::SPHERE)
+    {
+        float oneMinusCos = GetSphereConeOneMinusCos(centerRadius, p);
+        if (oneMinusCos < MIN_LIGHT_COSINE)
+            return 0;
+
+        return selectionPdf / (2*PI * oneMinusCos);
+    }
+    else
+    {
+        float cosine = std::abs(discNormal * dir);
+        if (cosine < MIN_LIGHT_COSINE)
+            return 0;
+
+        return selectionPdf * dist*dist / (cosine * PI * centerRadius[3]*centerRadius[3]);
+    }
+}
+
+bool SampleLight(const Primitive::Data &lights, unsigned numLights, float totalPower, const Vec3f &p, const Vec3f &randInput,
+                 Vec3f &dir, float &dist, Vec3f &emission, float &pdf)
+{
+    float u = Random(randInput);
+    int first = 0, last = (int)numLights - 1;
+    while (first < last)
+    {
+        int mid = (first + last) / 2;
+        if (Fetch(lights, mid * (int)gpuart::LIGHT_DATA_LEN + LIGHT_EMISSION_CDF)[3] > u)
+            last = mid;
+        else
+            first = mid + 1;
+    }
+
+    int addr = first * (int)gpuart::LIGHT_DATA_LEN;
+    const float *centerRadius = Fetch(lights, addr + LIGHT_CENTER_RADIUS);
+    const float *normalType = Fetch(lights, addr + LIGHT_NORMAL_TYPE);
+    int type = (int)FloatBitsToUint(normalType[3]);
+    emission = Vec3f(Fetch(lights, addr + LIGHT_EMISSION_CDF));
+
+    float u1 = Random(Vec3f(randInput.z, randInput.x, randInput.y));
+    float phi = 2*PI * Random(Vec3f(randInput.y, randInput.z, randInput.x));
+
+    if (type == gpuart::SPHERE)
+    {
+        Vec3f toCenter = Vec3f(centerRadius) - p;
+        float centerDist = toCenter.length();
+        float oneMinusCosMax = GetSphereConeOneMinusCos(centerRadius, p);
+        if (oneMinusCosMax < MIN_LIGHT_COSINE)
+            return false;
+
+        float oneMinusCos = u1 * oneMinusCosMax;
+        float cosine = 1 - oneMinusCos;
+        float sine = std::sqrt(std::max(oneMinusCos * (2 - oneMinusCos), 0.0f));
+
+        Vec3f axis = toCenter / centerDist;
+        Vec3f tangent = GetOrthogonal(axis);
+        dir = axis * cosine + (tangent * std::cos(phi) + (axis ^ tangent) * std::sin(phi)) * sine;
+
+        dist = centerDist * cosine - std::sqrt(std::max(centerRadius[3]*centerRadius[3] - centerDist*centerDist * sine*sine, 0.0f));
+    }
+    else
+    {
+        Vec3f normal(normalType);
+        Vec3f tangent = GetOrthogonal(normal);
+        Vec3f pointOnDisc = Vec3f(centerRadius) + (tangent * std::cos(phi) + (normal ^ tangent) * std::sin(phi))
+                                                  * (centerRadius[3] * std::sqrt(u1));
+        Vec3f toPoint = pointOnDisc - p;
+        dist = toPoint.length();
+        dir = toPoint / dist;
+    }
+
+    pdf = GetLightPdf(type, centerRadius, Vec3f(normalType), emission, totalPower, p, dir, dist);
+    return (pdf > 0 && dist > 0);
+}
+
+float PowerHeuristic(float pdf, float otherPdf)
+{
+    float ratio = otherPdf / pdf;
+    return 1 / (1 + ratio*ratio);
+}
+
+// direct_lighting.glsl -----------------------------------
+
+Vec3f GetLambertShadedDiffuseColor(const Vec3f &lightDir, const Vec3f &normal, const Vec3f &diffuseColor, float lightIntensity)
+{
+    float dotp = lightDir * normal;
+    if (dotp > 0)
+        return diffuseColor * (lightIntensity * dotp);
+    else
+        return Vec3f(0, 0, 0);
+}
+
+} // end of anonymous namespace
+
+
+/// Uses 'numThreads' threads for rendering (0: all hardware threads)
+gpuart::CPURenderer::CPURenderer(unsigned width, unsigned height, const Camera &camera, unsigned numThreads)
+: Width(width), Height(height)
+{
+    assert(width > 0);
+    assert(height > 0);
+
+    NumThreads = (numThreads > 0 ? numThreads : std::max(1U, std::thread::hardware_concurrency()));
+
+    Sun.azimuth = PI;
+    Sun.altitude = PI/4;
+    Sun.directLightingEnabled = true;
+
+    Dynamic.objects.assign(1, DynamicObject::MakeSphere(Vec3f(0, 0, 0), 0)); // user sphere
+    Dynamic.modified = true;
+    Dynamic.numGroups = 0;
+
+    Lights.modified = true;
+    Lights.numLights = 0;
+    Lights.numSceneLights = 0;
+    Lights.totalPower = 0;
+
+    PathTracing.pathsPerPixel = 5;
+    PathTracing.pathsPerPass = PathTracing.pathsPerPixel;
+    PathTracing.numPathsRendered = 0;
+
+    BVH.width = 4;
+
+    Image.assign(Width * Height, Vec3f(0, 0, 0));
+
+    SetCamera(camera);
+}
+
+/** After calling this method, 'primitives' are no longer used. If 'printInfo' is true,
+    construction details are printed to stdout. */
+void gpuart::CPURenderer::SetPrimitives(const PrimitiveSet &primitives, bool printInfo, BVHBuildStrategy strategy)
+{
+    std::chrono::high_resolution_clock::time_point tstart;
+    if (printInfo)
+    {
+        std::cout << "Constructing BVH tree of " << primitives.GetCount() << " primitives... "; std::cout.flush();
+        tstart = std::chrono::high_resolution_clock::now();
+    }
+
+    BoundingVolumesHierarchy tree(primitives, 1024, 2, strategy);
+
+    if (printInfo)
+    {
+        std::cout << "done (" << TimeElapsed(tstart) << ")." << std::endl;
+        std::cout << "SAH cost: " << std::setprecision(2) << tree.GetSAHCost() << "." << std::endl;
+        std::cout << "Compiling BVH tree... "; std::cout.flush();
+        tstart = std::chrono::high_resolution_clock::now();
+    }
+
+    BVH.tree.clear();
+    tree.Compile(primitives, BVH.tree, BVH.width);
+    BVH.meshVertices = primitives.MeshVertices;
+    StoreMaterials(primitives.Materials, BVH.materials);
+    Lights.scene.clear();
+    StoreLights(primitives, Lights.scene);
+    Lights.modified = true;
+
+    if (printInfo)
+        std::cout << "done (" << TimeElapsed(tstart) << ")." << std::endl;
+
+    ResetPathTracing();
+}
+
+/** Builds a two-level hierarchy (see TwoLevelBVH) of 'instances' of 'meshes'; returns 'false' on failure.
+    If 'printInfo' is true, construction details are printed to stdout. */
+bool gpuart::CPURenderer::SetInstancedScene(const std::vector<PrimitiveSet> &meshes, const std::vector<MeshInstance> &instances,
+                                            bool printInfo, BVHBuildStrategy strategy)
+{
+    std::chrono::high_resolution_clock::time_point tstart;
+    if (printInfo)
+    {
+        std::cout << "Constructing two-level BVH of " << meshes.size() << " meshes and "
+                  << instances.size() << " instances... "; std::cout.flush();
+        tstart = std::chrono::high_resolution_clock::now();
+    }
+
+    TwoLevelBVH tree;
+    std::vector<Material> materials;
+    if (!tree.Build(meshes, instances, 0, 1024, 2, strategy, BVH.width, BVH.tree, BVH.meshVertices, materials))
+        return false;
+
+    // Emissive primitives of instanced meshes are not sampled as lights
+    StoreMaterials(materials, BVH.materials);
+    Lights.scene.clear();
+    Lights.modified = true;
+
+    if (printInfo)
+        std::cout << "done (" << TimeElapsed(tstart) << ")." << std::endl;
+
+    ResetPathTracing();
+    return true;
+}
+
+void gpuart::CPURenderer::SetCamera(const Camera &cam)
+{
+    CurrentCamera = cam;
+    CurrentCamera.GetScreen((float)Width/Height, Screen.bottomLeft, Screen.deltaHorz, Screen.deltaVert);
+    ResetPathTracing();
+}
+
+/** Adds a user-controlled sphere, disc or cone (see gpuart::Renderer::AddDynamicObject());
+    returns its index. Index 0 is the user sphere (see SetUserSphere()). */
+size_t gpuart::CPURenderer::AddDynamicObject(const DynamicObject &object)
+{
+    Dynamic.objects.push_back(object);
+    Dynamic.modified = true;
+    ResetPathTracing();
+    return Dynamic.objects.size() - 1;
+}
+
+/// Replaces (e.g. moves) the dynamic object with index 'index'
+void gpuart::CPURenderer::SetDynamicObject(size_t index, const DynamicObject &object)
+{
+    Dynamic.objects.at(index) = object;
+    Dynamic.modified = true;
+    ResetPathTracing();
+}
+
+/// Removes all dynamic objects except the user sphere
+void gpuart::CPURenderer::ClearDynamicObjects()
+{
+    Dynamic.objects.resize(USER_SPHERE + 1);
+    Dynamic.modified = true;
+    ResetPathTracing();
+}
+
+/// Stores the dynamic objects into 'Dynamic.data' and the light list into 'Lights.data' if they were modified
+void gpuart::CPURenderer::UpdateDynamicObjects()
+{
+    if (!Dynamic.modified && !Lights.modified)
+        return;
+
+    if (Dynamic.modified)
+        Dynamic.numGroups = StoreDynamicObjects(Dynamic.objects, Dynamic.data);
+
+    Lights.data = Lights.scene;
+    StoreLights(Dynamic.objects, Lights.data);
+    Lights.numSceneLights = (unsigned)(Lights.scene.size() / (RGBA_ELEMS * LIGHT_DATA_LEN));
+    Lights.numLights = (unsigned)(Lights.data.size() / (RGBA_ELEMS * LIGHT_DATA_LEN));
+    Lights.totalPower = SetLightSelectionProbabilities(Lights.data);
+
+    Dynamic.modified = Lights.modified = false;
+}
+
+/// Use radius=0 to effectively disable the user-controlled sphere
+void gpuart::CPURenderer::SetUserSphere(const Vec3f &pos, float radius, float emittance)
+{
+    DynamicObject &sphere = Dynamic.objects[USER_SPHERE];
+    sphere.pos = pos;
+    sphere.radius = sphere.radius2 = radius;
+    sphere.SetEmittance(emittance);
+
+    Dynamic.modified = true;
+    ResetPathTracing();
+}
+
+void gpuart::CPURenderer::SetUserSphereSpecular(bool specular)
+{
+    Dynamic.objects[USER_SPHERE].SetSpecular(specular);
+    Dynamic.modified = true;
+    ResetPathTracing();
+}
+
+void gpuart::CPURenderer::SetUserSphereFuzzy(bool fuzzy)
+{
+    Dynamic.objects[USER_SPHERE].SetFuzzy(fuzzy);
+    Dynamic.modified = true;
+    ResetPathTracing();
+}
+
+/// Calls 'renderPixel(x, y)' for every pixel, using 'NumThreads' threads
+void gpuart::CPURenderer::ForEachPixel(const std::function<void (unsigned, unsigned)> &renderPixel) const
+{
+    // Rows are handed out one at a time, so that threads finishing early take over the remaining work
+    std::atomic<unsigned> nextRow(0);
+
+    auto worker = [&]()
+    {
+        unsigned y;
+        while ((y = nextRow++) < Height)
+            for (unsigned x = 0; x < Width; x++)
+                renderPixel(x, y);
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < NumThreads; i++)
+        threads.emplace_back(worker);
+
+    worker();
+
+    for (auto &t: threads)
+        t.join();
+}
+
+/// Returns the camera ray's origin and direction of pixel (x, y) (as calculated by the camera init. shader)
+void gpuart::CPURenderer::GetCameraRay(unsigned x, unsigned y, Vec3f &rstart, Vec3f &rdir) const
+{
+    // Texture coordinates of the pixel's center
+    float u = (x + 0.5f) / Width,
+          v = (y + 0.5f) / Height;
+
+    rstart = Screen.bottomLeft + Screen.deltaHorz*u + Screen.deltaVert*v;
+    rdir = (rstart - CurrentCamera.Pos).normalized();
+}
+
+/** Returns the material of an intersection found by CheckIntersectionInclDynamicObjects(): a dynamic object's one
+    is stored in its type header, other primitives' ones in the material table (as read by the shaders) */
+gpuart::Material gpuart::CPURenderer::GetHitMaterial(int materialID, int dynamicObject) const
+{
+    return Material::Unpack(dynamicObject >= 0 ? Fetch(Dynamic.data, dynamicObject) + 1 : Fetch(BVH.materials, materialID));
+}
+
+void gpuart::CPURenderer::RenderDirectLighting()
+{
+    assert(!BVH.tree.empty());
+
+    UpdateDynamicObjects();
+
+    const Vec3f sunDir = GetSunDirection();
+
+    ForEachPixel([&](unsigned x, unsigned y)
+    {
+        float pos;
+        Vec3f intersection, normal;
+        int primitiveType, materialID;
+        int primitiveAddr, dynamicObject;
+
+        Vec3f rstart, rdir;
+        GetCameraRay(x, y, rstart, rdir);
+
+        Vec3f colorWeight(1, 1, 1);
+        Vec3f irradiance(0, 0, 0);
+
+        for (int i = 0; i <= MAX_REFLECTIONS; i++)
+        {
+            CheckIntersectionInclDynamicObjects(
+                rstart, rdir, BVH.tree, BVH.meshVertices,
+                Dynamic.data, Dynamic.numGroups,
+                pos, intersection, normal, primitiveType, materialID, primitiveAddr, dynamicObject);
+
+            if (primitiveType == -1)
+            {
+                irradiance = Mul(colorWeight, GetSkyColor(rdir, sunDir, Sun.altitude));
+                break;
+            }
+
+            const Material material = GetHitMaterial(materialID, dynamicObject);
+
+            if (material.specular >= 0.5f)
+            {
+                rstart = intersection;
+                rdir = Reflect(rdir, normal);
+                colorWeight = Mul(colorWeight, material.albedo);
+            }
+            else if (material.IsEmissive())
+            {
+                const Vec3f &em = material.emission;
+                irradiance = Mul(colorWeight, em / std::max(std::max(em.x, em.y), em.z));
+                break;
+            }
+            else
+            {
+                Vec3f diffuseColor = Mul(material.albedo, colorWeight);
+
+                if (Sun.directLightingEnabled)
+                {
+                    if (!CheckOcclusionInclDynamicObjects(intersection, sunDir,
+                                                          BVH.tree, BVH.meshVertices,
+                                                          Dynamic.data, Dynamic.numGroups,
+                                                          NO_MAX_POS))
+                        irradiance += GetLambertShadedDiffuseColor(sunDir, normal, diffuseColor, LIGHT_INTENSITY);
+                }
+
+                // Emissive dynamic objects act as point lights of unit intensity at their centers (as in the shader)
+                for (unsigned l = Lights.numSceneLights; l < Lights.numLights; l++)
+                {
+                    const float *centerRadius = Fetch(Lights.data, l * LIGHT_DATA_LEN + LIGHT_CENTER_RADIUS);
+                    int type = (int)FloatBitsToUint(Fetch(Lights.data, l * LIGHT_DATA_LEN + LIGHT_NORMAL_TYPE)[3]);
+
+                    Vec3f dirToLight = Vec3f(centerRadius) - intersection;
+                    float dist = dirToLight.length();
+
+                    // Visibility is checked up to the light's (or its bounding sphere's) surface
+                    float maxPos = (type == DISC ? dist : dist - centerRadius[3]) * (1 - LIGHT_DIST_TOLERANCE);
+
+                    if (maxPos <= 0 || !CheckOcclusionInclDynamicObjects(intersection, dirToLight/dist,
+                                                                         BVH.tree, BVH.meshVertices,
+                                                                         Dynamic.data, Dynamic.numGroups,
+                                                                         maxPos))
+                    {
+                        irradiance += GetLambertShadedDiffuseColor(dirToLight/dist, normal, diffuseColor, 1) / (dist*dist);
+                    }
+                }
+
+                irradiance += diffuseColor * AMBIENT_INTENSITY;
+                break;
+            }
+        }
+
+        Image[x + y*Width] = irradiance;
+    });
+}
+
+void gpuart::CPURenderer::ResetPathTracing()
+{
+    PathTracing.numPathsRendered = 0;
+    PathTracing.accumulator.assign(Width * Height, Vec3f(0, 0, 0));
+}
+
+void gpuart::CPURenderer::RestartPathTracing(unsigned pathsPerPass, unsigned pathsPerPixel)
+{
+    if (pathsPerPass > pathsPerPixel)
+        pathsPerPass = pathsPerPixel;
+
+    PathTracing.pathsPerPixel = pathsPerPixel;
+    PathTracing.pathsPerPass = pathsPerPass;
+
+    ResetPathTracing();
+}
+
+/// Returns number of rendered paths per pixel
+unsigned gpuart::CPURenderer::RenderPathTracingPass()
+{
+    assert(!BVH.tree.empty());
+
+    UpdateDynamicObjects();
+
+    if (PathTracing.numPathsRendered < PathTracing.pathsPerPixel)
+    {
+        const unsigned pathsToRender = std::min(PathTracing.pathsPerPass,
+                                                PathTracing.pathsPerPixel - PathTracing.numPathsRendered);
+
+        const float pixelSize = 2 * CurrentCamera.ScreenDist * std::tan(CurrentCamera.FovY/2 * PI/180) / Height;
+        const Vec3f sunDir = GetSunDirection();
+
+        std::uniform_real_distribution<float> distr(0, 1);
+        float randSeed[4];
+        for (float &r: randSeed)
+            r = distr(RndGen);
+        const Vec3f randSeedXYZ(randSeed);
+
+        ForEachPixel([&](unsigned x, unsigned y)
+        {
+            float pos;
+            Vec3f intersection, normal;
+
+            Vec3f rstart0, rdir0;
+            GetCameraRay(x, y, rstart0, rdir0);
+
+            Vec3f rdirOrtho1;
+            if (std::abs(rdir0.x) > 1.0e-5f || std::abs(rdir0.y) > 1.0e-5f)
+                rdirOrtho1 = Vec3f(rdir0.y, -rdir0.x, 0).normalized();
+            else
+                rdirOrtho1 = Vec3f(0, -rdir0.z, rdir0.y).normalized();
+
+            Vec3f rdirOrtho2 = rdir0.normalized() ^ rdirOrtho1;
+
+            Vec3f color(0, 0, 0);
+
+            for (unsigned j = 0; j < pathsToRender; j++)
+            {
+                // Dither the camera ray's starting point and direction (see the shader for details)
+                float rand1 = Random(randSeed[0] + j);
+                float rand2 = Random(randSeed[1] + j);
+                Vec3f rstart = rstart0 + rdirOrtho1 * ((rand1 - 0.5f) * pixelSize)
+                                       + rdirOrtho2 * ((rand2 - 0.5f) * pixelSize);
+
+                Vec3f rdir = rstart - CurrentCamera.Pos;
+
+                Vec3f pathColor(0, 0, 0);
+                Vec3f colorWeight(1, 1, 1);
+
+                // Probability density (per solid angle) of the last diffuse reflection's direction; 0 after a specular one
+                float bsdfPdf = 0;
+
+                int i;
+                for (i = 0; i < MAX_PATH_SEGMENTS
+                            && colorWeight.x > MIN_WEIGHT && colorWeight.y > MIN_WEIGHT && colorWeight.z > MIN_WEIGHT; i++)
+                {
+                    int ptype, materialID, primitiveAddr, dynamicObject;
+
+                    CheckIntersectionInclDynamicObjects(
+                        rstart, rdir, BVH.tree, BVH.meshVertices,
+                        Dynamic.data, Dynamic.numGroups,
+                        pos, intersection, normal, ptype, materialID, primitiveAddr, dynamicObject);
+
+                    if (ptype == -1) // ray hits the background
+                    {
+                        if (i == 0)
+                            pathColor = GetSkyColor(rdir0, sunDir, Sun.altitude);
+                        else
+                            pathColor += Mul(GetSkyColor(rdir, sunDir, Sun.altitude) * SKY_LIGHT_INTENSITY, colorWeight);
+                        break;
+                    }
+
+                    const Material material = GetHitMaterial(materialID, dynamicObject);
+
+                    if (material.IsEmissive())
+                    {
+                        const Vec3f &em = material.emission;
+                        if (i == 0)
+                            pathColor = em / std::max(std::max(em.x, em.y), em.z);
+                        else
+                        {
+                            // Multiple importance sampling with next-event estimation (see the shader)
+                            float weight = 1;
+                            if (bsdfPdf > 0 && Lights.totalPower > 0 && (ptype == SPHERE || ptype == DISC)
+                                && (primitiveAddr >= 0 || dynamicObject >= 0))
+                            {
+                                const float *centerRadius, *discNormal;
+                                if (dynamicObject >= 0)
+                                {
+                                    centerRadius = Fetch(Dynamic.data, dynamicObject + 1);
+                                    discNormal = Fetch(Dynamic.data, dynamicObject + 2);
+                                }
+                                else
+                                {
+                                    centerRadius = Fetch(BVH.tree, primitiveAddr);
+                                    discNormal = Fetch(BVH.tree, primitiveAddr + 1);
+                                }
+
+                                float lightPdf = GetLightPdf(ptype, centerRadius, Vec3f(discNormal).normalized(), em, Lights.totalPower,
+                                                             rstart, rdir.normalized(), pos * rdir.length());
+                                weight = PowerHeuristic(bsdfPdf, lightPdf);
+                            }
+
+                            pathColor += Mul(colorWeight, em) * weight;
+                        }
+                        break;
+                    }
+
+                    colorWeight = Mul(colorWeight, material.albedo);
+                    rstart = intersection;
+
+                    bool specularReflection = (material.specular >= 1
+                                               || (material.specular > 0
+                                                   && Random(Vec3f(intersection.z, intersection.x, intersection.y)
+                                                             + Vec3f(randSeed[3], randSeed[2], randSeed[1])) < material.specular));
+                    if (specularReflection)
+                    {
+                        if (material.roughness == 0)
+                            rdir = Reflect(rdir, normal);
+                        else
+                            rdir = GetRandomDirectionInsideCone(Reflect(rdir, normal), normal,
+                                                                material.roughness * MAX_ROUGHNESS_ANGLE,
+                                                                intersection + randSeedXYZ);
+                        bsdfPdf = 0;
+                    }
+                    else
+                    {
+                        rdir = GetRandomHemisphereDirection(normal, intersection + randSeedXYZ);
+                        bsdfPdf = std::max(rdir * normal, 0.0f) / PI;
+                    }
+
+                    // Sun's direct lighting contribution
+                    if (Sun.directLightingEnabled && !specularReflection)
+                    {
+                        if (!CheckOcclusionInclDynamicObjects(intersection, sunDir,
+                                                              BVH.tree, BVH.meshVertices,
+                                                              Dynamic.data, Dynamic.numGroups,
+                                                              NO_MAX_POS))
+                        {
+                            float dotp = sunDir * normal;
+                            if (dotp > 0)
+                                pathColor += material.albedo * dotp;
+                        }
+                    }
+
+                    // Next-event estimation
+                    if (Lights.totalPower > 0 && !specularReflection)
+                    {
+                        Vec3f lightDir, lightEmission;
+                        float lightDist, lightPdf;
+
+                        if (SampleLight(Lights.data, Lights.numLights, Lights.totalPower, intersection,
+                                        Vec3f(intersection.y, intersection.z, intersection.x) + Vec3f(randSeed[3], randSeed[0], randSeed[2]),
+                                        lightDir, lightDist, lightEmission, lightPdf))
+                        {
+                            float cosine = lightDir * normal;
+                            if (cosine > 0 && !CheckOcclusionInclDynamicObjects(intersection, lightDir,
+                                                                                 BVH.tree, BVH.meshVertices,
+                                                                                 Dynamic.data, Dynamic.numGroups,
+                                                                                 lightDist * (1 - LIGHT_DIST_TOLERANCE)))
+                            {
+                                bool pathContinues = (i + 1 < MAX_PATH_SEGMENTS && colorWeight.x > MIN_WEIGHT
+                                                      && colorWeight.y > MIN_WEIGHT && colorWeight.z > MIN_WEIGHT);
+                                float weight = (pathContinues ? PowerHeuristic(lightPdf, cosine / PI) : 1);
+
+                                pathColor += Mul(lightEmission, colorWeight) * (cosine / PI / lightPdf * weight);
+                            }
+                        }
+                    }
+                }
+
+                color += pathColor;
+            }
+
+            PathTracing.accumulator[x + y*Width] += color;
+        });
+
+        PathTracing.numPathsRendered += pathsToRender;
+    }
+
+    if (PathTracing.numPathsRendered > 0)
+        for (size_t i = 0; i < Image.size(); i++)
+            Image[i] = PathTracing.accumulator[i] / (float)PathTracing.numPathsRendered;
+
+    return PathTracing.numPathsRendered;
+}
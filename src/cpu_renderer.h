@@ -0,0 +1,208 @@
+/*
+GPU-Assisted Ray Tracer
+Copyright (C) 2016 Filip Szczerek <ga.software@yahoo.com>
+
+This file is part of gpuart.
+
+Gpuart is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Gpuart is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with gpuart.  If not, see <http://www.gnu.org/licenses/>.
+
+File description:
+    CPU reference renderer header
+*/
+
+#ifndef GPUART_CPU_RENDERER_HEADER
+#define GPUART_CPU_RENDERER_HEADER
+
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <vector>
+
+#include "bvh.h"
+#include "core.h"
+#include "math_types.h"
+
+
+namespace gpuart
+{
+    /** Renders on the CPU (using multiple threads) the same images as gpuart::Renderer,
+        without requiring OpenGL. Traverses the same compiled BVH tree and mirrors
+        the shaders' calculations, so results match those of the GPU up to floating-point
+        rounding differences (and, in path tracing, their effect on random directions). */
+    class CPURenderer
+    {
+        unsigned Width, Height;
+        unsigned NumThreads;
+
+        Camera CurrentCamera;
+
+        /// Screen geometry calculated from 'CurrentCamera' (see Camera::GetScreen())
+        struct
+        {
+            Vec3f bottomLeft, deltaHorz, deltaVert;
+        } Screen;
+
+        struct
+        {
+            Primitive::Data tree;
+            std::vector<Vec3f> meshVertices;
+            Primitive::Data materials; ///< Material table (see StoreMaterials())
+
+            /// Max. number of children of a node in the compiled tree
+            unsigned width;
+        } BVH;
+
+        struct
+        {
+            float azimuth; ///< 0 to 2*pi
+            float altitude; ///< 0 to pi/2
+
+            bool directLightingEnabled;
+        } Sun;
+
+        /// User-controlled objects, see AddDynamicObject()
+        struct
+        {
+            /// The first one is the user sphere
+            std::vector<DynamicObject> objects;
+
+            /// Set if 'objects' have changed since they were last stored into 'data'
+            bool modified;
+
+            Primitive::Data data; ///< Stored by StoreDynamicObjects()
+            unsigned numGroups;
+        } Dynamic;
+
+        /// Light list (see StoreLights()): the scene's emissive primitives followed by the emissive dynamic objects
+        struct
+        {
+            Primitive::Data scene; ///< Lights of the scene's primitives
+
+            /// Set if 'scene' has changed since the list was last stored into 'data'
+            bool modified;
+
+            Primitive::Data data;
+            unsigned numLights;
+            unsigned numSceneLights; ///< Lights of 'scene', at the start of 'data'
+            float totalPower; ///< Returned by SetLightSelectionProbabilities()
+        } Lights;
+
+        /// Index of the user sphere in 'Dynamic.objects'
+        static const size_t USER_SPHERE = 0;
+
+        /// Stores the dynamic objects into 'Dynamic.data' and the light list into 'Lights.data' if they were modified
+        void UpdateDynamicObjects();
+
+        struct
+        {
+            /// Sum of radiance of all paths rendered since the last call to RestartPathTracing()
+            std::vector<Vec3f> accumulator;
+
+            unsigned numPathsRendered;
+            unsigned pathsPerPixel;
+            unsigned pathsPerPass; ///< less than or equal to 'pathsPerPixel'
+        } PathTracing;
+
+        /// Provides random seeds of path tracing passes (as in gpuart::Renderer)
+        std::mt19937 RndGen;
+
+        /// Result of the last rendering
+        std::vector<Vec3f> Image;
+
+        Vec3f GetSunDirection() const
+        {
+            return Vec3f(1, 0, 0).vroty(-Sun.altitude)
+                                 .vrotz(Sun.azimuth);
+        }
+
+        /// Calls 'renderPixel(x, y)' for every pixel, using 'NumThreads' threads
+        void ForEachPixel(const std::function<void (unsigned, unsigned)> &renderPixel) const;
+
+        /// Returns the camera ray's origin and direction of pixel (x, y) (as calculated by the camera init. shader)
+        void GetCameraRay(unsigned x, unsigned y, Vec3f &rstart, Vec3f &rdir) const;
+
+        void ResetPathTracing();
+
+        /** Returns the material of an intersection found by CheckIntersectionInclDynamicObjects(): a dynamic object's one
+            is stored in its type header, other primitives' ones in the material table (as read by the shaders) */
+        Material GetHitMaterial(int materialID, int dynamicObject) const;
+
+    public:
+
+        /// Uses 'numThreads' threads for rendering (0: all hardware threads)
+        CPURenderer(unsigned width, unsigned height, const Camera &camera, unsigned numThreads = 0);
+
+        /** After calling this method, 'primitives' are no longer used. If 'printInfo' is true,
+            construction details are printed to stdout. */
+        void SetPrimitives(const PrimitiveSet &primitives, bool printInfo,
+                           BVHBuildStrategy strategy = BVHBuildStrategy::Midpoint);
+
+        /** Builds a two-level hierarchy (see TwoLevelBVH) of 'instances' of 'meshes'; returns 'false' on failure.
+            If 'printInfo' is true, construction details are printed to stdout. */
+        bool SetInstancedScene(const std::vector<PrimitiveSet> &meshes, const std::vector<MeshInstance> &instances,
+                               bool printInfo, BVHBuildStrategy strategy = BVHBuildStrategy::Midpoint);
+
+        /** Sets the max. number of children of a node (2 to BoundingVolumesHierarchy::MAX_CHILDREN)
+            in the BVH tree compiled by subsequent calls to SetPrimitives(). */
+        void SetBVHWidth(unsigned width) { BVH.width = width; }
+
+        void SetCamera(const Camera &cam);
+
+        /// Sets Sun's azimuth (0 to 2*pi)
+        void SetSunAzimuth(float azimuth) { Sun.azimuth = azimuth; ResetPathTracing(); }
+
+        /// Sets Sun's altitude (0 to pi/2)
+        void SetSunAltitude(float altitude) { Sun.altitude = altitude; ResetPathTracing(); }
+
+        void SetSunDirectLighting(bool enabled = true) { Sun.directLightingEnabled = enabled; ResetPathTracing(); }
+
+        /** Adds a user-controlled sphere, disc or cone (see gpuart::Renderer::AddDynamicObject());
+            returns its index. Index 0 is the user sphere (see SetUserSphere()). */
+        size_t AddDynamicObject(const DynamicObject &object);
+
+        /// Replaces (e.g. moves) the dynamic object with index 'index'
+        void SetDynamicObject(size_t index, const DynamicObject &object);
+
+        const DynamicObject &GetDynamicObject(size_t index) const { return Dynamic.objects.at(index); }
+
+        size_t GetNumDynamicObjects() const { return Dynamic.objects.size(); }
+
+        /// Removes all dynamic objects except the user sphere
+        void ClearDynamicObjects();
+
+        /// Use radius=0 to effectively disable the user-controlled sphere
+        void SetUserSphere(const Vec3f &pos, float radius, float emittance);
+
+        void SetUserSphereSpecular(bool specular);
+
+        void SetUserSphereFuzzy(bool fuzzy);
+
+        void RenderDirectLighting();
+
+        void RestartPathTracing(unsigned pathsPerPass, unsigned pathsPerPixel);
+
+        /// Returns number of rendered paths per pixel
+        unsigned RenderPathTracingPass();
+
+        unsigned GetWidth() const  { return Width; }
+        unsigned GetHeight() const { return Height; }
+
+        /** Returns the result of the last rendering (for path tracing: normalized radiance
+            of all passes so far). Pixels are stored row by row, starting with the bottom row
+            (as read from OpenGL). */
+        const std::vector<Vec3f> &GetImage() const { return Image; }
+    };
+}
+
+#endif // GPUART_CPU_RENDERER_HEADER
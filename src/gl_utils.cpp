@@ -22,12 +22,14 @@ File description:
 */
 
 
+#include <algorithm>
 #include <cassert>
 #include <fstream>
 #include <iostream>
 #include <map>
 #include <memory>
 #include <string.h>
+#include <string>
 #include <vector>
 
 #include "core.h"
@@ -154,7 +156,31 @@ bool gpuart::GL::Init()
     return (FullscreenQuad.vertices && FullscreenQuad.elements);
 }
 
-gpuart::GL::Shader::Shader(GLenum type, const char *srcFileName)
+/** Copies 'size' bytes of 'data' to 'offset' by writing to a mapped, invalidated range without
+    synchronization (the range must not be in use by pending GL commands); returns 'false' on failure. */
+bool gpuart::GL::Buffer::Upload(GLenum target, GLintptr offset, const void *data, GLsizeiptr size)
+{
+    glBindBuffer(target, GLbuffer.Get());
+
+    void *dest = glMapBufferRange(target, offset, size, GL_MAP_WRITE_BIT
+                                                        | GL_MAP_INVALIDATE_RANGE_BIT
+                                                        | GL_MAP_UNSYNCHRONIZED_BIT);
+    if (!dest)
+    {
+        // Fall back to a regular (driver-copied) update
+        glBufferSubData(target, offset, size, data);
+        return true;
+    }
+
+    memcpy(dest, data, (size_t)size);
+
+    // The contents of a mapped buffer may be lost, e.g. on a video mode change
+    return glUnmapBuffer(target) == GL_TRUE;
+}
+
+/** If 'defines' is not null, it is inserted after the source's '#version' line
+    (e.g. "#define NAME\n" to compile a variant of the shader). */
+gpuart::GL::Shader::Shader(GLenum type, const char *srcFileName, const char *defines)
 {
     GLint srcLength;
     std::unique_ptr<GLchar[]> source = ReadTextFile(srcFileName, &srcLength);
@@ -164,7 +190,20 @@ gpuart::GL::Shader::Shader(GLenum type, const char *srcFileName)
     else
     {
         GLshader.Get() = glCreateShader(type);
-        glShaderSource(GLshader.Get(), 1, (const GLchar**)&source, &srcLength);
+
+        // Split the source after the '#version' line (which has to come first) if there are defines to insert
+        GLint versionLineLength = 0;
+        if (defines)
+        {
+            const std::string srcStr(source.get(), srcLength);
+            size_t versionPos = srcStr.find("#version");
+            if (versionPos != std::string::npos)
+                versionLineLength = (GLint)std::min(srcStr.find('\n', versionPos) + 1, srcStr.size());
+        }
+
+        const GLchar *strings[] = { source.get(), defines ? defines : "", source.get() + versionLineLength };
+        const GLint lengths[] = { versionLineLength, defines ? (GLint)strlen(defines) : 0, srcLength - versionLineLength };
+        glShaderSource(GLshader.Get(), 3, strings, lengths);
 
         glCompileShader(GLshader.Get());
         GLint success;
@@ -297,3 +336,50 @@ void gpuart::GL::Framebuffer::Bind()
     glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &PrevBuf);
     glBindFramebuffer(GL_DRAW_FRAMEBUFFER, GLframebuffer.Get());
 }
+
+/// An OpenGL context must be current
+gpuart::GL::StageTimer::StageTimer(): Oldest(0), NumPending(0), Active(false), LastResultMs(-1)
+{
+    for (Query &query: Queries)
+        query = Query(GL_TIME_ELAPSED);
+}
+
+/** Starts measurement; if all queries are still pending (the GPU is more than
+    NUM_QUERIES measurements behind), this measurement is skipped. */
+void gpuart::GL::StageTimer::Begin()
+{
+    assert(!Active);
+    Poll();
+    if (NumPending < NUM_QUERIES)
+    {
+        Queries[(Oldest + NumPending) % NUM_QUERIES].Begin();
+        Active = true;
+    }
+}
+
+void gpuart::GL::StageTimer::End()
+{
+    if (Active)
+    {
+        Queries[(Oldest + NumPending) % NUM_QUERIES].End();
+        NumPending++;
+        Active = false;
+    }
+}
+
+/// Collects available results; returns 'true' if there was a new one
+bool gpuart::GL::StageTimer::Poll()
+{
+    bool newResult = false;
+
+    // Queries complete in order of submission
+    while (NumPending > 0 && Queries[Oldest].IsResultAvailable())
+    {
+        LastResultMs = Queries[Oldest].GetResult() * 1.0e-6;
+        Oldest = (Oldest + 1) % NUM_QUERIES;
+        NumPending--;
+        newResult = true;
+    }
+
+    return newResult;
+}
@@ -131,6 +131,13 @@ namespace gpuart
                 glBufferData(target, size, data, usage);
             }
 
+            /// Allocates uninitialized storage of 'size' bytes; fill it with Upload()
+            Buffer(GLenum target, GLsizeiptr size, GLenum usage): Buffer(target, nullptr, (GLsizei)size, usage) { }
+
+            /** Copies 'size' bytes of 'data' to 'offset' by writing to a mapped, invalidated range without
+                synchronization (the range must not be in use by pending GL commands); returns 'false' on failure. */
+            bool Upload(GLenum target, GLintptr offset, const void *data, GLsizeiptr size);
+
             GLuint Get() const { return GLbuffer.GetConst(); }
         };
 
@@ -196,7 +203,9 @@ namespace gpuart
             Shader(Shader &&)                  = default;
             Shader & operator=(Shader &&)      = default;
 
-            Shader(GLenum type, const char *srcFileName);
+            /** If 'defines' is not null, it is inserted after the source's '#version' line
+                (e.g. "#define NAME\n" to compile a variant of the shader). */
+            Shader(GLenum type, const char *srcFileName, const char *defines = nullptr);
 
             const char *GetInfoLog() const { return InfoLog.get(); }
 
@@ -339,6 +348,8 @@ namespace gpuart
 
             Framebuffer(std::initializer_list<Texture*> attachedTextures);
 
+            GLuint Get() const { return GLframebuffer.GetConst(); }
+
             void Bind();
 
             /// Binds the framebuffer that was bound prior to calling Bind()
@@ -370,6 +381,109 @@ namespace gpuart
             FramebufferBinder & operator=(FramebufferBinder &&)      = delete;
         };
 
+        /// Movable, non-copyable
+        class Query
+        {
+            static void Deleter(GLuint obj) { glDeleteQueries(1, &obj); }
+            Wrapper<Deleter> GLquery;
+            GLenum Target;
+
+        public:
+
+            explicit operator bool() const { return static_cast<bool>(GLquery); }
+
+            Query() = default;
+
+            Query(const Query &)             = delete;
+            Query & operator=(const Query &) = delete;
+            Query(Query &&)                  = default;
+            Query & operator=(Query &&)      = default;
+
+            /// Creates a query object for 'target' (e.g. GL_TIME_ELAPSED)
+            explicit Query(GLenum target): Target(target)
+            {
+                glGenQueries(1, &GLquery.Get());
+            }
+
+            void Begin() { glBeginQuery(Target, GLquery.Get()); }
+
+            void End() { glEndQuery(Target); }
+
+            /// Returns 'true' if the result can be read without waiting
+            bool IsResultAvailable() const
+            {
+                GLuint available = GL_FALSE;
+                glGetQueryObjectuiv(GLquery.GetConst(), GL_QUERY_RESULT_AVAILABLE, &available);
+                return available == GL_TRUE;
+            }
+
+            /// Waits for the result if it is not yet available
+            GLuint64 GetResult() const
+            {
+                GLuint64 result = 0;
+                glGetQueryObjectui64v(GLquery.GetConst(), GL_QUERY_RESULT, &result);
+                return result;
+            }
+        };
+
+        /** Measures GPU execution time of a rendering stage with GL_TIME_ELAPSED queries
+            without stalling the pipeline: each measurement uses the next query of a small ring,
+            and results are collected by Poll() once available (usually a frame later).
+            Timers must not be nested, as only one GL_TIME_ELAPSED query can be active. Non-copyable. */
+        class StageTimer
+        {
+            static const unsigned NUM_QUERIES = 4;
+
+            Query Queries[NUM_QUERIES];
+            unsigned Oldest;     ///< Index of the oldest pending query
+            unsigned NumPending; ///< Number of ended queries whose results have not been collected
+            bool Active;         ///< 'true' between Begin() and End()
+            double LastResultMs;
+
+        public:
+
+            /// An OpenGL context must be current
+            StageTimer();
+
+            StageTimer(const StageTimer &)             = delete;
+            StageTimer & operator=(const StageTimer &) = delete;
+
+            /** Starts measurement; if all queries are still pending (the GPU is more than
+                NUM_QUERIES measurements behind), this measurement is skipped. */
+            void Begin();
+
+            void End();
+
+            /// Collects available results; returns 'true' if there was a new one
+            bool Poll();
+
+            /// Returns the most recent collected result in milliseconds, or a negative value if none
+            double GetLastResultMs() const { return LastResultMs; }
+        };
+
+        /// Calls StageTimer::Begin() on construction and End() on destruction
+        class StageTimerScope
+        {
+            StageTimer &Timer;
+        public:
+
+            StageTimerScope(StageTimer &timer): Timer(timer)
+            {
+                Timer.Begin();
+            }
+
+            ~StageTimerScope()
+            {
+                Timer.End();
+            }
+
+            StageTimerScope() = delete;
+            StageTimerScope(const StageTimerScope &)             = delete;
+            StageTimerScope & operator=(const StageTimerScope &) = delete;
+            StageTimerScope(StageTimerScope &&)                  = delete;
+            StageTimerScope & operator=(StageTimerScope &&)      = delete;
+        };
+
         namespace Utils
         {
             /// Returns 'false' on failure
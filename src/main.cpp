@@ -22,8 +22,11 @@ File description:
 */
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <chrono>
+#include <functional>
+#include <future>
 #include <initializer_list>
 #include <random>
 #include <fstream>
@@ -34,11 +37,13 @@ File description:
 #include <stdexcept>
 #include <string>
 
+#include "bvh_cache.h"
 #include "core.h"
 #include "gl_utils.h"
 #include "math_types.h"
 #include "renderer.h"
 #include "scenes.h"
+#include "traversal_stats.h"
 #include "utils.h"
 
 
@@ -82,6 +87,25 @@ class GPUARTApp: public nanogui::Screen
         unsigned PathsPerPass = 1;
     } Rendering;
 
+    /// Traversal statistics (see gpuart::TraversalStat)
+    struct
+    {
+        bool heatmapEnabled = false;
+        gpuart::TraversalStat heatmapStat = gpuart::TraversalStat::NodesVisited;
+        float heatmapMax = 100;
+
+        /// If 'true', statistics of the next rendered frame are printed to stdout
+        bool printRequested = false;
+    } TraversalStats;
+
+    void UpdateTraversalStats()
+    {
+        if (!Renderer->SetTraversalStatsEnabled(TraversalStats.heatmapEnabled || TraversalStats.printRequested))
+            throw std::runtime_error("Failed to enable traversal statistics");
+
+        Renderer->SetTraversalHeatmap(TraversalStats.heatmapEnabled, TraversalStats.heatmapStat, TraversalStats.heatmapMax);
+    }
+
     struct
     {
         enum class MouseMode { Camera, UserSphere };
@@ -124,6 +148,45 @@ class GPUARTApp: public nanogui::Screen
 
     std::unique_ptr<gpuart::Renderer> Renderer;
 
+    struct
+    {
+        int current = 0; ///< Index of the current scene in the "Scene" combo box
+        gpuart::BVHBuildStrategy bvhStrategy = gpuart::BVHBuildStrategy::Midpoint;
+
+        /// If 'true', compiled BVH trees are stored in and loaded from cache files (see gpuart::BVHCache)
+        bool useBVHCache = true;
+
+        /// 'false' until the first scene has been uploaded
+        bool ready = false;
+    } Scene;
+
+    /** Scene preparation (loading and BVH construction) on a worker thread;
+        the previous scene keeps being rendered until the new one is uploaded. */
+    struct
+    {
+        /// Written by the worker; valid once 'worker' is ready and has returned 'true'
+        gpuart::Renderer::CompiledScene compiled;
+
+        /// Current stage's description (a string literal) and approximate progress (0 to 1); set by the worker
+        std::atomic<const char*> stage;
+        std::atomic<float> fraction;
+
+        double tStart;
+
+        /// 'true' while the render thread uploads the prepared scene (see gpuart::Renderer::ContinueSceneUpload())
+        bool uploading = false;
+        std::chrono::high_resolution_clock::time_point tUploadStart;
+
+        /// Limits the time spent on uploading in a single frame
+        const size_t UPLOAD_BYTES_PER_FRAME = 32 << 20;
+
+        /// Scene requested while busy (preparing or uploading); it is started afterwards (-1: none)
+        int pendingSceneIdx = -1;
+
+        /// Declared last, so that it is destroyed (which waits for the worker) before the members used by the worker
+        std::future<bool> worker;
+    } SceneLoader;
+
     struct
     {
         std::vector<nanogui::Window*> Windows;
@@ -135,6 +198,7 @@ class GPUARTApp: public nanogui::Screen
         struct
         {
             nanogui::Label *renderSpeed;
+            nanogui::Label *stageTimes; ///< GPU times of rendering passes
             nanogui::Label *screenSize;
             struct
             {
@@ -144,6 +208,14 @@ class GPUARTApp: public nanogui::Screen
                 nanogui::Widget *w;
             } PathTracingProgress;
 
+            struct
+            {
+                nanogui::ProgressBar *pbar;
+                nanogui::Label *label;
+
+                nanogui::Widget *w;
+            } SceneLoading;
+
         } Info;
     } GUI;
 
@@ -158,6 +230,187 @@ class GPUARTApp: public nanogui::Screen
         GUI.Info.screenSize->setCaption(gpuart::Utils::FormatStr("%dx%d (%.1f Mpix)", w, h, w*h/1000000.0).get());
     }
 
+    /** Loads the scene and compiles its BVH, or maps the BVH cache file if 'useCache' is true and there is one
+        (otherwise the cache file is created); called on the worker thread. Returns 'false' on failure. */
+    static bool PrepareScene(const char *sceneName, const gpuart::BVHBuildParams &params, bool useCache,
+                             gpuart::Renderer::CompiledScene &scene,
+                             const std::function<void(const char *stage, float fraction)> &progress)
+    {
+        uint64_t cacheKey;
+        std::string cacheFileName;
+        if (useCache)
+        {
+            progress("Checking BVH cache", 0.0f);
+
+            if (gpuart::BVHCache::GetKey(sceneName, GetSceneInputFiles(sceneName), params, cacheKey))
+            {
+                cacheFileName = gpuart::BVHCache::GetFileName(sceneName, cacheKey);
+
+                std::unique_ptr<gpuart::BVHCache::File> cacheFile(new gpuart::BVHCache::File(cacheFileName.c_str(), cacheKey));
+                if (cacheFile->IsValid())
+                {
+                    std::cout << "Using cached BVH from \"" << cacheFileName << "\"." << std::endl;
+                    scene = gpuart::Renderer::CompiledScene();
+                    scene.cacheFile = std::move(cacheFile);
+                    return true;
+                }
+            }
+        }
+
+        progress("Loading scene", 0.0f);
+
+        gpuart::PrimitiveSet primitives;
+        if (!CreateScene(sceneName, primitives))
+            return false;
+
+        scene = gpuart::Renderer::CompileScene(primitives, params, true, progress);
+
+        if (!cacheFileName.empty() && gpuart::BVHCache::Save(cacheFileName.c_str(), cacheKey, params,
+                                                                  scene.tree, scene.meshVertices, scene.materials,
+                                                                  scene.lights))
+            std::cout << "Saved BVH cache file \"" << cacheFileName << "\"." << std::endl;
+
+        return true;
+    }
+
+    /// Starts preparing the scene in the background; it replaces the current one once ready (see PollSceneLoading())
+    void LoadScene(int sceneIdx)
+    {
+        Scene.current = sceneIdx;
+
+        if (SceneLoader.worker.valid() || SceneLoader.uploading)
+        {
+            // The worker cannot be interrupted; only the most recent request is started after it finishes
+            SceneLoader.pendingSceneIdx = sceneIdx;
+            return;
+        }
+
+        SceneLoader.stage = "Loading scene";
+        SceneLoader.fraction = 0;
+        SceneLoader.tStart = glfwGetTime();
+
+        // Correspond with items of the "Scene" combo box
+        static const char *SCENE_NAMES[] = { "box", "boxlight", "dragon11k", "dragon48k", "dragon871k", "cluster100k", "tree21k" };
+
+        gpuart::BVHBuildParams params;
+        params.strategy = Scene.bvhStrategy;
+        params.width = Renderer->GetBVHWidth();
+
+        const bool useCache = Scene.useBVHCache;
+
+        SceneLoader.worker = std::async(std::launch::async, [this, sceneIdx, params, useCache]() -> bool
+            {
+                // Exceptions (e.g. std::bad_alloc for a scene too big) would be rethrown by get() on the main thread
+                try
+                {
+                    return PrepareScene(SCENE_NAMES[sceneIdx], params, useCache, SceneLoader.compiled,
+                                        [this](const char *stage, float fraction)
+                                        {
+                                            SceneLoader.stage = stage;
+                                            SceneLoader.fraction = fraction;
+                                        });
+                }
+                catch (const std::exception &e)
+                {
+                    std::cerr << "Failed to prepare scene \"" << SCENE_NAMES[sceneIdx] << "\": " << e.what() << std::endl;
+                    SceneLoader.compiled = gpuart::Renderer::CompiledScene();
+                    return false;
+                }
+            });
+
+        GUI.Info.SceneLoading.w->setVisible(true);
+        UpdateSceneLoadingProgress();
+        performLayout();
+    }
+
+    void UpdateSceneLoadingProgress()
+    {
+        GUI.Info.SceneLoading.label->setCaption(gpuart::Utils::FormatStr("%s... (%.1f s)", SceneLoader.stage.load(),
+                                                                         glfwGetTime() - SceneLoader.tStart).get());
+        GUI.Info.SceneLoading.pbar->setValue(SceneLoader.fraction);
+    }
+
+    /// Starts the pending scene request, if any; returns 'false' if there is none
+    bool StartPendingScene()
+    {
+        if (SceneLoader.pendingSceneIdx < 0)
+            return false;
+
+        const int sceneIdx = SceneLoader.pendingSceneIdx;
+        SceneLoader.pendingSceneIdx = -1;
+        LoadScene(sceneIdx);
+
+        return true;
+    }
+
+    /** Uploads the scene prepared by the worker (if it has finished) in chunks spread over
+        several frames, then switches to it; called every frame. */
+    void PollSceneLoading()
+    {
+        if (SceneLoader.uploading)
+        {
+            if (!Renderer->ContinueSceneUpload(SceneLoader.UPLOAD_BYTES_PER_FRAME))
+            {
+                SceneLoader.fraction = Renderer->GetSceneUploadProgress();
+                UpdateSceneLoadingProgress();
+                return;
+            }
+
+            SceneLoader.uploading = false;
+            std::cout << "Scene uploaded (" << gpuart::Utils::TimeElapsed(SceneLoader.tUploadStart) << ").\n" << std::endl;
+
+            Scene.ready = true;
+
+            if (Rendering.mode == Rendering.Mode::PathTracing)
+            {
+                UpdatePathTracingProgress(0, Rendering.PathsPerPixel);
+                Renderer->RestartPathTracing(Rendering.PathsPerPass, Rendering.PathsPerPixel);
+            }
+
+            if (!StartPendingScene())
+            {
+                GUI.Info.SceneLoading.w->setVisible(false);
+                performLayout();
+            }
+            return;
+        }
+
+        if (!SceneLoader.worker.valid())
+            return;
+
+        if (SceneLoader.worker.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        {
+            UpdateSceneLoadingProgress();
+            return;
+        }
+
+        const bool created = SceneLoader.worker.get();
+
+        // If there is a newer request, the result is outdated; free it before building the next scene
+        if (SceneLoader.pendingSceneIdx >= 0)
+        {
+            SceneLoader.compiled = gpuart::Renderer::CompiledScene();
+            StartPendingScene();
+            return;
+        }
+
+        if (created)
+        {
+            SceneLoader.stage = "Uploading";
+            SceneLoader.fraction = 0;
+            SceneLoader.tUploadStart = std::chrono::high_resolution_clock::now();
+            SceneLoader.uploading = true;
+
+            Renderer->BeginSceneUpload(std::move(SceneLoader.compiled));
+            UpdateSceneLoadingProgress();
+        }
+        else
+        {
+            GUI.Info.SceneLoading.w->setVisible(false);
+            performLayout();
+        }
+    }
+
     void SetVertLayout(nanogui::Window *wnd)
     {
         wnd->setLayout(new nanogui::BoxLayout(nanogui::Orientation::Vertical, nanogui::Alignment::Minimum, 10, 5));
@@ -182,10 +435,18 @@ class GPUARTApp: public nanogui::Screen
 
         GUI.Info.screenSize = new nanogui::Label(wndInfo, "", "sans-bold");
 
+        GUI.Info.SceneLoading.w = new nanogui::Widget(wndInfo);
+        GUI.Info.SceneLoading.w->setLayout(new nanogui::BoxLayout(nanogui::Orientation::Vertical, nanogui::Alignment::Middle, 0, 5));
+        GUI.Info.SceneLoading.w->setVisible(false);
+        GUI.Info.SceneLoading.label = new nanogui::Label(GUI.Info.SceneLoading.w, "Loading scene... (000.0 s)");
+        GUI.Info.SceneLoading.pbar = new nanogui::ProgressBar(GUI.Info.SceneLoading.w);
+
         w = CreateHorzBox(*wndInfo);
         new nanogui::Label(w, "Speed:");
         GUI.Info.renderSpeed = new nanogui::Label(w, "", "sans-bold");
 
+        GUI.Info.stageTimes = new nanogui::Label(wndInfo, "");
+
         GUI.Info.PathTracingProgress.w = new nanogui::Widget(wndInfo);
         GUI.Info.PathTracingProgress.w->setLayout(new nanogui::BoxLayout(nanogui::Orientation::Vertical, nanogui::Alignment::Middle, 0, 5));
         GUI.Info.PathTracingProgress.w->setVisible(false);
@@ -295,6 +556,41 @@ class GPUARTApp: public nanogui::Screen
         mouseMode->setCallback([this](int item) { Controls.Mode = (item == 0 ? Controls.MouseMode::Camera
                                                                              : Controls.MouseMode::UserSphere); });
 
+        w = CreateHorzBox(*wndRendering);
+        new nanogui::Label(w, "Heatmap:");
+        auto heatmap = new nanogui::ComboBox(w, { "off",
+                                                  gpuart::GetTraversalStatName(gpuart::TraversalStat::NodesVisited),
+                                                  gpuart::GetTraversalStatName(gpuart::TraversalStat::AABBTests),
+                                                  gpuart::GetTraversalStatName(gpuart::TraversalStat::PrimitiveTests),
+                                                  gpuart::GetTraversalStatName(gpuart::TraversalStat::PathLength) });
+        heatmap->setCallback([this](int item)
+            {
+                TraversalStats.heatmapEnabled = (item > 0);
+                if (item > 0)
+                    TraversalStats.heatmapStat = (gpuart::TraversalStat)(item - 1);
+                UpdateTraversalStats();
+            });
+
+        w = CreateHorzBox(*wndRendering);
+        new nanogui::Label(w, "Heatmap max.:");
+        auto heatmapMax = new nanogui::FloatBox<float>(w, TraversalStats.heatmapMax);
+        heatmapMax->setMinMaxValues(1, 10000);
+        heatmapMax->setValueIncrement(10);
+        heatmapMax->setEditable(true);
+        heatmapMax->setSpinnable(true);
+        heatmapMax->setCallback([this](float val)
+            {
+                TraversalStats.heatmapMax = val;
+                UpdateTraversalStats();
+            });
+
+        auto printStats = new nanogui::Button(wndRendering, "Print traversal statistics");
+        printStats->setCallback([this]()
+            {
+                TraversalStats.printRequested = true;
+                UpdateTraversalStats();
+            });
+
         //----------------------------------
 
         nanogui::Window *wndScene = new nanogui::Window(this, "Scene");
@@ -306,27 +602,38 @@ class GPUARTApp: public nanogui::Screen
         w = CreateHorzBox(*wndScene);
         new nanogui::Label(w, "Scene:");
         auto scenes = new nanogui::ComboBox(w, { "box",
+                                                 "box with light",
                                                  "dragon 11k",
                                                  "dragon 48k",
                                                  "dragon 871k",
                                                  "cluster 100k",
                                                  "tree 21k" });
-        scenes->setCallback([this](int sel)
+        scenes->setCallback([this](int sel) { LoadScene(sel); });
+
+        w = CreateHorzBox(*wndScene);
+        new nanogui::Label(w, "BVH:");
+        auto bvhStrategy = new nanogui::ComboBox(w, { "midpoint", "SAH" });
+        bvhStrategy->setCallback([this](int item)
             {
-                switch (sel)
-                {
-                case 0: InitBox(*Renderer); break;
-                case 1: InitDragon(*Renderer, "data/dragon_11k.ply"); break;
-                case 2: InitDragon(*Renderer, "data/dragon_48k.ply"); break;
-                case 3: InitDragon(*Renderer, "data/dragon_871k.ply"); break;
-                case 4: InitCluster(*Renderer); break;
-                case 5: InitTree(*Renderer); break;
-                }
+                Scene.bvhStrategy = (item == 0 ? gpuart::BVHBuildStrategy::Midpoint
+                                               : gpuart::BVHBuildStrategy::SAH);
+                LoadScene(Scene.current);
+            });
 
-                if (Rendering.mode == Rendering.Mode::PathTracing)
-                    Renderer->RestartPathTracing(Rendering.PathsPerPass, Rendering.PathsPerPixel);
+        w = CreateHorzBox(*wndScene);
+        new nanogui::Label(w, "BVH width:");
+        auto bvhWidth = new nanogui::ComboBox(w, { "2", "4", "8" });
+        bvhWidth->setSelectedIndex(Renderer->GetBVHWidth() == 2 ? 0 : (Renderer->GetBVHWidth() == 4 ? 1 : 2));
+        bvhWidth->setCallback([this](int item)
+            {
+                Renderer->SetBVHWidth(2U << item);
+                LoadScene(Scene.current);
             });
 
+        auto bvhCache = new nanogui::CheckBox(wndScene, "Cache compiled BVH",
+                                              [this](bool checked) { Scene.useBVHCache = checked; });
+        bvhCache->setChecked(Scene.useBVHCache);
+
         w = CreateHorzBox(*wndScene);
         new nanogui::Label(w, "Sphere radius:");
         auto *sphR = new nanogui::FloatBox<float>(w, Renderer->GetUserSphereRadius());
@@ -549,6 +856,7 @@ class GPUARTApp: public nanogui::Screen
     void drawContents() override
     {
         ProcessZoom();
+        PollSceneLoading();
 
 
         if (GUI.pathsChanged
@@ -561,15 +869,19 @@ class GPUARTApp: public nanogui::Screen
             GUI.pathsChanged = false;
         }
 
-        glFinish();
-        double tRenderStart = glfwGetTime();
-
         if (Camera.MustUpdate)
         {
             Renderer->SetCamera(Camera.Cam);
             Camera.MustUpdate = false;
         }
 
+        if (!Scene.ready)
+        {
+            // Nothing to render until the first scene is uploaded
+            glfwPostEmptyEvent();
+            return;
+        }
+
         switch (Rendering.mode)
         {
             case Rendering.Mode::DirectLighting: Renderer->RenderDirectLighting(); break;
@@ -581,17 +893,49 @@ class GPUARTApp: public nanogui::Screen
                 break;
         }
 
-        glFinish();
+        if (TraversalStats.printRequested)
+        {
+            std::vector<float> stats;
+            Renderer->ReadTraversalStats(stats);
+            std::cout << "Traversal statistics:\n";
+            gpuart::PrintTraversalStats(stats, std::cout);
 
-        double tNow = glfwGetTime();
-        double renderTime = tNow - tRenderStart;
+            TraversalStats.printRequested = false;
+            UpdateTraversalStats();
+        }
 
+        double tNow = glfwGetTime();
         if (tNow - TPrevSec >= 1.0)
         {
             TPrevSec = tNow;
 
-            GUI.Info.renderSpeed->setCaption(
-                    gpuart::Utils::FormatStr("%.1f ms (%u/s)", renderTime*1000, (unsigned)(1.0/renderTime)).get());
+            // GPU times of the passes are collected asynchronously (they refer to an earlier frame)
+            gpuart::Renderer::StageTimes times = Renderer->GetStageTimes();
+            auto nonNegative = [](double t) { return std::max(t, 0.0); };
+
+            double renderTimeMs;
+            if (Rendering.mode == Rendering.Mode::DirectLighting)
+            {
+                renderTimeMs = nonNegative(times.directLighting);
+                GUI.Info.stageTimes->setCaption(
+                    gpuart::Utils::FormatStr("cam. init %.2f, direct %.2f ms",
+                                             nonNegative(times.camInit), renderTimeMs).get());
+            }
+            else
+            {
+                renderTimeMs = nonNegative(times.ptracingNormalize);
+                if (Renderer->GetNumPathsRendered() < Renderer->GetPathsPerPixel())
+                    renderTimeMs += nonNegative(times.pathTracing);
+
+                GUI.Info.stageTimes->setCaption(
+                    gpuart::Utils::FormatStr("cam. init %.2f, path %.2f, norm. %.2f ms",
+                                             nonNegative(times.camInit), nonNegative(times.pathTracing),
+                                             nonNegative(times.ptracingNormalize)).get());
+            }
+
+            if (renderTimeMs > 0)
+                GUI.Info.renderSpeed->setCaption(
+                        gpuart::Utils::FormatStr("%.1f ms (%u/s)", renderTimeMs, (unsigned)(1000/renderTimeMs)).get());
             performLayout();
         }
 
@@ -620,9 +964,9 @@ public:
             throw std::runtime_error("Renderer initialization failed");
 
         Renderer->SetUserSphere(Vec3f(-0.4f, 0, 0.2f), 0, 0);
-        InitBox(*Renderer);
 
         InitGUI();
+        LoadScene(0);
         UpdateScreenSizeInfo(mFBSize[0], mFBSize[1]);
 
         TPrevSec = glfwGetTime();
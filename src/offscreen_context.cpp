@@ -0,0 +1,226 @@
+/*
+GPU-Assisted Ray Tracer
+Copyright (C) 2016 Filip Szczerek <ga.software@yahoo.com>
+
+This file is part of gpuart.
+
+Gpuart is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Gpuart is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with gpuart.  If not, see <http://www.gnu.org/licenses/>.
+
+File description:
+    Window-less OpenGL context implementation
+*/
+
+#include <cstring>
+#include <iostream>
+
+#if defined(GPUART_HEADLESS_EGL)
+  #include <EGL/egl.h>
+  #include <EGL/eglext.h>
+#elif defined(GPUART_HEADLESS_OSMESA)
+  #include <GL/osmesa.h>
+#else
+  #include <nanogui/nanogui.h> // includes GLFW and the OpenGL function loader (if any)
+#endif
+
+#include "offscreen_context.h"
+
+
+#if defined(GPUART_HEADLESS_EGL)
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+static bool HasExtension(const char *extensions, const char *name)
+{
+    if (!extensions)
+        return false;
+
+    const size_t len = std::strlen(name);
+    for (const char *ext = std::strstr(extensions, name); ext; ext = std::strstr(ext + len, name))
+        if ((ext == extensions || ext[-1] == ' ') && (ext[len] == ' ' || ext[len] == '\0'))
+            return true;
+
+    return false;
+}
+
+gpuart::GL::OffscreenContext::OffscreenContext(): Display(nullptr), Context(nullptr), IsOK(false)
+{
+    EGLDisplay display = EGL_NO_DISPLAY;
+
+    // The surfaceless platform needs neither a window system nor a GPU
+    const char *clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    if (HasExtension(clientExtensions, "EGL_MESA_platform_surfaceless"))
+    {
+        auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+        if (getPlatformDisplay)
+            display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    }
+    if (display == EGL_NO_DISPLAY)
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr))
+    {
+        std::cerr << "Failed to initialize EGL." << std::endl;
+        return;
+    }
+    Display = display;
+
+    const char *extensions = eglQueryString(display, EGL_EXTENSIONS);
+    if (!HasExtension(extensions, "EGL_KHR_surfaceless_context"))
+    {
+        std::cerr << "EGL does not support surfaceless contexts." << std::endl;
+        return;
+    }
+
+    const EGLint configAttribs[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+                                     EGL_SURFACE_TYPE,    0,
+                                     EGL_NONE };
+    EGLConfig config = nullptr;
+    EGLint numConfigs = 0;
+    if (!eglChooseConfig(display, configAttribs, &config, 1, &numConfigs) || numConfigs == 0)
+    {
+        if (!HasExtension(extensions, "EGL_KHR_no_config_context"))
+        {
+            std::cerr << "No suitable EGL configuration." << std::endl;
+            return;
+        }
+        config = nullptr; // EGL_NO_CONFIG_KHR
+    }
+
+    if (!eglBindAPI(EGL_OPENGL_API))
+    {
+        std::cerr << "EGL does not support OpenGL." << std::endl;
+        return;
+    }
+
+    const EGLint contextAttribs[] = { EGL_CONTEXT_MAJOR_VERSION_KHR,       3,
+                                      EGL_CONTEXT_MINOR_VERSION_KHR,       3,
+                                      EGL_CONTEXT_OPENGL_PROFILE_MASK_KHR, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT_KHR,
+                                      EGL_NONE };
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+    if (context == EGL_NO_CONTEXT)
+    {
+        std::cerr << "Failed to create an OpenGL 3.3 core profile context with EGL." << std::endl;
+        return;
+    }
+    Context = context;
+
+    if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+    {
+        std::cerr << "Failed to make the EGL context current." << std::endl;
+        return;
+    }
+
+    IsOK = true;
+}
+
+gpuart::GL::OffscreenContext::~OffscreenContext()
+{
+    if (Display)
+    {
+        eglMakeCurrent(Display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        if (Context)
+            eglDestroyContext(Display, Context);
+        eglTerminate(Display);
+    }
+}
+
+const char *gpuart::GL::OffscreenContext::GetBackendName() { return "EGL"; }
+
+#elif defined(GPUART_HEADLESS_OSMESA)
+
+gpuart::GL::OffscreenContext::OffscreenContext(): Context(nullptr), IsOK(false)
+{
+    const int attribs[] = { OSMESA_FORMAT,                OSMESA_RGBA,
+                            OSMESA_DEPTH_BITS,            0,
+                            OSMESA_PROFILE,               OSMESA_CORE_PROFILE,
+                            OSMESA_CONTEXT_MAJOR_VERSION, 3,
+                            OSMESA_CONTEXT_MINOR_VERSION, 3,
+                            0 };
+
+    OSMesaContext context = OSMesaCreateContextAttribs(attribs, nullptr);
+    if (!context)
+    {
+        std::cerr << "Failed to create an OpenGL 3.3 core profile context with OSMesa." << std::endl;
+        return;
+    }
+    Context = context;
+
+    Buffer.resize(4);
+    if (!OSMesaMakeCurrent(context, Buffer.data(), GL_UNSIGNED_BYTE, 1, 1))
+    {
+        std::cerr << "Failed to make the OSMesa context current." << std::endl;
+        return;
+    }
+
+    IsOK = true;
+}
+
+gpuart::GL::OffscreenContext::~OffscreenContext()
+{
+    if (Context)
+        OSMesaDestroyContext(static_cast<OSMesaContext>(Context));
+}
+
+const char *gpuart::GL::OffscreenContext::GetBackendName() { return "OSMesa"; }
+
+#else
+
+gpuart::GL::OffscreenContext::OffscreenContext(): Window(nullptr), IsOK(false)
+{
+    if (!glfwInit())
+    {
+        std::cerr << "Failed to initialize GLFW." << std::endl;
+        return;
+    }
+
+    glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+    GLFWwindow *window = glfwCreateWindow(1, 1, "gpuart", nullptr, nullptr);
+    if (!window)
+    {
+        std::cerr << "Failed to create an OpenGL 3.3 core profile context with GLFW." << std::endl;
+        return;
+    }
+    Window = window;
+
+    glfwMakeContextCurrent(window);
+
+#if defined(NANOGUI_GLAD)
+    if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+    {
+        std::cerr << "Failed to load OpenGL functions." << std::endl;
+        return;
+    }
+    glGetError(); // clear the error flag possibly set by GLAD
+#endif
+
+    IsOK = true;
+}
+
+gpuart::GL::OffscreenContext::~OffscreenContext()
+{
+    if (Window)
+        glfwDestroyWindow(static_cast<GLFWwindow*>(Window));
+    glfwTerminate();
+}
+
+const char *gpuart::GL::OffscreenContext::GetBackendName() { return "GLFW"; }
+
+#endif
@@ -0,0 +1,72 @@
+/*
+GPU-Assisted Ray Tracer
+Copyright (C) 2016 Filip Szczerek <ga.software@yahoo.com>
+
+This file is part of gpuart.
+
+Gpuart is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Gpuart is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with gpuart.  If not, see <http://www.gnu.org/licenses/>.
+
+File description:
+    Window-less OpenGL context header
+*/
+
+#ifndef GPUART_OFFSCREEN_CONTEXT_HEADER
+#define GPUART_OFFSCREEN_CONTEXT_HEADER
+
+#include <vector>
+
+
+namespace gpuart
+{
+namespace GL
+{
+    /** OpenGL 3.3 core profile context without a visible window; non-copyable.
+        Depending on the build configuration, it is created with:
+          - EGL (GPUART_HEADLESS_EGL), preferably on the Mesa surfaceless platform, which requires
+            neither an X server nor a GPU (e.g. llvmpipe),
+          - OSMesa (GPUART_HEADLESS_OSMESA),
+          - GLFW (otherwise), as a hidden window; requires a display.
+        The default framebuffer must not be rendered to; use framebuffer objects instead. */
+    class OffscreenContext
+    {
+    #if defined(GPUART_HEADLESS_EGL)
+        void *Display, *Context;
+    #elif defined(GPUART_HEADLESS_OSMESA)
+        void *Context;
+        std::vector<unsigned char> Buffer; ///< OSMesa requires a color buffer, even if it is not used
+    #else
+        void *Window;
+    #endif
+
+        bool IsOK;
+
+    public:
+
+        /// Creates the context and makes it current; check success with GetIsOK()
+        OffscreenContext();
+
+        ~OffscreenContext();
+
+        OffscreenContext(const OffscreenContext &)             = delete;
+        OffscreenContext & operator=(const OffscreenContext &) = delete;
+
+        bool GetIsOK() const { return IsOK; }
+
+        /// Returns the name of the API used to create the context
+        static const char *GetBackendName();
+    };
+}
+}
+
+#endif // GPUART_OFFSCREEN_CONTEXT_HEADER
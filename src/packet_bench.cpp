@@ -0,0 +1,296 @@
+/*
+GPU-Assisted Ray Tracer
+Copyright (C) 2016 Filip Szczerek <ga.software@yahoo.com>
+
+This file is part of gpuart.
+
+Gpuart is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Gpuart is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with gpuart.  If not, see <http://www.gnu.org/licenses/>.
+
+File description:
+    Micro-benchmark of single-ray and ray packet queries of the compiled BVH
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bvh.h"
+#include "core.h"
+#include "math_types.h"
+#include "ray_packet.h"
+#include "scenes.h"
+#include "utils.h"
+
+
+using gpuart::Vec3f;
+using gpuart::RAY_PACKET_SIZE;
+
+
+static void PrintUsage()
+{
+    std::cout <<
+        "Usage: gpuart-packet-bench [scene ...] [options]\n\n"
+        "Scenes: box, boxlight, dragon11k, dragon48k, dragon871k, cluster100k, tree21k\n"
+        "        (default: dragon48k dragon871k cluster100k)\n\n"
+        "Options:\n"
+        "  --size WxH               number of camera rays (default: 640x480)\n"
+        "  --repeat N               number of timed repetitions; the fastest one is reported (default: 3)\n"
+        "  --sah                    build the BVH with the surface area heuristic\n"
+        "  --bvh-width N            max. children of a compiled BVH node (2-8, default: 4)\n";
+}
+
+/// Rays of one kind, grouped in packets of neighboring rays
+struct RaySet
+{
+    std::vector<gpuart::RayPacket> packets;
+    std::vector<uint32_t> masks; ///< Valid rays of each packet
+
+    size_t GetNumRays() const
+    {
+        size_t count = 0;
+        for (uint32_t mask: masks)
+            for (unsigned i = 0; i < RAY_PACKET_SIZE; i++)
+                count += (mask >> i) & 1;
+        return count;
+    }
+};
+
+/// Returns the number of rays traced per second (in millions) by the fastest of 'repeat' calls to 'traceAll'
+template<typename F>
+static double MeasureMRaysPerSec(size_t numRays, unsigned repeat, F traceAll)
+{
+    double best = 0;
+    for (unsigned r = 0; r < repeat; r++)
+    {
+        auto tstart = std::chrono::high_resolution_clock::now();
+        traceAll();
+        double elapsed = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - tstart).count();
+        best = std::max(best, numRays / elapsed * 1.0e-6);
+    }
+    return best;
+}
+
+/** Measures single-ray and packet queries of 'rays'; prints the results and the number of rays
+    whose results differ. */
+static void Benchmark(const char *label, const RaySet &rays, bool occlusion, unsigned repeat,
+                      gpuart::PacketTracer &tracer)
+{
+    const size_t numRays = rays.GetNumRays();
+
+    std::vector<float> singlePos(rays.packets.size() * RAY_PACKET_SIZE, -1),
+                       packetPos(rays.packets.size() * RAY_PACKET_SIZE, -1);
+
+    double single = MeasureMRaysPerSec(numRays, repeat, [&]()
+        {
+            for (size_t p = 0; p < rays.packets.size(); p++)
+                for (unsigned i = 0; i < RAY_PACKET_SIZE; i++)
+                    if (rays.masks[p] & (1U << i))
+                    {
+                        const gpuart::RayPacket &packet = rays.packets[p];
+                        Vec3f rstart(packet.rstart[0][i], packet.rstart[1][i], packet.rstart[2][i]),
+                              rdir(packet.rdir[0][i], packet.rdir[1][i], packet.rdir[2][i]);
+
+                        if (occlusion)
+                            singlePos[p*RAY_PACKET_SIZE + i] = tracer.OccludedRay(rstart, rdir, packet.maxPos[i]) ? 1 : -1;
+                        else
+                        {
+                            Vec3f intersection, normal;
+                            int ptype;
+                            tracer.IntersectRay(rstart, rdir, singlePos[p*RAY_PACKET_SIZE + i], intersection, normal, ptype);
+                        }
+                    }
+        });
+
+    double packets = MeasureMRaysPerSec(numRays, repeat, [&]()
+        {
+            gpuart::RayPacketHits hits;
+            for (size_t p = 0; p < rays.packets.size(); p++)
+            {
+                if (occlusion)
+                {
+                    uint32_t occluded = tracer.Occluded(rays.packets[p], rays.masks[p]);
+                    for (unsigned i = 0; i < RAY_PACKET_SIZE; i++)
+                        packetPos[p*RAY_PACKET_SIZE + i] = (occluded & (1U << i)) ? 1 : -1;
+                }
+                else
+                {
+                    tracer.Intersect(rays.packets[p], rays.masks[p], hits);
+                    std::copy(hits.pos, hits.pos + RAY_PACKET_SIZE, packetPos.begin() + p*RAY_PACKET_SIZE);
+                }
+            }
+        });
+
+    size_t numDifferent = 0;
+    for (size_t p = 0; p < rays.packets.size(); p++)
+        for (unsigned i = 0; i < RAY_PACKET_SIZE; i++)
+            if ((rays.masks[p] & (1U << i)) && singlePos[p*RAY_PACKET_SIZE + i] != packetPos[p*RAY_PACKET_SIZE + i])
+                numDifferent++;
+
+    std::cout << "  " << std::left << std::setw(10) << label << std::right << std::fixed << std::setprecision(2)
+              << std::setw(9) << numRays << " rays, single: " << std::setw(6) << single << " Mrays/s, packets: "
+              << std::setw(6) << packets << " Mrays/s (" << packets / single << "x)";
+    if (numDifferent)
+        std::cout << ", " << numDifferent << " results differ";
+    std::cout << std::endl;
+}
+
+/** Creates camera rays of a 'width'x'height' image (in tiles of RAY_PACKET_SIZE/2 x 2 pixels), and their
+    continuations from the closest intersections: rays towards the Sun and randomly scattered rays. */
+static void CreateRays(unsigned width, unsigned height, gpuart::PacketTracer &tracer,
+                       RaySet &cameraRays, RaySet &shadowRays, RaySet &diffuseRays)
+{
+    // Same initial camera and Sun direction as in the GUI
+    gpuart::Camera cam;
+    cam.Pos = Vec3f(0.1f, -3.05f, 1);
+    cam.Up = Vec3f(0, 0, 1);
+    cam.Dir = Vec3f(0, 0, 0.95f) - cam.Pos;
+    cam.FovY = 60;
+    cam.ScreenDist = 0.2f;
+
+    const Vec3f sunDir = Vec3f(1, 0, 0).vroty(-3.1415926f/4).vrotz(3.1415926f);
+
+    Vec3f bottomLeft, deltaHorz, deltaVert;
+    cam.GetScreen((float)width/height, bottomLeft, deltaHorz, deltaVert);
+
+    const unsigned TILE_WIDTH = RAY_PACKET_SIZE / 2, TILE_HEIGHT = 2;
+
+    std::mt19937 rndGen;
+    std::uniform_real_distribution<float> distr(-1, 1);
+
+    for (unsigned y0 = 0; y0 < height; y0 += TILE_HEIGHT)
+        for (unsigned x0 = 0; x0 < width; x0 += TILE_WIDTH)
+        {
+            gpuart::RayPacket packet;
+            uint32_t mask = 0;
+
+            for (unsigned i = 0; i < RAY_PACKET_SIZE; i++)
+            {
+                unsigned x = std::min(x0 + i % TILE_WIDTH, width - 1),
+                         y = std::min(y0 + i / TILE_WIDTH, height - 1);
+
+                Vec3f rstart = bottomLeft + deltaHorz * ((x + 0.5f) / width) + deltaVert * ((y + 0.5f) / height);
+                packet.Set(i, rstart, (rstart - cam.Pos).normalized());
+
+                if (x0 + i % TILE_WIDTH < width && y0 + i / TILE_WIDTH < height)
+                    mask |= 1U << i;
+            }
+            cameraRays.packets.push_back(packet);
+            cameraRays.masks.push_back(mask);
+
+            gpuart::RayPacketHits hits;
+            tracer.Intersect(packet, mask, hits);
+
+            gpuart::RayPacket shadowPacket, diffusePacket;
+            uint32_t hitMask = 0;
+            for (unsigned i = 0; i < RAY_PACKET_SIZE; i++)
+            {
+                if ((mask & (1U << i)) && hits.pos[i] > 0)
+                    hitMask |= 1U << i;
+
+                Vec3f randomDir;
+                do
+                {
+                    randomDir = Vec3f(distr(rndGen), distr(rndGen), distr(rndGen));
+                } while (randomDir.sqrlength() > 1 || randomDir.sqrlength() < 1.0e-6f);
+                if (hits.pos[i] > 0 && randomDir * hits.normal[i] < 0)
+                    randomDir = -randomDir;
+
+                shadowPacket.Set(i, hits.intersection[i], sunDir);
+                diffusePacket.Set(i, hits.intersection[i], randomDir.normalized());
+            }
+            shadowRays.packets.push_back(shadowPacket);
+            shadowRays.masks.push_back(hitMask);
+            diffuseRays.packets.push_back(diffusePacket);
+            diffuseRays.masks.push_back(hitMask);
+        }
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<std::string> sceneNames;
+    unsigned width = 640, height = 480;
+    unsigned repeat = 3;
+    unsigned bvhWidth = 4;
+    auto strategy = gpuart::BVHBuildStrategy::Midpoint;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string opt = argv[i];
+        const int numArgsLeft = argc - 1 - i;
+
+        if (opt == "--size" && numArgsLeft >= 1)
+        {
+            if (2 != std::sscanf(argv[++i], "%ux%u", &width, &height) || width == 0 || height == 0)
+            {
+                std::cerr << "Invalid image size: " << argv[i] << std::endl;
+                return 1;
+            }
+        }
+        else if (opt == "--repeat" && numArgsLeft >= 1)
+            repeat = std::max(1, std::atoi(argv[++i]));
+        else if (opt == "--sah")
+            strategy = gpuart::BVHBuildStrategy::SAH;
+        else if (opt == "--bvh-width" && numArgsLeft >= 1)
+        {
+            if (!gpuart::Utils::ParseBVHWidth(argv[++i], bvhWidth))
+            {
+                std::cerr << "Invalid BVH width: " << argv[i] << std::endl;
+                return 1;
+            }
+        }
+        else if (opt.compare(0, 2, "--") != 0)
+            sceneNames.push_back(opt);
+        else
+        {
+            std::cerr << "Invalid option: " << opt << "\n\n";
+            PrintUsage();
+            return 1;
+        }
+    }
+
+    if (sceneNames.empty())
+        sceneNames = { "dragon48k", "dragon871k", "cluster100k" };
+
+    std::cout << "Ray packet size: " << RAY_PACKET_SIZE << "\n" << std::endl;
+
+    for (const std::string &sceneName: sceneNames)
+    {
+        gpuart::PrimitiveSet primitives;
+        if (!CreateScene(sceneName.c_str(), primitives))
+            return 1;
+
+        gpuart::Primitive::Data tree;
+        gpuart::BoundingVolumesHierarchy(primitives, 1024, 2, strategy).Compile(primitives, tree, bvhWidth);
+
+        gpuart::PacketTracer tracer(tree, primitives.MeshVertices);
+
+        RaySet cameraRays, shadowRays, diffuseRays;
+        CreateRays(width, height, tracer, cameraRays, shadowRays, diffuseRays);
+
+        std::cout << sceneName << " (" << primitives.GetCount() << " primitives):" << std::endl;
+        Benchmark("camera", cameraRays, false, repeat, tracer);
+        Benchmark("shadow", shadowRays, true, repeat, tracer);
+        Benchmark("diffuse", diffuseRays, false, repeat, tracer);
+        std::cout << std::endl;
+    }
+
+    return 0;
+}
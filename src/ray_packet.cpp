@@ -0,0 +1,713 @@
+/*
+GPU-Assisted Ray Tracer
+Copyright (C) 2016 Filip Szczerek <ga.software@yahoo.com>
+
+This file is part of gpuart.
+
+Gpuart is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Gpuart is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with gpuart.  If not, see <http://www.gnu.org/licenses/>.
+
+File description:
+    Ray packet queries of a compiled BVH tree (SSE/AVX) implementation
+*/
+
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#else
+#error "Ray packets require SSE2 or AVX."
+#endif
+
+#include "bvh.h"
+#include "ray_packet.h"
+
+
+using gpuart::Vec3f;
+using gpuart::Primitive;
+using gpuart::BoundingVolumesHierarchy;
+using gpuart::RAY_PACKET_SIZE;
+
+
+namespace
+{
+
+// Values correspond with #defines in shaders (see also cpu_renderer.cpp) -------------
+
+const float VISIBILITY_OFFSET = 1.0e-4f;
+const float TRIANGLE_SURFACE_TOLERANCE = 1.0e-10f;
+const float CONE_TOLERANCE = 1.0e-7f;
+const float RDIR_MIN_ABS = 1.0e-30f;
+
+// Offsets of RGBA quads, see gpuart::BoundingVolumesHierarchy::Compile()
+const int BVH_NODE_INFO_OFS    = 0;
+const int BVH_QUANT_PARAMS_OFS = 1;
+const int BVH_CHILDREN_BB_OFS  = 2;
+const int BVH_PRIM_DATA_OFS    = 1;
+
+const int NDINFO_FLAGS       = 0;
+const int NDINFO_CHILD0_ADDR = 1;
+
+const uint32_t CHBB_PER_QUAD = 2;
+const uint32_t NDINFO_NUM_CHILDREN_ADDR = 2;
+
+/// Number of RGBA quads occupied by primitives' data, indexed by gpuart::Primitive_t
+const int PRIMITIVE_DATA_LEN[] = { 1, 2, 3, 4, 1 };
+
+const uint32_t ALL_RAYS = (1U << RAY_PACKET_SIZE) - 1;
+
+/// Rays are traced as a packet only if their directions are within this angle's cosine of each other
+const float MIN_COHERENT_COS_ANGLE = 0.95f;
+
+
+// SIMD vector of RAY_PACKET_SIZE floats; comparisons return masks (all bits set in lanes where true) ---
+
+#if defined(__AVX__)
+
+struct Floats
+{
+    __m256 v;
+
+    Floats() { }
+    Floats(__m256 v): v(v) { }
+    Floats(float f): v(_mm256_set1_ps(f)) { }
+
+    static Floats Load(const float *p) { return _mm256_loadu_ps(p); }
+    void Store(float *p) const { _mm256_storeu_ps(p, v); }
+};
+
+inline Floats operator +(Floats a, Floats b) { return _mm256_add_ps(a.v, b.v); }
+inline Floats operator -(Floats a, Floats b) { return _mm256_sub_ps(a.v, b.v); }
+inline Floats operator *(Floats a, Floats b) { return _mm256_mul_ps(a.v, b.v); }
+inline Floats operator /(Floats a, Floats b) { return _mm256_div_ps(a.v, b.v); }
+
+inline Floats operator <(Floats a, Floats b)  { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline Floats operator <=(Floats a, Floats b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline Floats operator >(Floats a, Floats b)  { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+inline Floats operator >=(Floats a, Floats b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+
+inline Floats operator &(Floats a, Floats b) { return _mm256_and_ps(a.v, b.v); }
+inline Floats operator |(Floats a, Floats b) { return _mm256_or_ps(a.v, b.v); }
+/// Returns (NOT a) AND b
+inline Floats AndNot(Floats a, Floats b) { return _mm256_andnot_ps(a.v, b.v); }
+
+inline Floats Min(Floats a, Floats b) { return _mm256_min_ps(a.v, b.v); }
+inline Floats Max(Floats a, Floats b) { return _mm256_max_ps(a.v, b.v); }
+inline Floats Sqrt(Floats a) { return _mm256_sqrt_ps(a.v); }
+
+/// Returns 'a' in lanes where 'mask' is set, 'b' elsewhere
+inline Floats Select(Floats mask, Floats a, Floats b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+
+/// Returns bit 'i' set if lane 'i' of 'mask' is set
+inline uint32_t MoveMask(Floats mask) { return (uint32_t)_mm256_movemask_ps(mask.v); }
+
+#else
+
+struct Floats
+{
+    __m128 v;
+
+    Floats() { }
+    Floats(__m128 v): v(v) { }
+    Floats(float f): v(_mm_set1_ps(f)) { }
+
+    static Floats Load(const float *p) { return _mm_loadu_ps(p); }
+    void Store(float *p) const { _mm_storeu_ps(p, v); }
+};
+
+inline Floats operator +(Floats a, Floats b) { return _mm_add_ps(a.v, b.v); }
+inline Floats operator -(Floats a, Floats b) { return _mm_sub_ps(a.v, b.v); }
+inline Floats operator *(Floats a, Floats b) { return _mm_mul_ps(a.v, b.v); }
+inline Floats operator /(Floats a, Floats b) { return _mm_div_ps(a.v, b.v); }
+
+inline Floats operator <(Floats a, Floats b)  { return _mm_cmplt_ps(a.v, b.v); }
+inline Floats operator <=(Floats a, Floats b) { return _mm_cmple_ps(a.v, b.v); }
+inline Floats operator >(Floats a, Floats b)  { return _mm_cmpgt_ps(a.v, b.v); }
+inline Floats operator >=(Floats a, Floats b) { return _mm_cmpge_ps(a.v, b.v); }
+
+inline Floats operator &(Floats a, Floats b) { return _mm_and_ps(a.v, b.v); }
+inline Floats operator |(Floats a, Floats b) { return _mm_or_ps(a.v, b.v); }
+/// Returns (NOT a) AND b
+inline Floats AndNot(Floats a, Floats b) { return _mm_andnot_ps(a.v, b.v); }
+
+inline Floats Min(Floats a, Floats b) { return _mm_min_ps(a.v, b.v); }
+inline Floats Max(Floats a, Floats b) { return _mm_max_ps(a.v, b.v); }
+inline Floats Sqrt(Floats a) { return _mm_sqrt_ps(a.v); }
+
+/// Returns 'a' in lanes where 'mask' is set, 'b' elsewhere
+inline Floats Select(Floats mask, Floats a, Floats b) { return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)); }
+
+/// Returns bit 'i' set if lane 'i' of 'mask' is set
+inline uint32_t MoveMask(Floats mask) { return (uint32_t)_mm_movemask_ps(mask.v); }
+
+#endif
+
+inline Floats Abs(Floats a) { return AndNot(Floats(-0.0f), a); }
+
+/// Returns a SIMD mask with lane 'i' set if bit 'i' of 'bits' is set (inverse of MoveMask())
+Floats LaneMask(uint32_t bits)
+{
+    struct Table
+    {
+        float masks[1U << RAY_PACKET_SIZE][RAY_PACKET_SIZE];
+
+        Table()
+        {
+            for (uint32_t b = 0; b <= ALL_RAYS; b++)
+                for (unsigned i = 0; i < RAY_PACKET_SIZE; i++)
+                {
+                    uint32_t laneBits = (b & (1U << i)) ? 0xFFFFFFFFU : 0;
+                    std::memcpy(&masks[b][i], &laneBits, sizeof(float));
+                }
+        }
+    };
+    static const Table table;
+
+    return Floats::Load(table.masks[bits]);
+}
+
+unsigned PopCount(uint32_t bits)
+{
+    unsigned count = 0;
+    for (; bits; bits &= bits - 1)
+        count++;
+    return count;
+}
+
+/// Returns the index of the lowest set bit of (non-zero) 'bits'
+unsigned LowestBit(uint32_t bits)
+{
+    assert(bits != 0);
+    unsigned i = 0;
+    while (!(bits & (1U << i)))
+        i++;
+    return i;
+}
+
+/// Vector of RAY_PACKET_SIZE 3D vectors
+struct Vec3N
+{
+    Floats x, y, z;
+
+    Vec3N() { }
+    Vec3N(Floats x, Floats y, Floats z): x(x), y(y), z(z) { }
+
+    /// Broadcasts 'v' to all lanes
+    Vec3N(const Vec3f &v): x(v.x), y(v.y), z(v.z) { }
+};
+
+inline Vec3N operator +(const Vec3N &a, const Vec3N &b) { return Vec3N(a.x + b.x, a.y + b.y, a.z + b.z); }
+inline Vec3N operator -(const Vec3N &a, const Vec3N &b) { return Vec3N(a.x - b.x, a.y - b.y, a.z - b.z); }
+inline Vec3N operator *(const Vec3N &a, Floats f) { return Vec3N(a.x * f, a.y * f, a.z * f); }
+
+inline Floats Dot(const Vec3N &a, const Vec3N &b) { return a.x*b.x + a.y*b.y + a.z*b.z; }
+
+inline Vec3N Cross(const Vec3N &a, const Vec3N &b)
+{
+    return Vec3N(a.y*b.z - a.z*b.y,
+                 a.z*b.x - a.x*b.z,
+                 a.x*b.y - a.y*b.x);
+}
+
+uint32_t FloatBitsToUint(float f)
+{
+    uint32_t result;
+    std::memcpy(&result, &f, sizeof(result));
+    return result;
+}
+
+float UintBitsToFloat(uint32_t u)
+{
+    float result;
+    std::memcpy(&result, &u, sizeof(result));
+    return result;
+}
+
+/// Returns the RGBA quad at 'addr' (equivalent of texelFetch() from a buffer texture)
+const float *Fetch(const Primitive::Data &data, int addr)
+{
+    return &data[RGBA_ELEMS * addr];
+}
+
+// Packet-vs-primitive tests; each mirrors (per ray) its scalar counterpart in the shaders
+// and returns 'pos' (-1 where there is no intersection)
+
+Floats SphereIntersection(const Vec3N &rstart, const Vec3N &rdir, const Vec3f &center, float radius)
+{
+    Vec3N oc = rstart - Vec3N(center);
+
+    Floats a = Dot(rdir, rdir);
+    Floats b = Floats(2) * Dot(rdir, oc);
+    Floats c = Dot(oc, oc) - Floats(radius*radius);
+
+    Floats delta = b*b - Floats(4)*a*c;
+
+    Floats sd = Sqrt(Max(delta, 0));
+    Floats k1 = (Floats(0) - b + sd) / (a + a);
+    Floats k2 = (Floats(0) - b - sd) / (a + a);
+
+    Floats pos = Select(k1 < VISIBILITY_OFFSET, k2,
+                        Select(k2 < VISIBILITY_OFFSET, k1, Select(k1 < k2, k1, k2)));
+
+    return Select(delta >= 0, pos, -1);
+}
+
+Floats DiscIntersection(const Vec3N &rstart, const Vec3N &rdir, const Vec3f &center, float radius, const Vec3f &dnormal)
+{
+    Vec3N n(dnormal);
+
+    Floats tmp = Dot(rdir, n);
+    Floats k = Dot(n, Vec3N(center) - rstart) / tmp;
+
+    Vec3N q = rdir * k + rstart - Vec3N(center);
+
+    Floats hit = AndNot(Abs(tmp) < 1.0e-8f, k > 0) & (Dot(q, q) <= radius*radius);
+
+    return Select(hit, k, -1);
+}
+
+Floats TriangleIntersection(const Vec3N &rstart, const Vec3N &rdir, const Vec3f &v0, const Vec3f &v1, const Vec3f &v2)
+{
+    Vec3N edge1(v1 - v0),
+          edge2(v2 - v0);
+
+    Vec3N pvec = Cross(rdir, edge2);
+    Floats det = Dot(edge1, pvec);
+    Floats invDet = Floats(1) / det;
+
+    Vec3N tvec = rstart - Vec3N(v0);
+    Floats u = Dot(tvec, pvec) * invDet;
+
+    Vec3N qvec = Cross(tvec, edge1);
+    Floats v = Dot(rdir, qvec) * invDet;
+
+    Floats miss = (Abs(det) < TRIANGLE_SURFACE_TOLERANCE) | (u < 0) | (u > 1) | (v < 0) | (u + v > 1);
+
+    return Select(miss, -1, Dot(edge2, qvec) * invDet);
+}
+
+Floats ConeIntersection(const Vec3N &rstart, const Vec3N &rdir,
+                        const Vec3f &center1, float radius1, const Vec3f &unitAxis, float axisLen,
+                        float widthCoeff, float dotAxC1)
+{
+    Vec3N axis(unitAxis);
+
+    Floats axDir = Dot(axis, rdir),
+           axStart = Dot(axis, rstart);
+
+    Vec3N D = axis * axDir;
+    Vec3N E = Vec3N(Vec3f(0, 0, 0)) - rdir;
+    Vec3N F = Vec3N(center1) + axis * axStart - Vec3N(unitAxis * dotAxC1) - rstart;
+    Floats G = Floats(widthCoeff) * axDir;
+    Floats H = Floats(widthCoeff) * axStart - Floats(widthCoeff * dotAxC1) + Floats(radius1);
+
+    Floats A = Dot(D, D) + Dot(E, E) + Floats(2) * Dot(D, E) - G*G;
+    Floats B = Floats(2) * Dot(F, D + E) - Floats(2)*G*H;
+    Floats C = Dot(F, F) - H*H;
+
+    Floats delta = B*B - Floats(4)*A*C;
+
+    Floats miss = (Abs(A) < CONE_TOLERANCE) | (delta < CONE_TOLERANCE);
+
+    Floats sqrtdelta = Sqrt(Max(delta, 0));
+
+    Floats k1 = (Floats(0) - B + sqrtdelta) / (A + A);
+    Floats k2 = (Floats(0) - B - sqrtdelta) / (A + A);
+
+    Floats t1 = Dot(axis, rstart + rdir * k1 - Vec3N(center1));
+    Floats t2 = Dot(axis, rstart + rdir * k2 - Vec3N(center1));
+
+    Floats onaxis1 = (t1 >= 0) & (t1 <= axisLen);
+    Floats onaxis2 = (t2 >= 0) & (t2 <= axisLen);
+
+    // The conditions are evaluated in the same order as in the shader
+    Floats pos = -1;
+    pos = Select(((k2 < k1) & onaxis1 & onaxis2) | AndNot(onaxis1, onaxis2), k2, pos);
+    pos = Select(((k1 < k2) & onaxis1 & onaxis2) | AndNot(onaxis2, onaxis1), k1, pos);
+    pos = Select((k2 < VISIBILITY_OFFSET) & onaxis1, k1, pos);
+    pos = Select((k1 < VISIBILITY_OFFSET) & onaxis2, k2, pos);
+
+    return Select(miss, -1, pos);
+}
+
+/// Returns positions of the packet's intersections with the primitive whose data starts at 'addr'
+Floats PrimitiveIntersection(const Vec3N &rstart, const Vec3N &rdir, int primitiveType,
+                             const Primitive::Data &tree, const std::vector<Vec3f> &meshVertices, int addr)
+{
+    const float *d = Fetch(tree, addr);
+
+    switch (primitiveType)
+    {
+    case gpuart::SPHERE:
+        return SphereIntersection(rstart, rdir, Vec3f(d), d[3]);
+
+    case gpuart::DISC:
+        return DiscIntersection(rstart, rdir, Vec3f(d), d[3], Vec3f(d + RGBA_ELEMS));
+
+    case gpuart::TRIANGLE:
+        return TriangleIntersection(rstart, rdir, Vec3f(d), Vec3f(d + RGBA_ELEMS), Vec3f(d + 2*RGBA_ELEMS));
+
+    case gpuart::CONE:
+        return ConeIntersection(rstart, rdir,
+                                Vec3f(d), d[3],                               // first center and radius
+                                Vec3f(d + 2*RGBA_ELEMS), d[2*RGBA_ELEMS + 3], // unit axis and axis length
+                                d[3*RGBA_ELEMS], d[3*RGBA_ELEMS + 2]);        // width coeff., dot(axis, center1)
+
+    case gpuart::MESH_TRIANGLE:
+        return TriangleIntersection(rstart, rdir,
+                                    meshVertices[FloatBitsToUint(d[0])],
+                                    meshVertices[FloatBitsToUint(d[1])],
+                                    meshVertices[FloatBitsToUint(d[2])]);
+
+    default: assert(0); return -1;
+    }
+}
+
+/// Returns the unit normal (facing 'rstart') at 'intersection' of a ray with the primitive whose data starts at 'addr'
+Vec3f GetPrimitiveNormal(const Vec3f &rstart, const Vec3f &rdir, const Vec3f &intersection, int primitiveType,
+                         const Primitive::Data &tree, const std::vector<Vec3f> &meshVertices, int addr)
+{
+    const float *d = Fetch(tree, addr);
+    Vec3f normal;
+
+    switch (primitiveType)
+    {
+    case gpuart::SPHERE:
+        normal = (intersection - Vec3f(d)).normalized();
+        break;
+
+    case gpuart::DISC:
+        return ((rstart - Vec3f(d)) * Vec3f(d + RGBA_ELEMS) > 0 ? Vec3f(d + RGBA_ELEMS) : -Vec3f(d + RGBA_ELEMS));
+
+    case gpuart::TRIANGLE:
+        normal = ((Vec3f(d + RGBA_ELEMS) - Vec3f(d)) ^ (Vec3f(d + 2*RGBA_ELEMS) - Vec3f(d))).normalized();
+        break;
+
+    case gpuart::MESH_TRIANGLE:
+        {
+            const Vec3f &v0 = meshVertices[FloatBitsToUint(d[0])];
+            normal = ((meshVertices[FloatBitsToUint(d[1])] - v0) ^ (meshVertices[FloatBitsToUint(d[2])] - v0)).normalized();
+        }
+        break;
+
+    case gpuart::CONE:
+        {
+            Vec3f center1(d), unitAxis(d + 2*RGBA_ELEMS);
+            float cosB = d[3*RGBA_ELEMS + 1];
+
+            Vec3f proj = center1 + unitAxis * (unitAxis * (intersection - center1));
+            Vec3f n1 = (intersection - proj).normalized();
+            normal = (unitAxis * (cosB - n1 * unitAxis) + n1).normalized();
+            return (normal * rdir > 0 ? -normal : normal);
+        }
+
+    default: assert(0);
+    }
+
+    return ((rstart - intersection) * normal < 0 ? -normal : normal);
+}
+
+} // end of anonymous namespace
+
+
+/// 'tree' and 'meshVertices' must remain valid and unchanged during the lifetime of the object
+gpuart::PacketTracer::PacketTracer(const Primitive::Data &tree, const std::vector<Vec3f> &meshVertices)
+: Tree(tree), MeshVertices(meshVertices)
+{
+    Stack.reserve(1024);
+}
+
+/** Traverses the tree with rays of 'packet' selected by 'mask'. If 'anyHit' is false, receives
+    the closest intersections in 'closestPos' and their primitives' addresses and types in 'hitAddr'
+    and 'hitType'. If 'anyHit' is true, returns the mask of rays which intersect anything before
+    'closestPos' (initialized by the caller), and 'hitAddr', 'hitType' are not used. */
+uint32_t gpuart::PacketTracer::Traverse(const RayPacket &packet, uint32_t mask, bool anyHit,
+                                        float *closestPos, int *hitAddr, int *hitType)
+{
+    Vec3N rstart(Floats::Load(packet.rstart[0]), Floats::Load(packet.rstart[1]), Floats::Load(packet.rstart[2]));
+    Vec3N rdir(Floats::Load(packet.rdir[0]), Floats::Load(packet.rdir[1]), Floats::Load(packet.rdir[2]));
+
+    // 1/rdir with all components finite, as in the shaders' GetFiniteRayDirInverse()
+    float rdivArray[3][RAY_PACKET_SIZE];
+    for (int axis = 0; axis < 3; axis++)
+        for (unsigned i = 0; i < RAY_PACKET_SIZE; i++)
+        {
+            float c = packet.rdir[axis][i];
+            rdivArray[axis][i] = 1 / (std::abs(c) < RDIR_MIN_ABS ? RDIR_MIN_ABS : c);
+        }
+    Vec3N rdiv(Floats::Load(rdivArray[0]), Floats::Load(rdivArray[1]), Floats::Load(rdivArray[2]));
+
+    Floats closest = Floats::Load(closestPos);
+    uint32_t occluded = 0;
+
+    /* Rays whose directions' signs differ would visit the children in different orders, and rays
+       of diverging directions would mostly visit different nodes; such rays are traced separately. */
+    uint32_t signs[3];
+    for (int axis = 0; axis < 3; axis++)
+        signs[axis] = MoveMask(Floats::Load(packet.rdir[axis]) < 0) & mask;
+
+    bool coherent = true;
+    for (int axis = 0; axis < 3; axis++)
+        coherent = coherent && (signs[axis] == 0 || signs[axis] == mask);
+
+    if (coherent && mask)
+    {
+        Vec3N firstDir(Vec3f(packet.rdir[0][LowestBit(mask)], packet.rdir[1][LowestBit(mask)], packet.rdir[2][LowestBit(mask)]));
+        Floats cosAngle = Dot(rdir, firstDir);
+        Floats minCosAngle = Floats(MIN_COHERENT_COS_ANGLE) * Sqrt(Dot(rdir, rdir) * Dot(firstDir, firstDir));
+
+        coherent = ((MoveMask(cosAngle >= minCosAngle) & mask) == mask);
+    }
+
+    StackEntry root;
+    root.addr = 0;
+    for (float &t: root.tnear)
+        t = -1.0e+19f; // the root is always entered
+
+    Stack.clear();
+    if (coherent)
+    {
+        root.mask = mask;
+        Stack.push_back(root);
+    }
+    else
+        for (int i = RAY_PACKET_SIZE - 1; i >= 0; i--)
+            if (mask & (1U << i))
+            {
+                root.mask = 1U << i;
+                Stack.push_back(root);
+            }
+
+    while (!Stack.empty())
+    {
+        StackEntry entry = Stack.back();
+        Stack.pop_back();
+
+        // Rays are culled if their closest intersection found so far lies before the node's bounding box
+        uint32_t nodeMask = entry.mask & ~occluded & MoveMask(Floats::Load(entry.tnear) <= closest);
+        if (!nodeMask)
+            continue;
+
+        unsigned numRays = PopCount(nodeMask);
+        if (numRays > 1 && numRays <= MIN_COHERENT_RAYS)
+        {
+            // Too few rays enter the node; traverse its subtree with each of them separately
+            for (int i = RAY_PACKET_SIZE - 1; i >= 0; i--)
+                if (nodeMask & (1U << i))
+                {
+                    entry.mask = 1U << i;
+                    Stack.push_back(entry);
+                }
+            continue;
+        }
+
+        Floats active = LaneMask(nodeMask);
+
+        const float *nodeInfo = Fetch(Tree, entry.addr + BVH_NODE_INFO_OFS);
+        uint32_t flags = FloatBitsToUint(nodeInfo[NDINFO_FLAGS]);
+
+        if ((flags & BoundingVolumesHierarchy::LEAF) == BoundingVolumesHierarchy::LEAF)
+        {
+            uint32_t numPrimitives = (flags & ~BoundingVolumesHierarchy::FLAGS_MASK);
+            int primAddr = entry.addr + BVH_PRIM_DATA_OFS;
+
+            for (uint32_t i = 0; i < numPrimitives; i++)
+            {
+                int ptype = (int)FloatBitsToUint(Fetch(Tree, primAddr)[0]);
+                int dataAddr = primAddr + 1; // +1 skips the stored 'ptype'
+
+                Floats pos = PrimitiveIntersection(rstart, rdir, ptype, Tree, MeshVertices, dataAddr);
+                Floats hit = active & (pos >= VISIBILITY_OFFSET) & (pos < closest);
+                uint32_t hitBits = MoveMask(hit);
+
+                if (hitBits)
+                {
+                    if (anyHit)
+                    {
+                        occluded |= hitBits;
+                        nodeMask &= ~hitBits;
+                        if (!nodeMask)
+                            break;
+                        active = LaneMask(nodeMask);
+                    }
+                    else
+                    {
+                        closest = Select(hit, pos, closest);
+                        for (unsigned j = 0; j < RAY_PACKET_SIZE; j++)
+                            if (hitBits & (1U << j))
+                            {
+                                hitAddr[j] = dataAddr;
+                                hitType[j] = ptype;
+                            }
+                    }
+                }
+
+                primAddr = dataAddr + PRIMITIVE_DATA_LEN[ptype];
+            }
+        }
+        else
+        {
+            uint32_t numChildren = (flags & ~BoundingVolumesHierarchy::FLAGS_MASK);
+            unsigned orderAxis = (flags & BoundingVolumesHierarchy::ORDER_AXIS_MASK) >> BoundingVolumesHierarchy::ORDER_AXIS_SHIFT;
+
+            // Rays entering the node have the same direction signs (or there is just one)
+            bool reversed = (packet.rdir[orderAxis][LowestBit(nodeMask)] < 0);
+
+            const float *quantParams = Fetch(Tree, entry.addr + BVH_QUANT_PARAMS_OFS);
+            uint32_t exponents = FloatBitsToUint(quantParams[3]);
+            float scale[3];
+            for (int axis = 0; axis < 3; axis++)
+                scale[axis] = UintBitsToFloat(((exponents >> (8*axis)) & 0xFF) << 23);
+
+            StackEntry children[BoundingVolumesHierarchy::MAX_CHILDREN];
+            unsigned numEntered = 0;
+
+            for (uint32_t step = 0; step < numChildren; step++)
+            {
+                uint32_t i = (reversed ? numChildren - 1 - step : step);
+
+                const float *qbox = Fetch(Tree, entry.addr + BVH_CHILDREN_BB_OFS + i / CHBB_PER_QUAD) + (i % CHBB_PER_QUAD) * 2;
+                uint32_t qmin = FloatBitsToUint(qbox[0]),
+                         qmax = FloatBitsToUint(qbox[1]);
+
+                // Branchless slab test of all rays against the dequantized child's bounding box
+                Floats tmin[3], tmax[3];
+                const Floats *rstartAxis[3] = { &rstart.x, &rstart.y, &rstart.z },
+                             *rdivAxis[3]   = { &rdiv.x, &rdiv.y, &rdiv.z };
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    float bbmin = quantParams[axis] + (float)((qmin >> (8*axis)) & 0xFF) * scale[axis],
+                          bbmax = quantParams[axis] + (float)((qmax >> (8*axis)) & 0xFF) * scale[axis];
+
+                    Floats t0 = (Floats(bbmin) - *rstartAxis[axis]) * *rdivAxis[axis],
+                           t1 = (Floats(bbmax) - *rstartAxis[axis]) * *rdivAxis[axis];
+
+                    tmin[axis] = Min(t0, t1);
+                    tmax[axis] = Max(t0, t1);
+                }
+                Floats tnear = Max(Max(tmin[0], tmin[1]), tmin[2]),
+                       tfar  = Min(Min(tmax[0], tmax[1]), tmax[2]);
+
+                uint32_t enteringRays = MoveMask(active & (tnear <= tfar) & (tfar >= 0) & (tnear <= closest));
+                if (!enteringRays)
+                    continue;
+
+                StackEntry &child = children[numEntered++];
+                child.mask = enteringRays;
+                tnear.Store(child.tnear);
+
+                if (i < NDINFO_NUM_CHILDREN_ADDR)
+                    child.addr = (int)FloatBitsToUint(nodeInfo[NDINFO_CHILD0_ADDR + i]);
+                else
+                {
+                    uint32_t addrIdx = i - NDINFO_NUM_CHILDREN_ADDR;
+                    int addrQuad = entry.addr + BVH_CHILDREN_BB_OFS
+                                   + (int)((numChildren + CHBB_PER_QUAD - 1) / CHBB_PER_QUAD + addrIdx / 4);
+                    child.addr = (int)FloatBitsToUint(Fetch(Tree, addrQuad)[addrIdx % 4]);
+                }
+            }
+
+            // Push in reverse, so that the children are visited front-to-back
+            while (numEntered > 0)
+                Stack.push_back(children[--numEntered]);
+        }
+    }
+
+    if (!anyHit)
+        closest.Store(closestPos);
+
+    return occluded;
+}
+
+/// Finds the closest intersections of rays of 'packet' selected by 'mask' (other rays' hits are undefined)
+void gpuart::PacketTracer::Intersect(const RayPacket &packet, uint32_t mask, RayPacketHits &hits)
+{
+    mask &= ALL_RAYS;
+
+    float closestPos[RAY_PACKET_SIZE];
+    int hitAddr[RAY_PACKET_SIZE], hitType[RAY_PACKET_SIZE];
+    for (unsigned i = 0; i < RAY_PACKET_SIZE; i++)
+    {
+        closestPos[i] = packet.maxPos[i];
+        hitAddr[i] = -1;
+        hitType[i] = -1;
+    }
+
+    Traverse(packet, mask, false, closestPos, hitAddr, hitType);
+
+    for (unsigned i = 0; i < RAY_PACKET_SIZE; i++)
+    {
+        hits.primitiveAddr[i] = hitAddr[i];
+
+        if (hitAddr[i] < 0)
+        {
+            hits.pos[i] = -1;
+            hits.primitiveType[i] = -1;
+            continue;
+        }
+
+        Vec3f rstart(packet.rstart[0][i], packet.rstart[1][i], packet.rstart[2][i]),
+              rdir(packet.rdir[0][i], packet.rdir[1][i], packet.rdir[2][i]);
+
+        hits.pos[i] = closestPos[i];
+        hits.intersection[i] = rstart + rdir * closestPos[i];
+        hits.normal[i] = GetPrimitiveNormal(rstart, rdir, hits.intersection[i], hitType[i], Tree, MeshVertices, hitAddr[i]);
+        hits.primitiveType[i] = (hitType[i] == MESH_TRIANGLE ? (int)TRIANGLE : hitType[i]);
+    }
+}
+
+/** Returns the mask of those rays of 'packet' selected by 'mask' which intersect any primitive
+    before reaching their 'maxPos'. Traversal stops for each ray at the first intersection found;
+    meant for shadow rays. */
+uint32_t gpuart::PacketTracer::Occluded(const RayPacket &packet, uint32_t mask)
+{
+    float maxPos[RAY_PACKET_SIZE];
+    std::memcpy(maxPos, packet.maxPos, sizeof(maxPos));
+
+    return Traverse(packet, mask & ALL_RAYS, true, maxPos, nullptr, nullptr);
+}
+
+/// Finds the closest intersection of a single ray; returns 'false' if there is none
+bool gpuart::PacketTracer::IntersectRay(const Vec3f &rstart, const Vec3f &rdir,
+                                        float &pos, Vec3f &intersection, Vec3f &normal, int &primitiveType)
+{
+    RayPacket packet;
+    for (unsigned i = 0; i < RAY_PACKET_SIZE; i++)
+        packet.Set(i, rstart, rdir);
+
+    RayPacketHits hits;
+    Intersect(packet, 1, hits);
+
+    pos = hits.pos[0];
+    primitiveType = hits.primitiveType[0];
+    if (hits.primitiveAddr[0] < 0)
+        return false;
+
+    intersection = hits.intersection[0];
+    normal = hits.normal[0];
+    return true;
+}
+
+/// Returns 'true' if a single ray intersects any primitive before reaching 'maxPos'
+bool gpuart::PacketTracer::OccludedRay(const Vec3f &rstart, const Vec3f &rdir, float maxPos)
+{
+    RayPacket packet;
+    for (unsigned i = 0; i < RAY_PACKET_SIZE; i++)
+        packet.Set(i, rstart, rdir, maxPos);
+
+    return Occluded(packet, 1) != 0;
+}
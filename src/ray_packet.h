@@ -0,0 +1,140 @@
+/*
+GPU-Assisted Ray Tracer
+Copyright (C) 2016 Filip Szczerek <ga.software@yahoo.com>
+
+This file is part of gpuart.
+
+Gpuart is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Gpuart is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with gpuart.  If not, see <http://www.gnu.org/licenses/>.
+
+File description:
+    Ray packet queries of a compiled BVH tree (SSE/AVX) header
+*/
+
+#ifndef GPUART_RAY_PACKET_HEADER
+#define GPUART_RAY_PACKET_HEADER
+
+#include <cstdint>
+#include <vector>
+
+#include "core.h"
+#include "math_types.h"
+
+
+/// Number of rays in a packet: 8 if compiled with AVX enabled, 4 otherwise (SSE2)
+#if defined(__AVX__)
+#define GPUART_RAY_PACKET_SIZE 8
+#else
+#define GPUART_RAY_PACKET_SIZE 4
+#endif
+
+namespace gpuart
+{
+    const unsigned RAY_PACKET_SIZE = GPUART_RAY_PACKET_SIZE;
+
+    /// Rays stored as a structure of arrays; ray 'i' corresponds with bit 'i' of packet masks
+    struct RayPacket
+    {
+        float rstart[3][RAY_PACKET_SIZE]; ///< Rays' origins (x, y, z)
+        float rdir[3][RAY_PACKET_SIZE];   ///< Rays' directions (x, y, z); need not be normalized
+
+        /// Only intersections before rstart + maxPos*rdir are reported
+        float maxPos[RAY_PACKET_SIZE];
+
+        void Set(unsigned i, const Vec3f &start, const Vec3f &dir, float maxPosition = 1.0e+19f)
+        {
+            rstart[0][i] = start.x; rstart[1][i] = start.y; rstart[2][i] = start.z;
+            rdir[0][i] = dir.x; rdir[1][i] = dir.y; rdir[2][i] = dir.z;
+            maxPos[i] = maxPosition;
+        }
+    };
+
+    /// Closest intersections of a packet's rays
+    struct RayPacketHits
+    {
+        /** Satisfies: rstart + pos*rdir = intersection.
+            Receives a value <0 if there is no intersection. */
+        float pos[RAY_PACKET_SIZE];
+
+        Vec3f intersection[RAY_PACKET_SIZE]; ///< Intersection coordinates
+        Vec3f normal[RAY_PACKET_SIZE];       ///< Unit normal at intersection (facing 'rstart')
+
+        /// Type of the intersected primitive (mesh triangles are reported as TRIANGLE); -1 if none
+        int primitiveType[RAY_PACKET_SIZE];
+
+        /// Address (in RGBA quads) of the intersected primitive's data in the compiled tree; -1 if none
+        int primitiveAddr[RAY_PACKET_SIZE];
+    };
+
+    /** Traces packets of rays through a BVH tree compiled by BoundingVolumesHierarchy::Compile(),
+        using SSE or AVX intrinsics to test all rays of a packet against a node's children bounding boxes
+        and against primitives at once. The results equal those of the shaders' CheckBVHIntersection()
+        and CheckBVHOcclusion() up to floating-point rounding.
+
+        Packets whose rays' directions have different signs are traced as single rays; a packet is also
+        split into single rays in subtrees entered by few of its rays (see MIN_COHERENT_RAYS).
+
+        Two-level trees (see TwoLevelBVH) are not supported.
+
+        Not thread-safe (the traversal stack is a member); use one instance per thread. */
+    class PacketTracer
+    {
+        const Primitive::Data &Tree;
+        const std::vector<Vec3f> &MeshVertices;
+
+        struct StackEntry
+        {
+            int addr;      ///< Node's address
+            uint32_t mask; ///< Rays which intersect the node's bounding box
+            float tnear[RAY_PACKET_SIZE]; ///< Positions of the intersections with the node's bounding box
+        };
+
+        std::vector<StackEntry> Stack;
+
+        /** Traverses the tree with rays of 'packet' selected by 'mask'. If 'anyHit' is false, receives
+            the closest intersections in 'closestPos' and their primitives' addresses and types in 'hitAddr'
+            and 'hitType'. If 'anyHit' is true, returns the mask of rays which intersect anything before
+            'closestPos' (initialized by the caller), and 'hitAddr', 'hitType' are not used. */
+        uint32_t Traverse(const RayPacket &packet, uint32_t mask, bool anyHit,
+                          float *closestPos, int *hitAddr, int *hitType);
+
+    public:
+
+        /** A packet is split into single rays when at most this many of its rays enter a node
+            (and there is more than one). */
+        static const unsigned MIN_COHERENT_RAYS = RAY_PACKET_SIZE / 2;
+
+        /// 'tree' and 'meshVertices' must remain valid and unchanged during the lifetime of the object
+        PacketTracer(const Primitive::Data &tree, const std::vector<Vec3f> &meshVertices);
+
+        PacketTracer(const PacketTracer &)             = delete;
+        PacketTracer & operator=(const PacketTracer &) = delete;
+
+        /// Finds the closest intersections of rays of 'packet' selected by 'mask' (other rays' hits are undefined)
+        void Intersect(const RayPacket &packet, uint32_t mask, RayPacketHits &hits);
+
+        /** Returns the mask of those rays of 'packet' selected by 'mask' which intersect any primitive
+            before reaching their 'maxPos'. Traversal stops for each ray at the first intersection found;
+            meant for shadow rays. */
+        uint32_t Occluded(const RayPacket &packet, uint32_t mask);
+
+        /// Finds the closest intersection of a single ray; returns 'false' if there is none
+        bool IntersectRay(const Vec3f &rstart, const Vec3f &rdir,
+                          float &pos, Vec3f &intersection, Vec3f &normal, int &primitiveType);
+
+        /// Returns 'true' if a single ray intersects any primitive before reaching 'maxPos'
+        bool OccludedRay(const Vec3f &rstart, const Vec3f &rdir, float maxPos);
+    };
+}
+
+#endif // GPUART_RAY_PACKET_HEADER
@@ -0,0 +1,366 @@
+/*
+GPU-Assisted Ray Tracer
+Copyright (C) 2016 Filip Szczerek <ga.software@yahoo.com>
+
+This file is part of gpuart.
+
+Gpuart is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Gpuart is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with gpuart.  If not, see <http://www.gnu.org/licenses/>.
+
+File description:
+    Headless batch rendering (OpenGL without a window, or the CPU reference renderer)
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "core.h"
+#include "cpu_renderer.h"
+#include "gl_utils.h"
+#include "math_types.h"
+#include "offscreen_context.h"
+#include "renderer.h"
+#include "scenes.h"
+#include "traversal_stats.h"
+#include "utils.h"
+
+
+#define PI 3.1415926f
+
+using gpuart::Vec3f;
+using gpuart::Utils::TimeElapsed;
+
+
+static void PrintUsage()
+{
+    std::cout <<
+        "Usage: gpuart-render <scene> <direct|path> <output.png|output.exr|output.pfm|output.ppm> [options]\n\n"
+        "Scenes: box, boxlight, dragon11k, dragon48k, dragon871k, cluster100k, tree21k, dragons (instanced)\n\n"
+        "Options:\n"
+        "  --size WxH               image size (default: 640x480)\n"
+        "  --paths N                paths per pixel of path tracing (default: 16)\n"
+        "  --paths-per-pass N       paths per pixel rendered in a single pass (default: 1)\n"
+        "  --camera PX PY PZ TX TY TZ\n"
+        "                           camera position and the point it looks at (default: as in the GUI)\n"
+        "  --fovy DEG               vertical field of view (default: 60)\n"
+        "  --sun AZIMUTH ALTITUDE   direction towards the Sun in degrees (default: 180 45)\n"
+        "  --sphere RADIUS EM       user sphere's radius and emittance (default: 0 0)\n"
+        "  --dynamic N              add N small dynamic objects (spheres, discs, cones) in a ring (default: 0)\n"
+        "  --sah                    build the BVH with the surface area heuristic\n"
+        "  --bvh-width N            max. children of a compiled BVH node (2-8, default: 4)\n"
+        "  --cpu                    render with the CPU reference renderer instead of OpenGL\n"
+        "  --threads N              number of threads of the CPU renderer (default: all hardware threads)\n"
+        "  --stats                  print per-pixel BVH traversal statistics (OpenGL only)\n"
+        "  --heatmap STAT[:MAX]     save a heatmap of a traversal statistic instead of the image (OpenGL only);\n"
+        "                           STAT: nodes, aabb, prims or path; MAX: value of the hottest color (default: 100)\n";
+}
+
+/// Returns 'false' if 'name' is not a valid statistic name for --heatmap
+static bool ParseHeatmapStat(const std::string &name, gpuart::TraversalStat &stat)
+{
+    if (name == "nodes")
+        stat = gpuart::TraversalStat::NodesVisited;
+    else if (name == "aabb")
+        stat = gpuart::TraversalStat::AABBTests;
+    else if (name == "prims")
+        stat = gpuart::TraversalStat::PrimitiveTests;
+    else if (name == "path")
+        stat = gpuart::TraversalStat::PathLength;
+    else
+        return false;
+
+    return true;
+}
+
+static bool EndsWith(const std::string &s, const char *suffix)
+{
+    size_t len = std::strlen(suffix);
+    return s.size() >= len && s.compare(s.size() - len, len, suffix) == 0;
+}
+
+/// Rendering parameters common to gpuart::Renderer and gpuart::CPURenderer
+struct Settings
+{
+    std::string sceneName;
+    bool pathTracing = false;
+    unsigned pathsPerPixel = 16, pathsPerPass = 1;
+    float sunAzimuth = PI, sunAltitude = PI/4;
+    float sphereRadius = 0, sphereEmittance = 0;
+    unsigned numDynamicObjects = 0;
+    unsigned bvhWidth = 4;
+    gpuart::BVHBuildStrategy strategy = gpuart::BVHBuildStrategy::Midpoint;
+};
+
+/** Loads the scene and renders it with 'renderer'; 'finish' is called after the last rendering call
+    and has to wait until the image is complete. Returns 'false' on failure. */
+template<typename RendererT, typename FinishFunc>
+static bool Render(RendererT &renderer, const Settings &settings, FinishFunc finish)
+{
+    renderer.SetUserSphere(Vec3f(-0.4f, 0, 0.2f), settings.sphereRadius, settings.sphereEmittance);
+
+    std::vector<gpuart::DynamicObject> dynamicObjects;
+    CreateDynamicObjects(settings.numDynamicObjects, dynamicObjects);
+    for (const auto &obj: dynamicObjects)
+        renderer.AddDynamicObject(obj);
+
+    renderer.SetSunAzimuth(settings.sunAzimuth);
+    renderer.SetSunAltitude(settings.sunAltitude);
+    renderer.SetBVHWidth(settings.bvhWidth);
+
+    if (IsInstancedScene(settings.sceneName.c_str()))
+    {
+        std::vector<gpuart::PrimitiveSet> meshes;
+        std::vector<gpuart::MeshInstance> instances;
+        if (!CreateInstancedScene(settings.sceneName.c_str(), meshes, instances)
+            || !renderer.SetInstancedScene(meshes, instances, true, settings.strategy))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        gpuart::PrimitiveSet primitives;
+        if (!CreateScene(settings.sceneName.c_str(), primitives))
+            return false;
+
+        renderer.SetPrimitives(primitives, true, settings.strategy);
+    }
+
+    std::cout << "Rendering... "; std::cout.flush();
+    auto tstart = std::chrono::high_resolution_clock::now();
+
+    if (!settings.pathTracing)
+        renderer.RenderDirectLighting();
+    else
+    {
+        renderer.RestartPathTracing(settings.pathsPerPass, settings.pathsPerPixel);
+        while (renderer.RenderPathTracingPass() < settings.pathsPerPixel)
+            ;
+    }
+    finish();
+
+    std::cout << "done (" << TimeElapsed(tstart) << ")." << std::endl;
+
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    Settings settings;
+    settings.sceneName = argv[1];
+    const std::string mode = argv[2];
+    const std::string outFileName = argv[3];
+
+    unsigned width = 640, height = 480;
+    bool useCPU = false;
+    unsigned numThreads = 0;
+
+    bool printStats = false;
+    bool heatmap = false;
+    gpuart::TraversalStat heatmapStat = gpuart::TraversalStat::NodesVisited;
+    float heatmapMax = 100;
+
+    // Same initial camera as in the GUI
+    gpuart::Camera cam;
+    cam.Pos = Vec3f(0.1f, -3.05f, 1);
+    cam.Up = Vec3f(0, 0, 1);
+    cam.Dir = Vec3f(0, 0, 0.95f) - cam.Pos;
+    cam.FovY = 60;
+    cam.ScreenDist = 0.2f;
+
+    for (int i = 4; i < argc; i++)
+    {
+        const std::string opt = argv[i];
+        const int numArgsLeft = argc - 1 - i;
+
+        if (opt == "--size" && numArgsLeft >= 1)
+        {
+            if (2 != std::sscanf(argv[++i], "%ux%u", &width, &height) || width == 0 || height == 0)
+            {
+                std::cerr << "Invalid image size: " << argv[i] << std::endl;
+                return 1;
+            }
+        }
+        else if (opt == "--paths" && numArgsLeft >= 1)
+            settings.pathsPerPixel = std::max(1, std::atoi(argv[++i]));
+        else if (opt == "--paths-per-pass" && numArgsLeft >= 1)
+            settings.pathsPerPass = std::max(1, std::atoi(argv[++i]));
+        else if (opt == "--camera" && numArgsLeft >= 6)
+        {
+            float values[6];
+            for (float &value: values)
+                value = (float)std::atof(argv[++i]);
+
+            cam.Pos = Vec3f(values[0], values[1], values[2]);
+            cam.Dir = Vec3f(values[3], values[4], values[5]) - cam.Pos;
+            if (cam.Dir.sqrlength() == 0)
+            {
+                std::cerr << "Camera position and target must differ." << std::endl;
+                return 1;
+            }
+        }
+        else if (opt == "--fovy" && numArgsLeft >= 1)
+            cam.FovY = (float)std::atof(argv[++i]);
+        else if (opt == "--sun" && numArgsLeft >= 2)
+        {
+            settings.sunAzimuth = (float)std::atof(argv[++i]) * PI/180;
+            settings.sunAltitude = (float)std::atof(argv[++i]) * PI/180;
+        }
+        else if (opt == "--sphere" && numArgsLeft >= 2)
+        {
+            settings.sphereRadius = (float)std::atof(argv[++i]);
+            settings.sphereEmittance = (float)std::atof(argv[++i]);
+        }
+        else if (opt == "--dynamic" && numArgsLeft >= 1)
+            settings.numDynamicObjects = std::max(0, std::atoi(argv[++i]));
+        else if (opt == "--sah")
+            settings.strategy = gpuart::BVHBuildStrategy::SAH;
+        else if (opt == "--bvh-width" && numArgsLeft >= 1)
+        {
+            if (!gpuart::Utils::ParseBVHWidth(argv[++i], settings.bvhWidth))
+            {
+                std::cerr << "Invalid BVH width: " << argv[i] << std::endl;
+                return 1;
+            }
+        }
+        else if (opt == "--cpu")
+            useCPU = true;
+        else if (opt == "--threads" && numArgsLeft >= 1)
+            numThreads = std::max(0, std::atoi(argv[++i]));
+        else if (opt == "--stats")
+            printStats = true;
+        else if (opt == "--heatmap" && numArgsLeft >= 1)
+        {
+            const std::string arg = argv[++i];
+            const size_t colon = arg.find(':');
+            if (colon != std::string::npos)
+                heatmapMax = (float)std::atof(arg.c_str() + colon + 1);
+
+            if (!ParseHeatmapStat(arg.substr(0, colon), heatmapStat) || heatmapMax <= 0)
+            {
+                std::cerr << "Invalid heatmap: " << arg << std::endl;
+                return 1;
+            }
+            heatmap = true;
+        }
+        else
+        {
+            std::cerr << "Invalid option: " << opt << "\n\n";
+            PrintUsage();
+            return 1;
+        }
+    }
+
+    if (mode != "direct" && mode != "path")
+    {
+        std::cerr << "Unknown rendering mode: " << mode << std::endl;
+        return 1;
+    }
+    settings.pathTracing = (mode == "path");
+
+    if (!EndsWith(outFileName, ".png") && !EndsWith(outFileName, ".exr") &&
+        !EndsWith(outFileName, ".pfm") && !EndsWith(outFileName, ".ppm"))
+    {
+        std::cerr << "Output file must have extension .png, .exr, .pfm or .ppm." << std::endl;
+        return 1;
+    }
+
+    if (useCPU && (printStats || heatmap))
+    {
+        std::cerr << "Traversal statistics are available only with OpenGL." << std::endl;
+        return 1;
+    }
+
+    std::vector<Vec3f> image;
+
+    if (useCPU)
+    {
+        gpuart::CPURenderer renderer(width, height, cam, numThreads);
+        if (!Render(renderer, settings, []() { }))
+            return 1;
+
+        image = renderer.GetImage();
+    }
+    else
+    {
+        gpuart::GL::OffscreenContext context;
+        if (!context.GetIsOK())
+            return 1;
+
+        std::cout << "OpenGL renderer (" << gpuart::GL::OffscreenContext::GetBackendName() << "): "
+                  << glGetString(GL_RENDERER) << ", " << glGetString(GL_VERSION) << std::endl;
+
+        if (!gpuart::GL::Init())
+        {
+            std::cerr << "Failed to initialize OpenGL objects." << std::endl;
+            return 1;
+        }
+
+        // Declared after 'context', so that it is destroyed first
+        gpuart::Renderer renderer(width, height, cam, true);
+        if (!renderer.GetIsOK())
+            return 1;
+
+        if (printStats || heatmap)
+        {
+            if (!renderer.SetTraversalStatsEnabled(true))
+                return 1;
+            renderer.SetTraversalHeatmap(heatmap, heatmapStat, heatmapMax);
+        }
+
+        if (!Render(renderer, settings, []() { glFinish(); }))
+            return 1;
+
+        renderer.ReadImage(image);
+
+        if (printStats)
+        {
+            std::vector<float> stats;
+            renderer.ReadTraversalStats(stats);
+            std::cout << "\nTraversal statistics" << (settings.pathTracing ? " (last pass)" : "") << ":\n";
+            gpuart::PrintTraversalStats(stats, std::cout);
+        }
+
+        GLenum error = glGetError();
+        if (error != GL_NO_ERROR)
+        {
+            std::cerr << "OpenGL error 0x" << std::hex << error << std::dec << "." << std::endl;
+            return 1;
+        }
+    }
+
+    bool saved;
+    if (EndsWith(outFileName, ".png"))
+        saved = gpuart::Utils::SaveImagePNG(outFileName.c_str(), width, height, image);
+    else if (EndsWith(outFileName, ".exr"))
+        saved = gpuart::Utils::SaveImageEXR(outFileName.c_str(), width, height, image);
+    else if (EndsWith(outFileName, ".pfm"))
+        saved = gpuart::Utils::SaveImagePFM(outFileName.c_str(), width, height, image);
+    else
+        saved = gpuart::Utils::SaveImagePPM(outFileName.c_str(), width, height, image);
+
+    return saved ? 0 : 1;
+}
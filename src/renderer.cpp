@@ -29,6 +29,7 @@ File description:
 #include <iomanip>
 #include <iostream>
 #include <memory>
+#include <utility>
 
 #include "bvh.h"
 #include "math_types.h"
@@ -57,6 +58,8 @@ namespace Uniforms
     const char *primitive     = "Primitive";
 
     const char *bvh           = "BVH";
+    const char *meshVertices  = "MeshVertices";
+    const char *materials     = "Materials";
 
     const char *pos           = "Pos";
 
@@ -67,15 +70,23 @@ namespace Uniforms
     const char *sunDirAlt     = "SunDirAlt";
     const char *sunDirectLightingEnabled = "SunDirectLightingEnabled";
 
-    const char *userSphere      = "UserSphere";
-    const char *userSphereEm    = "UserSphereEm";
-    const char *userSphereFlags = "UserSphereFlags";
+    const char *dynamicObjects         = "DynamicObjects";
+    const char *numDynamicObjectGroups = "NumDynamicObjectGroups";
+
+    const char *lights          = "Lights";
+    const char *numLights       = "NumLights";
+    const char *firstDynamicLight = "FirstDynamicLight";
+    const char *totalLightPower = "TotalLightPower";
 
     const char *radiance     = "Radiance";
     const char *prevRadiance = "PrevRadiance";
     const char *randSeed     = "RandSeed";
     const char *pixelSize    = "PixelSize";
     const char *cameraPos    = "CameraPos";
+
+    const char *traversalStats = "TraversalStats";
+    const char *statIndex      = "StatIndex";
+    const char *maxValue       = "MaxValue";
 }
 
 /// Values correspond with identifiers used in shaders
@@ -98,10 +109,13 @@ gpuart::GL::Texture gpuart::Renderer::CreateTextureVec3(unsigned width, unsigned
     return gpuart::GL::Texture(internalFormat, width, height, format, GL_FLOAT, data, interpolated);
 }
 
+/// Inserted into shaders compiled as the instrumented variant
+static const char *TRAVERSAL_STATS_DEFINE = "#define TRAVERSAL_STATS\n";
+
 static
-bool CreateShader(gpuart::GL::Shader &shader, GLenum type, const char *srcFileName)
+bool CreateShader(gpuart::GL::Shader &shader, GLenum type, const char *srcFileName, const char *defines = nullptr)
 {
-    shader = gpuart::GL::Shader(type, srcFileName);
+    shader = gpuart::GL::Shader(type, srcFileName, defines);
     if (!shader)
     {
         if (shader.GetInfoLog())
@@ -136,15 +150,8 @@ bool gpuart::Renderer::SetCamera(const Camera &cam)
 {
     CurrentCamera = cam;
 
-    float aspect = (float)Viewport.width/Viewport.height;
-
-    // 'cam.Up' projected onto the plane orthogonal to 'cam.Dir'
-    Vec3f up = ((cam.Dir ^ cam.Up) ^ cam.Dir).normalized();
-    Vec3f target = cam.Pos + cam.Dir.normalized() * cam.ScreenDist;
-    // Screen center to right edge
-    Vec3f a = (cam.Dir.normalized() ^ up) * cam.ScreenDist * aspect * std::tan(cam.FovY/2 * PI/180);
-    // Screen center to top edge
-    Vec3f b = up * a.length() / aspect;
+    Vec3f bottomLeft, deltaHorz, deltaVert;
+    cam.GetScreen((float)Viewport.width/Viewport.height, bottomLeft, deltaHorz, deltaVert);
 
 
     SetDefaultGLState();
@@ -153,12 +160,15 @@ bool gpuart::Renderer::SetCamera(const Camera &cam)
     prog.Use();
 
     prog.SetUniform3f(Uniforms::pos, cam.Pos);
-    prog.SetUniform3f(Uniforms::bottomLeft, target - a - b);
-    prog.SetUniform3f(Uniforms::deltaHorz, 2*a);
-    prog.SetUniform3f(Uniforms::deltaVert, 2*b);
+    prog.SetUniform3f(Uniforms::bottomLeft, bottomLeft);
+    prog.SetUniform3f(Uniforms::deltaHorz, deltaHorz);
+    prog.SetUniform3f(Uniforms::deltaVert, deltaVert);
 
-    if (!gpuart::GL::Utils::DrawFullscreenQuad(prog.GetAttribute(Attributes::position)))
-        return false;
+    {
+        GL::StageTimerScope timer(StageTimers.camInit);
+        if (!gpuart::GL::Utils::DrawFullscreenQuad(prog.GetAttribute(Attributes::position)))
+            return false;
+    }
 
     ResetPathTracing();
 
@@ -190,73 +200,52 @@ bool gpuart::Renderer::InitPerPixelTextures()
             return false;
     }
 
+    if (Stats.enabled && !InitTraversalStatsTextures())
+        return false;
+
+    if (Offscreen.enabled)
+    {
+        Offscreen.image = gpuart::GL::Texture(GL_RGBA32F, Viewport.width, Viewport.height,
+                                              GL_RGBA, GL_FLOAT, nullptr, false);
+        Offscreen.fbo = gpuart::GL::Framebuffer({ &Offscreen.image });
+        if (!Offscreen.fbo)
+            return false;
+    }
+
     return SetCamera(CurrentCamera);
 }
 
-/** Use GetIsOK() to verify successful initialization.
-    gpuart::GL::Init() has to be called prior to calling this constructor. */
-gpuart::Renderer::Renderer(unsigned viewportWidth, unsigned viewportHeight, const gpuart::Camera &camera)
+/** Creates the traversal counters and the framebuffers of the instrumented rendering stages,
+    attached to the existing path tracing accumulators; returns 'false' on failure. */
+bool gpuart::Renderer::InitTraversalStatsTextures()
 {
-    IsOK = false;
-
-    Lighting.Sun.azimuth = PI;
-    Lighting.Sun.altitude = PI/4;
-    Lighting.Sun.directLightingEnabled = true;
-
-    UserSphere.pos = Vec3f(0, 0, 0);
-    UserSphere.emittance = 0;
-    UserSphere.radius = 0;
-    UserSphere.flags = 0;
-
-    PathTracing.pathsPerPixel = 5;
-    PathTracing.pathsPerPass = PathTracing.pathsPerPixel;
-    PathTracing.numPathsRendered = 0;
-    PathTracing.selector = 0;
-
-
-    if (!CreateShader(Shaders.Primitive.disc, GL_FRAGMENT_SHADER, "shaders/disc.glsl"))
-        return;
-
-    if (!CreateShader(Shaders.Primitive.sphere, GL_FRAGMENT_SHADER, "shaders/sphere.glsl"))
-        return;
-
-    if (!CreateShader(Shaders.Primitive.triangle, GL_FRAGMENT_SHADER, "shaders/triangle.glsl"))
-        return;
-
-    if (!CreateShader(Shaders.Primitive.cone, GL_FRAGMENT_SHADER, "shaders/cone.glsl"))
-        return;
-
-    if (!CreateShader(Shaders.Calc.intersection, GL_FRAGMENT_SHADER, "shaders/intersection.glsl"))
-        return;
-
-    if (!CreateShader(Shaders.Calc.bvhIntersection, GL_FRAGMENT_SHADER, "shaders/bvh_intersection.glsl"))
-        return;
-
-    if (!CreateShader(Shaders.Calc.sky, GL_FRAGMENT_SHADER, "shaders/sky.glsl"))
-        return;
-
-    if (!CreateShader(Shaders.RenderingStage.directLighting, GL_FRAGMENT_SHADER, "shaders/direct_lighting.glsl"))
-        return;
-
-    if (!CreateShader(Shaders.RenderingStage.pathTracing, GL_FRAGMENT_SHADER, "shaders/path_tracing.glsl"))
-        return;
-
-    if (!CreateShader(Shaders.RenderingStage.ptracingNormalize, GL_FRAGMENT_SHADER, "shaders/pt_normalize.glsl"))
-        return;
-
-    if (!CreateShader(Shaders.common, GL_FRAGMENT_SHADER, "shaders/common.glsl"))
-        return;
-
-    if (!CreateShader(Shaders.noise, GL_FRAGMENT_SHADER, "shaders/noise.glsl"))
-        return;
+    Stats.counters = gpuart::GL::Texture(GL_RGBA32F, Viewport.width, Viewport.height,
+                                         GL_RGBA, GL_FLOAT, nullptr, false);
+    Stats.directImage = gpuart::GL::Texture(GL_RGBA32F, Viewport.width, Viewport.height,
+                                            GL_RGBA, GL_FLOAT, nullptr, false);
+
+    // Order of attachments corresponds with 'layout(location)' of outputs in the rendering stage shaders
+    Stats.directFBO = gpuart::GL::Framebuffer({ &Stats.directImage, &Stats.counters });
+    if (!Stats.directFBO)
+        return false;
 
-    if (!CreateShader(Shaders.cameraInit, GL_FRAGMENT_SHADER, "shaders/cam_init.glsl"))
-        return;
+    for (auto i: {0, 1})
+    {
+        Stats.accumFBO[i] = gpuart::GL::Framebuffer({ &PathTracing.accumulator[i], &Stats.counters });
+        if (!Stats.accumFBO[i])
+            return false;
+    }
 
-    if (!CreateShader(Shaders.vertex, GL_VERTEX_SHADER, "shaders/vertex.glsl"))
-        return;
+    return true;
+}
 
-    if (!CreateProgram(Programs.directLighting,
+/// Returns 'false' on failure
+bool gpuart::Renderer::CreateRenderingPrograms(GL::Program &directLighting, GL::Program &pathTracing,
+                                               const GL::Shader &bvhIntersection,
+                                               const GL::Shader &directLightingShader,
+                                               const GL::Shader &pathTracingShader)
+{
+    if (!CreateProgram(directLighting,
 
                       { &Shaders.Primitive.sphere,
                         &Shaders.Primitive.disc,
@@ -265,9 +254,9 @@ gpuart::Renderer::Renderer(unsigned viewportWidth, unsigned viewportHeight, cons
 
                         &Shaders.Calc.intersection,
                         &Shaders.Calc.sky,
-                        &Shaders.Calc.bvhIntersection,
+                        &bvhIntersection,
 
-                        &Shaders.RenderingStage.directLighting,
+                        &directLightingShader,
 
                         &Shaders.common,
                         &Shaders.vertex },
@@ -279,28 +268,35 @@ gpuart::Renderer::Renderer(unsigned viewportWidth, unsigned viewportHeight, cons
                         Uniforms::sunDirectLightingEnabled,
 
                         Uniforms::bvh,
+                        Uniforms::meshVertices,
+                        Uniforms::materials,
+
+                        Uniforms::dynamicObjects,
+                        Uniforms::numDynamicObjectGroups,
 
-                        Uniforms::userSphere,
-                        Uniforms::userSphereFlags },
+                        Uniforms::lights,
+                        Uniforms::numLights,
+                        Uniforms::firstDynamicLight },
 
 
                       { Attributes::position }))
     {
-        return;
+        return false;
     }
 
-    if (!CreateProgram(Programs.pathTracing,
+    if (!CreateProgram(pathTracing,
 
                       { &Shaders.Primitive.sphere,
                         &Shaders.Primitive.disc,
                         &Shaders.Primitive.triangle,
                         &Shaders.Primitive.cone,
 
-                        &Shaders.Calc.bvhIntersection,
+                        &bvhIntersection,
                         &Shaders.Calc.intersection,
                         &Shaders.Calc.sky,
+                        &Shaders.Calc.lightSampling,
 
-                        &Shaders.RenderingStage.pathTracing,
+                        &pathTracingShader,
 
                         &Shaders.common,
                         &Shaders.noise,
@@ -315,17 +311,118 @@ gpuart::Renderer::Renderer(unsigned viewportWidth, unsigned viewportHeight, cons
                         Uniforms::sunDirectLightingEnabled,
 
                         Uniforms::bvh,
+                        Uniforms::meshVertices,
+                        Uniforms::materials,
 
                         Uniforms::prevRadiance,
                         Uniforms::randSeed,
                         Uniforms::pixelSize,
                         Uniforms::cameraPos,
 
-                        Uniforms::userSphere,
-                        Uniforms::userSphereEm,
-                        Uniforms::userSphereFlags },
+                        Uniforms::dynamicObjects,
+                        Uniforms::numDynamicObjectGroups,
+
+                        Uniforms::lights,
+                        Uniforms::numLights,
+                        Uniforms::totalLightPower },
 
                       { Attributes::position }))
+    {
+        return false;
+    }
+
+    return true;
+}
+
+/** Use GetIsOK() to verify successful initialization.
+    gpuart::GL::Init() has to be called prior to calling this constructor.
+    If 'offscreen' is true, the final image is rendered into a floating-point texture
+    instead of the default framebuffer (e.g. when there is no window); see ReadImage(). */
+gpuart::Renderer::Renderer(unsigned viewportWidth, unsigned viewportHeight, const gpuart::Camera &camera, bool offscreen)
+{
+    IsOK = false;
+    Offscreen.enabled = offscreen;
+
+    Lighting.Sun.azimuth = PI;
+    Lighting.Sun.altitude = PI/4;
+    Lighting.Sun.directLightingEnabled = true;
+
+    Dynamic.objects.assign(1, DynamicObject::MakeSphere(Vec3f(0, 0, 0), 0)); // user sphere
+    Dynamic.modified = true;
+    Dynamic.bufSize = 0;
+    Dynamic.numGroups = 0;
+
+    Lights.modified = true;
+    Lights.bufSize = 0;
+    Lights.numLights = 0;
+    Lights.numSceneLights = 0;
+    Lights.totalPower = 0;
+
+    PathTracing.pathsPerPixel = 5;
+    PathTracing.pathsPerPass = PathTracing.pathsPerPixel;
+    PathTracing.numPathsRendered = 0;
+    PathTracing.selector = 0;
+
+    BVH.width = 4;
+
+    SceneUpload.active = false;
+    SceneUpload.treeBytes = SceneUpload.meshVerticesBytes = 0;
+    SceneUpload.bytesUploaded = 0;
+
+    Stats.enabled = false;
+    Stats.Heatmap.enabled = false;
+    Stats.Heatmap.stat = TraversalStat::NodesVisited;
+    Stats.Heatmap.maxValue = 100;
+
+    if (!CreateShader(Shaders.Primitive.disc, GL_FRAGMENT_SHADER, "shaders/disc.glsl"))
+        return;
+
+    if (!CreateShader(Shaders.Primitive.sphere, GL_FRAGMENT_SHADER, "shaders/sphere.glsl"))
+        return;
+
+    if (!CreateShader(Shaders.Primitive.triangle, GL_FRAGMENT_SHADER, "shaders/triangle.glsl"))
+        return;
+
+    if (!CreateShader(Shaders.Primitive.cone, GL_FRAGMENT_SHADER, "shaders/cone.glsl"))
+        return;
+
+    if (!CreateShader(Shaders.Calc.intersection, GL_FRAGMENT_SHADER, "shaders/intersection.glsl"))
+        return;
+
+    if (!CreateShader(Shaders.Calc.bvhIntersection, GL_FRAGMENT_SHADER, "shaders/bvh_intersection.glsl"))
+        return;
+
+    if (!CreateShader(Shaders.Calc.sky, GL_FRAGMENT_SHADER, "shaders/sky.glsl"))
+        return;
+
+    if (!CreateShader(Shaders.Calc.lightSampling, GL_FRAGMENT_SHADER, "shaders/light_sampling.glsl"))
+        return;
+
+    if (!CreateShader(Shaders.RenderingStage.directLighting, GL_FRAGMENT_SHADER, "shaders/direct_lighting.glsl"))
+        return;
+
+    if (!CreateShader(Shaders.RenderingStage.pathTracing, GL_FRAGMENT_SHADER, "shaders/path_tracing.glsl"))
+        return;
+
+    if (!CreateShader(Shaders.RenderingStage.ptracingNormalize, GL_FRAGMENT_SHADER, "shaders/pt_normalize.glsl"))
+        return;
+
+    if (!CreateShader(Shaders.common, GL_FRAGMENT_SHADER, "shaders/common.glsl"))
+        return;
+
+    if (!CreateShader(Shaders.noise, GL_FRAGMENT_SHADER, "shaders/noise.glsl"))
+        return;
+
+    if (!CreateShader(Shaders.cameraInit, GL_FRAGMENT_SHADER, "shaders/cam_init.glsl"))
+        return;
+
+    if (!CreateShader(Shaders.vertex, GL_VERTEX_SHADER, "shaders/vertex.glsl"))
+        return;
+
+    if (!CreateRenderingPrograms(Programs.directLighting, Programs.pathTracing,
+                                 Shaders.Calc.bvhIntersection,
+                                 Shaders.RenderingStage.directLighting,
+                                 Shaders.RenderingStage.pathTracing))
     {
         return;
     }
@@ -369,13 +466,25 @@ gpuart::Renderer::Renderer(unsigned viewportWidth, unsigned viewportHeight, cons
     IsOK = true;
 }
 
+/// Binds the framebuffer receiving the final image
+void gpuart::Renderer::BindOutputFramebuffer()
+{
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, Offscreen.enabled ? Offscreen.fbo.Get() : 0);
+}
+
 void gpuart::Renderer::RenderDirectLighting()
 {
     assert(IsOK);
 
+    UploadDynamicObjects();
+
     SetDefaultGLState();
+    if (Stats.enabled)
+        Stats.directFBO.Bind();
+    else
+        BindOutputFramebuffer();
 
-    gpuart::GL::Program &prog = Programs.directLighting;
+    gpuart::GL::Program &prog = Stats.enabled ? Stats.Programs.directLighting : Programs.directLighting;
     prog.Use();
 
     GLenum texIdx = 0;
@@ -392,15 +501,46 @@ void gpuart::Renderer::RenderDirectLighting()
     prog.SetUniform4f(Uniforms::sunDirAlt, GetSunDirection(), GetSunAltitude());
     prog.SetUniform1i(Uniforms::sunDirectLightingEnabled, IsSunDirectLightingEnabled());
 
-    prog.SetUniform4f(Uniforms::userSphere, UserSphere.pos, UserSphere.radius);
-    prog.SetUniform1ui(Uniforms::userSphereFlags, UserSphere.flags);
-
     glActiveTexture(GL_TEXTURE0 + texIdx);
     glBindTexture(GL_TEXTURE_BUFFER, BVH.tex.Get());
     prog.SetUniform1i(Uniforms::bvh, texIdx);
     texIdx++;
 
-    gpuart::GL::Utils::DrawFullscreenQuad(prog.GetAttribute(Attributes::position));
+    glActiveTexture(GL_TEXTURE0 + texIdx);
+    glBindTexture(GL_TEXTURE_BUFFER, BVH.meshVertTex.Get());
+    prog.SetUniform1i(Uniforms::meshVertices, texIdx);
+    texIdx++;
+
+    glActiveTexture(GL_TEXTURE0 + texIdx);
+    glBindTexture(GL_TEXTURE_BUFFER, BVH.materialsTex.Get());
+    prog.SetUniform1i(Uniforms::materials, texIdx);
+    texIdx++;
+
+    glActiveTexture(GL_TEXTURE0 + texIdx);
+    glBindTexture(GL_TEXTURE_BUFFER, Dynamic.tex.Get());
+    prog.SetUniform1i(Uniforms::dynamicObjects, texIdx);
+    texIdx++;
+
+    prog.SetUniform1i(Uniforms::numDynamicObjectGroups, Dynamic.numGroups);
+
+    glActiveTexture(GL_TEXTURE0 + texIdx);
+    glBindTexture(GL_TEXTURE_BUFFER, Lights.tex.Get());
+    prog.SetUniform1i(Uniforms::lights, texIdx);
+    texIdx++;
+
+    prog.SetUniform1i(Uniforms::numLights, Lights.numLights);
+    prog.SetUniform1i(Uniforms::firstDynamicLight, Lights.numSceneLights);
+
+    {
+        GL::StageTimerScope timer(StageTimers.directLighting);
+        gpuart::GL::Utils::DrawFullscreenQuad(prog.GetAttribute(Attributes::position));
+    }
+
+    if (Stats.enabled)
+    {
+        Stats.directFBO.Unbind();
+        PresentImage(Stats.directImage, 1);
+    }
 }
 
 /// Returns 'false' on failure
@@ -440,42 +580,387 @@ std::ostream& operator <<(std::ostream &os, const ByteCount &bc)
     return os;
 }
 
-/** May change the order of elements in 'primitives'. After calling this method,
-    contents of 'primitives' are no longer used. */
-void gpuart::Renderer::SetPrimitives(std::vector<Primitive*> &primitives, bool printInfo)
+/** Builds and compiles the BVH of 'primitives'; does not use OpenGL, so it can run on a worker thread.
+    If 'printInfo' is true and 'params.strategy' is not the midpoint split, a midpoint-split tree is also built
+    for comparison of SAH costs. 'progress' (if set) is called at the start of each stage.
+    If 'refittable' is true, primitives of the scene can be updated after uploading (see UpdatePrimitive()). */
+gpuart::Renderer::CompiledScene gpuart::Renderer::CompileScene(const PrimitiveSet &primitives, const BVHBuildParams &params, bool printInfo,
+                                                               const std::function<void(const char *stage, float fraction)> &progress,
+                                                               bool refittable)
 {
+    CompiledScene scene;
+
+    if (progress)
+        progress("Building BVH", 0.0f);
+
     std::chrono::high_resolution_clock::time_point tstart;
     if (printInfo)
     {
-        std::cout << "Constructing BVH tree of " << primitives.size() << " primitives... "; std::cout.flush();
+        std::cout << "Constructing BVH tree of " << primitives.GetCount() << " primitives... "; std::cout.flush();
         tstart = std::chrono::high_resolution_clock::now();
     }
 
-    BVH.tree = gpuart::BoundingVolumesHierarchy(primitives, 1024, 2);
+    gpuart::BoundingVolumesHierarchy tree(primitives, params.maxNumLevels, params.minPrimitivesPerNode, params.strategy);
 
     if (printInfo)
     {
         std::cout << "done (" << TimeElapsed(tstart) << ")." << std::endl;
+
+        std::cout << "SAH cost: " << std::setprecision(2) << tree.GetSAHCost();
+        if (params.strategy != BVHBuildStrategy::Midpoint)
+        {
+            std::cout << " (midpoint split: "
+                      << gpuart::BoundingVolumesHierarchy(primitives, params.maxNumLevels, params.minPrimitivesPerNode,
+                                                          BVHBuildStrategy::Midpoint).GetSAHCost()
+                      << ")";
+        }
+        std::cout << "." << std::endl;
+
         std::cout << "Compiling BVH tree... "; std::cout.flush();
         tstart = std::chrono::high_resolution_clock::now();
     }
 
-    gpuart::Primitive::Data compiledTree;
-    BVH.tree.Compile(compiledTree);
+    if (progress)
+        progress("Compiling BVH", 0.5f);
+
+    if (refittable)
+    {
+        std::vector<CompiledPrimitiveLocation> locations;
+        tree.Compile(primitives, scene.tree, params.width, &locations);
+        scene.refitter.reset(new BVHRefitter(primitives, scene.tree, std::move(locations)));
+    }
+    else
+        tree.Compile(primitives, scene.tree, params.width);
 
     if (printInfo)
         std::cout << "done (" << TimeElapsed(tstart) << ").\n";
 
     // Uncomment the following line only for debugging (lots of output):
-    // std::cout << "\n\n\n"; gpuart::BoundingVolumesHierarchy::Print(compiledTree, std::cout);
+    // std::cout << "\n\n\n"; gpuart::BoundingVolumesHierarchy::Print(scene.tree, std::cout);
 
-    BVH.buf = gpuart::GL::Buffer(GL_TEXTURE_BUFFER,
-                                 compiledTree.data(), (GLsizei)(compiledTree.size() * sizeof(decltype(compiledTree)::value_type)),
-                                 GL_STATIC_DRAW);
-    BVH.tex = gpuart::GL::Texture(GL_RGBA32F, BVH.buf);
+    // Mesh vertices are stored as RGBA quads, as RGB32F buffer textures require OpenGL 4.0
+    scene.meshVertices.reserve(RGBA_ELEMS * std::max<size_t>(1, primitives.MeshVertices.size()));
+    for (const Vec3f &v: primitives.MeshVertices)
+        scene.meshVertices.insert(scene.meshVertices.end(), { v.x, v.y, v.z, RGBA_PAD });
+
+    if (scene.meshVertices.empty())
+        scene.meshVertices.assign(RGBA_ELEMS, RGBA_PAD); // avoid creating an empty buffer
+
+    StoreMaterials(primitives.Materials, scene.materials);
+    StoreLights(primitives, scene.lights, refittable ? &scene.lightPrimitives : nullptr);
 
     if (printInfo)
-        std::cout << "Compiled tree occupies " << ByteCount(compiledTree.size() * sizeof(decltype(compiledTree)::value_type)) << "." << std::endl;
+    {
+        std::cout << "Compiled tree occupies " << ByteCount(scene.tree.size() * sizeof(Primitive::Data::value_type));
+        if (!primitives.MeshVertices.empty())
+            std::cout << ", mesh vertices: " << ByteCount(scene.meshVertices.size() * sizeof(Primitive::Data::value_type));
+        std::cout << "." << std::endl;
+    }
+
+    if (progress)
+        progress("Uploading", 1.0f);
+
+    return scene;
+}
+
+/** Builds and compiles a two-level hierarchy (see TwoLevelBVH) of 'instances' of 'meshes', with space
+    for up to 'maxInstances' instances (0: as many as 'instances'); does not use OpenGL. On failure,
+    the returned scene's tree is empty. */
+gpuart::Renderer::CompiledScene gpuart::Renderer::CompileInstancedScene(const std::vector<PrimitiveSet> &meshes,
+                                                                        const std::vector<MeshInstance> &instances,
+                                                                        const BVHBuildParams &params, size_t maxInstances,
+                                                                        bool printInfo)
+{
+    CompiledScene scene;
+
+    std::chrono::high_resolution_clock::time_point tstart;
+    if (printInfo)
+    {
+        std::cout << "Constructing two-level BVH of " << meshes.size() << " meshes and "
+                  << instances.size() << " instances... "; std::cout.flush();
+        tstart = std::chrono::high_resolution_clock::now();
+    }
+
+    std::vector<Vec3f> meshVertices;
+    std::vector<Material> materials;
+    scene.twoLevel.reset(new TwoLevelBVH());
+    if (!scene.twoLevel->Build(meshes, instances, maxInstances, params.maxNumLevels, params.minPrimitivesPerNode,
+                               params.strategy, params.width, scene.tree, meshVertices, materials))
+    {
+        return CompiledScene();
+    }
+
+    scene.meshVertices.reserve(RGBA_ELEMS * std::max<size_t>(1, meshVertices.size()));
+    for (const Vec3f &v: meshVertices)
+        scene.meshVertices.insert(scene.meshVertices.end(), { v.x, v.y, v.z, RGBA_PAD });
+
+    if (scene.meshVertices.empty())
+        scene.meshVertices.assign(RGBA_ELEMS, RGBA_PAD); // avoid creating an empty buffer
+
+    // Emissive primitives of instanced meshes are not sampled as lights
+    StoreMaterials(materials, scene.materials);
+
+    if (printInfo)
+    {
+        std::cout << "done (" << TimeElapsed(tstart) << ").\n";
+        std::cout << "Compiled tree occupies " << ByteCount(scene.tree.size() * sizeof(Primitive::Data::value_type)) << "." << std::endl;
+    }
+
+    return scene;
+}
+
+/** Starts uploading 'scene' in chunks with ContinueSceneUpload(); until it completes, the current scene
+    is rendered. Discards an unfinished upload. */
+void gpuart::Renderer::BeginSceneUpload(CompiledScene &&scene)
+{
+    SceneUpload.scene = std::move(scene);
+    const CompiledScene &src = SceneUpload.scene;
+
+    // A cache file is uploaded directly from its memory mapping
+    SceneUpload.tree = src.cacheFile ? src.cacheFile->GetTree() : src.tree.data();
+    SceneUpload.treeBytes = sizeof(GLfloat) * (src.cacheFile ? src.cacheFile->GetTreeSize() : src.tree.size());
+    SceneUpload.meshVertices = src.cacheFile ? src.cacheFile->GetMeshVertices() : src.meshVertices.data();
+    SceneUpload.meshVerticesBytes = sizeof(GLfloat) * (src.cacheFile ? src.cacheFile->GetMeshVerticesSize() : src.meshVertices.size());
+
+    // Storage is allocated up front and filled by ContinueSceneUpload(), avoiding a full-size copy made by the driver
+    SceneUpload.treeBuf = gpuart::GL::Buffer(GL_TEXTURE_BUFFER, (GLsizeiptr)SceneUpload.treeBytes, GL_STATIC_DRAW);
+    SceneUpload.meshVertBuf = gpuart::GL::Buffer(GL_TEXTURE_BUFFER, (GLsizeiptr)SceneUpload.meshVerticesBytes, GL_STATIC_DRAW);
+
+    SceneUpload.bytesUploaded = 0;
+    SceneUpload.useMapping = true;
+    SceneUpload.active = true;
+}
+
+/** Uploads up to 'maxBytes' of the scene passed to BeginSceneUpload(). Once all data are uploaded,
+    the scene replaces the current one, path tracing restarts and 'true' is returned. */
+bool gpuart::Renderer::ContinueSceneUpload(size_t maxBytes)
+{
+    assert(SceneUpload.active);
+    assert(maxBytes > 0);
+
+    // The new buffers are not used by any GL commands yet, so unsynchronized writes are safe
+    while (maxBytes > 0 && SceneUpload.bytesUploaded < SceneUpload.treeBytes + SceneUpload.meshVerticesBytes)
+    {
+        const bool inTree = SceneUpload.bytesUploaded < SceneUpload.treeBytes;
+        const size_t offset = inTree ? SceneUpload.bytesUploaded : SceneUpload.bytesUploaded - SceneUpload.treeBytes;
+        const size_t totalBytes = inTree ? SceneUpload.treeBytes : SceneUpload.meshVerticesBytes;
+        const size_t chunkSize = std::min(maxBytes, totalBytes - offset);
+
+        GL::Buffer &dest = inTree ? SceneUpload.treeBuf : SceneUpload.meshVertBuf;
+        const char *src = reinterpret_cast<const char*>(inTree ? SceneUpload.tree : SceneUpload.meshVertices);
+        if (!SceneUpload.useMapping)
+        {
+            glBindBuffer(GL_TEXTURE_BUFFER, dest.Get());
+            glBufferSubData(GL_TEXTURE_BUFFER, (GLintptr)offset, (GLsizeiptr)chunkSize, src + offset);
+        }
+        else if (!dest.Upload(GL_TEXTURE_BUFFER, (GLintptr)offset, src + offset, (GLsizeiptr)chunkSize))
+        {
+            // Mapped contents were lost; start over without mapping, so that the upload cannot be interrupted again
+            std::cerr << "Scene upload interrupted, restarting without buffer mapping." << std::endl;
+            SceneUpload.bytesUploaded = 0;
+            SceneUpload.useMapping = false;
+            return false;
+        }
+
+        SceneUpload.bytesUploaded += chunkSize;
+        maxBytes -= chunkSize;
+    }
+
+    if (SceneUpload.bytesUploaded < SceneUpload.treeBytes + SceneUpload.meshVerticesBytes)
+        return false;
+
+    BVH.buf = std::move(SceneUpload.treeBuf);
+    BVH.tex = gpuart::GL::Texture(GL_RGBA32F, BVH.buf);
+
+    BVH.meshVertBuf = std::move(SceneUpload.meshVertBuf);
+    BVH.meshVertTex = gpuart::GL::Texture(GL_RGBA32F, BVH.meshVertBuf);
+
+    // The material table is small enough to be uploaded at once
+    const CompiledScene &scene = SceneUpload.scene;
+    const GLfloat *materials = scene.cacheFile ? scene.cacheFile->GetMaterials() : scene.materials.data();
+    const size_t materialsSize = scene.cacheFile ? scene.cacheFile->GetMaterialsSize() : scene.materials.size();
+    BVH.materialsBuf = gpuart::GL::Buffer(GL_TEXTURE_BUFFER, materials, (GLsizei)(materialsSize * sizeof(GLfloat)), GL_STATIC_DRAW);
+    BVH.materialsTex = gpuart::GL::Texture(GL_RGBA32F, BVH.materialsBuf);
+
+    // Combined with the dynamic objects' lights by UploadDynamicObjects()
+    if (scene.cacheFile)
+        Lights.scene.assign(scene.cacheFile->GetLights(), scene.cacheFile->GetLights() + scene.cacheFile->GetLightsSize());
+    else
+        Lights.scene = std::move(SceneUpload.scene.lights);
+    Lights.scenePrimitives = std::move(SceneUpload.scene.lightPrimitives);
+    Lights.modified = true;
+
+    // Keep the tree of a refittable scene; release other CPU-side copies (or the mapping), which are no longer needed
+    BVH.tree = std::move(SceneUpload.scene.tree);
+    BVH.refitter = std::move(SceneUpload.scene.refitter);
+    if (!BVH.refitter)
+        Primitive::Data().swap(BVH.tree);
+    BVH.twoLevel = std::move(SceneUpload.scene.twoLevel);
+    SceneUpload.scene = CompiledScene();
+    SceneUpload.active = false;
+
+    ResetPathTracing();
+
+    return true;
+}
+
+/// Uploads 'scene' (replacing the current one) and restarts path tracing
+void gpuart::Renderer::SetCompiledScene(CompiledScene &&scene)
+{
+    const size_t UPLOAD_CHUNK_SIZE = 16 << 20;
+
+    // Terminates: after an interrupted mapped upload, ContinueSceneUpload() restarts (at most once) without mapping
+    BeginSceneUpload(std::move(scene));
+    while (!ContinueSceneUpload(UPLOAD_CHUNK_SIZE))
+        ;
+}
+
+/** After calling this method, 'primitives' are no longer used. If 'printInfo' is true
+    and 'strategy' is not the midpoint split, a midpoint-split tree is also built for comparison of SAH costs. */
+void gpuart::Renderer::SetPrimitives(const PrimitiveSet &primitives, bool printInfo, BVHBuildStrategy strategy, bool refittable)
+{
+    BVHBuildParams params;
+    params.strategy = strategy;
+    params.width = BVH.width;
+
+    SetCompiledScene(CompileScene(primitives, params, printInfo, nullptr, refittable));
+}
+
+/** Sets a two-level scene of 'instances' of 'meshes' (see CompileInstancedScene()) and restarts path tracing;
+    returns 'false' on failure. */
+bool gpuart::Renderer::SetInstancedScene(const std::vector<PrimitiveSet> &meshes, const std::vector<MeshInstance> &instances,
+                                         bool printInfo, BVHBuildStrategy strategy, size_t maxInstances)
+{
+    BVHBuildParams params;
+    params.strategy = strategy;
+    params.width = BVH.width;
+
+    CompiledScene scene = CompileInstancedScene(meshes, instances, params, maxInstances, printInfo);
+    if (scene.tree.empty())
+        return false;
+
+    SetCompiledScene(std::move(scene));
+    return true;
+}
+
+/** Replaces the instances of the current two-level scene (e.g. moved); rebuilds and uploads only
+    the top-level tree and restarts path tracing. Returns 'false' on failure. */
+bool gpuart::Renderer::SetInstances(const std::vector<MeshInstance> &instances)
+{
+    if (!BVH.twoLevel)
+    {
+        std::cerr << "The current scene is not a two-level hierarchy." << std::endl;
+        return false;
+    }
+
+    Primitive::Data topLevel;
+    if (!BVH.twoLevel->CompileTopLevel(instances, topLevel))
+        return false;
+
+    // The top-level tree is at the start of the buffer, before the bottom-level trees
+    glBindBuffer(GL_TEXTURE_BUFFER, BVH.buf.Get());
+    glBufferSubData(GL_TEXTURE_BUFFER, 0, (GLsizeiptr)(topLevel.size() * sizeof(GLfloat)), topLevel.data());
+
+    ResetPathTracing();
+    return true;
+}
+
+/** Replaces the primitive with index 'index' (as in the PrimitiveSet the current scene was compiled of)
+    with 'primitive' of the same type and material, e.g. moved. Takes effect after calling RefitBVH().
+    Returns 'false' if the scene is not refittable or 'primitive' is of a different type or material. */
+bool gpuart::Renderer::UpdatePrimitive(size_t index, const Primitive &primitive)
+{
+    if (!BVH.refitter)
+    {
+        std::cerr << "The current scene was not compiled as refittable." << std::endl;
+        return false;
+    }
+
+    if (!BVH.refitter->UpdatePrimitive(index, primitive, BVH.tree))
+        return false;
+
+    // Move the light record of an emissive primitive along; its emission is unchanged, as is the material
+    auto light = std::lower_bound(Lights.scenePrimitives.begin(), Lights.scenePrimitives.end(), index);
+    if (light != Lights.scenePrimitives.end() && *light == index)
+    {
+        GLfloat *record = &Lights.scene[(light - Lights.scenePrimitives.begin()) * RGBA_ELEMS * LIGHT_DATA_LEN];
+
+        Primitive::Data updated;
+        primitive.StoreLight(Vec3f(record[2*RGBA_ELEMS], record[2*RGBA_ELEMS + 1], record[2*RGBA_ELEMS + 2]), updated);
+        std::copy(updated.begin(), updated.end(), record);
+        Lights.modified = true;
+    }
+
+    return true;
+}
+
+/** Refits the BVH after calls to UpdatePrimitive(), uploads only the modified parts of the compiled tree
+    and restarts path tracing. The BVH topology stays the same, so rebuild the scene after large movements. */
+void gpuart::Renderer::RefitBVH()
+{
+    if (!BVH.refitter)
+        return;
+
+    std::vector<std::pair<size_t, size_t>> modifiedRanges;
+    BVH.refitter->Refit(BVH.tree, modifiedRanges);
+    if (modifiedRanges.empty())
+        return;
+
+    // Unlike the initial upload, the buffer is in use by previous frames, so let the driver synchronize
+    glBindBuffer(GL_TEXTURE_BUFFER, BVH.buf.Get());
+    for (const auto &range: modifiedRanges)
+        glBufferSubData(GL_TEXTURE_BUFFER, (GLintptr)(range.first * sizeof(GLfloat)),
+                        (GLsizeiptr)(range.second * sizeof(GLfloat)), &BVH.tree[range.first]);
+
+    ResetPathTracing();
+}
+
+/// Uploads 'data' to 'buf' (viewed by 'tex'), which is reallocated if smaller than 'data' ('bufSize' bytes)
+static
+void UploadDynamicData(const gpuart::Primitive::Data &data, gpuart::GL::Buffer &buf, gpuart::GL::Texture &tex, size_t &bufSize)
+{
+    const size_t size = data.size() * sizeof(GLfloat);
+    if (size > bufSize)
+    {
+        buf = gpuart::GL::Buffer(GL_TEXTURE_BUFFER, data.data(), (GLsizei)size, GL_DYNAMIC_DRAW);
+        tex = gpuart::GL::Texture(GL_RGBA32F, buf);
+        bufSize = size;
+    }
+    else
+    {
+        // Contents past 'size' are left over from earlier uploads; shaders do not access them
+        glBindBuffer(GL_TEXTURE_BUFFER, buf.Get());
+        glBufferSubData(GL_TEXTURE_BUFFER, 0, (GLsizeiptr)size, data.data());
+    }
+}
+
+/// Stores and uploads the dynamic objects and the light list if they were modified
+void gpuart::Renderer::UploadDynamicObjects()
+{
+    if (!Dynamic.modified && !Lights.modified)
+        return;
+
+    if (Dynamic.modified)
+    {
+        Dynamic.numGroups = StoreDynamicObjects(Dynamic.objects, Dynamic.data);
+        if (Dynamic.data.empty())
+            Dynamic.data.assign(RGBA_ELEMS, RGBA_PAD); // avoid creating an empty buffer
+
+        UploadDynamicData(Dynamic.data, Dynamic.buf, Dynamic.tex, Dynamic.bufSize);
+    }
+
+    // Selection probabilities depend on all lights, so the whole list is stored again
+    Lights.data = Lights.scene;
+    StoreLights(Dynamic.objects, Lights.data);
+    Lights.numSceneLights = (unsigned)(Lights.scene.size() / (RGBA_ELEMS * LIGHT_DATA_LEN));
+    Lights.numLights = (unsigned)(Lights.data.size() / (RGBA_ELEMS * LIGHT_DATA_LEN));
+    Lights.totalPower = SetLightSelectionProbabilities(Lights.data);
+    if (Lights.data.empty())
+        Lights.data.assign(RGBA_ELEMS, RGBA_PAD); // avoid creating an empty buffer
+
+    UploadDynamicData(Lights.data, Lights.buf, Lights.tex, Lights.bufSize);
+
+    Dynamic.modified = Lights.modified = false;
 }
 
 /// Cleans up the state after NanoGUI
@@ -485,6 +970,16 @@ void gpuart::Renderer::SetDefaultGLState()
     glDisable(GL_DEPTH_TEST);
     glDisable(GL_STENCIL_TEST);
     glDisable(GL_CULL_FACE);
+
+    /* If the ratio of framebuffer size to "96 DPI-equivalent window size" is not 1
+       (which may happen on some OSes under high-DPI displays), NanoGUI may reset
+       the GL viewport to a size not exactly equal to the framebuffer size, which we
+       pass using Renderer::UpdateViewportSize().
+
+       Need to restore it here, otherwise our full-screen quad will not have expected
+       coordinate ranges and path tracing accumulation will be incorrect. Without a window
+       (see GL::OffscreenContext), the initial viewport is empty. */
+    glViewport(0, 0, Viewport.width, Viewport.height);
 }
 
 void gpuart::Renderer::ResetPathTracing()
@@ -517,17 +1012,9 @@ unsigned gpuart::Renderer::RenderPathTracingPass()
 
     GLenum texIdx;
     unsigned pathsToRender = 0;
+    UploadDynamicObjects();
     SetDefaultGLState();
 
-    /* If the ratio of framebuffer size to "96 DPI-equivalent window size" is not 1
-       (which may happen on some OSes under high-DPI displays), NanoGUI may reset
-       the GL viewport to a size not exactly equal to the framebuffer size, which we
-       pass using Renderer::UpdateViewportSize().
-
-       Need to restore it here, otherwise our full-screen quad will not have expected
-       coordinate ranges and path tracing accumulation will be incorrect. */
-    glViewport(0, 0, Viewport.width, Viewport.height);
-
     unsigned src = PathTracing.selector;
     unsigned dest = src^1;
 
@@ -537,9 +1024,10 @@ unsigned gpuart::Renderer::RenderPathTracingPass()
 
         PathTracing.lastDest = dest;
 
-        PathTracing.accumFBO[dest].Bind();
+        GL::Framebuffer &accumFBO = Stats.enabled ? Stats.accumFBO[dest] : PathTracing.accumFBO[dest];
+        accumFBO.Bind();
 
-        gpuart::GL::Program &prog = Programs.pathTracing;
+        gpuart::GL::Program &prog = Stats.enabled ? Stats.Programs.pathTracing : Programs.pathTracing;
 
         prog.Use();
 
@@ -559,6 +1047,26 @@ unsigned gpuart::Renderer::RenderPathTracingPass()
         prog.SetUniform1i(Uniforms::bvh, texIdx);
         texIdx++;
 
+        glActiveTexture(GL_TEXTURE0 + texIdx);
+        glBindTexture(GL_TEXTURE_BUFFER, BVH.meshVertTex.Get());
+        prog.SetUniform1i(Uniforms::meshVertices, texIdx);
+        texIdx++;
+
+        glActiveTexture(GL_TEXTURE0 + texIdx);
+        glBindTexture(GL_TEXTURE_BUFFER, BVH.materialsTex.Get());
+        prog.SetUniform1i(Uniforms::materials, texIdx);
+        texIdx++;
+
+        glActiveTexture(GL_TEXTURE0 + texIdx);
+        glBindTexture(GL_TEXTURE_BUFFER, Dynamic.tex.Get());
+        prog.SetUniform1i(Uniforms::dynamicObjects, texIdx);
+        texIdx++;
+
+        glActiveTexture(GL_TEXTURE0 + texIdx);
+        glBindTexture(GL_TEXTURE_BUFFER, Lights.tex.Get());
+        prog.SetUniform1i(Uniforms::lights, texIdx);
+        texIdx++;
+
         glActiveTexture(GL_TEXTURE0 + texIdx);
         glBindTexture(GL_TEXTURE_2D, PathTracing.accumulator[src].Get());
         prog.SetUniform1i(Uniforms::prevRadiance, texIdx);
@@ -577,10 +1085,9 @@ unsigned gpuart::Renderer::RenderPathTracingPass()
         prog.SetUniform4f(Uniforms::sunDirAlt, GetSunDirection(), GetSunAltitude());
         prog.SetUniform1i(Uniforms::sunDirectLightingEnabled, IsSunDirectLightingEnabled());
 
-        prog.SetUniform4f(Uniforms::userSphere, UserSphere.pos, UserSphere.radius);
-        prog.SetUniform3f(Uniforms::userSphereEm, Vec3f(1, 1, 1) * UserSphere.emittance);
-
-        prog.SetUniform1ui(Uniforms::userSphereFlags, UserSphere.flags);
+        prog.SetUniform1i(Uniforms::numDynamicObjectGroups, Dynamic.numGroups);
+        prog.SetUniform1i(Uniforms::numLights, Lights.numLights);
+        prog.SetUniform1f(Uniforms::totalLightPower, Lights.totalPower);
 
         std::uniform_real_distribution<float> distr(0, 1);
         prog.SetUniform4f(Uniforms::randSeed, distr(RndGen),
@@ -588,32 +1095,172 @@ unsigned gpuart::Renderer::RenderPathTracingPass()
                                               distr(RndGen),
                                               distr(RndGen));
 
-        gpuart::GL::Utils::DrawFullscreenQuad(prog.GetAttribute(Attributes::position));
+        {
+            GL::StageTimerScope timer(StageTimers.pathTracing);
+            gpuart::GL::Utils::DrawFullscreenQuad(prog.GetAttribute(Attributes::position));
+        }
 
         PathTracing.numPathsRendered += pathsToRender;
 
-        PathTracing.accumFBO[dest].Unbind();
+        accumFBO.Unbind();
 
         // Switch the accumulators
         PathTracing.selector = PathTracing.selector ^ 1;
     }
 
     // 2) Render the normalized output of accumulated path tracing passes to screen
+    {
+        GL::StageTimerScope timer(StageTimers.ptracingNormalize);
+        PresentImage(PathTracing.accumulator[PathTracing.lastDest], PathTracing.numPathsRendered);
+    }
+
+    return PathTracing.numPathsRendered;
+}
 
-    // Make sure we render to the default (on-screen) framebuffer
-    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+/** Renders the normalized 'radiance' (or the traversal statistics heatmap) to the output framebuffer;
+    not timed, so that only the path tracer's presentation is measured (as 'ptracingNormalize') */
+void gpuart::Renderer::PresentImage(const GL::Texture &radiance, unsigned numPathsPerPixel)
+{
+    // Make sure we render to the default (on-screen) or off-screen output framebuffer
+    BindOutputFramebuffer();
 
-    Programs.ptracingNormalize.Use();
+    const bool heatmap = Stats.enabled && Stats.Heatmap.enabled;
+    gpuart::GL::Program &prog = heatmap ? Stats.Programs.heatmap : Programs.ptracingNormalize;
+    prog.Use();
 
-    texIdx = 0;
+    GLenum texIdx = 0;
     glActiveTexture(GL_TEXTURE0 + texIdx);
-    glBindTexture(GL_TEXTURE_2D, PathTracing.accumulator[PathTracing.lastDest].Get());
-    Programs.ptracingNormalize.SetUniform1i(Uniforms::radiance, texIdx);
+    if (heatmap)
+    {
+        glBindTexture(GL_TEXTURE_2D, Stats.counters.Get());
+        prog.SetUniform1i(Uniforms::traversalStats, texIdx);
+        prog.SetUniform1i(Uniforms::statIndex, (int)Stats.Heatmap.stat);
+        prog.SetUniform1f(Uniforms::maxValue, std::max(Stats.Heatmap.maxValue, 1e-3f));
+    }
+    else
+    {
+        glBindTexture(GL_TEXTURE_2D, radiance.Get());
+        prog.SetUniform1i(Uniforms::radiance, texIdx);
+        prog.SetUniform1i(Uniforms::numPathsPerPixel, numPathsPerPixel);
+    }
     texIdx++;
 
-    Programs.ptracingNormalize.SetUniform1i(Uniforms::numPathsPerPixel, PathTracing.numPathsRendered);
+    gpuart::GL::Utils::DrawFullscreenQuad(prog.GetAttribute(Attributes::position));
+}
 
-    gpuart::GL::Utils::DrawFullscreenQuad(Programs.ptracingNormalize.GetAttribute(Attributes::position));
+/** Switches to the instrumented rendering stages, which also produce per-pixel
+    traversal statistics (slower); returns 'false' on failure. The path tracing
+    image accumulated so far is kept either way. */
+bool gpuart::Renderer::SetTraversalStatsEnabled(bool enabled)
+{
+    if (enabled == Stats.enabled)
+        return true;
 
-    return PathTracing.numPathsRendered;
+    if (enabled && !Stats.Programs.heatmap)
+    {
+        if (!CreateShader(Stats.Shaders.bvhIntersection, GL_FRAGMENT_SHADER, "shaders/bvh_intersection.glsl", TRAVERSAL_STATS_DEFINE) ||
+            !CreateShader(Stats.Shaders.directLighting, GL_FRAGMENT_SHADER, "shaders/direct_lighting.glsl", TRAVERSAL_STATS_DEFINE) ||
+            !CreateShader(Stats.Shaders.pathTracing, GL_FRAGMENT_SHADER, "shaders/path_tracing.glsl", TRAVERSAL_STATS_DEFINE) ||
+            !CreateShader(Stats.Shaders.heatmap, GL_FRAGMENT_SHADER, "shaders/traversal_heatmap.glsl"))
+        {
+            return false;
+        }
+
+        if (!CreateRenderingPrograms(Stats.Programs.directLighting, Stats.Programs.pathTracing,
+                                     Stats.Shaders.bvhIntersection,
+                                     Stats.Shaders.directLighting,
+                                     Stats.Shaders.pathTracing))
+        {
+            return false;
+        }
+
+        if (!CreateProgram(Stats.Programs.heatmap,
+
+                           { &Stats.Shaders.heatmap,
+                             &Shaders.vertex },
+
+                           { Uniforms::traversalStats,
+                             Uniforms::statIndex,
+                             Uniforms::maxValue },
+
+                           { Attributes::position }))
+        {
+            return false;
+        }
+    }
+
+    Stats.enabled = enabled;
+    if (!enabled)
+    {
+        Stats.directFBO = GL::Framebuffer();
+        for (auto i: {0, 1})
+            Stats.accumFBO[i] = GL::Framebuffer();
+        Stats.counters = GL::Texture();
+        Stats.directImage = GL::Texture();
+        return true;
+    }
+    else if (!InitTraversalStatsTextures())
+    {
+        IsOK = false;
+        return false;
+    }
+    else
+        return true;
+}
+
+/** Reads back the traversal counters of the last call to RenderDirectLighting() or RenderPathTracingPass()
+    (TraversalStat::NumStats values per pixel, rows starting with the bottom one); returns 'false'
+    if traversal statistics are not enabled. */
+bool gpuart::Renderer::ReadTraversalStats(std::vector<float> &values)
+{
+    if (!Stats.enabled)
+        return false;
+
+    values.resize((size_t)TraversalStat::NumStats * Viewport.width * Viewport.height);
+
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glBindTexture(GL_TEXTURE_2D, Stats.counters.Get());
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, values.data());
+
+    return true;
+}
+
+/** Collects the available results of GPU timer queries without waiting; each value refers
+    to the most recent measured pass, which usually is the one rendered a frame earlier. */
+gpuart::Renderer::StageTimes gpuart::Renderer::GetStageTimes()
+{
+    StageTimes times;
+    for (auto &timerAndResult: { std::make_pair(&StageTimers.camInit,           &times.camInit),
+                                 std::make_pair(&StageTimers.directLighting,    &times.directLighting),
+                                 std::make_pair(&StageTimers.pathTracing,       &times.pathTracing),
+                                 std::make_pair(&StageTimers.ptracingNormalize, &times.ptracingNormalize) })
+    {
+        timerAndResult.first->Poll();
+        *timerAndResult.second = timerAndResult.first->GetLastResultMs();
+    }
+
+    return times;
+}
+
+/** Reads back the final image of the last call to RenderDirectLighting() or RenderPathTracingPass();
+    'pixels' receive the rows starting with the bottom one. */
+void gpuart::Renderer::ReadImage(std::vector<Vec3f> &pixels)
+{
+    assert(IsOK);
+
+    GLint prevReadBuf;
+    glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &prevReadBuf);
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, Offscreen.enabled ? Offscreen.fbo.Get() : 0);
+    glReadBuffer(Offscreen.enabled ? GL_COLOR_ATTACHMENT0 : GL_BACK);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+
+    std::vector<GLfloat> values(3 * Viewport.width * Viewport.height);
+    glReadPixels(0, 0, Viewport.width, Viewport.height, GL_RGB, GL_FLOAT, values.data());
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, prevReadBuf);
+
+    pixels.resize(Viewport.width * Viewport.height);
+    for (size_t i = 0; i < pixels.size(); i++)
+        pixels[i] = Vec3f(values[3*i], values[3*i+1], values[3*i+2]);
 }
@@ -25,31 +25,48 @@ File description:
 #define GPUART_RENDERER_HEADER
 
 #include <nanogui/nanogui.h>
+#include <algorithm>
+#include <functional>
 #include <memory>
 #include <random>
+#include <vector>
 
 #include "bvh.h"
+#include "bvh_cache.h"
 #include "core.h"
 #include "gl_utils.h"
 #include "math_types.h"
+#include "traversal_stats.h"
 
 
 namespace gpuart
 {
-    class Camera
+    class Renderer
     {
     public:
-        Vec3f Pos; ///< Camera position
-        Vec3f Dir; ///< Viewing direction
-        Vec3f Up;  ///< Camera's "up" direction
-        float FovY; ///< Vertical field of view in degrees
+        /// Compiled BVH and mesh vertices of a scene, ready to be uploaded with SetCompiledScene() or BeginSceneUpload()
+        struct CompiledScene
+        {
+            Primitive::Data tree;
+            Primitive::Data meshVertices; ///< RGBA quads
+            Primitive::Data materials;    ///< Material table (see StoreMaterials())
+            Primitive::Data lights;       ///< Light records of the emissive primitives (see StoreLights())
 
-        /// Pos-screen distance; camera rays originate at the screen
-        float ScreenDist;
-    };
+            /// Indices of the primitives of 'lights' (see StoreLights()); filled only if 'refitter' is set
+            std::vector<size_t> lightPrimitives;
 
-    class Renderer
-    {
+            /** If not null, the tree, mesh vertices, materials and lights are uploaded from this file instead
+                ('tree', 'meshVertices', 'materials' and 'lights' are empty) */
+            std::unique_ptr<BVHCache::File> cacheFile;
+
+            /// If not null, 'tree' is kept after uploading, so that primitives can be updated (see UpdatePrimitive())
+            std::unique_ptr<BVHRefitter> refitter;
+
+            /// If not null, 'tree' is a two-level hierarchy whose instances can be moved (see SetInstances())
+            std::unique_ptr<TwoLevelBVH> twoLevel;
+        };
+
+    private:
         bool IsOK;
 
         /// Ray arrays (textures)
@@ -72,9 +89,44 @@ namespace gpuart
         {
             GL::Texture tex;
             GL::Buffer buf;
-            BoundingVolumesHierarchy tree;
+
+            /// Vertices of mesh triangles, referred to by indices stored in 'tree'
+            GL::Texture meshVertTex;
+            GL::Buffer meshVertBuf;
+
+            /// Material table indexed by material IDs stored in 'tree' (see Primitive::StoreIntoBVH())
+            GL::Texture materialsTex;
+            GL::Buffer materialsBuf;
+
+            /// Max. number of children of a node in the compiled tree
+            unsigned width;
+
+            /// CPU-side copy of the compiled tree and its refitter; empty unless the scene was compiled as refittable
+            Primitive::Data tree;
+            std::unique_ptr<BVHRefitter> refitter;
+
+            /// Set if the current scene is a two-level hierarchy
+            std::unique_ptr<TwoLevelBVH> twoLevel;
         } BVH;
 
+        /// Scene being uploaded by ContinueSceneUpload(); replaces the one in 'BVH' once complete
+        struct
+        {
+            bool active;
+
+            CompiledScene scene;
+            GL::Buffer treeBuf, meshVertBuf;
+
+            /// Source data (pointing into 'scene')
+            const GLfloat *tree, *meshVertices;
+            size_t treeBytes, meshVerticesBytes;
+
+            size_t bytesUploaded; ///< Tree first, then mesh vertices
+
+            /// Cleared after mapped contents were lost; the upload then restarts with glBufferSubData() instead
+            bool useMapping;
+        } SceneUpload;
+
         struct
         {
             unsigned selector; ///< Indicates the source & destination in 'accumulator'
@@ -101,6 +153,7 @@ namespace gpuart
                 GL::Shader intersection;
                 GL::Shader bvhIntersection;
                 GL::Shader sky;
+                GL::Shader lightSampling;
             } Calc;
 
             struct
@@ -138,21 +191,120 @@ namespace gpuart
 
         } Lighting;
 
-        enum UserSphereFlags: uint32_t
+        /// User-controlled objects, see AddDynamicObject()
+        struct
         {
-            EM_NONZERO = 1U << 0, ///< non-zero emittance
-            SPECULAR   = 1U << 1,
-            FUZZY      = 1U << 2  ///< fuzzy specular reflection
-        };
+            /// The first one is the user sphere
+            std::vector<DynamicObject> objects;
+
+            /// Set if 'objects' have changed since they were last uploaded
+            bool modified;
+
+            Primitive::Data data; ///< Stored by StoreDynamicObjects()
+            GL::Buffer buf;
+            GL::Texture tex;
+            size_t bufSize; ///< In bytes
 
+            unsigned numGroups;
+        } Dynamic;
+
+        /// Index of the user sphere in 'Dynamic.objects'
+        static const size_t USER_SPHERE = 0;
+
+        /// Light list (see StoreLights()): the scene's emissive primitives followed by the emissive dynamic objects
+        struct
+        {
+            Primitive::Data scene; ///< Light records of the current scene's primitives
+            std::vector<size_t> scenePrimitives; ///< Indices of the primitives of 'scene' (if the scene is refittable)
+
+            /// Set if 'scene' has changed since the list was last uploaded
+            bool modified;
+
+            Primitive::Data data;
+            GL::Buffer buf;
+            GL::Texture tex;
+            size_t bufSize; ///< In bytes
+
+            unsigned numLights;
+            unsigned numSceneLights; ///< Lights of 'scene', at the start of 'data'
+            float totalPower; ///< See SetLightSelectionProbabilities()
+        } Lights;
+
+        /// Stores and uploads the dynamic objects and the light list if they were modified
+        void UploadDynamicObjects();
+
+        void DynamicObjectsModified()
+        {
+            Dynamic.modified = true;
+            ResetPathTracing();
+        }
+
+        /// Receives the final image instead of the default (on-screen) framebuffer if 'enabled' is true
         struct
         {
-            Vec3f pos;
-            float radius;
-            float emittance;
+            bool enabled;
+            GL::Texture image;
+            GL::Framebuffer fbo;
+        } Offscreen;
+
+        /// Binds the framebuffer receiving the final image
+        void BindOutputFramebuffer();
+
+        /** Instrumented variants of the rendering stages, which additionally write per-pixel
+            traversal counters (see TraversalStat); created on first use. */
+        struct
+        {
+            bool enabled;
+
+            /// Counters of the last direct lighting or path tracing pass (averaged over the pass' paths)
+            GL::Texture counters;
+
+            GL::Texture directImage;     ///< Receives direct lighting, which is then presented by PresentImage()
+            GL::Framebuffer directFBO;   ///< Attachments: 'directImage', 'counters'
+            GL::Framebuffer accumFBO[2]; ///< Attachments: PathTracing.accumulator[i], 'counters'
+
+            struct
+            {
+                GL::Shader bvhIntersection,
+                           directLighting,
+                           pathTracing,
+                           heatmap;
+            } Shaders;
+
+            struct
+            {
+                GL::Program directLighting,
+                            pathTracing,
+                            heatmap;
+            } Programs;
+
+            /// If enabled, the final image shows 'heatmapStat' instead of radiance
+            struct
+            {
+                bool enabled;
+                TraversalStat stat;
+                float maxValue; ///< Counter value shown with the hottest color
+            } Heatmap;
+        } Stats;
+
+        /// Returns 'false' on failure
+        bool CreateRenderingPrograms(GL::Program &directLighting, GL::Program &pathTracing,
+                                     const GL::Shader &bvhIntersection,
+                                     const GL::Shader &directLightingShader,
+                                     const GL::Shader &pathTracingShader);
 
-            uint32_t flags;
-        } UserSphere;
+        /** Renders the normalized 'radiance' (or the traversal statistics heatmap) to the output framebuffer;
+            not timed, so that only the path tracer's presentation is measured (as 'ptracingNormalize') */
+        void PresentImage(const GL::Texture &radiance, unsigned numPathsPerPixel);
+
+        /// GPU execution times of rendering passes
+        struct
+        {
+            GL::StageTimer camInit,
+                           directLighting,
+                           pathTracing,
+                           ptracingNormalize;
+        } StageTimers;
 
         Camera CurrentCamera;
         GL::Framebuffer CamInitFBO; ///< Used for initializing camera rays in a shader
@@ -169,6 +321,10 @@ namespace gpuart
         /// Returns 'false' on failure
         bool InitPerPixelTextures();
 
+        /** Creates the traversal counters and the framebuffers of the instrumented rendering stages,
+            attached to the existing path tracing accumulators; returns 'false' on failure. */
+        bool InitTraversalStatsTextures();
+
         /// Cleans up the state after NanoGUI
         void SetDefaultGLState();
 
@@ -181,13 +337,77 @@ namespace gpuart
         void ResetPathTracing();
 
     public:
+        /// GPU execution times (in milliseconds) of rendering passes; negative if not measured yet
+        struct StageTimes
+        {
+            double camInit, directLighting, pathTracing, ptracingNormalize;
+        };
+
         /** Use GetIsOK() to verify successful initialization.
-            gpuart::GL::Init() has to be called prior to calling this constructor. */
-        Renderer(unsigned viewportWidth, unsigned viewportHeight, const Camera &camera);
+            gpuart::GL::Init() has to be called prior to calling this constructor.
+            If 'offscreen' is true, the final image is rendered into a floating-point texture
+            instead of the default framebuffer (e.g. when there is no window); see ReadImage(). */
+        Renderer(unsigned viewportWidth, unsigned viewportHeight, const Camera &camera, bool offscreen = false);
+
+        /** Builds and compiles the BVH of 'primitives'; does not use OpenGL, so it can run on a worker thread.
+            If 'printInfo' is true and 'params.strategy' is not the midpoint split, a midpoint-split tree is also built
+            for comparison of SAH costs. 'progress' (if set) is called at the start of each stage.
+            If 'refittable' is true, primitives of the scene can be updated after uploading (see UpdatePrimitive()). */
+        static CompiledScene CompileScene(const PrimitiveSet &primitives, const BVHBuildParams &params, bool printInfo,
+                                          const std::function<void(const char *stage, float fraction)> &progress = nullptr,
+                                          bool refittable = false);
+
+        /** Builds and compiles a two-level hierarchy (see TwoLevelBVH) of 'instances' of 'meshes', with space
+            for up to 'maxInstances' instances (0: as many as 'instances'); does not use OpenGL. On failure,
+            the returned scene's tree is empty. */
+        static CompiledScene CompileInstancedScene(const std::vector<PrimitiveSet> &meshes, const std::vector<MeshInstance> &instances,
+                                                   const BVHBuildParams &params, size_t maxInstances, bool printInfo);
+
+        /** Starts uploading 'scene' in chunks with ContinueSceneUpload(); until it completes, the current scene
+            is rendered. Discards an unfinished upload. */
+        void BeginSceneUpload(CompiledScene &&scene);
+
+        /** Uploads up to 'maxBytes' of the scene passed to BeginSceneUpload(). Once all data are uploaded,
+            the scene replaces the current one, path tracing restarts and 'true' is returned. */
+        bool ContinueSceneUpload(size_t maxBytes);
+
+        /// Returns the uploaded fraction (0 to 1) of the scene passed to BeginSceneUpload()
+        float GetSceneUploadProgress() const
+        {
+            return (float)SceneUpload.bytesUploaded / std::max<size_t>(1, SceneUpload.treeBytes + SceneUpload.meshVerticesBytes);
+        }
+
+        /// Uploads 'scene' (replacing the current one) and restarts path tracing
+        void SetCompiledScene(CompiledScene &&scene);
+
+        /** After calling this method, 'primitives' are no longer used. If 'printInfo' is true
+            and 'strategy' is not the midpoint split, a midpoint-split tree is also built for comparison of SAH costs.
+            If 'refittable' is true, primitives can be updated later with UpdatePrimitive(). */
+        void SetPrimitives(const PrimitiveSet &primitives, bool printInfo,
+                           BVHBuildStrategy strategy = BVHBuildStrategy::Midpoint, bool refittable = false);
+
+        /** Sets a two-level scene of 'instances' of 'meshes' (see CompileInstancedScene()) and restarts path tracing;
+            returns 'false' on failure. */
+        bool SetInstancedScene(const std::vector<PrimitiveSet> &meshes, const std::vector<MeshInstance> &instances,
+                               bool printInfo, BVHBuildStrategy strategy = BVHBuildStrategy::Midpoint, size_t maxInstances = 0);
 
-        /** May change the order of elements in 'primitives'. After calling this method,
-            contents of 'primitives' are no longer used. */
-        void SetPrimitives(std::vector<Primitive*> &primitives, bool printInfo);
+        /** Replaces the instances of the current two-level scene (e.g. moved); rebuilds and uploads only
+            the top-level tree and restarts path tracing. Returns 'false' on failure. */
+        bool SetInstances(const std::vector<MeshInstance> &instances);
+
+        /** Replaces the primitive with index 'index' (as in the PrimitiveSet the current scene was compiled of)
+            with 'primitive' of the same type and material, e.g. moved. Takes effect after calling RefitBVH().
+            Returns 'false' if the scene is not refittable or 'primitive' is of a different type or material. */
+        bool UpdatePrimitive(size_t index, const Primitive &primitive);
+
+        /** Refits the BVH after calls to UpdatePrimitive(), uploads only the modified parts of the compiled tree
+            and restarts path tracing. The BVH topology stays the same, so rebuild the scene after large movements. */
+        void RefitBVH();
+
+        /** Sets the max. number of children of a node (2 to BoundingVolumesHierarchy::MAX_CHILDREN)
+            in the BVH tree compiled by subsequent calls to SetPrimitives(). */
+        void SetBVHWidth(unsigned width) { BVH.width = width; }
+        unsigned GetBVHWidth() const { return BVH.width; }
 
         /// Returns 'false' on failure
         bool UpdateViewportSize(unsigned width, unsigned height);
@@ -219,67 +439,77 @@ namespace gpuart
 
         bool IsSunDirectLightingEnabled() const { return Lighting.Sun.directLightingEnabled; }
 
+        /** Adds a user-controlled sphere, disc or cone, which can be moved in every frame (see SetDynamicObject())
+            without rebuilding the scene's BVH; returns its index. Index 0 is the user sphere (see SetUserSphere()). */
+        size_t AddDynamicObject(const DynamicObject &object)
+        {
+            Dynamic.objects.push_back(object);
+            DynamicObjectsModified();
+            return Dynamic.objects.size() - 1;
+        }
+
+        /// Replaces (e.g. moves) the dynamic object with index 'index'; the changes are uploaded once per rendered frame
+        void SetDynamicObject(size_t index, const DynamicObject &object)
+        {
+            Dynamic.objects.at(index) = object;
+            DynamicObjectsModified();
+        }
+
+        const DynamicObject &GetDynamicObject(size_t index) const { return Dynamic.objects.at(index); }
+
+        size_t GetNumDynamicObjects() const { return Dynamic.objects.size(); }
+
+        /// Removes all dynamic objects except the user sphere
+        void ClearDynamicObjects()
+        {
+            Dynamic.objects.resize(USER_SPHERE + 1);
+            DynamicObjectsModified();
+        }
+
         /// Use radius=0 to effectively disable the user-controlled sphere
         void SetUserSphere(const Vec3f &pos, float radius, float emittance)
         {
-            UserSphere.pos = pos;
-            UserSphere.radius = radius;
-            UserSphere.emittance = emittance;
-
-            if (emittance > 0)
-                UserSphere.flags |= UserSphereFlags::EM_NONZERO;
-            else
-                UserSphere.flags &= ~UserSphereFlags::EM_NONZERO;
+            DynamicObject &sphere = Dynamic.objects[USER_SPHERE];
+            sphere.pos = pos;
+            sphere.radius = sphere.radius2 = radius;
+            sphere.SetEmittance(emittance);
 
-            ResetPathTracing();
+            DynamicObjectsModified();
         }
 
         void SetUserSphereSpecular(bool specular)
         {
-            if (specular)
-                UserSphere.flags |= UserSphereFlags::SPECULAR;
-            else
-                UserSphere.flags &= ~UserSphereFlags::SPECULAR;
-
-            ResetPathTracing();
+            Dynamic.objects[USER_SPHERE].SetSpecular(specular);
+            DynamicObjectsModified();
         }
 
         void SetUserSphereFuzzy(bool fuzzy)
         {
-            if (fuzzy)
-                UserSphere.flags |= UserSphereFlags::FUZZY;
-            else
-                UserSphere.flags &= ~UserSphereFlags::FUZZY;
-
-            ResetPathTracing();
+            Dynamic.objects[USER_SPHERE].SetFuzzy(fuzzy);
+            DynamicObjectsModified();
         }
 
         /// Use radius=0 to effectively disable the user-controlled sphere
         void SetUserSphereRadius(float radius)
         {
-            UserSphere.radius = radius;
-            ResetPathTracing();
+            Dynamic.objects[USER_SPHERE].radius = Dynamic.objects[USER_SPHERE].radius2 = radius;
+            DynamicObjectsModified();
         }
 
         void SetUserSpherePos(const Vec3f &pos)
         {
-            UserSphere.pos = pos;
-            ResetPathTracing();
+            Dynamic.objects[USER_SPHERE].pos = pos;
+            DynamicObjectsModified();
         }
 
-        Vec3f GetUserSpherePos()        const { return UserSphere.pos; }
-        float GetUserSphereRadius()     const { return UserSphere.radius; }
-        float GetUserSphereEmittance() const  { return UserSphere.emittance; }
+        Vec3f GetUserSpherePos()        const { return Dynamic.objects[USER_SPHERE].pos; }
+        float GetUserSphereRadius()     const { return Dynamic.objects[USER_SPHERE].radius; }
+        float GetUserSphereEmittance() const  { return Dynamic.objects[USER_SPHERE].GetEmittance(); }
 
         void SetUserSphereEmittance(float em)
         {
-            UserSphere.emittance = em;
-            if (em > 0)
-                UserSphere.flags |= UserSphereFlags::EM_NONZERO;
-            else
-                UserSphere.flags &= ~UserSphereFlags::EM_NONZERO;
-
-            ResetPathTracing();
+            Dynamic.objects[USER_SPHERE].SetEmittance(em);
+            DynamicObjectsModified();
         }
 
         void RenderDirectLighting();
@@ -291,6 +521,36 @@ namespace gpuart
 
         unsigned GetPathsPerPixel() const { return PathTracing.pathsPerPixel; }
 
+        unsigned GetNumPathsRendered() const { return PathTracing.numPathsRendered; }
+
+        /** Reads back the final image of the last call to RenderDirectLighting() or RenderPathTracingPass();
+            'pixels' receive the rows starting with the bottom one. */
+        void ReadImage(std::vector<Vec3f> &pixels);
+
+        /** Switches to the instrumented rendering stages, which also produce per-pixel
+            traversal statistics (slower); returns 'false' on failure. The path tracing
+            image accumulated so far is kept either way. */
+        bool SetTraversalStatsEnabled(bool enabled);
+        bool GetTraversalStatsEnabled() const { return Stats.enabled; }
+
+        /** If 'enabled' (and traversal statistics are enabled), the final image is a heatmap of 'stat'
+            with 'maxValue' mapped to the hottest color. */
+        void SetTraversalHeatmap(bool enabled, TraversalStat stat, float maxValue)
+        {
+            Stats.Heatmap.enabled = enabled;
+            Stats.Heatmap.stat = stat;
+            Stats.Heatmap.maxValue = maxValue;
+        }
+
+        /** Reads back the traversal counters of the last call to RenderDirectLighting() or RenderPathTracingPass()
+            (TraversalStat::NumStats values per pixel, rows starting with the bottom one); returns 'false'
+            if traversal statistics are not enabled. */
+        bool ReadTraversalStats(std::vector<float> &values);
+
+        /** Collects the available results of GPU timer queries without waiting; each value refers
+            to the most recent measured pass, which usually is the one rendered a frame earlier. */
+        StageTimes GetStageTimes();
+
         bool GetIsOK() const { return IsOK; }
 
     };
@@ -21,6 +21,10 @@ File description:
     Scene initialization implementation
 */
 
+#include <cmath>
+#include <iostream>
+#include <string>
+
 #include "math_types.h"
 #include "scenes.h"
 #include "utils.h"
@@ -28,76 +32,186 @@ File description:
 using gpuart::Vec3f;
 
 
-bool InitDragon(gpuart::Renderer &renderer, const char *meshFName)
+bool CreateDragon(gpuart::PrimitiveSet &primitives, const char *meshFName)
 {
-    std::vector<gpuart::Primitive*> primitives;
-
     if (!gpuart::Utils::LoadMeshFromPLY(primitives, meshFName, 10, Vec3f(0, 0, -0.5)))
     {
         std::cerr << "Failed to load mesh from \"" << meshFName << "\"." << std::endl;
         return false;
     }
-    primitives.push_back(new gpuart::Disc(Vec3f(0, 0, 0), Vec3f(0, 0, 1), 5));
-
-    renderer.SetPrimitives(primitives, true);
-    for (auto *p: primitives)
-        delete p;
+    primitives.Add(gpuart::Disc(Vec3f(0, 0, 0), Vec3f(0, 0, 1), 5));
 
-    std::cout << std::endl;
     return true;
 }
 
 
-void InitBox(gpuart::Renderer &renderer)
+bool CreateBox(gpuart::PrimitiveSet &primitives)
 {
-    std::vector<gpuart::Primitive*> primitives;
-
-    primitives.push_back(new gpuart::Sphere(Vec3f(0, 0, 0.3f), 0.3f));
-    primitives.push_back(new gpuart::Disc(Vec3f(0, 0, 0), Vec3f(0, 0, 1), 6));
-    primitives.push_back(new gpuart::Triangle(1, -1, 0,  1, 1, 0,  1, 1, 1));
-    primitives.push_back(new gpuart::Triangle(1, -1, 0,  1, 1, 1,  1, -1, 1));
-    primitives.push_back(new gpuart::Cone(Vec3f(0.5f, -0.7, 0), Vec3f(0.5f, -0.7f, 0.35f), 0.2f, 0.2f));
-    primitives.push_back(new gpuart::Triangle(1, 1, 0, 1, 1, 1,  -1, 1, 1));
-    primitives.push_back(new gpuart::Triangle(-1, 1, 1,  -1, 1, 0,  1, 1, 0));
-    primitives.push_back(new gpuart::Triangle(-1, -1, 0, -1, 1, 0,  -1, 1, 1));
-    primitives.push_back(new gpuart::Triangle(-1, -1, 0,  -1, 1, 1,  -1, -1, 1));
-
-    renderer.SetPrimitives(primitives, true);
-    std::cout << std::endl;
-    for (auto *p: primitives)
-        delete p;
+    primitives.Add(gpuart::Sphere(Vec3f(0, 0, 0.3f), 0.3f));
+    primitives.Add(gpuart::Disc(Vec3f(0, 0, 0), Vec3f(0, 0, 1), 6));
+    primitives.Add(gpuart::Triangle(1, -1, 0,  1, 1, 0,  1, 1, 1));
+    primitives.Add(gpuart::Triangle(1, -1, 0,  1, 1, 1,  1, -1, 1));
+    primitives.Add(gpuart::Cone(Vec3f(0.5f, -0.7, 0), Vec3f(0.5f, -0.7f, 0.35f), 0.2f, 0.2f));
+    primitives.Add(gpuart::Triangle(1, 1, 0, 1, 1, 1,  -1, 1, 1));
+    primitives.Add(gpuart::Triangle(-1, 1, 1,  -1, 1, 0,  1, 1, 0));
+    primitives.Add(gpuart::Triangle(-1, -1, 0, -1, 1, 0,  -1, 1, 1));
+    primitives.Add(gpuart::Triangle(-1, -1, 0,  -1, 1, 1,  -1, -1, 1));
+
+    return true;
 }
 
-bool InitCluster(gpuart::Renderer &renderer)
+/// The box with an emissive disc below its ceiling, sampled as a light by the path tracer
+bool CreateLitBox(gpuart::PrimitiveSet &primitives)
 {
-    std::vector<gpuart::Primitive*> primitives;
+    CreateBox(primitives);
+
+    gpuart::Disc light(Vec3f(0, 0, 0.99f), Vec3f(0, 0, -1), 0.3f);
+    light.SetMaterial(primitives.AddMaterial(gpuart::Material(Vec3f(0, 0, 0), 0, Vec3f(6, 5.5f, 5))));
+    primitives.Add(light);
 
+    return true;
+}
+
+bool CreateCluster(gpuart::PrimitiveSet &primitives)
+{
     if (!gpuart::Utils::LoadPrimitives(primitives, "data/cluster_100k.dat", 0.01f, Vec3f(0, 0, 2.5f)))
         return false;
 
-    primitives.push_back(new gpuart::Disc(Vec3f(1, 0, 0), Vec3f(0, 0, 1), 6));
+    primitives.Add(gpuart::Disc(Vec3f(1, 0, 0), Vec3f(0, 0, 1), 6));
+
+    return true;
+}
+
+bool CreateTree(gpuart::PrimitiveSet &primitives)
+{
+    if (!gpuart::Utils::LoadPrimitives(primitives, "data/tree1_21k.dat", 0.3f))
+        return false;
 
-    renderer.SetPrimitives(primitives, true);
-    std::cout << std::endl;
-    for (auto *p: primitives)
-        delete p;
+    primitives.Add(gpuart::Disc(Vec3f(1, 0, 0), Vec3f(0, 0, 1), 6));
 
     return true;
 }
 
-bool InitTree(gpuart::Renderer &renderer)
+/** Creates a built-in scene specified by name ("box", "boxlight", "dragon11k", "dragon48k", "dragon871k",
+    "cluster100k", "tree21k"); returns 'false' on failure or if the name is unknown. */
+bool CreateScene(const char *name, gpuart::PrimitiveSet &primitives)
 {
-    std::vector<gpuart::Primitive*> primitives;
+    std::string sceneName(name);
+
+    if (sceneName == "box")
+        return CreateBox(primitives);
+    else if (sceneName == "boxlight")
+        return CreateLitBox(primitives);
+    else if (sceneName == "dragon11k")
+        return CreateDragon(primitives, "data/dragon_11k.ply");
+    else if (sceneName == "dragon48k")
+        return CreateDragon(primitives, "data/dragon_48k.ply");
+    else if (sceneName == "dragon871k")
+        return CreateDragon(primitives, "data/dragon_871k.ply");
+    else if (sceneName == "cluster100k")
+        return CreateCluster(primitives);
+    else if (sceneName == "tree21k")
+        return CreateTree(primitives);
+    else
+    {
+        std::cerr << "Unknown scene \"" << name << "\"." << std::endl;
+        return false;
+    }
+}
 
-    if (!gpuart::Utils::LoadPrimitives(primitives, "data/tree1_21k.dat", 0.3f))
+/** Creates a built-in two-level scene (see gpuart::TwoLevelBVH) specified by name ("dragons": instances
+    of the 48k-triangle dragon); returns 'false' on failure or if the name is unknown. */
+bool CreateInstancedScene(const char *name, std::vector<gpuart::PrimitiveSet> &meshes,
+                          std::vector<gpuart::MeshInstance> &instances)
+{
+    using gpuart::Transform3x4;
+
+    if (std::string(name) != "dragons")
+    {
+        std::cerr << "Unknown instanced scene \"" << name << "\"." << std::endl;
         return false;
+    }
 
-    primitives.push_back(new gpuart::Disc(Vec3f(1, 0, 0), Vec3f(0, 0, 1), 6));
+    meshes.resize(2);
 
-    renderer.SetPrimitives(primitives, true);
-    std::cout << std::endl;
-    for (auto *p: primitives)
-        delete p;
+    // Mesh #0: the floor
+    meshes[0].Add(gpuart::Disc(Vec3f(0, 0, 0), Vec3f(0, 0, 1), 6));
+    instances.push_back({ 0, Transform3x4::Identity() });
+
+    // Mesh #1: the dragon, placed in a 2x5 grid with various sizes and orientations
+    if (!gpuart::Utils::LoadMeshFromPLY(meshes[1], "data/dragon_48k.ply", 10, Vec3f(0, 0, -0.5)))
+    {
+        std::cerr << "Failed to load mesh from \"data/dragon_48k.ply\"." << std::endl;
+        return false;
+    }
+
+    for (int row = 0; row < 2; row++)
+        for (int col = 0; col < 5; col++)
+        {
+            float scale = 0.35f + 0.05f * ((row * 5 + col) % 3);
+            instances.push_back({ 1, Transform3x4::Translation(Vec3f(-1.6f + 0.8f*col, -0.4f + 1.0f*row, 0))
+                                     * Transform3x4::RotationZ(0.6f * (row * 5 + col))
+                                     * Transform3x4::Scaling(scale) });
+        }
 
     return true;
 }
+
+/// Returns 'true' if 'name' is a two-level scene created by CreateInstancedScene()
+bool IsInstancedScene(const char *name)
+{
+    return std::string(name) == "dragons";
+}
+
+/** Fills 'objects' with 'count' small dynamic objects (spheres, discs and cones, some of them specular
+    or emissive) placed in a ring around the center of the built-in scenes, e.g. for testing and benchmarks. */
+void CreateDynamicObjects(unsigned count, std::vector<gpuart::DynamicObject> &objects)
+{
+    using gpuart::DynamicObject;
+
+    const float RING_RADIUS = 0.8f;
+    const float SIZE = 0.06f;
+
+    objects.clear();
+    for (unsigned i = 0; i < count; i++)
+    {
+        float angle = 2 * 3.1415926f * i / count;
+        Vec3f pos(RING_RADIUS * std::cos(angle), RING_RADIUS * std::sin(angle), 0.15f + 0.1f * (i % 2));
+
+        DynamicObject obj;
+        if (i % 3 == 0)
+            obj = DynamicObject::MakeSphere(pos, SIZE);
+        else if (i % 3 == 1)
+            obj = DynamicObject::MakeDisc(pos, Vec3f(std::cos(angle), std::sin(angle), 0.5f), SIZE);
+        else
+            obj = DynamicObject::MakeCone(pos, pos + Vec3f(0, 0, 2*SIZE), SIZE, SIZE/2);
+
+        if (i % 4 == 1)
+            obj.SetSpecular(true);
+        else if (i % 4 == 3)
+            obj.SetEmittance(5);
+
+        objects.push_back(obj);
+    }
+}
+
+/// Returns the files a built-in scene (see CreateScene()) is loaded from; empty for procedural scenes
+std::vector<std::string> GetSceneInputFiles(const char *name)
+{
+    std::string sceneName(name);
+
+    if (sceneName == "dragon11k")
+        return { "data/dragon_11k.ply" };
+    else if (sceneName == "dragon48k")
+        return { "data/dragon_48k.ply" };
+    else if (sceneName == "dragon871k")
+        return { "data/dragon_871k.ply" };
+    else if (sceneName == "cluster100k")
+        return { "data/cluster_100k.dat" };
+    else if (sceneName == "tree21k")
+        return { "data/tree1_21k.dat" };
+    else if (sceneName == "dragons")
+        return { "data/dragon_48k.ply" };
+    else
+        return { };
+}
@@ -25,12 +25,42 @@ File description:
 #ifndef GPUART_SCENES_HEADER
 #define GPUART_SCENES_HEADER
 
-#include "renderer.h"
+#include <string>
+#include <vector>
 
+#include "core.h"
 
-void InitBox(gpuart::Renderer &renderer);
-bool InitCluster(gpuart::Renderer &renderer);
-bool InitDragon(gpuart::Renderer &renderer, const char *meshFName);
-bool InitTree(gpuart::Renderer &renderer);
+
+/// Each function below fills 'primitives' with a built-in scene; returns 'false' on failure
+
+bool CreateBox(gpuart::PrimitiveSet &primitives);
+
+/// The box with an emissive disc below its ceiling, sampled as a light by the path tracer
+bool CreateLitBox(gpuart::PrimitiveSet &primitives);
+
+bool CreateCluster(gpuart::PrimitiveSet &primitives);
+
+bool CreateDragon(gpuart::PrimitiveSet &primitives, const char *meshFName);
+
+bool CreateTree(gpuart::PrimitiveSet &primitives);
+
+/** Creates a built-in scene specified by name ("box", "boxlight", "dragon11k", "dragon48k", "dragon871k",
+    "cluster100k", "tree21k"); returns 'false' on failure or if the name is unknown. */
+bool CreateScene(const char *name, gpuart::PrimitiveSet &primitives);
+
+/** Creates a built-in two-level scene (see gpuart::TwoLevelBVH) specified by name ("dragons": instances
+    of the 48k-triangle dragon); returns 'false' on failure or if the name is unknown. */
+bool CreateInstancedScene(const char *name, std::vector<gpuart::PrimitiveSet> &meshes,
+                          std::vector<gpuart::MeshInstance> &instances);
+
+/// Returns 'true' if 'name' is a two-level scene created by CreateInstancedScene()
+bool IsInstancedScene(const char *name);
+
+/** Fills 'objects' with 'count' small dynamic objects (spheres, discs and cones, some of them specular
+    or emissive) placed in a ring around the center of the built-in scenes, e.g. for testing and benchmarks. */
+void CreateDynamicObjects(unsigned count, std::vector<gpuart::DynamicObject> &objects);
+
+/// Returns the files a built-in scene (see CreateScene()) is loaded from; empty for procedural scenes
+std::vector<std::string> GetSceneInputFiles(const char *name);
 
 #endif // GPUART_SCENES_HEADER
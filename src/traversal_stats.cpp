@@ -0,0 +1,123 @@
+/*
+GPU-Assisted Ray Tracer
+Copyright (C) 2016 Filip Szczerek <ga.software@yahoo.com>
+
+This file is part of gpuart.
+
+Gpuart is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Gpuart is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with gpuart.  If not, see <http://www.gnu.org/licenses/>.
+
+File description:
+    Traversal statistics implementation
+*/
+
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <iomanip>
+#include <string>
+
+#include "traversal_stats.h"
+
+
+const char *gpuart::GetTraversalStatName(TraversalStat stat)
+{
+    switch (stat)
+    {
+    case TraversalStat::NodesVisited:   return "nodes visited";
+    case TraversalStat::AABBTests:      return "AABB tests";
+    case TraversalStat::PrimitiveTests: return "primitive tests";
+    case TraversalStat::PathLength:     return "path length";
+    default:                            return "";
+    }
+}
+
+/** Summarizes 'stat' of per-pixel counters 'values'; each pixel's
+    counters occupy consecutive TraversalStat::NumStats elements. */
+gpuart::TraversalStatSummary gpuart::SummarizeTraversalStat(const std::vector<float> &values, TraversalStat stat)
+{
+    const size_t numStats = (size_t)TraversalStat::NumStats;
+    assert(values.size() % numStats == 0);
+
+    std::vector<float> sorted;
+    sorted.reserve(values.size() / numStats);
+    for (size_t i = (size_t)stat; i < values.size(); i += numStats)
+        sorted.push_back(values[i]);
+
+    TraversalStatSummary summary;
+    summary.mean = 0;
+    summary.p50 = summary.p90 = summary.p99 = summary.max = 0;
+    if (sorted.empty())
+        return summary;
+
+    std::sort(sorted.begin(), sorted.end());
+
+    for (float value: sorted)
+    {
+        summary.mean += value;
+
+        // Path tracing counters are averages over several paths, hence rounding
+        const unsigned count = (unsigned)std::lround(value);
+        size_t bucket = 0;
+        while (count >> bucket)
+            bucket++;
+
+        if (bucket >= summary.log2Histogram.size())
+            summary.log2Histogram.resize(bucket + 1, 0);
+        summary.log2Histogram[bucket]++;
+    }
+    summary.mean /= sorted.size();
+
+    auto percentile = [&sorted](double p) { return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))]; };
+    summary.p50 = percentile(0.50);
+    summary.p90 = percentile(0.90);
+    summary.p99 = percentile(0.99);
+    summary.max = sorted.back();
+
+    return summary;
+}
+
+/// Prints summaries and histograms of all counters in 'values' (see SummarizeTraversalStat())
+void gpuart::PrintTraversalStats(const std::vector<float> &values, std::ostream &os)
+{
+    const size_t numPixels = values.size() / (size_t)TraversalStat::NumStats;
+
+    for (int i = 0; i < (int)TraversalStat::NumStats; i++)
+    {
+        const TraversalStat stat = (TraversalStat)i;
+        const TraversalStatSummary summary = SummarizeTraversalStat(values, stat);
+
+        os << std::fixed << std::setprecision(1)
+           << GetTraversalStatName(stat) << " per pixel: mean " << summary.mean
+           << ", p50 " << summary.p50 << ", p90 " << summary.p90 << ", p99 " << summary.p99
+           << ", max " << summary.max << "\n";
+
+        for (size_t bucket = 0; bucket < summary.log2Histogram.size(); bucket++)
+        {
+            const uint32_t count = summary.log2Histogram[bucket];
+            if (count == 0)
+                continue;
+
+            if (bucket == 0)
+                os << "  " << std::setw(15) << "0";
+            else
+                os << "  " << std::setw(7) << (1U << (bucket - 1)) << " - " << std::setw(5) << (1U << bucket) - 1;
+
+            const double fraction = (double)count / numPixels;
+            os << ": " << std::setw(5) << 100 * fraction << "% "
+               << std::string((size_t)std::ceil(50 * fraction), '#') << "\n";
+        }
+    }
+    os.flush();
+}
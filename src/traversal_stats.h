@@ -0,0 +1,65 @@
+/*
+GPU-Assisted Ray Tracer
+Copyright (C) 2016 Filip Szczerek <ga.software@yahoo.com>
+
+This file is part of gpuart.
+
+Gpuart is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Gpuart is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with gpuart.  If not, see <http://www.gnu.org/licenses/>.
+
+File description:
+    Traversal statistics header
+*/
+
+#ifndef GPUART_TRAVERSAL_STATS_HEADER
+#define GPUART_TRAVERSAL_STATS_HEADER
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+
+namespace gpuart
+{
+    /// Per-pixel counters of the instrumented traversal; values correspond with STAT_* in shaders
+    enum class TraversalStat
+    {
+        NodesVisited = 0,
+        AABBTests,
+        PrimitiveTests,
+        PathLength, ///< Number of traced ray segments (camera ray and reflections)
+
+        NumStats
+    };
+
+    const char *GetTraversalStatName(TraversalStat stat);
+
+    /// Distribution of a single per-pixel counter
+    struct TraversalStatSummary
+    {
+        double mean;
+        float p50, p90, p99, max;
+
+        /// Element 0: number of zero values; element i > 0: number of values in [2^(i-1), 2^i)
+        std::vector<uint32_t> log2Histogram;
+    };
+
+    /** Summarizes 'stat' of per-pixel counters 'values'; each pixel's
+        counters occupy consecutive TraversalStat::NumStats elements. */
+    TraversalStatSummary SummarizeTraversalStat(const std::vector<float> &values, TraversalStat stat);
+
+    /// Prints summaries and histograms of all counters in 'values' (see SummarizeTraversalStat())
+    void PrintTraversalStats(const std::vector<float> &values, std::ostream &os);
+}
+
+#endif // GPUART_TRAVERSAL_STATS_HEADER
@@ -22,9 +22,12 @@ File description:
 */
 
 
+#include <algorithm>
 #include <chrono>
 #include <cstdarg>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <iomanip>
@@ -32,6 +35,18 @@ File description:
 #include <sstream>
 #include <string>
 
+#ifdef _WIN32
+  #define WIN32_LEAN_AND_MEAN
+  #define NOMINMAX
+  #include <windows.h>
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+#include "bvh.h"
 #include "utils.h"
 
 
@@ -43,105 +58,555 @@ std::ostream& gpuart::Utils::operator <<(std::ostream &os, const gpuart::Utils::
     return os;
 }
 
-/// Loads a mesh of triangles in PLY format and appends it to 'primitives'
-bool gpuart::Utils::LoadMeshFromPLY(std::vector<gpuart::Primitive*> &primitives, const char *fileName,
-                                    float magnification, const Vec3f &translation)
+/// Check success with IsOpen()
+gpuart::Utils::MappedFile::MappedFile(const char *fileName): Data(nullptr), Size(0)
 {
-    std::ifstream fs(fileName);
+#ifdef _WIN32
+    MappingHandle = nullptr;
+    FileHandle = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (FileHandle == INVALID_HANDLE_VALUE)
+    {
+        FileHandle = nullptr;
+        return;
+    }
 
-    if (fs.fail())
-        return false;
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(FileHandle, &fileSize) || fileSize.QuadPart == 0)
+        return;
 
-    std::stringstream ss;
-    std::string line, token;
+    MappingHandle = CreateFileMappingA(FileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!MappingHandle)
+        return;
 
-    std::getline(fs, line);
-    if (line != "ply")
-        return false;
+    Data = static_cast<const char*>(MapViewOfFile(MappingHandle, FILE_MAP_READ, 0, 0, 0));
+    if (Data)
+        Size = (size_t)fileSize.QuadPart;
+#else
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0)
+        return;
 
-    size_t numVertices = 0;
-    size_t numFaces = 0;
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) == 0 && fileStat.st_size > 0)
+    {
+        void *addr = mmap(nullptr, (size_t)fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED)
+        {
+            Data = static_cast<const char*>(addr);
+            Size = (size_t)fileStat.st_size;
+        }
+    }
 
-    auto tstart = std::chrono::high_resolution_clock::now();
-    std::cout << "Loading mesh from \"" << fileName << "\"... "; std::cout.flush();
+    close(fd); // the mapping remains valid
+#endif
+}
+
+gpuart::Utils::MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+    if (Data)
+        UnmapViewOfFile(Data);
+    if (MappingHandle)
+        CloseHandle(MappingHandle);
+    if (FileHandle)
+        CloseHandle(FileHandle);
+#else
+    if (Data)
+        munmap(const_cast<char*>(Data), Size);
+#endif
+}
 
-    while (!fs.eof() && line != "end_header")
+namespace
+{
+    enum class PlyFormat
     {
-        std::getline(fs, line);
-        if (0 == line.find("element vertex"))
+        Ascii,
+        BinaryLittleEndian,
+        BinaryBigEndian
+    };
+
+    enum class PlyType
+    {
+        Invalid,
+        Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64
+    };
+
+    struct PlyProperty
+    {
+        std::string name;
+        PlyType type;      ///< Type of the value, or of the items if the property is a list
+        PlyType countType; ///< Type of the item count if the property is a list, otherwise 'Invalid'
+    };
+
+    struct PlyElement
+    {
+        std::string name;
+        size_t count;
+        std::vector<PlyProperty> properties;
+
+        /// Returns index of the property called 'propName' or -1 if there is none
+        int FindProperty(const char *propName) const
         {
-            ss.clear();
-            ss.str(line);
-            ss.ignore(std::numeric_limits<std::streamsize>::max(), ' '); // "element"
-            ss.ignore(std::numeric_limits<std::streamsize>::max(), ' '); // "vertex"
-            ss >> numVertices;
-            if (ss.fail())
+            for (size_t i = 0; i < properties.size(); i++)
+                if (properties[i].name == propName)
+                    return (int)i;
+            return -1;
+        }
+    };
+
+    PlyType GetPlyType(const std::string &name)
+    {
+        if (name == "char"   || name == "int8")    return PlyType::Int8;
+        if (name == "uchar"  || name == "uint8")   return PlyType::UInt8;
+        if (name == "short"  || name == "int16")   return PlyType::Int16;
+        if (name == "ushort" || name == "uint16")  return PlyType::UInt16;
+        if (name == "int"    || name == "int32")   return PlyType::Int32;
+        if (name == "uint"   || name == "uint32")  return PlyType::UInt32;
+        if (name == "float"  || name == "float32") return PlyType::Float32;
+        if (name == "double" || name == "float64") return PlyType::Float64;
+
+        return PlyType::Invalid;
+    }
+
+    bool IsSpace(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+
+    bool IsDigit(char c)
+    {
+        return c >= '0' && c <= '9';
+    }
+
+    /// Reads values from the data section of a PLY file
+    class PlyReader
+    {
+        const char *Pos, *End;
+        PlyFormat Format;
+        bool SwapBytes; ///< True if the file's endianness differs from the host's
+
+        template<typename T>
+        bool ReadBinary(double &value)
+        {
+            if ((size_t)(End - Pos) < sizeof(T))
                 return false;
+
+            char bytes[sizeof(T)];
+            memcpy(bytes, Pos, sizeof(T));
+            Pos += sizeof(T);
+
+            if (SwapBytes)
+                std::reverse(bytes, bytes + sizeof(T));
+
+            T result;
+            memcpy(&result, bytes, sizeof(T));
+            value = (double)result;
+            return true;
         }
-        else if (0 == line.find("element face"))
+
+        /// Parses a decimal number; much faster than a stream, as it does not use locales or copy the input
+        bool ReadAscii(double &value)
         {
-            ss.clear();
-            ss.str(line);
-            ss.ignore(std::numeric_limits<std::streamsize>::max(), ' '); // "element"
-            ss.ignore(std::numeric_limits<std::streamsize>::max(), ' '); // "face"
-            ss >> numFaces;
-            if (ss.fail())
+            while (Pos < End && IsSpace(*Pos))
+                Pos++;
+
+            const char *tokenStart = Pos;
+
+            bool negative = false;
+            if (Pos < End && (*Pos == '-' || *Pos == '+'))
+                negative = (*Pos++ == '-');
+
+            uint64_t mantissa = 0;
+            int numDigits = 0; // significant digits stored in 'mantissa'
+            int exponent = 0;
+            bool anyDigits = false;
+
+            for (; Pos < End && IsDigit(*Pos); Pos++)
+            {
+                anyDigits = true;
+                if (numDigits < 19)
+                {
+                    mantissa = 10*mantissa + (*Pos - '0');
+                    if (mantissa != 0)
+                        numDigits++;
+                }
+                else
+                    exponent++;
+            }
+
+            if (Pos < End && *Pos == '.')
+                for (Pos++; Pos < End && IsDigit(*Pos); Pos++)
+                {
+                    anyDigits = true;
+                    if (numDigits < 19)
+                    {
+                        mantissa = 10*mantissa + (*Pos - '0');
+                        if (mantissa != 0)
+                            numDigits++;
+                        exponent--;
+                    }
+                }
+
+            if (anyDigits && Pos < End && (*Pos == 'e' || *Pos == 'E'))
+            {
+                Pos++;
+                bool negativeExp = false;
+                if (Pos < End && (*Pos == '-' || *Pos == '+'))
+                    negativeExp = (*Pos++ == '-');
+
+                if (Pos == End || !IsDigit(*Pos))
+                    return false;
+
+                int explicitExp = 0;
+                for (; Pos < End && IsDigit(*Pos); Pos++)
+                    if (explicitExp < 10000)
+                        explicitExp = 10*explicitExp + (*Pos - '0');
+
+                exponent += (negativeExp ? -explicitExp : explicitExp);
+            }
+
+            static const double POWERS_OF_10[] = { 1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                                   1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                                   1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+            if (anyDigits && (Pos == End || IsSpace(*Pos))
+                && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22)
+            {
+                // Both the mantissa and the power of 10 are exact doubles, so the result is correctly rounded
+                value = (exponent < 0 ? mantissa / POWERS_OF_10[-exponent] : mantissa * POWERS_OF_10[exponent]);
+                if (negative)
+                    value = -value;
+                return true;
+            }
+
+            // Rare cases (very long mantissas, extreme exponents, "inf" etc.)
+            Pos = tokenStart;
+            while (Pos < End && !IsSpace(*Pos))
+                Pos++;
+
+            std::string token(tokenStart, Pos);
+            char *tokenEnd;
+            value = std::strtod(token.c_str(), &tokenEnd);
+            return !token.empty() && *tokenEnd == '\0';
+        }
+
+    public:
+
+        PlyReader(const char *begin, const char *end, PlyFormat format)
+        : Pos(begin), End(end), Format(format)
+        {
+            const uint16_t one = 1;
+            bool isHostLittleEndian = (*reinterpret_cast<const uint8_t*>(&one) == 1);
+
+            SwapBytes = ((format == PlyFormat::BinaryLittleEndian && !isHostLittleEndian) ||
+                         (format == PlyFormat::BinaryBigEndian && isHostLittleEndian));
+        }
+
+        /// Reads a value of 'type'; returns 'false' on error
+        bool Read(PlyType type, double &value)
+        {
+            if (Format == PlyFormat::Ascii)
+                return ReadAscii(value);
+
+            switch (type)
+            {
+                case PlyType::Int8:    return ReadBinary<int8_t>(value);
+                case PlyType::UInt8:   return ReadBinary<uint8_t>(value);
+                case PlyType::Int16:   return ReadBinary<int16_t>(value);
+                case PlyType::UInt16:  return ReadBinary<uint16_t>(value);
+                case PlyType::Int32:   return ReadBinary<int32_t>(value);
+                case PlyType::UInt32:  return ReadBinary<uint32_t>(value);
+                case PlyType::Float32: return ReadBinary<float>(value);
+                case PlyType::Float64: return ReadBinary<double>(value);
+                default: return false;
+            }
+        }
+
+        /** Returns the number of bytes left; every value occupies at least one,
+            so element and item counts exceeding it come from a truncated or corrupted file. */
+        size_t GetRemainingBytes() const { return (size_t)(End - Pos); }
+
+        /// Reads a list's item count; returns 'false' on error
+        bool ReadCount(PlyType countType, size_t &count)
+        {
+            double value;
+            if (!Read(countType, value) || !(value >= 0 && value <= GetRemainingBytes()))
                 return false;
+
+            count = (size_t)value;
+            return true;
         }
-    }
 
-    std::vector<gpuart::Vec3f> vertices;
+        /// Skips a whole property (a single value or a list); returns 'false' on error
+        bool Skip(const PlyProperty &property)
+        {
+            size_t count = 1;
+            if (property.countType != PlyType::Invalid && !ReadCount(property.countType, count))
+                return false;
+
+            double value;
+            for (size_t i = 0; i < count; i++)
+                if (!Read(property.type, value))
+                    return false;
 
-    for (size_t i = 0; i < numVertices; i++)
+            return true;
+        }
+
+        const char *GetPos() const { return Pos; }
+    };
+
+    /// Returns the next line (without the line terminator) and advances 'pos' past it
+    std::string GetLine(const char *&pos, const char *end)
     {
-        std::getline(fs, line);
-        if (line.empty())
-            continue;
+        const char *lineStart = pos;
+        while (pos < end && *pos != '\n')
+            pos++;
 
-        ss.clear();
-        ss.str(line);
+        const char *lineEnd = pos;
+        if (lineEnd > lineStart && *(lineEnd - 1) == '\r')
+            lineEnd--;
 
-        float x, y, z;
-        ss >> x;
-        ss >> y;
-        ss >> z;
-        if (ss.fail())
+        if (pos < end)
+            pos++; // skip '\n'
+
+        return std::string(lineStart, lineEnd);
+    }
+
+    /** Parses the PLY header at 'pos' and advances 'pos' to the beginning of data.
+        Returns 'false' if the header is invalid. */
+    bool ParsePlyHeader(const char *&pos, const char *end, PlyFormat &format, std::vector<PlyElement> &elements)
+    {
+        if (GetLine(pos, end) != "ply")
             return false;
 
-        vertices.push_back(translation + magnification * gpuart::Vec3f(x, y, z));
+        bool formatFound = false;
+        std::stringstream ss;
+        std::string line, keyword;
+
+        while (true)
+        {
+            if (pos == end)
+                return false;
+
+            line = GetLine(pos, end);
+            ss.clear();
+            ss.str(line);
+            keyword.clear();
+            ss >> keyword;
+
+            if (keyword == "end_header")
+                break;
+            else if (keyword == "format")
+            {
+                std::string formatName;
+                ss >> formatName;
+
+                if (formatName == "ascii")
+                    format = PlyFormat::Ascii;
+                else if (formatName == "binary_little_endian")
+                    format = PlyFormat::BinaryLittleEndian;
+                else if (formatName == "binary_big_endian")
+                    format = PlyFormat::BinaryBigEndian;
+                else
+                    return false;
+
+                formatFound = true;
+            }
+            else if (keyword == "element")
+            {
+                PlyElement element;
+                ss >> element.name >> element.count;
+                if (ss.fail())
+                    return false;
+
+                elements.push_back(element);
+            }
+            else if (keyword == "property")
+            {
+                if (elements.empty())
+                    return false;
+
+                PlyProperty property;
+                std::string typeName;
+                ss >> typeName;
+
+                if (typeName == "list")
+                {
+                    std::string countTypeName;
+                    ss >> countTypeName >> typeName;
+                    property.countType = GetPlyType(countTypeName);
+                    if (property.countType == PlyType::Invalid)
+                        return false;
+                }
+                else
+                    property.countType = PlyType::Invalid;
+
+                property.type = GetPlyType(typeName);
+                ss >> property.name;
+                if (ss.fail() || property.type == PlyType::Invalid)
+                    return false;
+
+                elements.back().properties.push_back(property);
+            }
+            // Other keywords ("comment", "obj_info") are ignored
+        }
+
+        return formatFound;
     }
+}
+
+/** Loads a mesh in PLY format (ASCII or binary) and appends it to 'primitives' as mesh triangles;
+    polygonal faces are triangulated. */
+bool gpuart::Utils::LoadMeshFromPLY(gpuart::PrimitiveSet &primitives, const char *fileName,
+                                    float magnification, const Vec3f &translation)
+{
+    MappedFile file(fileName);
+
+    if (!file.IsOpen())
+        return false;
+
+    const char *pos = file.GetData(), *end = file.GetData() + file.GetSize();
+
+    PlyFormat format;
+    std::vector<PlyElement> elements;
+    if (!ParsePlyHeader(pos, end, format, elements))
+        return false;
+
+    auto tstart = std::chrono::high_resolution_clock::now();
+    std::cout << "Loading mesh from \"" << fileName << "\"... "; std::cout.flush();
 
-    for (size_t i = 0; i < numFaces && !fs.eof(); i++)
+    PlyReader reader(pos, end, format);
+
+    std::vector<gpuart::Vec3f> &vertices = primitives.MeshVertices;
+    const size_t firstVertex = vertices.size(); // the mesh's vertex indices are relative to 'firstVertex'
+    size_t numFaces = 0, numTriangles = 0;
+    const size_t firstTriangle = primitives.MeshTriangles.size();
+
+    auto loadElements = [&]()
     {
-        std::getline(fs, line);
-        if (line.empty())
-            continue;
+        for (const PlyElement &element: elements)
+        {
+            const std::vector<PlyProperty> &props = element.properties;
 
-        ss.clear();
-        ss.str(line);
+            if (element.name == "vertex")
+            {
+                int coordProps[3] = { element.FindProperty("x"), element.FindProperty("y"), element.FindProperty("z") };
+                for (int propIdx: coordProps)
+                    if (propIdx < 0 || props[propIdx].countType != PlyType::Invalid)
+                        return false;
 
-        ss << line;
+                if (vertices.size() + element.count > UINT32_MAX // mesh triangles store 32-bit indices
+                    || element.count > reader.GetRemainingBytes())
+                    return false;
 
-        int verts, v0, v1, v2;
-        ss >> verts;
-        ss >> v0;
-        ss >> v1;
-        ss >> v2;
-        if (verts != 3 || ss.fail())
-            return false;
+                vertices.reserve(vertices.size() + element.count);
+
+                for (size_t i = 0; i < element.count; i++)
+                {
+                    float coords[3];
+
+                    for (size_t p = 0; p < props.size(); p++)
+                    {
+                        double value;
+
+                        if (props[p].countType != PlyType::Invalid)
+                        {
+                            if (!reader.Skip(props[p]))
+                                return false;
+                        }
+                        else if (!reader.Read(props[p].type, value))
+                            return false;
+
+                        for (int c = 0; c < 3; c++)
+                            if ((int)p == coordProps[c])
+                                coords[c] = (float)value;
+                    }
+
+                    vertices.push_back(translation + magnification * gpuart::Vec3f(coords[0], coords[1], coords[2]));
+                }
+            }
+            else if (element.name == "face")
+            {
+                int indicesProp = element.FindProperty("vertex_indices");
+                if (indicesProp < 0)
+                    indicesProp = element.FindProperty("vertex_index");
+
+                if (indicesProp < 0 || props[indicesProp].countType == PlyType::Invalid
+                    || element.count > reader.GetRemainingBytes())
+                    return false;
+
+                primitives.MeshTriangles.reserve(primitives.MeshTriangles.size() + element.count);
+
+                std::vector<uint32_t> faceVertices;
+
+                for (size_t i = 0; i < element.count; i++)
+                {
+                    for (size_t p = 0; p < props.size(); p++)
+                    {
+                        if ((int)p != indicesProp)
+                        {
+                            if (!reader.Skip(props[p]))
+                                return false;
+                            continue;
+                        }
 
-        primitives.push_back(new gpuart::Triangle(vertices[v0], vertices[v1], vertices[v2]));
+                        size_t count;
+                        if (!reader.ReadCount(props[p].countType, count))
+                            return false;
+
+                        faceVertices.resize(count);
+                        for (size_t v = 0; v < count; v++)
+                        {
+                            double index;
+                            if (!reader.Read(props[p].type, index) || !(index >= 0 && index < vertices.size() - firstVertex))
+                                return false;
+
+                            faceVertices[v] = (uint32_t)(firstVertex + (size_t)index);
+                        }
+                    }
+
+                    // Triangulate the face as a fan around its first vertex (faces with fewer than 3 vertices are skipped)
+                    for (size_t v = 1; v + 1 < faceVertices.size(); v++)
+                    {
+                        primitives.Add(gpuart::MeshTriangle(vertices, faceVertices[0], faceVertices[v], faceVertices[v+1]));
+                        numTriangles++;
+                    }
+                }
+
+                numFaces += element.count;
+            }
+            else
+            {
+                for (size_t i = 0; i < element.count; i++)
+                    for (const PlyProperty &prop: props)
+                        if (!reader.Skip(prop))
+                            return false;
+            }
+        }
+
+        return true;
+    };
+
+    if (!loadElements())
+    {
+        // Do not leave a partially loaded mesh behind
+        vertices.erase(vertices.begin() + firstVertex, vertices.end());
+        primitives.MeshTriangles.erase(primitives.MeshTriangles.begin() + firstTriangle, primitives.MeshTriangles.end());
+        return false;
     }
 
     std::cout << " done (" << TimeElapsed(tstart) << "), "
-              << "faces: " << numFaces << ", vertices: " << numVertices << "." << std::endl;
-
+              << "faces: " << numFaces << ", ";
+    if (numTriangles != numFaces)
+        std::cout << "triangles: " << numTriangles << ", ";
+    std::cout << "vertices: " << vertices.size() - firstVertex << "." << std::endl;
 
     return true;
 }
 
-/// Loads primitives from a text file and appends them to 'primitives'
-bool gpuart::Utils::LoadPrimitives(std::vector<gpuart::Primitive*> &primitives, const char *fileName,
+/** Loads primitives from a text file and appends them to 'primitives'; a line "material r g b [specular
+    [er eg eb [roughness]]]" adds a material to the scene's table, used by the primitives which follow it. */
+bool gpuart::Utils::LoadPrimitives(gpuart::PrimitiveSet &primitives, const char *fileName,
                                    float magnification, const gpuart::Vec3f &translation)
 {
     std::cout << "Loading primitives from \"" << fileName << "\"..."; std::cout.flush();
@@ -154,6 +619,7 @@ bool gpuart::Utils::LoadPrimitives(std::vector<gpuart::Primitive*> &primitives,
 
     std::stringstream ss;
     std::string line, token;
+    uint32_t material = Primitive::DEFAULT_MATERIAL;
 
     while (!fs.eof())
     {
@@ -165,7 +631,19 @@ bool gpuart::Utils::LoadPrimitives(std::vector<gpuart::Primitive*> &primitives,
         ss.str(line);
 
         ss >> token;
-        if (token == "sphere")
+        if (token == "material")
+        {
+            Vec3f albedo, emission;
+            float specular = 0, roughness = 0;
+
+            ss >> albedo.x >> albedo.y >> albedo.z;
+            if (ss.fail())
+                return false;
+
+            ss >> specular >> emission.x >> emission.y >> emission.z >> roughness;
+            material = primitives.AddMaterial(gpuart::Material(albedo, specular, emission, roughness));
+        }
+        else if (token == "sphere")
         {
             float x, y, z, r;
             ss >> x >> y >> z;
@@ -176,7 +654,9 @@ bool gpuart::Utils::LoadPrimitives(std::vector<gpuart::Primitive*> &primitives,
             if (ss.fail())
                 r = 4.0f;
 
-            primitives.push_back(new gpuart::Sphere(translation + magnification * Vec3f(x, y, z), magnification * r));
+            gpuart::Sphere sphere(translation + magnification * Vec3f(x, y, z), magnification * r);
+            sphere.SetMaterial(material);
+            primitives.Add(sphere);
         }
         else if (token == "cone")
         {
@@ -190,10 +670,10 @@ bool gpuart::Utils::LoadPrimitives(std::vector<gpuart::Primitive*> &primitives,
             if (ss.fail())
                 return false;
 
-            primitives.push_back(new gpuart::Cone(translation + magnification * center1,
-                                                  translation + magnification * center2,
-                                                  magnification * radius1,
-                                                  magnification * radius2));
+            gpuart::Cone cone(translation + magnification * center1, translation + magnification * center2,
+                              magnification * radius1, magnification * radius2);
+            cone.SetMaterial(material);
+            primitives.Add(cone);
         }
     }
 
@@ -219,3 +699,329 @@ std::unique_ptr<char[]> gpuart::Utils::FormatStr(const char *format, ...)
 
     return result;
 }
+
+/** Parses the max. number of children of a compiled BVH node given on the command line (--bvh-width);
+    returns 'false' if 'arg' is not a whole number from 2 to BoundingVolumesHierarchy::MAX_CHILDREN. */
+bool gpuart::Utils::ParseBVHWidth(const char *arg, unsigned &width)
+{
+    char *end;
+    const long value = std::strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || value < 2 || value > (long)BoundingVolumesHierarchy::MAX_CHILDREN)
+        return false;
+
+    width = (unsigned)value;
+    return true;
+}
+
+static bool IsLittleEndian()
+{
+    uint16_t value = 1;
+    return *reinterpret_cast<const uint8_t*>(&value) == 1;
+}
+
+static void SwapBytes(float &value)
+{
+    char *bytes = reinterpret_cast<char*>(&value);
+    std::reverse(bytes, bytes + sizeof(value));
+}
+
+/** Saves an RGB image in PFM format (32-bit floating-point, little-endian);
+    'pixels' are stored row by row, starting with the bottom row (as read from OpenGL). */
+bool gpuart::Utils::SaveImagePFM(const char *fileName, unsigned width, unsigned height, const std::vector<Vec3f> &pixels)
+{
+    std::ofstream file(fileName, std::ios_base::out | std::ios_base::binary);
+    if (!file)
+    {
+        std::cerr << "Cannot create \"" << fileName << "\"." << std::endl;
+        return false;
+    }
+
+    // Negative scale denotes little-endian values; PFM rows are stored bottom-to-top
+    file << "PF\n" << width << " " << height << "\n-1.0\n";
+
+    std::vector<float> row(3 * width);
+    for (unsigned y = 0; y < height; y++)
+    {
+        for (unsigned x = 0; x < width; x++)
+        {
+            const Vec3f &p = pixels[y * width + x];
+            row[3*x]   = p.x;
+            row[3*x+1] = p.y;
+            row[3*x+2] = p.z;
+        }
+
+        if (!IsLittleEndian())
+            for (float &value: row)
+                SwapBytes(value);
+
+        file.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
+    }
+
+    return (bool)file;
+}
+
+/** Saves an RGB image in binary PPM format, with values clamped to [0; 1] and converted to 8 bits;
+    'pixels' are stored as for SaveImagePFM(). */
+bool gpuart::Utils::SaveImagePPM(const char *fileName, unsigned width, unsigned height, const std::vector<Vec3f> &pixels)
+{
+    std::ofstream file(fileName, std::ios_base::out | std::ios_base::binary);
+    if (!file)
+    {
+        std::cerr << "Cannot create \"" << fileName << "\"." << std::endl;
+        return false;
+    }
+
+    file << "P6\n" << width << " " << height << "\n255\n";
+
+    auto toByte = [](float value) { return (char)(uint8_t)(std::max(0.0f, std::min(value, 1.0f)) * 255 + 0.5f); };
+
+    std::vector<char> row(3 * width);
+    for (unsigned y = height; y-- > 0; ) // PPM rows are stored top-to-bottom
+    {
+        for (unsigned x = 0; x < width; x++)
+        {
+            const Vec3f &p = pixels[y * width + x];
+            row[3*x]   = toByte(p.x);
+            row[3*x+1] = toByte(p.y);
+            row[3*x+2] = toByte(p.z);
+        }
+        file.write(row.data(), row.size());
+    }
+
+    return (bool)file;
+}
+
+/// Appends 'value' to 'dest' as 'numBytes' bytes, most significant first if 'bigEndian' is true
+static void AppendInt(std::vector<uint8_t> &dest, uint64_t value, unsigned numBytes, bool bigEndian)
+{
+    for (unsigned i = 0; i < numBytes; i++)
+    {
+        unsigned shift = 8 * (bigEndian ? numBytes - 1 - i : i);
+        dest.push_back((uint8_t)(value >> shift));
+    }
+}
+
+static uint32_t CRC32(const uint8_t *data, size_t length)
+{
+    static uint32_t table[256];
+    static bool tableReady = false;
+    if (!tableReady)
+    {
+        for (uint32_t n = 0; n < 256; n++)
+        {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+        tableReady = true;
+    }
+
+    uint32_t crc = 0xFFFFFFFFU;
+    for (size_t i = 0; i < length; i++)
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+
+    return crc ^ 0xFFFFFFFFU;
+}
+
+/** Saves an RGB image in PNG format, with values clamped to [0; 1] and converted to 8 bits;
+    'pixels' are stored as for SaveImagePFM(). */
+bool gpuart::Utils::SaveImagePNG(const char *fileName, unsigned width, unsigned height, const std::vector<Vec3f> &pixels)
+{
+    std::ofstream file(fileName, std::ios_base::out | std::ios_base::binary);
+    if (!file)
+    {
+        std::cerr << "Cannot create \"" << fileName << "\"." << std::endl;
+        return false;
+    }
+
+    auto toByte = [](float value) { return (uint8_t)(std::max(0.0f, std::min(value, 1.0f)) * 255 + 0.5f); };
+
+    // Raw image data: each row (top-to-bottom) is preceded by filter type 0 (none)
+    std::vector<uint8_t> raw;
+    raw.reserve((size_t)height * (1 + 3 * width));
+    for (unsigned y = height; y-- > 0; )
+    {
+        raw.push_back(0);
+        for (unsigned x = 0; x < width; x++)
+        {
+            const Vec3f &p = pixels[y * width + x];
+            raw.insert(raw.end(), { toByte(p.x), toByte(p.y), toByte(p.z) });
+        }
+    }
+
+    // Wrap the data in a zlib stream of uncompressed ("stored") deflate blocks
+    const size_t MAX_BLOCK_LEN = 65535;
+    std::vector<uint8_t> zlib = { 0x78, 0x01 };
+    uint32_t adlerA = 1, adlerB = 0;
+    for (size_t start = 0; start == 0 || start < raw.size(); start += MAX_BLOCK_LEN)
+    {
+        size_t len = std::min(MAX_BLOCK_LEN, raw.size() - start);
+        zlib.push_back(start + len == raw.size() ? 1 : 0); // final block flag
+        AppendInt(zlib, len, 2, false);
+        AppendInt(zlib, ~len & 0xFFFF, 2, false);
+        zlib.insert(zlib.end(), raw.begin() + start, raw.begin() + start + len);
+
+        for (size_t i = start; i < start + len; i++)
+        {
+            adlerA = (adlerA + raw[i]) % 65521;
+            adlerB = (adlerB + adlerA) % 65521;
+        }
+    }
+    AppendInt(zlib, (adlerB << 16) | adlerA, 4, true);
+
+    auto writeChunk = [&file](const char *type, const std::vector<uint8_t> &contents)
+    {
+        std::vector<uint8_t> chunk;
+        AppendInt(chunk, contents.size(), 4, true);
+        chunk.insert(chunk.end(), type, type + 4);
+        chunk.insert(chunk.end(), contents.begin(), contents.end());
+        AppendInt(chunk, CRC32(chunk.data() + 4, chunk.size() - 4), 4, true);
+        file.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+    };
+
+    file.write("\x89PNG\r\n\x1A\n", 8);
+
+    std::vector<uint8_t> header;
+    AppendInt(header, width, 4, true);
+    AppendInt(header, height, 4, true);
+    header.insert(header.end(), { 8,    // bit depth
+                                  2,    // color type: RGB
+                                  0,    // compression method: deflate
+                                  0,    // filter method: adaptive
+                                  0 }); // no interlace
+    writeChunk("IHDR", header);
+    writeChunk("IDAT", zlib);
+    writeChunk("IEND", {});
+
+    return (bool)file;
+}
+
+/** Saves an RGB image in OpenEXR format (uncompressed, 32-bit floating-point);
+    'pixels' are stored as for SaveImagePFM(). */
+bool gpuart::Utils::SaveImageEXR(const char *fileName, unsigned width, unsigned height, const std::vector<Vec3f> &pixels)
+{
+    std::ofstream file(fileName, std::ios_base::out | std::ios_base::binary);
+    if (!file)
+    {
+        std::cerr << "Cannot create \"" << fileName << "\"." << std::endl;
+        return false;
+    }
+
+    // All values in an EXR file are little-endian
+    std::vector<uint8_t> header = { 0x76, 0x2F, 0x31, 0x01,  // magic number
+                                    2, 0, 0, 0 };            // version 2, single-part scan line file
+
+    auto appendAttribute = [&header](const char *name, const char *type, const std::vector<uint8_t> &value)
+    {
+        header.insert(header.end(), name, name + std::strlen(name) + 1);
+        header.insert(header.end(), type, type + std::strlen(type) + 1);
+        AppendInt(header, value.size(), 4, false);
+        header.insert(header.end(), value.begin(), value.end());
+    };
+
+    auto floatBits = [](float value) { uint32_t bits; std::memcpy(&bits, &value, sizeof(bits)); return bits; };
+
+    // Channels have to be listed (and stored in scan lines) in alphabetical order
+    const char *CHANNELS[] = { "B", "G", "R" };
+    const float Vec3f::*CHANNEL_MEMBERS[] = { &Vec3f::z, &Vec3f::y, &Vec3f::x };
+
+    std::vector<uint8_t> channelList;
+    for (const char *channel: CHANNELS)
+    {
+        channelList.insert(channelList.end(), channel, channel + std::strlen(channel) + 1);
+        AppendInt(channelList, 2, 4, false); // pixel type: FLOAT
+        AppendInt(channelList, 0, 4, false); // pLinear and reserved bytes
+        AppendInt(channelList, 1, 4, false); // x sampling
+        AppendInt(channelList, 1, 4, false); // y sampling
+    }
+    channelList.push_back(0);
+
+    std::vector<uint8_t> window;
+    for (uint32_t value: { 0U, 0U, width - 1, height - 1 })
+        AppendInt(window, value, 4, false);
+
+    std::vector<uint8_t> one, center;
+    AppendInt(one, floatBits(1.0f), 4, false);
+    AppendInt(center, 0, 8, false);
+
+    appendAttribute("channels", "chlist", channelList);
+    appendAttribute("compression", "compression", { 0 }); // none
+    appendAttribute("dataWindow", "box2i", window);
+    appendAttribute("displayWindow", "box2i", window);
+    appendAttribute("lineOrder", "lineOrder", { 0 }); // increasing Y (top-to-bottom)
+    appendAttribute("pixelAspectRatio", "float", one);
+    appendAttribute("screenWindowCenter", "v2f", center);
+    appendAttribute("screenWindowWidth", "float", one);
+    header.push_back(0);
+
+    // Offset table of scan lines, each consisting of Y coordinate, data size and the channels' values
+    const size_t lineDataSize = 3 * width * sizeof(float);
+    const uint64_t firstLineOffset = header.size() + (uint64_t)height * 8;
+    for (unsigned y = 0; y < height; y++)
+        AppendInt(header, firstLineOffset + (uint64_t)y * (8 + lineDataSize), 8, false);
+
+    file.write(reinterpret_cast<const char*>(header.data()), header.size());
+
+    std::vector<uint8_t> line;
+    for (unsigned y = 0; y < height; y++)
+    {
+        line.clear();
+        AppendInt(line, y, 4, false);
+        AppendInt(line, lineDataSize, 4, false);
+        for (const float Vec3f::*channel: CHANNEL_MEMBERS)
+            for (unsigned x = 0; x < width; x++)
+                AppendInt(line, floatBits(pixels[(height - 1 - y) * width + x].*channel), 4, false);
+
+        file.write(reinterpret_cast<const char*>(line.data()), line.size());
+    }
+
+    return (bool)file;
+}
+
+/// Loads an RGB or grayscale PFM image; 'pixels' receive the contents as for SaveImagePFM()
+bool gpuart::Utils::LoadImagePFM(const char *fileName, unsigned &width, unsigned &height, std::vector<Vec3f> &pixels)
+{
+    std::ifstream file(fileName, std::ios_base::in | std::ios_base::binary);
+    if (!file)
+    {
+        std::cerr << "Cannot open \"" << fileName << "\"." << std::endl;
+        return false;
+    }
+
+    std::string magic;
+    float scale;
+    file >> magic >> width >> height >> scale;
+    file.get(); // single whitespace character ends the header
+
+    if (!file || (magic != "PF" && magic != "Pf") || width == 0 || height == 0)
+    {
+        std::cerr << "Invalid PFM header in \"" << fileName << "\"." << std::endl;
+        return false;
+    }
+
+    const unsigned numChannels = (magic == "PF" ? 3 : 1);
+    const bool swapBytes = ((scale < 0) != IsLittleEndian());
+
+    std::vector<float> values((size_t)numChannels * width * height);
+    if (!file.read(reinterpret_cast<char*>(values.data()), values.size() * sizeof(float)))
+    {
+        std::cerr << "Unexpected end of file in \"" << fileName << "\"." << std::endl;
+        return false;
+    }
+
+    if (swapBytes)
+        for (float &value: values)
+            SwapBytes(value);
+
+    pixels.resize((size_t)width * height);
+    for (size_t i = 0; i < pixels.size(); i++)
+    {
+        if (numChannels == 3)
+            pixels[i] = Vec3f(values[3*i], values[3*i+1], values[3*i+2]);
+        else
+            pixels[i] = Vec3f(values[i], values[i], values[i]);
+    }
+
+    return true;
+}
@@ -44,16 +44,68 @@ namespace Utils
 
     std::ostream& operator <<(std::ostream &os, const TimeElapsed &te);
 
-    /// Loads a mesh of triangles in PLY format and appends it to 'primitives'
-    bool LoadMeshFromPLY(std::vector<gpuart::Primitive*> &primitives, const char *fileName,
+    /// Read-only view of a whole file mapped into memory; non-copyable
+    class MappedFile
+    {
+        const char *Data;
+        size_t Size;
+
+    #ifdef _WIN32
+        void *FileHandle, *MappingHandle;
+    #endif
+
+    public:
+
+        /// Check success with IsOpen()
+        explicit MappedFile(const char *fileName);
+
+        ~MappedFile();
+
+        MappedFile(const MappedFile &)             = delete;
+        MappedFile & operator=(const MappedFile &) = delete;
+
+        bool IsOpen() const { return Data != nullptr; }
+
+        const char *GetData() const { return Data; }
+
+        size_t GetSize() const { return Size; }
+    };
+
+    /** Loads a mesh in PLY format (ASCII or binary) and appends it to 'primitives' as mesh triangles;
+        polygonal faces are triangulated. */
+    bool LoadMeshFromPLY(gpuart::PrimitiveSet &primitives, const char *fileName,
                          float magnification = 1.0f, const Vec3f &translation = Vec3f(0, 0, 0));
 
-    /// Loads primitives from a text file and appends them to 'primitives'
-    bool LoadPrimitives(std::vector<gpuart::Primitive*> &primitives, const char *fileName,
+    /** Loads primitives from a text file and appends them to 'primitives'; a line "material r g b [specular
+        [er eg eb [roughness]]]" adds a material to the scene's table, used by the primitives which follow it. */
+    bool LoadPrimitives(gpuart::PrimitiveSet &primitives, const char *fileName,
                         float magnification = 1.0f, const Vec3f &translation = Vec3f(0, 0, 0));
 
     /// Returns a null-terminated string created with snprintf()
     std::unique_ptr<char[]> FormatStr(const char *format, ...);
+
+    /** Parses the max. number of children of a compiled BVH node given on the command line (--bvh-width);
+        returns 'false' if 'arg' is not a whole number from 2 to BoundingVolumesHierarchy::MAX_CHILDREN. */
+    bool ParseBVHWidth(const char *arg, unsigned &width);
+
+    /** Saves an RGB image in PFM format (32-bit floating-point, little-endian);
+        'pixels' are stored row by row, starting with the bottom row (as read from OpenGL). */
+    bool SaveImagePFM(const char *fileName, unsigned width, unsigned height, const std::vector<Vec3f> &pixels);
+
+    /** Saves an RGB image in binary PPM format, with values clamped to [0; 1] and converted to 8 bits;
+        'pixels' are stored as for SaveImagePFM(). */
+    bool SaveImagePPM(const char *fileName, unsigned width, unsigned height, const std::vector<Vec3f> &pixels);
+
+    /** Saves an RGB image in PNG format, with values clamped to [0; 1] and converted to 8 bits;
+        'pixels' are stored as for SaveImagePFM(). */
+    bool SaveImagePNG(const char *fileName, unsigned width, unsigned height, const std::vector<Vec3f> &pixels);
+
+    /** Saves an RGB image in OpenEXR format (uncompressed, 32-bit floating-point);
+        'pixels' are stored as for SaveImagePFM(). */
+    bool SaveImageEXR(const char *fileName, unsigned width, unsigned height, const std::vector<Vec3f> &pixels);
+
+    /// Loads an RGB or grayscale PFM image; 'pixels' receive the contents as for SaveImagePFM()
+    bool LoadImagePFM(const char *fileName, unsigned &width, unsigned &height, std::vector<Vec3f> &pixels);
 }
 }
 